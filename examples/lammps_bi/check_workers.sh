@@ -0,0 +1,29 @@
+#!/bin/bash
+# Check that rangefinder.x split across worker processes writes the same output as a single process.
+# Run from this directory with rangefinder.x in it:
+#   ./check_workers.sh [number of worker processes (default 4)]
+
+workers=${1:-4}
+set -e
+rm -rf check_serial check_workers
+mkdir check_serial check_workers
+for dir in check_serial check_workers; do
+	cp top.in control.in $dir/
+done
+echo "num_worker_processes $workers" >> check_workers/control.in
+
+for dir in check_serial check_workers; do
+	(cd $dir && ../rangefinder.x -l ../reference_traj.lammpstrj > rangefinder.log)
+done
+
+# Ranges are minima and maxima and histograms are counts, so the combined output should match exactly.
+if ls check_workers/range_worker_*.out > /dev/null 2>&1; then
+	echo "Partial range files were left behind."
+	exit 1
+fi
+if diff -r -x '*.log' check_serial check_workers; then
+	echo "Output with $workers worker processes matches the single-process output."
+else
+	echo "Output with $workers worker processes differs from the single-process output."
+	exit 1
+fi
@@ -0,0 +1,35 @@
+#!/bin/bash
+# Check that the batched pair kernel reproduces the one-pair-at-a-time result for this example.
+# Run from this directory with newfm.x in it:
+#   ./check_batched_kernel.sh [relative tolerance (default 1e-10)]
+
+tolerance=${1:-1e-10}
+set -e
+rm -rf check_scalar check_batched
+mkdir check_scalar check_batched
+for dir in check_scalar check_batched; do
+	cp top.in rmin.in rmin_b.in $dir/
+done
+grep -v '^batched_pair_kernel_flag' control.in > check_scalar/control.in
+echo "batched_pair_kernel_flag 0" >> check_scalar/control.in
+grep -v '^batched_pair_kernel_flag' control.in > check_batched/control.in
+echo "batched_pair_kernel_flag 1" >> check_batched/control.in
+
+for dir in check_scalar check_batched; do
+	(cd $dir && ../newfm.x -l ../LJ_sample75_20frames.dat > newfm.log)
+done
+
+# Compare the forces in 1_1.dat, which are written at full precision, within a relative tolerance.
+# Any difference between the two kernels should only come from rounding.
+paste check_scalar/1_1.dat check_batched/1_1.dat | awk -v tolerance=$tolerance '
+	NF == 4 && $1 ~ /^[-0-9.]+$/ {
+		difference = $2 - $4; if (difference < 0) difference = -difference;
+		scale = $2; if (scale < 0) scale = -scale; if (scale < 1.0) scale = 1.0;
+		if (difference > tolerance * scale) { bad++; printf("Mismatch at r = %s: %s vs %s\n", $1, $2, $4); }
+		n++;
+	}
+	END {
+		if (n == 0) { print "No forces were compared."; exit 1; }
+		if (bad > 0) { printf("%d of %d forces differ between the scalar and batched pair kernels.\n", bad, n); exit 1; }
+		printf("All %d forces agree between the scalar and batched pair kernels.\n", n);
+	}'
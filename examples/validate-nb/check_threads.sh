@@ -0,0 +1,36 @@
+#!/bin/bash
+# Check that threaded frame processing reproduces the 1-thread result for this example.
+# Run from this directory with an OpenMP build of newfm.x in it:
+#   ./check_threads.sh [number of threads (default 4)]
+# The threaded run leaves block_size unset so that the default dense block size is checked too.
+
+threads=${1:-4}
+set -e
+rm -rf check_serial check_threaded
+mkdir check_serial check_threaded
+for dir in check_serial check_threaded; do
+	cp top.in rmin.in rmin_b.in $dir/
+done
+cp control.in check_serial/
+grep -v '^block_size' control.in > check_threaded/control.in
+echo "num_frame_threads $threads" >> check_threaded/control.in
+
+for dir in check_serial check_threaded; do
+	(cd $dir && ../newfm.x -l ../LJ_sample75_20frames.dat > newfm.log)
+done
+
+# Compare the tabulated forces and potentials within a relative tolerance.
+paste check_serial/1_1.table check_threaded/1_1.table | awk -v tolerance=1e-6 '
+	NF == 8 && $1 ~ /^[0-9]+$/ {
+		for (i = 3; i <= 4; i++) {
+			difference = $i - $(i + 4); if (difference < 0) difference = -difference;
+			scale = $i; if (scale < 0) scale = -scale; if (scale < 1.0) scale = 1.0;
+			if (difference > tolerance * scale) { bad++; printf("Mismatch at r = %s: %s vs %s\n", $2, $i, $(i + 4)); }
+		}
+		n++;
+	}
+	END {
+		if (n == 0) { print "No table entries were compared."; exit 1; }
+		if (bad > 0) { printf("%d of %d table values differ between 1 and %s threads.\n", bad, 2 * n, "'"$threads"'"); exit 1; }
+		printf("All %d table values agree between 1 and %s threads.\n", 2 * n, "'"$threads"'");
+	}'
@@ -20,7 +20,10 @@ void check_depricated_options(const char* parameter_name, const int line);
 
 void set_control_parameter(const char* parameter_name, const char* val, ControlInputs* const control_input, const int line)
 {
-    if (strcmp("block_size", parameter_name) == 0) sscanf(val, "%d", &control_input->frames_per_traj_block);
+    if (strcmp("block_size", parameter_name) == 0) {
+    	sscanf(val, "%d", &control_input->frames_per_traj_block);
+    	control_input->block_size_set_flag = 1;
+    }
     else if (strcmp("use_statistical_reweighting", parameter_name) == 0) sscanf(val, "%d", &control_input->use_statistical_reweighting);
     else if (strcmp("dynamic_types", parameter_name) == 0) sscanf(val, "%d", &control_input->dynamic_types);
     else if (strcmp("dynamic_state_sampling", parameter_name) == 0) sscanf(val, "%d", &control_input->dynamic_state_sampling);
@@ -36,6 +39,7 @@ void set_control_parameter(const char* parameter_name, const char* val, ControlI
     else if (strcmp("start_frame", parameter_name) == 0) sscanf(val, "%d", &control_input->starting_frame);
     else if (strcmp("n_frames", parameter_name) == 0) sscanf(val, "%d", &control_input->n_frames);
     else if (strcmp("nonbonded_cutoff", parameter_name) == 0) sscanf(val, "%lf", &control_input->pair_nonbonded_cutoff);
+    else if (strcmp("verlet_skin", parameter_name) == 0) sscanf(val, "%lf", &control_input->verlet_skin);
     else if (strcmp("pair_nonbonded_basis_set_resolution", parameter_name) == 0) sscanf(val, "%lf", &control_input->pair_nonbonded_fm_binwidth);
     else if (strcmp("pair_bond_basis_set_resolution", parameter_name) == 0) sscanf(val, "%lf", &control_input->pair_bond_fm_binwidth);
     else if (strcmp("angle_basis_set_resolution", parameter_name) == 0) sscanf(val, "%lf", &control_input->angle_fm_binwidth);
@@ -44,6 +48,8 @@ void set_control_parameter(const char* parameter_name, const char* val, ControlI
     else if (strcmp("pair_bond_bspline_basis_order", parameter_name) == 0) sscanf(val, "%d", &control_input->pair_bond_bspline_k);
     else if (strcmp("angle_bspline_basis_order", parameter_name) == 0) sscanf(val, "%d", &control_input->angle_bspline_k);
     else if (strcmp("dihedral_bspline_basis_order", parameter_name) == 0) sscanf(val, "%d", &control_input->dihedral_bspline_k);
+    else if (strcmp("native_bspline_flag", parameter_name) == 0) sscanf(val, "%d", &control_input->native_bspline_flag);
+    else if (strcmp("batched_pair_kernel_flag", parameter_name) == 0) sscanf(val, "%d", &control_input->batched_pair_kernel_flag);
     else if (strcmp("basis_type", parameter_name) == 0) sscanf(val, "%d", &control_input->basis_set_type);
     else if (strcmp("matrix_type", parameter_name) == 0) sscanf(val, "%d", &control_input->matrix_type);
     else if (strcmp("pair_nonbonded_output_binwidth", parameter_name) == 0) sscanf(val, "%lf", &control_input->pair_nonbonded_output_binwidth);
@@ -52,9 +58,18 @@ void set_control_parameter(const char* parameter_name, const char* val, ControlI
     else if (strcmp("dihedral_output_binwidth", parameter_name) == 0) sscanf(val, "%lf", &control_input->dihedral_output_binwidth);
     else if (strcmp("primary_output_style", parameter_name) == 0) sscanf(val, "%d", &control_input->output_style);
     else if (strcmp("itnlim", parameter_name) == 0) sscanf(val, "%d", &control_input->itnlim);
+    else if (strcmp("sparse_solver_tolerance", parameter_name) == 0) sscanf(val, "%lf", &control_input->sparse_solver_tolerance);
+    else if (strcmp("sparse_solver_max_iterations", parameter_name) == 0) sscanf(val, "%d", &control_input->sparse_solver_max_iterations);
     else if (strcmp("rcond", parameter_name) == 0) sscanf(val, "%lf", &control_input->rcond);
 	else if (strcmp("sparse_safety_factor", parameter_name) == 0) sscanf(val, "%lf", &control_input->sparse_safety_factor);
 	else if (strcmp("num_sparse_threads", parameter_name) == 0) sscanf(val, "%d", &control_input->num_sparse_threads);
+	else if (strcmp("num_frame_threads", parameter_name) == 0) sscanf(val, "%d", &control_input->num_frame_threads);
+	else if (strcmp("num_prefetch_frames", parameter_name) == 0) sscanf(val, "%d", &control_input->num_prefetch_frames);
+	else if (strcmp("num_xtc_decode_threads", parameter_name) == 0) sscanf(val, "%d", &control_input->num_xtc_decode_threads);
+	else if (strcmp("frame_index_flag", parameter_name) == 0) sscanf(val, "%d", &control_input->frame_index_flag);
+	else if (strcmp("num_worker_processes", parameter_name) == 0) sscanf(val, "%d", &control_input->num_worker_processes);
+	else if (strcmp("range_finding_flag", parameter_name) == 0) sscanf(val, "%d", &control_input->range_finding_flag);
+	else if (strcmp("frame_cache_memory_mb", parameter_name) == 0) sscanf(val, "%d", &control_input->frame_cache_memory_mb);
     else if (strcmp("max_pair_bonds_per_site", parameter_name) == 0) sscanf(val, "%d", &control_input->max_pair_bonds_per_site);
     else if (strcmp("max_angles_per_site", parameter_name) == 0) sscanf(val, "%d", &control_input->max_angles_per_site);
     else if (strcmp("max_dihedrals_per_site", parameter_name) == 0) sscanf(val, "%d", &control_input->max_dihedrals_per_site);
@@ -115,6 +130,7 @@ ControlInputs::ControlInputs(void)
     // Set defaults for all control.in parameters
     
     frames_per_traj_block = 10;
+    block_size_set_flag = 0;
     use_statistical_reweighting = 0;
     pressure_constraint_flag = 0;
     volume_weighting_flag = 0;
@@ -131,6 +147,7 @@ ControlInputs::ControlInputs(void)
     starting_frame = 1;
     n_frames = 10;
     pair_nonbonded_cutoff = 1.0;
+    verlet_skin = 0.0;
     pair_nonbonded_fm_binwidth = 0.05;
     pair_bond_fm_binwidth = 0.05;
     angle_fm_binwidth = 1.0;
@@ -140,6 +157,8 @@ ControlInputs::ControlInputs(void)
     angle_bspline_k = 4;
     dihedral_bspline_k = 4;
     basis_set_type = 0;
+    native_bspline_flag = 1;
+    batched_pair_kernel_flag = 1;
     matrix_type = 0;
     pair_nonbonded_output_binwidth = 0.05;
     pair_bond_output_binwidth = 0.05;
@@ -147,9 +166,18 @@ ControlInputs::ControlInputs(void)
     dihedral_output_binwidth = 1.0;
     output_style = 0;
     itnlim = 0;
+    sparse_solver_tolerance = 1.0e-10;
+    sparse_solver_max_iterations = 0;
     rcond = -1.0;
 	sparse_safety_factor = 0.20;
     num_sparse_threads = 1;
+    num_frame_threads = 1;
+    num_prefetch_frames = 0;
+    num_xtc_decode_threads = 1;
+    frame_index_flag = 0;
+    num_worker_processes = 1;
+    range_finding_flag = 0;
+    frame_cache_memory_mb = 0;
     max_pair_bonds_per_site = 4;
     max_angles_per_site = 12;
     max_dihedrals_per_site = 36;
@@ -204,6 +232,11 @@ ControlInputs::ControlInputs(void)
         std::getline(control_in, line);
     }
     control_in.close();
+    
+    // Dense matrices used to force block_size to 1, so keep that as their default
+    // rather than silently growing the per-block matrix of existing inputs.
+    // Threaded frame processing divides each block among the threads, so give every thread a frame.
+    if ( (matrix_type == 0) && (block_size_set_flag == 0) ) frames_per_traj_block = (num_frame_threads > 1) ? num_frame_threads : 1;
 }
 
 ControlInputs::~ControlInputs() 
@@ -17,6 +17,7 @@ typedef struct ControlInputs {
     int starting_frame;
     int n_frames;
     int frames_per_traj_block;
+    int block_size_set_flag;                    // 1 if block_size was given in control.in; 0 to use the matrix_type's default
     int volume_weighting_flag;
     
     // Input specifications
@@ -44,6 +45,7 @@ typedef struct ControlInputs {
 	int density_excluded_style;				// 0 no exclusions; 2 exclude 1-2 bonded; 3 exclude 1-2 and 1-3 bonded; 4 exclude 1-2, 1-3 and 1-4 bonded interactions
     double gamma;
     double pair_nonbonded_cutoff;
+    double verlet_skin;                         // Skin distance added to the pair cutoff for Verlet lists reused across frames; 0 to disable.
 	double density_cutoff_distance;
     int max_pair_bonds_per_site;
     int max_angles_per_site;
@@ -63,6 +65,8 @@ typedef struct ControlInputs {
     int three_body_bspline_k;               // B-spline k value for nonbonded three body interactions
 	int density_bspline_k;                  // B-spline k value for density interactions
     int basis_set_type;
+    int native_bspline_flag;                // 1 to evaluate order 4 to 6 B-splines natively; 0 to always use GSL (reference)
+    int batched_pair_kernel_flag;           // 1 to force match pair nonbonded interactions a site's partners at a time; 0 one pair at a time (reference)
     
     // Output specifications. 
     int output_style;
@@ -96,12 +100,21 @@ typedef struct ControlInputs {
     // Matrix specifications
     int matrix_type;
     int itnlim;
+    double sparse_solver_tolerance;
+    int sparse_solver_max_iterations;
     int iterative_calculation_flag;
     double tikhonov_regularization_param;
     int regularization_style;
     double rcond;
 	double sparse_safety_factor; 
 	int num_sparse_threads;
+	int num_frame_threads;
+	int num_prefetch_frames;
+	int num_xtc_decode_threads;
+	int frame_index_flag;
+	int num_worker_processes;
+	int range_finding_flag;
+	int frame_cache_memory_mb;
 	
 	ControlInputs(void);
 	~ControlInputs(void);
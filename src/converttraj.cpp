@@ -0,0 +1,64 @@
+//
+//  converttraj.cpp
+//
+//  This driver converts a trajectory in any supported format to an MSCG binary
+//  trajectory (.cgtrj) that newfm.x and rangefinder.x can read much faster with -b.
+//  It reads the same control.in and top.in as the other drivers.
+//
+//  Copyright (c) 2016 The Voth Group at The University of Chicago. All rights reserved.
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include "control_input.h"
+#include "interaction_model.h"
+#include "misc.h"
+#include "topology.h"
+#include "trajectory_input.h"
+
+int main(int argc, char* argv[])
+{
+    double start_cputime = clock();
+
+    FrameSource fs;
+
+    // Take the output options off the end of the command line and pass the rest to the usual parser.
+    printf("Parsing command line arguments.\n");
+    int value_size = 8;
+    if (argc > 1 && strcmp(argv[argc - 1], "-single") == 0) {
+        value_size = 4;
+        argc--;
+    }
+    if (argc < 3 || strcmp(argv[argc - 2], "-o") != 0) {
+        printf("Usage: %s <trajectory arguments as for newfm.x> -o file.cgtrj [-single]\n", argv[0]);
+        printf("Add -single to store positions and forces in single precision.\n");
+        exit(EXIT_SUCCESS);
+    }
+    const char* output_filename = argv[argc - 1];
+    parse_command_line_arguments(argc - 2, argv, &fs);
+
+    printf("Reading high level control parameters.\n");
+    ControlInputs control_input;
+    CG_MODEL_DATA cg(&control_input);   // CG model parameters and data; put here to initialize without default constructor
+    copy_control_inputs_to_frd(&control_input, &fs);
+
+    printf("Reading topology file.\n");
+    read_topology_file(&cg.topo_data, &cg);
+
+    printf("Reading first frame.\n");
+    fs.get_first_frame(&fs, cg.n_cg_sites, cg.topo_data.cg_site_types);
+
+    // Convert every frame up to the last one used with this control.in,
+    // so that the same start_frame and n_frames select the same frames from the binary trajectory.
+    printf("Converting frames 1 to %d.\n", fs.starting_frame + fs.n_frames - 1);
+    write_binary_trajectory(&fs, output_filename, value_size, fs.starting_frame + fs.n_frames - 1);
+    fs.cleanup(&fs);
+
+    //print cpu time used
+    double end_cputime = clock();
+    double elapsed_cputime = ((double)(end_cputime - start_cputime)) / CLOCKS_PER_SEC;
+    printf("%f seconds used.\n", elapsed_cputime);
+    return 0;
+}
@@ -26,35 +26,41 @@
 bool check_excluded_list(const TopologyData* const topo_data, const int i, const int j);
 bool check_density_excluded_list(const TopologyData* const topo_data, const int i, const int j);
 
+// Calculate all the matrix elements for one frame with a given set of computers.
+
+void calculate_frame_fm_matrix_with_computers(CG_MODEL_DATA* const cg, std::list<InteractionClassComputer*> &icomp_list, ThreeBodyNonbondedClassComputer &three_body_nonbonded_computer, MATRIX_DATA* const mat, FrameConfig* const frame_config, PairCellList &pair_cell_list, PairVerletList &pair_verlet_list, ThreeBCellList &three_body_cell_list, int trajectory_block_frame_index);
+
 // Main routine responsible for calling single-element matrix computations,
 // differing by the way that potentially interacting particles are found in 
 // each frame and possibly found not to interact after.
 
-void order_pair_nonbonded_fm_matrix_element_calculation(InteractionClassComputer* const info, calc_pair_matrix_elements calc_matrix_elements, int* const cg_site_types, const int n_cg_types, MATRIX_DATA* const mat, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths);
-void order_bonded_fm_matrix_element_calculation(InteractionClassComputer* const info, int* const cg_site_types, const int n_cg_types, MATRIX_DATA* const mat, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths);
-void order_three_body_nonbonded_fm_matrix_element_calculation(InteractionClassComputer* const info, int* const cg_site_types, const int n_cg_types, MATRIX_DATA* const mat, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths);
-void density_fm_matrix_element_calculation(InteractionClassComputer* const iclass, calc_pair_matrix_elements calc_matrix_elements, int* const cg_site_types, const int n_cg_types, MATRIX_DATA* const mat, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths);
+void order_pair_nonbonded_fm_matrix_element_calculation(InteractionClassComputer* const info, calc_pair_matrix_elements calc_matrix_elements, int* const cg_site_types, const int n_cg_types, MATRIX_DATA* const mat, std::array<frame_real, DIMENSION>* const &x, const real *simulation_box_half_lengths);
+void order_bonded_fm_matrix_element_calculation(InteractionClassComputer* const info, int* const cg_site_types, const int n_cg_types, MATRIX_DATA* const mat, std::array<frame_real, DIMENSION>* const &x, const real *simulation_box_half_lengths);
+void order_three_body_nonbonded_fm_matrix_element_calculation(InteractionClassComputer* const info, int* const cg_site_types, const int n_cg_types, MATRIX_DATA* const mat, std::array<frame_real, DIMENSION>* const &x, const real *simulation_box_half_lengths);
+void density_fm_matrix_element_calculation(InteractionClassComputer* const iclass, calc_pair_matrix_elements calc_matrix_elements, int* const cg_site_types, const int n_cg_types, MATRIX_DATA* const mat, std::array<frame_real, DIMENSION>* const &x, const real *simulation_box_half_lengths);
 
 // Helper functions for the above
 
-void process_completed_density(DensityClassComputer* const info, calc_pair_matrix_elements process_density, const int n_cg_types, int* const cg_site_types, MATRIX_DATA* const mat, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths);
-inline void decode_density_interaction_and_calculate(DensityClassComputer* info, unsigned long interaction_flags, calc_pair_matrix_elements calc_matrix_elements, int* const cg_site_types, MATRIX_DATA* const mat, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths);
+void process_completed_density(DensityClassComputer* const info, calc_pair_matrix_elements process_density, const int n_cg_types, int* const cg_site_types, MATRIX_DATA* const mat, std::array<frame_real, DIMENSION>* const &x, const real *simulation_box_half_lengths);
+inline void decode_density_interaction_and_calculate(DensityClassComputer* info, unsigned long interaction_flags, calc_pair_matrix_elements calc_matrix_elements, int* const cg_site_types, MATRIX_DATA* const mat, std::array<frame_real, DIMENSION>* const &x, const real *simulation_box_half_lengths);
 void process_normal_interaction_matrix_elements(InteractionClassComputer* const info, MATRIX_DATA* const mat, const int n_body, int* particle_ids, std::array<double, DIMENSION>* derivatives, const double param_value, const int virial_flag, const double param_deriv, const double distance);
+inline void accumulate_tabulated_interaction_matrix_elements(InteractionClassComputer* const info, MATRIX_DATA* const mat, const int n_body, int* particle_ids, std::array<double, DIMENSION>* derivatives, const double param_value, const int virial_flag);
+inline void accumulate_matched_interaction_matrix_elements(InteractionClassComputer* const info, MATRIX_DATA* const mat, const int n_body, int* particle_ids, std::array<double, DIMENSION>* derivatives, const double param_value, const int virial_flag, const int first_nonzero_basis_index);
 void process_density_matrix_elements(InteractionClassComputer* const info, MATRIX_DATA* const mat, const int n_body, int* particle_ids, std::array<double, DIMENSION>* derivatives, const double density_value, const int virial_flag, const double density_derivative, const double distance);
 
 // Functions for calculating individual 3-component matrix elements.
 
-void calc_isotropic_two_body_fm_matrix_elements(InteractionClassComputer* const info, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat);
-void calc_angular_three_body_fm_matrix_elements(InteractionClassComputer* const info, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat);
-void calc_dihedral_four_body_fm_matrix_elements(InteractionClassComputer* const info, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat);
-void calc_density_fm_matrix_elements(InteractionClassComputer* const info, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat);
-void calc_nonbonded_1_three_body_fm_matrix_elements(InteractionClassComputer* const info, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat);
-void calc_nonbonded_2_three_body_fm_matrix_elements(InteractionClassComputer* const info, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat);
+void calc_isotropic_two_body_fm_matrix_elements(InteractionClassComputer* const info, std::array<frame_real, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat);
+void calc_angular_three_body_fm_matrix_elements(InteractionClassComputer* const info, std::array<frame_real, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat);
+void calc_dihedral_four_body_fm_matrix_elements(InteractionClassComputer* const info, std::array<frame_real, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat);
+void calc_density_fm_matrix_elements(InteractionClassComputer* const info, std::array<frame_real, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat);
+void calc_nonbonded_1_three_body_fm_matrix_elements(InteractionClassComputer* const info, std::array<frame_real, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat);
+void calc_nonbonded_2_three_body_fm_matrix_elements(InteractionClassComputer* const info, std::array<frame_real, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat);
 double calc_gaussian_density_derivative(DensityClassComputer* const icomp, DensityClassSpec* const ispec, const double distance);
 double calc_switching_density_derivative(DensityClassComputer* const icomp, DensityClassSpec* const ispec, const double distance);
 double calc_lucy_density_derivative(DensityClassComputer* const icomp, DensityClassSpec* const ispec, const double distance);
 double calc_re_density_derivative(DensityClassComputer* const icomp, DensityClassSpec* const ispec, const double distance);
-void do_nothing(InteractionClassComputer* const info, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat);
+void do_nothing(InteractionClassComputer* const info, std::array<frame_real, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat);
 void accumulate_matching_order_parameter_forces(InteractionClassComputer* const info, const int first_nonzero_basis_index, double extra_derivative_value, std::vector<double> &basis_fn_vals, const int n_body, const int* particle_ids, std::array<double, DIMENSION>* const &derivatives, MATRIX_DATA * const mat);
 
 //--------------------------------------------------------------------
@@ -76,6 +82,10 @@ void set_up_force_computers(CG_MODEL_DATA* const cg)
 
     // Set up three body nonbonded interaction classes.
     cg->three_body_nonbonded_computer.special_set_up_computer(&cg->three_body_nonbonded_interactions, &curr_iclass_col_index);
+    
+    // Sort the exclusion lists for fast lookups in the nonbonded pair loops.
+    if (cg->topo_data.exclusion_list != NULL) cg->topo_data.exclusion_list->build_lookup();
+    if (cg->topo_data.density_exclusion_list != NULL) cg->topo_data.density_exclusion_list->build_lookup();
 }
 
 void InteractionClassComputer::set_up_computer(InteractionClassSpec* const ispec_pt, int *curr_iclass_col_index) 
@@ -109,6 +119,7 @@ void InteractionClassComputer::set_up_computer(InteractionClassSpec* const ispec
 void PairNonbondedClassComputer::class_set_up_computer(void) 
 {
 	calculate_fm_matrix_elements = calc_isotropic_two_body_fm_matrix_elements;
+	use_batched_kernel = (static_cast<PairNonbondedClassSpec*>(ispec)->batched_kernel_flag != 0);
 }
 
 void PairBondedClassComputer::class_set_up_computer(void) 
@@ -251,18 +262,103 @@ void ThreeBodyNonbondedClassComputer::special_set_up_computer(InteractionClassSp
         interaction_class_column_index = *curr_iclass_col_index;
         *curr_iclass_col_index += ispec->interaction_column_indices[ispec->n_to_force_match];
     }
-    fm_s_comp = new BSplineAndDerivComputer(ispec);
+    // The Stillinger-Weber style has a single fixed basis function per interaction, so it has no spline.
+    if (ispec->class_subtype == 3) {
+    	fm_s_comp = NULL;
+    } else {
+    	fm_s_comp = new BSplineAndDerivComputer(ispec);
+    	fm_basis_fn_vals = std::vector<double>(fm_s_comp->get_n_coef());
+    	fm_basis_deriv_vals = std::vector<double>(fm_s_comp->get_n_coef());
+    }
+}
+
+// Make a private copy of each computer in cg for use by a single thread.
+// The spline computers and density intermediates hold per-evaluation scratch space,
+// so those are rebuilt for each copy rather than shared.
+
+FrameWorkerComputers::FrameWorkerComputers(CG_MODEL_DATA* const cg) :
+	pair_nonbonded_computer(cg->pair_nonbonded_computer), pair_bonded_computer(cg->pair_bonded_computer),
+	angular_computer(cg->angular_computer), dihedral_computer(cg->dihedral_computer),
+	three_body_nonbonded_computer(cg->three_body_nonbonded_computer),
+	density_computer(cg->density_computer),
+	pair_verlet_list(cg->pair_nonbonded_cutoff, cg->verlet_skin)
+{
+	icomp_list.push_back(&pair_nonbonded_computer);
+	icomp_list.push_back(&pair_bonded_computer);
+	icomp_list.push_back(&angular_computer);
+	icomp_list.push_back(&dihedral_computer);
+	icomp_list.push_back(&density_computer);
+	
+	std::list<InteractionClassComputer*>::iterator icomp_iterator;
+	for(icomp_iterator=icomp_list.begin(); icomp_iterator != icomp_list.end(); icomp_iterator++) {
+		(*icomp_iterator)->fm_s_comp = set_up_fm_spline_comp((*icomp_iterator)->ispec);
+		(*icomp_iterator)->table_s_comp = set_up_table_spline_comp((*icomp_iterator)->ispec);
+	}
+	if (three_body_nonbonded_computer.ispec->class_subtype != 3) three_body_nonbonded_computer.fm_s_comp = new BSplineAndDerivComputer(three_body_nonbonded_computer.ispec);
+	three_body_nonbonded_computer.table_s_comp = NULL;
+	
+	// Copy the density intermediates allocated in DensityClassComputer::class_set_up_computer.
+	DensityClassSpec* density_spec = static_cast<DensityClassSpec*>(density_computer.ispec);
+	int n_defined = density_spec->get_n_defined();
+	if (n_defined > 0) {
+		if (density_spec->class_subtype > 0) {
+			density_computer.density_values = new double[n_defined * density_spec->n_cg_sites]();
+			density_computer.denomenator = new double[n_defined];
+			density_computer.u_cutoff = new double[n_defined];
+			density_computer.f_cutoff = new double[n_defined];
+			for (int ii = 0; ii < n_defined; ii++) {
+				density_computer.denomenator[ii] = cg->density_computer.denomenator[ii];
+				density_computer.u_cutoff[ii] = cg->density_computer.u_cutoff[ii];
+				density_computer.f_cutoff[ii] = cg->density_computer.f_cutoff[ii];
+			}
+		}
+		if (density_spec->class_subtype == 4) {
+			density_computer.c0 = new double[n_defined];
+			density_computer.c2 = new double[n_defined];
+			density_computer.c4 = new double[n_defined];
+			density_computer.c6 = new double[n_defined];
+			for (int ii = 0; ii < n_defined; ii++) {
+				density_computer.c0[ii] = cg->density_computer.c0[ii];
+				density_computer.c2[ii] = cg->density_computer.c2[ii];
+				density_computer.c4[ii] = cg->density_computer.c4[ii];
+				density_computer.c6[ii] = cg->density_computer.c6[ii];
+			}
+		}
+	}
+}
+
+FrameWorkerComputers::~FrameWorkerComputers()
+{
+	std::list<InteractionClassComputer*>::iterator icomp_iterator;
+	for(icomp_iterator=icomp_list.begin(); icomp_iterator != icomp_list.end(); icomp_iterator++) {
+		if ( (*icomp_iterator)->fm_s_comp != NULL ) delete (*icomp_iterator)->fm_s_comp;
+		if ( (*icomp_iterator)->table_s_comp != NULL ) delete (*icomp_iterator)->table_s_comp;
+	}
+	if (three_body_nonbonded_computer.fm_s_comp != NULL) delete three_body_nonbonded_computer.fm_s_comp;
 }
 
 //--------------------------------------------------------------------
 // Main routine calling all other matrix element calculation routines
 //--------------------------------------------------------------------
 
-void calculate_frame_fm_matrix(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, FrameConfig* const frame_config, PairCellList pair_cell_list, ThreeBCellList three_body_cell_list, int trajectory_block_frame_index)
+void calculate_frame_fm_matrix(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, FrameConfig* const frame_config, PairCellList &pair_cell_list, ThreeBCellList &three_body_cell_list, int trajectory_block_frame_index)
+{
+	calculate_frame_fm_matrix_with_computers(cg, cg->icomp_list, cg->three_body_nonbonded_computer, mat, frame_config, pair_cell_list, cg->pair_verlet_list, three_body_cell_list, trajectory_block_frame_index);
+}
+
+void calculate_frame_fm_matrix(CG_MODEL_DATA* const cg, FrameWorkerComputers* const computers, MATRIX_DATA* const mat, FrameConfig* const frame_config, PairCellList &pair_cell_list, ThreeBCellList &three_body_cell_list, int trajectory_block_frame_index)
+{
+	calculate_frame_fm_matrix_with_computers(cg, computers->icomp_list, computers->three_body_nonbonded_computer, mat, frame_config, pair_cell_list, computers->pair_verlet_list, three_body_cell_list, trajectory_block_frame_index);
+}
+
+void calculate_frame_fm_matrix_with_computers(CG_MODEL_DATA* const cg, std::list<InteractionClassComputer*> &icomp_list, ThreeBodyNonbondedClassComputer &three_body_nonbonded_computer, MATRIX_DATA* const mat, FrameConfig* const frame_config, PairCellList &pair_cell_list, PairVerletList &pair_verlet_list, ThreeBCellList &three_body_cell_list, int trajectory_block_frame_index)
 {
     // Each frame is a set of contiguous rows in the FM matrix; get the starting row for this frame.
     int current_frame_starting_row = trajectory_block_frame_index * cg->n_cg_sites; //shift row number after each frame within one block
     
+    // Record this frame's weight for matrices that weight the frames of a block separately.
+    mat->block_frame_weights[trajectory_block_frame_index] = mat->get_frame_weight();
+    
     // Wrap all coordinates to ensure they are within a single image of
     // the periodic domain and get the target forces for the calculation.
     for (unsigned l = 0; l < cg->topo_data.n_cg_sites; l++) {
@@ -272,18 +368,30 @@ void calculate_frame_fm_matrix(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat,
     }
     
     // Set up a cell list and initialize the calculation temps for pair 
-    // nonbonded matrix element computations.
-    pair_cell_list.populateList(frame_config->current_n_sites, frame_config->x);
+    // nonbonded matrix element computations. With a Verlet list, the cell list
+    // is only needed when the Verlet list has to be rebuilt.
+    if (cg->verlet_skin > 0.0) {
+        pair_cell_list.verlet_list = &pair_verlet_list;
+        if (pair_verlet_list.needsRebuild(frame_config->current_n_sites, frame_config->x, frame_config->simulation_box_half_lengths)) {
+            pair_cell_list.populateList(frame_config->current_n_sites, frame_config->x);
+            pair_verlet_list.build(pair_cell_list, frame_config->current_n_sites, frame_config->x, frame_config->simulation_box_half_lengths,
+                                   (cg->pair_nonbonded_interactions.n_defined > 0) ? cg->topo_data.exclusion_list : NULL,
+                                   (cg->density_interactions.n_defined > 0) ? cg->topo_data.density_exclusion_list : NULL);
+        }
+    } else {
+        pair_cell_list.verlet_list = NULL;
+        pair_cell_list.populateList(frame_config->current_n_sites, frame_config->x);
+    }
     if (cg->three_body_nonbonded_interactions.class_subtype > 0) {
         three_body_cell_list.populateList(frame_config->current_n_sites, frame_config->x);
     }
     
     // Calculate matrix elements by looking through interaction (cell and topology) lists to find active (and non-excluded) interactions.
     std::list<InteractionClassComputer*>::iterator icomp_iterator;
-	for(icomp_iterator=cg->icomp_list.begin(); icomp_iterator != cg->icomp_list.end(); icomp_iterator++) {
+	for(icomp_iterator=icomp_list.begin(); icomp_iterator != icomp_list.end(); icomp_iterator++) {
         (*icomp_iterator)->calculate_interactions(mat, trajectory_block_frame_index, current_frame_starting_row, cg->n_cg_types, cg->topo_data, pair_cell_list, frame_config->x, frame_config->simulation_box_half_lengths);
     }
-    cg->three_body_nonbonded_computer.calculate_3B_interactions(mat, trajectory_block_frame_index, current_frame_starting_row, cg->n_cg_types, cg->topo_data, three_body_cell_list, frame_config->x, frame_config->simulation_box_half_lengths);
+    three_body_nonbonded_computer.calculate_3B_interactions(mat, trajectory_block_frame_index, current_frame_starting_row, cg->n_cg_types, cg->topo_data, three_body_cell_list, frame_config->x, frame_config->simulation_box_half_lengths);
 }
 
 //--------------------------------------------------------------------
@@ -293,47 +401,187 @@ void calculate_frame_fm_matrix(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat,
 
 // Find all neighbors of all particles and call nonbonded matrix element computations for any pairs that interact. 
 
-void PairNonbondedClassComputer::calculate_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths) 
+void PairNonbondedClassComputer::calculate_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, std::array<frame_real, DIMENSION>* const &x, const real* simulation_box_half_lengths) 
 {
     if (ispec->n_defined == 0) return;
     trajectory_block_frame_index = traj_block_frame_index;
     current_frame_starting_row = curr_frame_starting_row;
-    walk_neighbor_list(mat, calculate_fm_matrix_elements, n_cg_types, topo_data, pair_cell_list, x, simulation_box_half_lengths);
+    walk_neighbor_list(mat, n_cg_types, topo_data, pair_cell_list, x, simulation_box_half_lengths);
 }
 
-inline void InteractionClassComputer::walk_neighbor_list(MATRIX_DATA* const mat, calc_pair_matrix_elements calc_matrix_elements, const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths) 
+// Gather the partners l of each particle k from the Verlet list or the cell list
+// and handle them together in process_pair_batch.
+
+void PairNonbondedClassComputer::walk_neighbor_list(MATRIX_DATA* const mat, const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, std::array<frame_real, DIMENSION>* const &x, const real* simulation_box_half_lengths) 
 {
-    if (ispec->n_defined == 0) return;
+    // Exclusions were already applied when the Verlet list was built.
+    if (pair_cell_list.verlet_list != NULL) {
+        const PairVerletList* verlet_list = pair_cell_list.verlet_list;
+        for (k = 0; k < verlet_list->n_particles; k++) {
+        	int n_partners = verlet_list->pair_starts[k + 1] - verlet_list->pair_starts[k];
+        	if (n_partners > 0) process_pair_batch(&verlet_list->pair_partners[verlet_list->pair_starts[k]], n_partners, mat, n_cg_types, topo_data, x, simulation_box_half_lengths);
+        }
+        return;
+    }
     int stencil_size = pair_cell_list.get_stencil_size();
     for (int kk = 0; kk < pair_cell_list.size; kk++) {
-        k = pair_cell_list.head[kk];
-        while (k >= 0) {
-            l = pair_cell_list.list[k];
-            while (l >= 0) {
-                if (check_excluded_list(&topo_data, k, l) == false) {
-                    order_pair_nonbonded_fm_matrix_element_calculation(this, calc_matrix_elements, topo_data.cg_site_types, n_cg_types, mat, x, simulation_box_half_lengths);
-                }
-                l = pair_cell_list.list[l];
-            }
+        for (k = pair_cell_list.head[kk]; k >= 0; k = pair_cell_list.list[k]) {
+        	batch_partners.clear();
+        	for (int n = pair_cell_list.list[k]; n >= 0; n = pair_cell_list.list[n]) {
+        		if (check_excluded_list(&topo_data, k, n) == false) batch_partners.push_back(n);
+        	}
             //do the above the 2nd time for neiboring cells
             for (int nei = 0; nei < stencil_size; nei++) {
                 int ll = pair_cell_list.stencil[stencil_size * kk + nei];
-                l = pair_cell_list.head[ll];
-                while (l >= 0) {
-                    if (check_excluded_list(&topo_data, k, l) == false) {
-                        order_pair_nonbonded_fm_matrix_element_calculation(this, calc_matrix_elements, topo_data.cg_site_types, n_cg_types, mat, x, simulation_box_half_lengths);
-                    }
-                    l = pair_cell_list.list[l];
+                for (int n = pair_cell_list.head[ll]; n >= 0; n = pair_cell_list.list[n]) {
+                	if (check_excluded_list(&topo_data, k, n) == false) batch_partners.push_back(n);
                 }
             }
-            k = pair_cell_list.list[k];
+            if (batch_partners.size() > 0) process_pair_batch(&batch_partners[0], (int)batch_partners.size(), mat, n_cg_types, topo_data, x, simulation_box_half_lengths);
         }
     }
 }
 
-inline void DensityClassComputer::walk_density_neighbor_list(MATRIX_DATA* const mat, calc_pair_matrix_elements calc_matrix_elements, const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths) 
+// Handle particle k and each of its n_partners partners.
+// Without the batched kernel (as in range finding), each pair is passed to calculate_fm_matrix_elements in turn.
+// With it, this does the work of calc_isotropic_two_body_fm_matrix_elements for all the partners together:
+// the displacements are calculated for the whole batch, the distances for the partners within the cutoff,
+// the basis functions together for the interacting pairs of each force matched interaction, and the
+// matrix elements are then accumulated one pair at a time in the original order, so the results are identical.
+
+void PairNonbondedClassComputer::process_pair_batch(const int* const partners, const int n_partners, MATRIX_DATA* const mat, const int n_cg_types, const TopologyData& topo_data, std::array<frame_real, DIMENSION>* const &x, const real* simulation_box_half_lengths)
+{
+	if (!use_batched_kernel) {
+		for (int p = 0; p < n_partners; p++) {
+			l = partners[p];
+			order_pair_nonbonded_fm_matrix_element_calculation(this, calculate_fm_matrix_elements, topo_data.cg_site_types, n_cg_types, mat, x, simulation_box_half_lengths);
+		}
+		return;
+	}
+	
+	if ((int)batch_rr2.size() < n_partners) {
+		for (int d = 0; d < DIMENSION; d++) {
+			batch_displacements[d].resize(n_partners);
+			batch_derivatives[d].resize(n_partners);
+		}
+		batch_rr2.resize(n_partners);
+		batch_distances.resize(n_partners);
+		batch_within_cutoff.resize(n_partners);
+		batch_interacting.resize(n_partners);
+		batch_index_among_defined.resize(n_partners);
+		batch_group_positions.resize(n_partners);
+		group_params.resize(n_partners);
+		group_first_nonzero_basis_indices.resize(n_partners);
+	}
+	
+	// Gather the partner coordinates and take their minimum image displacements from particle k.
+	double* displacements[DIMENSION];
+	double* derivatives[DIMENSION];
+	double x_k[DIMENSION];
+	for (int d = 0; d < DIMENSION; d++) {
+		displacements[d] = &batch_displacements[d][0];
+		derivatives[d] = &batch_derivatives[d][0];
+		x_k[d] = (double)x[k][d];
+		for (int p = 0; p < n_partners; p++) {
+			displacements[d][p] = (double)x[partners[p]][d];
+		}
+	}
+	calc_min_image_displacements_batch(n_partners, x_k, simulation_box_half_lengths, displacements, &batch_rr2[0]);
+	
+	// Pack the partners within the cutoff at the front of the buffers, since most
+	// partners from a cell list are outside it, then find their distances.
+	int n_within_cutoff = 0;
+	for (int p = 0; p < n_partners; p++) {
+		batch_within_cutoff[n_within_cutoff] = partners[p];
+		for (int d = 0; d < DIMENSION; d++) displacements[d][n_within_cutoff] = displacements[d][p];
+		batch_rr2[n_within_cutoff] = batch_rr2[p];
+		n_within_cutoff += (batch_rr2[p] <= cutoff2);
+	}
+	const double* distances = &batch_distances[0];
+	calc_distances_and_derivatives_batch(n_within_cutoff, displacements, &batch_rr2[0], &batch_distances[0], derivatives);
+	
+	// Keep the partners within the range of their interaction.
+	int n_interacting = 0;
+	for (int p = 0; p < n_within_cutoff; p++) {
+		int index_among_defined = ispec->get_index_from_hash(calc_two_body_interaction_hash(topo_data.cg_site_types[k], topo_data.cg_site_types[batch_within_cutoff[p]], n_cg_types));
+		if (distances[p] < ispec->lower_cutoffs[index_among_defined] ||
+			distances[p] > ispec->upper_cutoffs[index_among_defined]) continue;
+		batch_interacting[n_interacting] = p;
+		batch_index_among_defined[n_interacting] = index_among_defined;
+		n_interacting++;
+	}
+	if (n_interacting == 0) return;
+	
+	// Group the force matched pairs by interaction and evaluate the basis functions of each group together.
+	int n_coef = 0;
+	if (ispec->n_to_force_match > 0) {
+		n_coef = fm_s_comp->get_n_coef();
+		group_starts.assign(ispec->n_to_force_match + 1, 0);
+		for (int q = 0; q < n_interacting; q++) {
+			group_starts[ispec->defined_to_matched_intrxn_index_map[batch_index_among_defined[q]]]++;
+		}
+		// Each group's count sits one entry past its start, so the running sum gives the starts;
+		// the first entry counted the pairs that are not force matched.
+		group_starts[0] = 0;
+		for (int g = 0; g < ispec->n_to_force_match; g++) group_starts[g + 1] += group_starts[g];
+		
+		group_fill.assign(group_starts.begin(), group_starts.end() - 1);
+		group_defined_indices.resize(ispec->n_to_force_match);
+		for (int q = 0; q < n_interacting; q++) {
+			int index_among_matched = ispec->defined_to_matched_intrxn_index_map[batch_index_among_defined[q]];
+			if (index_among_matched == 0) continue;
+			int position = group_fill[index_among_matched - 1]++;
+			batch_group_positions[q] = position;
+			group_params[position] = distances[batch_interacting[q]];
+			group_defined_indices[index_among_matched - 1] = batch_index_among_defined[q];
+		}
+		
+		if ((int)group_basis_fn_vals.size() < n_interacting * n_coef) group_basis_fn_vals.resize(n_interacting * n_coef);
+		for (int g = 0; g < ispec->n_to_force_match; g++) {
+			int n_in_group = group_starts[g + 1] - group_starts[g];
+			if (n_in_group == 0) continue;
+			fm_s_comp->calculate_basis_fn_vals_batch(group_defined_indices[g], n_in_group, &group_params[group_starts[g]], &group_first_nonzero_basis_indices[group_starts[g]], &group_basis_fn_vals[group_starts[g] * n_coef]);
+		}
+	}
+	
+	// Accumulate the matrix elements one pair at a time in the original order.
+	int particle_ids[2];
+	std::array<double, DIMENSION> pair_derivatives[1];
+	for (int q = 0; q < n_interacting; q++) {
+		int p = batch_interacting[q];
+		l = batch_within_cutoff[p];
+		index_among_defined_intrxns = batch_index_among_defined[q];
+		set_indices();
+		particle_ids[0] = k;
+		particle_ids[1] = l;
+		for (int d = 0; d < DIMENSION; d++) pair_derivatives[0][d] = derivatives[d][p];
+		
+		if (index_among_tabulated_interactions > 0) {
+			accumulate_tabulated_interaction_matrix_elements(this, mat, 2, particle_ids, pair_derivatives, distances[p], 1);
+		}
+		if (index_among_matched_interactions > 0) {
+			int position = batch_group_positions[q];
+			for (int i = 0; i < n_coef; i++) fm_basis_fn_vals[i] = group_basis_fn_vals[position * n_coef + i];
+			accumulate_matched_interaction_matrix_elements(this, mat, 2, particle_ids, pair_derivatives, distances[p], 1, group_first_nonzero_basis_indices[position]);
+		}
+	}
+}
+
+inline void DensityClassComputer::walk_density_neighbor_list(MATRIX_DATA* const mat, calc_pair_matrix_elements calc_matrix_elements, const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, std::array<frame_real, DIMENSION>* const &x, const real* simulation_box_half_lengths) 
 {
     if (ispec->n_defined == 0) return;
+    // Exclusions were already applied when the Verlet list was built.
+    if (pair_cell_list.verlet_list != NULL) {
+        const PairVerletList* verlet_list = pair_cell_list.verlet_list;
+        for (int kk = 0; kk < verlet_list->n_particles; kk++) {
+            for (int p = verlet_list->density_starts[kk]; p < verlet_list->density_starts[kk + 1]; p++) {
+                k = kk;
+                l = verlet_list->density_partners[p];
+                density_fm_matrix_element_calculation(this, calc_matrix_elements, topo_data.cg_site_types, n_cg_types, mat, x, simulation_box_half_lengths);
+            }
+        }
+        return;
+    }
     int stencil_size = pair_cell_list.get_stencil_size();
     for (int kk = 0; kk < pair_cell_list.size; kk++) {
         k = pair_cell_list.head[kk];
@@ -363,7 +611,7 @@ inline void DensityClassComputer::walk_density_neighbor_list(MATRIX_DATA* const
 
 // Calculate matrix elements for all bonded interactions by looping over the approriate topology lists. 
 
-void PairBondedClassComputer::calculate_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths) 
+void PairBondedClassComputer::calculate_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, std::array<frame_real, DIMENSION>* const &x, const real* simulation_box_half_lengths) 
 {
     if (ispec->n_defined == 0) return;
     trajectory_block_frame_index = traj_block_frame_index;
@@ -376,7 +624,7 @@ void PairBondedClassComputer::calculate_interactions(MATRIX_DATA* const mat, int
     }
 }
 
-void AngularClassComputer::calculate_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths) 
+void AngularClassComputer::calculate_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, std::array<frame_real, DIMENSION>* const &x, const real* simulation_box_half_lengths) 
 {
     if (ispec->n_defined == 0) return;
     trajectory_block_frame_index = traj_block_frame_index;
@@ -394,7 +642,7 @@ void AngularClassComputer::calculate_interactions(MATRIX_DATA* const mat, int tr
     }
 }
 
-void DihedralClassComputer::calculate_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths) 
+void DihedralClassComputer::calculate_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, std::array<frame_real, DIMENSION>* const &x, const real* simulation_box_half_lengths) 
 {
     if (ispec->n_defined == 0) return;
     
@@ -424,7 +672,7 @@ void DihedralClassComputer::calculate_interactions(MATRIX_DATA* const mat, int t
 // for each pair of density groups that interact. Exclusion lists are handled in the called subroutines.
 // Then, calculate the matrix elements by looking through the neighbor list (for all pairs of neighbors for all particles) to calculate matrix elements.
 
-void DensityClassComputer::calculate_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths) 
+void DensityClassComputer::calculate_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, std::array<frame_real, DIMENSION>* const &x, const real* simulation_box_half_lengths) 
 {
 	if (ispec->get_n_defined() == 0) return;
 	
@@ -447,83 +695,87 @@ void DensityClassComputer::calculate_interactions(MATRIX_DATA* const mat, int tr
   
 // Calculate matrix elements for three body non-bonded interactions.
 // Find all pairs of neighbors of all particles and call nonbonded matrix element computations
-// for any triples that interact. Exclusion lists are handled in the called subroutines.
+// for any triples that interact. Exclusion lists are handled while walking the neighbors.
 
-void ThreeBodyNonbondedClassComputer::calculate_3B_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, const ThreeBCellList& three_body_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths) 
+void ThreeBodyNonbondedClassComputer::calculate_3B_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, const ThreeBCellList& three_body_cell_list, std::array<frame_real, DIMENSION>* const &x, const real* simulation_box_half_lengths) 
 {
     if (ispec->n_defined == 0) return;
     if (ispec->class_subtype > 0) {                    
         trajectory_block_frame_index = traj_block_frame_index;
         current_frame_starting_row = curr_frame_starting_row;
-       	walk_3B_neighbor_list(mat, n_cg_types, topo_data, three_body_cell_list, x, simulation_box_half_lengths);
+       	walk_3B_neighbor_shells(mat, n_cg_types, topo_data, three_body_cell_list, x, simulation_box_half_lengths);
 	}
 }
 
-inline void InteractionClassComputer::walk_3B_neighbor_list(MATRIX_DATA* const mat, const int n_cg_types, const TopologyData& topo_data, const ThreeBCellList& three_body_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths) 
+// Walk the three body cell list one central particle j at a time. The neighbors of j within the
+// largest three body cutoff are first gathered into a shell, taking j's own cell and then each
+// stencil cell in turn, along with their displacements from j and their exclusion flags.
+// Every pair of shell members is then tried as the end particles (k, l) of a triplet, which
+// visits the triplets in the same order as walking the cells directly but computes each
+// displacement and exclusion check once per neighbor instead of once per triplet.
+
+void ThreeBodyNonbondedClassComputer::walk_3B_neighbor_shells(MATRIX_DATA* const mat, const int n_cg_types, const TopologyData& topo_data, const ThreeBCellList& three_body_cell_list, std::array<frame_real, DIMENSION>* const &x, const real* simulation_box_half_lengths) 
 {
+	ThreeBodyNonbondedClassSpec* tb_spec = static_cast<ThreeBodyNonbondedClassSpec*>(ispec);
+	double shell_cutoff = 0.0;
+	for (int i = 0; i < tb_spec->n_defined; i++) shell_cutoff = fmax(shell_cutoff, tb_spec->three_body_nonbonded_cutoffs[i]);
+	double shell_cutoff2 = shell_cutoff * shell_cutoff;
+	
 	int stencil_size = three_body_cell_list.get_stencil_size();
     for (int kk = 0; kk < three_body_cell_list.size; kk++) {
         j = three_body_cell_list.head[kk];
         while (j >= 0) {
-            k = three_body_cell_list.head[kk];
-            while (k >= 0) {
-                if (j != k) {
-                    //three body
-                    l = three_body_cell_list.list[k];
-                    while (l >= 0) {
-                        if (l >= 0) {
-	                        if (l != j) {
-    	                       if ( (check_excluded_list(&topo_data, l, j) == false)  && (check_excluded_list(&topo_data, j, k) == false) ) {
-        	                       order_three_body_nonbonded_fm_matrix_element_calculation(this, topo_data.cg_site_types, n_cg_types, mat, x, simulation_box_half_lengths);
-            	               }
-            	        	}
-                        	l = three_body_cell_list.list[l];
-						}
-					}
-                    for (int nei_3 = 0; nei_3 < stencil_size; nei_3++) {
-                        int ll_3 = three_body_cell_list.stencil[stencil_size * kk + nei_3];
-                        l = three_body_cell_list.head[ll_3];
-                        while (l >= 0) {
-                            if ( (check_excluded_list(&topo_data, l, j) == false)  && (check_excluded_list(&topo_data, j, k) == false) ) {
-                                order_three_body_nonbonded_fm_matrix_element_calculation(this, topo_data.cg_site_types, n_cg_types, mat, x, simulation_box_half_lengths);
-                            }
-                            l = three_body_cell_list.list[l];
-                        }
-                    }
-                }
-                k = three_body_cell_list.list[k];
-            }
-            
+        	shell_ids.clear();
+        	shell_displacements.clear();
+        	shell_rr2.clear();
+        	shell_excluded_as_k.clear();
+        	shell_excluded_as_l.clear();
+        	
+        	for (int n = three_body_cell_list.head[kk]; n >= 0; n = three_body_cell_list.list[n]) {
+        		if (n != j) add_to_shell(n, topo_data, shell_cutoff2, x, simulation_box_half_lengths);
+        	}
             for (int nei = 0; nei < stencil_size; nei++) {
                 int ll = three_body_cell_list.stencil[stencil_size * kk + nei];
-                k = three_body_cell_list.head[ll];
-                while (k >= 0) {
-                    //three body
-                    l = three_body_cell_list.list[k];
-                    while (l >= 0) {
-                        if ( (check_excluded_list(&topo_data, l, j) == false)  && (check_excluded_list(&topo_data, j, k) == false) ) {
-                                order_three_body_nonbonded_fm_matrix_element_calculation(this, topo_data.cg_site_types, n_cg_types, mat, x, simulation_box_half_lengths);
-                        }
-                        l = three_body_cell_list.list[l];
-                    }
-                    for (int nei_3 = nei + 1; nei_3 < stencil_size; nei_3++) {
-                        int ll_3 = three_body_cell_list.stencil[stencil_size * kk + nei_3];
-                        l = three_body_cell_list.head[ll_3];
-                        while (l >= 0) {
-                            if ( (check_excluded_list(&topo_data, l, j) == false)  && (check_excluded_list(&topo_data, j, k) == false) ) {
-                                order_three_body_nonbonded_fm_matrix_element_calculation(this, topo_data.cg_site_types, n_cg_types, mat, x, simulation_box_half_lengths);
-                            }
-                            l = three_body_cell_list.list[l];
-                        }
-                    }
-                    k = three_body_cell_list.list[k];
+                for (int n = three_body_cell_list.head[ll]; n >= 0; n = three_body_cell_list.list[n]) {
+                	add_to_shell(n, topo_data, shell_cutoff2, x, simulation_box_half_lengths);
                 }
             }
+            
+            int shell_size = (int)shell_ids.size();
+            for (shell_k = 0; shell_k < shell_size; shell_k++) {
+            	if (shell_excluded_as_k[shell_k]) continue;
+            	k = shell_ids[shell_k];
+            	for (shell_l = shell_k + 1; shell_l < shell_size; shell_l++) {
+            		if (shell_excluded_as_l[shell_l]) continue;
+            		l = shell_ids[shell_l];
+            		order_three_body_nonbonded_fm_matrix_element_calculation(this, topo_data.cg_site_types, n_cg_types, mat, x, simulation_box_half_lengths);
+            	}
+            }
             j = three_body_cell_list.list[j];
         }
     }
 }
 
+// Add particle n to the shell of the current central particle j if it is within the shell cutoff.
+
+inline void ThreeBodyNonbondedClassComputer::add_to_shell(const int n, const TopologyData& topo_data, const double shell_cutoff2, std::array<frame_real, DIMENSION>* const &x, const real* simulation_box_half_lengths)
+{
+	int particle_ids[2] = {j, n};
+	std::array<double, DIMENSION> displacement;
+	double rr2 = 0.0;
+	subtract_min_image_vectors(particle_ids, x, simulation_box_half_lengths, displacement);
+	for (int i = 0; i < DIMENSION; i++) {
+		rr2 += displacement[i] * displacement[i];
+	}
+	if (rr2 > shell_cutoff2) return;
+	
+	shell_ids.push_back(n);
+	shell_displacements.push_back(displacement);
+	shell_rr2.push_back(rr2);
+	shell_excluded_as_k.push_back(check_excluded_list(&topo_data, j, n));
+	shell_excluded_as_l.push_back(check_excluded_list(&topo_data, n, j));
+}
+
 //--------------------------------------------------------------------
 //  Routines for checking if nonbonded interactions should be excluded
 // from the model because they are between bonded particles.
@@ -532,19 +784,13 @@ inline void InteractionClassComputer::walk_3B_neighbor_list(MATRIX_DATA* const m
 inline bool check_excluded_list(const TopologyData* const topo_data, const int i, const int j)
 {
     // Check whether this non-bonded interaction is excluded from the model
-    for (unsigned k = 0; k < topo_data->exclusion_list->partner_numbers_[i]; k++) {
-        if (topo_data->exclusion_list->partners_[i][k] == unsigned(j)) return true;
-    }
-    return false;
+    return topo_data->exclusion_list->is_partner(i, j);
 }
 
 inline bool check_density_excluded_list(const TopologyData* const topo_data, const int i, const int j)
 {
 	// Check whetehr this non-bonded interaction is excluded from the model
-	for (unsigned k = 0; k < topo_data->density_exclusion_list->partner_numbers_[i]; k++) {
-        if (topo_data->density_exclusion_list->partners_[i][k] == unsigned(j)) return true;
-    }
-    return false;
+	return topo_data->density_exclusion_list->is_partner(i, j);
 }
 
 //--------------------------------------------------------------------
@@ -553,7 +799,7 @@ inline bool check_density_excluded_list(const TopologyData* const topo_data, con
 // each frame and possibly found not to interact after.
 //--------------------------------------------------------------------
 
-void order_pair_nonbonded_fm_matrix_element_calculation(InteractionClassComputer* const info, calc_pair_matrix_elements calc_matrix_elements, int* const cg_site_types, const int n_cg_types, MATRIX_DATA* const mat, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths)
+void order_pair_nonbonded_fm_matrix_element_calculation(InteractionClassComputer* const info, calc_pair_matrix_elements calc_matrix_elements, int* const cg_site_types, const int n_cg_types, MATRIX_DATA* const mat, std::array<frame_real, DIMENSION>* const &x, const real *simulation_box_half_lengths)
 {
     // Calculate the appropriate matrix elements.
     info->index_among_defined_intrxns = info->ispec->get_index_from_hash(calc_two_body_interaction_hash(cg_site_types[info->k], cg_site_types[info->l], n_cg_types));
@@ -562,7 +808,7 @@ void order_pair_nonbonded_fm_matrix_element_calculation(InteractionClassComputer
     calc_matrix_elements(info, x, simulation_box_half_lengths, mat);
 }
 
-void order_bonded_fm_matrix_element_calculation(InteractionClassComputer* const info, int* const cg_site_types, const int n_cg_types, MATRIX_DATA* const mat, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths)
+void order_bonded_fm_matrix_element_calculation(InteractionClassComputer* const info, int* const cg_site_types, const int n_cg_types, MATRIX_DATA* const mat, std::array<frame_real, DIMENSION>* const &x, const real *simulation_box_half_lengths)
 {
      // Calculate the appropriate matrix elements.    
     info->index_among_defined_intrxns = info->ispec->get_index_from_hash(info->calculate_hash_number(cg_site_types, n_cg_types));
@@ -571,7 +817,7 @@ void order_bonded_fm_matrix_element_calculation(InteractionClassComputer* const
     (*info->calculate_fm_matrix_elements)(info, x, simulation_box_half_lengths, mat);
 }
 
-void order_three_body_nonbonded_fm_matrix_element_calculation(InteractionClassComputer* const info, int* const cg_site_types, const int n_cg_types, MATRIX_DATA* const mat, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths)
+void order_three_body_nonbonded_fm_matrix_element_calculation(InteractionClassComputer* const info, int* const cg_site_types, const int n_cg_types, MATRIX_DATA* const mat, std::array<frame_real, DIMENSION>* const &x, const real *simulation_box_half_lengths)
 {
     ThreeBodyNonbondedClassComputer* icomp = static_cast<ThreeBodyNonbondedClassComputer*>(info);
     ThreeBodyNonbondedClassSpec* ispec = static_cast<ThreeBodyNonbondedClassSpec*>(icomp->ispec);
@@ -589,7 +835,7 @@ void order_three_body_nonbonded_fm_matrix_element_calculation(InteractionClassCo
     (*icomp->calculate_fm_matrix_elements)(icomp, x, simulation_box_half_lengths, mat); 
 }
 
-void density_fm_matrix_element_calculation(InteractionClassComputer* const info, calc_pair_matrix_elements calc_matrix_elements, int* const cg_site_types, const int n_cg_types, MATRIX_DATA* const mat, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths)
+void density_fm_matrix_element_calculation(InteractionClassComputer* const info, calc_pair_matrix_elements calc_matrix_elements, int* const cg_site_types, const int n_cg_types, MATRIX_DATA* const mat, std::array<frame_real, DIMENSION>* const &x, const real *simulation_box_half_lengths)
 {
 	DensityClassComputer* icomp = static_cast<DensityClassComputer*>(info);
 	DensityClassSpec* ispec = static_cast<DensityClassSpec*>(icomp->ispec);
@@ -611,7 +857,7 @@ void density_fm_matrix_element_calculation(InteractionClassComputer* const info,
 // Helper functions of functions in the above section.
 //---------------------------------------------------------------------
 
-void process_completed_density(DensityClassComputer* const info, calc_pair_matrix_elements process_density, const int n_cg_types, int *const cg_site_types, MATRIX_DATA* const mat, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths) 
+void process_completed_density(DensityClassComputer* const info, calc_pair_matrix_elements process_density, const int n_cg_types, int *const cg_site_types, MATRIX_DATA* const mat, std::array<frame_real, DIMENSION>* const &x, const real *simulation_box_half_lengths) 
 {	
 	DensityClassSpec* ispec = static_cast<DensityClassSpec*>(info->ispec);
 	
@@ -635,7 +881,7 @@ void process_completed_density(DensityClassComputer* const info, calc_pair_matri
 	}
 }
 
-inline void decode_density_interaction_and_calculate(DensityClassComputer* info, unsigned long interaction_flags, calc_pair_matrix_elements calc_matrix_elements, int *const cg_site_types, MATRIX_DATA* const mat, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths)
+inline void decode_density_interaction_and_calculate(DensityClassComputer* info, unsigned long interaction_flags, calc_pair_matrix_elements calc_matrix_elements, int *const cg_site_types, MATRIX_DATA* const mat, std::array<frame_real, DIMENSION>* const &x, const real *simulation_box_half_lengths)
 {
 	DensityClassSpec* ispec = static_cast<DensityClassSpec*>(info->ispec);
 	// Loop through to determine which bits are non-zero.
@@ -679,55 +925,71 @@ inline void process_normal_interaction_matrix_elements(InteractionClassComputer*
 	int index_among_matched = info->index_among_matched_interactions;
     int index_among_tabulated = info->index_among_tabulated_interactions;
     int first_nonzero_basis_index;
-    int temp_column_index;
-    double basis_sum;
     
     if (index_among_tabulated > 0) {
-		// Pull the interaction from a table. 	   
-    	info->table_s_comp->calculate_basis_fn_vals(index_among_defined, param_value, first_nonzero_basis_index, info->table_basis_fn_vals);
-    	basis_sum  = info->table_basis_fn_vals[0] + info->table_basis_fn_vals[1];
-    	
-    	// Add to force target.
-		mat->accumulate_tabulated_forces(info, basis_sum, n_body, particle_ids, derivatives, mat);
-    	
-    	// Add to target virial if virial_flag is non-zero.
-    	switch (virial_flag) {
-    		case 1:
-	    	    if (mat->virial_constraint_rows > 0) mat->accumulate_target_constraint_element(mat, info->trajectory_block_frame_index, -basis_sum * param_value);
-        		break;
-        	
-        	case 0: default:
-    			// These interactions do not contribute to the scalar virial.
-    			// Such interactions include angles and dihedrals.
-        		break;
-    	}
+    	accumulate_tabulated_interaction_matrix_elements(info, mat, n_body, particle_ids, derivatives, param_value, virial_flag);
 	}
 
     if (index_among_matched > 0) {
 	    // Compute the strength of each basis function.
 	    info->fm_s_comp->calculate_basis_fn_vals(index_among_defined, param_value, first_nonzero_basis_index, info->fm_basis_fn_vals);
-    	
-    	// Add to the force matching.       
-    	mat->accumulate_matching_forces(info, first_nonzero_basis_index, info->fm_basis_fn_vals, n_body, particle_ids, derivatives, mat);
- 			
-    	// Add to virial matching if virial_flag is non-zero.
-    	switch (virial_flag) {
-    		case 1:
-	    	    temp_column_index = info->interaction_class_column_index + info->ispec->interaction_column_indices[index_among_matched - 1] + first_nonzero_basis_index;
-	    		for (unsigned i = 0; i < info->fm_basis_fn_vals.size(); i++) {
-        			int basis_column = temp_column_index + i;
-        			if (mat->virial_constraint_rows > 0)(*mat->accumulate_virial_constraint_matrix_element)(info->trajectory_block_frame_index, basis_column, info->fm_basis_fn_vals[i] * param_value, mat);
-        		}
-        		break;
-        	
-        	case 0: default:
-    			// These interactions do not contribute to the scalar virial.
-    			// Such interactions include angles and dihedrals.
-        		break;
-    	}
+    	accumulate_matched_interaction_matrix_elements(info, mat, n_body, particle_ids, derivatives, param_value, virial_flag, first_nonzero_basis_index);
 	}    
 }
 
+// Add a tabulated interaction's contribution to the force (and virial) targets.
+
+inline void accumulate_tabulated_interaction_matrix_elements(InteractionClassComputer* const info, MATRIX_DATA* const mat, const int n_body, int* particle_ids, std::array<double, DIMENSION>* derivatives, const double param_value, const int virial_flag)
+{
+    int first_nonzero_basis_index;
+    double basis_sum;
+    
+	// Pull the interaction from a table. 	   
+	info->table_s_comp->calculate_basis_fn_vals(info->index_among_defined_intrxns, param_value, first_nonzero_basis_index, info->table_basis_fn_vals);
+	basis_sum  = info->table_basis_fn_vals[0] + info->table_basis_fn_vals[1];
+	
+	// Add to force target.
+	mat->accumulate_tabulated_forces(info, basis_sum, n_body, particle_ids, derivatives, mat);
+	
+	// Add to target virial if virial_flag is non-zero.
+	switch (virial_flag) {
+		case 1:
+    	    if (mat->virial_constraint_rows > 0) mat->accumulate_target_constraint_element(mat, info->trajectory_block_frame_index, -basis_sum * param_value);
+    		break;
+    	
+    	case 0: default:
+			// These interactions do not contribute to the scalar virial.
+			// Such interactions include angles and dihedrals.
+    		break;
+	}
+}
+
+// Add a force matched interaction's matrix elements using the basis function values already in fm_basis_fn_vals.
+
+inline void accumulate_matched_interaction_matrix_elements(InteractionClassComputer* const info, MATRIX_DATA* const mat, const int n_body, int* particle_ids, std::array<double, DIMENSION>* derivatives, const double param_value, const int virial_flag, const int first_nonzero_basis_index)
+{
+    int temp_column_index;
+    
+	// Add to the force matching.       
+	mat->accumulate_matching_forces(info, first_nonzero_basis_index, info->fm_basis_fn_vals, n_body, particle_ids, derivatives, mat);
+		
+	// Add to virial matching if virial_flag is non-zero.
+	switch (virial_flag) {
+		case 1:
+    	    temp_column_index = info->interaction_class_column_index + info->ispec->interaction_column_indices[info->index_among_matched_interactions - 1] + first_nonzero_basis_index;
+    		for (unsigned i = 0; i < info->fm_basis_fn_vals.size(); i++) {
+    			int basis_column = temp_column_index + i;
+    			if (mat->virial_constraint_rows > 0)(*mat->accumulate_virial_constraint_matrix_element)(info->trajectory_block_frame_index, basis_column, info->fm_basis_fn_vals[i] * param_value, mat);
+    		}
+    		break;
+    	
+    	case 0: default:
+			// These interactions do not contribute to the scalar virial.
+			// Such interactions include angles and dihedrals.
+    		break;
+	}
+}
+
 inline void process_density_matrix_elements(InteractionClassComputer* const info, MATRIX_DATA* const mat, const int n_body, int* particle_ids, std::array<double, DIMENSION>* derivatives, const double density_value, const int virial_flag, const double density_derivative, const double distance)
 {
     int index_among_defined = info->index_among_defined_intrxns;
@@ -768,7 +1030,7 @@ inline void process_density_matrix_elements(InteractionClassComputer* const info
 
 // Each of these functions follows the idiom of calc_isotropic_two_body_fm_matrix_elements.
 
-void calc_isotropic_two_body_fm_matrix_elements(InteractionClassComputer* const info, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat)
+void calc_isotropic_two_body_fm_matrix_elements(InteractionClassComputer* const info, std::array<frame_real, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat)
 {
     int particle_ids[2] = {info->k, info->l};
     std::array<double, DIMENSION>* derivatives = new std::array<double, DIMENSION>[1];
@@ -785,7 +1047,7 @@ void calc_isotropic_two_body_fm_matrix_elements(InteractionClassComputer* const
     delete [] derivatives;
 }
 
-void calc_angular_three_body_fm_matrix_elements(InteractionClassComputer* const info, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat)
+void calc_angular_three_body_fm_matrix_elements(InteractionClassComputer* const info, std::array<frame_real, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat)
 {
     int particle_ids[3] = {info->k, info->l, info->j}; // end indices (k, l), followed by center index (j)
     std::array<double, DIMENSION>* derivatives = new std::array<double, DIMENSION>[2];
@@ -803,7 +1065,7 @@ void calc_angular_three_body_fm_matrix_elements(InteractionClassComputer* const
     delete [] derivatives;
 }
 
-void calc_dihedral_four_body_fm_matrix_elements(InteractionClassComputer* const info, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat)
+void calc_dihedral_four_body_fm_matrix_elements(InteractionClassComputer* const info, std::array<frame_real, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat)
 {
     int particle_ids[4] = {info->k, info->l, info->i, info->j}; // end indices (k, l) followed by central bond indices (i, j)
     std::array<double, DIMENSION>* derivatives = new std::array<double, DIMENSION>[3];
@@ -826,33 +1088,26 @@ void calc_dihedral_four_body_fm_matrix_elements(InteractionClassComputer* const
 	delete [] derivatives;
 }
 
-void calc_nonbonded_1_three_body_fm_matrix_elements(InteractionClassComputer* const info, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat)
+void calc_nonbonded_1_three_body_fm_matrix_elements(InteractionClassComputer* const info, std::array<frame_real, DIMENSION>* const &, const real *, MATRIX_DATA* const mat)
 {
     int particle_ids[3] = {info->k, info->l, info->j}; // end indices (k, l) followed by center index (j).    
     ThreeBodyNonbondedClassComputer* icomp = static_cast<ThreeBodyNonbondedClassComputer*>(info);
     ThreeBodyNonbondedClassSpec* ispec = static_cast<ThreeBodyNonbondedClassSpec*>(icomp->ispec);
 
-	std::array<double, DIMENSION>* relative_site_position_2 = new std::array<double, DIMENSION>[1];
-	std::array<double, DIMENSION>* relative_site_position_3 = new std::array<double, DIMENSION>[1];
-	std::array<double, DIMENSION>* derivatives = new std::array<double, DIMENSION>[2];
+	std::array<double, DIMENSION> relative_site_position_2[1], relative_site_position_3[1], derivatives[2];
 	std::array<double, DIMENSION> tx1, tx2, tx;
 	double theta, rr1, rr2;
     double angle_prefactor, dr1_prefactor, dr2_prefactor;
     int	this_column;
 	
-	bool within_cutoff = conditionally_calc_sw_angle_and_intermediates(particle_ids, x, simulation_box_half_lengths, ispec->three_body_nonbonded_cutoffs[icomp->index_among_defined_intrxns], ispec->three_body_gamma, relative_site_position_2, relative_site_position_3, derivatives, theta, rr1, rr2, angle_prefactor, dr1_prefactor, dr2_prefactor);
-	if (!within_cutoff) {
-		delete [] relative_site_position_2;
-		delete [] relative_site_position_3;
-		delete [] derivatives;
-		return;
-    }
+	bool within_cutoff = conditionally_calc_sw_angle_and_intermediates_from_displacements(icomp->shell_displacements[icomp->shell_k], icomp->shell_rr2[icomp->shell_k], icomp->shell_displacements[icomp->shell_l], icomp->shell_rr2[icomp->shell_l], ispec->three_body_nonbonded_cutoffs[icomp->index_among_defined_intrxns], ispec->three_body_gamma, relative_site_position_2, relative_site_position_3, derivatives, theta, rr1, rr2, angle_prefactor, dr1_prefactor, dr2_prefactor);
+	if (!within_cutoff) return;
 
     icomp->intrxn_param = theta;
   
     // Calculate the matrix elements if it's supposed to be force matched
     info->fm_s_comp->calculate_basis_fn_vals(info->index_among_defined_intrxns, info->intrxn_param, info->basis_function_column_index, info->fm_basis_fn_vals); 
-    std::vector<double> basis_der_vals(info->fm_s_comp->get_n_coef());
+    std::vector<double> &basis_der_vals = icomp->fm_basis_deriv_vals;
     BSplineAndDerivComputer *fm_s_comp = static_cast<BSplineAndDerivComputer*>(icomp->fm_s_comp);
     fm_s_comp->calculate_bspline_deriv_vals(info->index_among_defined_intrxns, info->intrxn_param, info->basis_function_column_index, basis_der_vals); 
     
@@ -874,33 +1129,23 @@ void calc_nonbonded_1_three_body_fm_matrix_elements(InteractionClassComputer* co
         (*mat->accumulate_fm_matrix_element)(temp_row_index_2, this_column, &tx2[0], mat);
         (*mat->accumulate_fm_matrix_element)(temp_row_index_3, this_column, &tx[0], mat);
     }
-    delete [] relative_site_position_2;
-	delete [] relative_site_position_3;
-    delete [] derivatives;
 }
 
-void calc_nonbonded_2_three_body_fm_matrix_elements(InteractionClassComputer* const info, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat)
+void calc_nonbonded_2_three_body_fm_matrix_elements(InteractionClassComputer* const info, std::array<frame_real, DIMENSION>* const &, const real *, MATRIX_DATA* const mat)
 {
     int particle_ids[3] = {info->k, info->l, info->j}; // end indices (k, l) followed by center index (j).    
     ThreeBodyNonbondedClassComputer* icomp = static_cast<ThreeBodyNonbondedClassComputer*>(info);
     ThreeBodyNonbondedClassSpec* ispec = static_cast<ThreeBodyNonbondedClassSpec*>(icomp->ispec);
     
-	std::array<double, DIMENSION>* relative_site_position_2 = new std::array<double, DIMENSION>[1];
-	std::array<double, DIMENSION>* relative_site_position_3 = new std::array<double, DIMENSION>[1];
-	std::array<double, DIMENSION>* derivatives = new std::array<double, DIMENSION>[2];
+	std::array<double, DIMENSION> relative_site_position_2[1], relative_site_position_3[1], derivatives[2];
 	std::array<double, DIMENSION> tx1, tx2, tx;
     double theta, rr1, rr2;
     double cos_theta;
     double angle_prefactor, dr1_prefactor, dr2_prefactor;
     double u, du;
     
-    bool within_cutoff = conditionally_calc_sw_angle_and_intermediates(particle_ids, x, simulation_box_half_lengths, ispec->three_body_nonbonded_cutoffs[icomp->index_among_defined_intrxns], ispec->three_body_gamma, relative_site_position_2, relative_site_position_3, derivatives, theta, rr1, rr2, angle_prefactor, dr1_prefactor, dr2_prefactor);
-	if (!within_cutoff) {
-		delete [] relative_site_position_2;
-		delete [] relative_site_position_3;
-		delete [] derivatives;
-		return;
-    }
+    bool within_cutoff = conditionally_calc_sw_angle_and_intermediates_from_displacements(icomp->shell_displacements[icomp->shell_k], icomp->shell_rr2[icomp->shell_k], icomp->shell_displacements[icomp->shell_l], icomp->shell_rr2[icomp->shell_l], ispec->three_body_nonbonded_cutoffs[icomp->index_among_defined_intrxns], ispec->three_body_gamma, relative_site_position_2, relative_site_position_3, derivatives, theta, rr1, rr2, angle_prefactor, dr1_prefactor, dr2_prefactor);
+	if (!within_cutoff) return;
 
     icomp->intrxn_param = theta;
     theta /= DEGREES_PER_RADIAN;
@@ -923,13 +1168,9 @@ void calc_nonbonded_2_three_body_fm_matrix_elements(InteractionClassComputer* co
     (*mat->accumulate_fm_matrix_element)(temp_row_index_1, temp_column_index, &tx1[0], mat);
     (*mat->accumulate_fm_matrix_element)(temp_row_index_2, temp_column_index, &tx2[0], mat);
     (*mat->accumulate_fm_matrix_element)(temp_row_index_3, temp_column_index, &tx[0], mat); 
-    
-    delete [] relative_site_position_2;
-	delete [] relative_site_position_3;   
-	delete [] derivatives;
 }
 
-void calc_gaussian_density_values(InteractionClassComputer* const info, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat)
+void calc_gaussian_density_values(InteractionClassComputer* const info, std::array<frame_real, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat)
 {
 	DensityClassComputer* icomp = static_cast<DensityClassComputer*>(info);
 	DensityClassSpec* ispec = static_cast<DensityClassSpec*>(icomp->ispec);
@@ -948,7 +1189,7 @@ void calc_gaussian_density_values(InteractionClassComputer* const info, std::arr
 	}
 }
 
-void calc_switching_density_values(InteractionClassComputer* const info, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat)
+void calc_switching_density_values(InteractionClassComputer* const info, std::array<frame_real, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat)
 {
 	DensityClassComputer* icomp = static_cast<DensityClassComputer*>(info);
 	DensityClassSpec* ispec = static_cast<DensityClassSpec*>(icomp->ispec);
@@ -969,7 +1210,7 @@ void calc_switching_density_values(InteractionClassComputer* const info, std::ar
 	}
 }
 
-void calc_lucy_density_values(InteractionClassComputer* const info, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat)
+void calc_lucy_density_values(InteractionClassComputer* const info, std::array<frame_real, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat)
 {
 	DensityClassComputer* icomp = static_cast<DensityClassComputer*>(info);
 	DensityClassSpec* ispec = static_cast<DensityClassSpec*>(icomp->ispec);
@@ -991,7 +1232,7 @@ void calc_lucy_density_values(InteractionClassComputer* const info, std::array<d
 	}
 }
 
-void calc_re_density_values(InteractionClassComputer* const info, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat)
+void calc_re_density_values(InteractionClassComputer* const info, std::array<frame_real, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat)
 {
 	DensityClassComputer* icomp = static_cast<DensityClassComputer*>(info);
 	DensityClassSpec* ispec = static_cast<DensityClassSpec*>(icomp->ispec);
@@ -1017,7 +1258,7 @@ void calc_re_density_values(InteractionClassComputer* const info, std::array<dou
 	}
 }
 
-void calc_density_fm_matrix_elements(InteractionClassComputer* const info, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat)
+void calc_density_fm_matrix_elements(InteractionClassComputer* const info, std::array<frame_real, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat)
 {
 	info->index_among_matched_interactions = info->ispec->defined_to_matched_intrxn_index_map[info->index_among_defined_intrxns];
 	info->index_among_tabulated_interactions = info->ispec->defined_to_tabulated_intrxn_index_map[info->index_among_defined_intrxns];
@@ -1077,6 +1318,6 @@ double calc_re_density_derivative(DensityClassComputer* const icomp, DensityClas
 	return density_derivative;
 }
 
-void do_nothing(InteractionClassComputer* const info, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat) 
+void do_nothing(InteractionClassComputer* const info, std::array<frame_real, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat) 
 {
 }
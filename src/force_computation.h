@@ -9,6 +9,7 @@
 #define _force_computation_h
 
 #include <array>
+#include <list>
 
 #include "trajectory_input.h"
 #include "interaction_model.h"
@@ -18,13 +19,33 @@ struct MATRIX_DATA;
 // Initialization routines to start the FM matrix calculation
 void set_up_force_computers(CG_MODEL_DATA* const cg);
 
+// Thread-private copies of the interaction class computers in cg, used when several
+// frames are processed at once. The interaction class specs in cg stay shared and are only read.
+// Each worker also keeps its own Verlet list, since consecutive frames of one worker are not consecutive in the trajectory.
+struct FrameWorkerComputers {
+    PairNonbondedClassComputer pair_nonbonded_computer;
+    PairBondedClassComputer pair_bonded_computer;
+    AngularClassComputer angular_computer;
+    DihedralClassComputer dihedral_computer;
+    ThreeBodyNonbondedClassComputer three_body_nonbonded_computer;
+	DensityClassComputer density_computer;
+	PairVerletList pair_verlet_list;
+	
+	std::list<InteractionClassComputer*> icomp_list;
+	
+	FrameWorkerComputers(CG_MODEL_DATA* const cg);
+	~FrameWorkerComputers();
+};
+
 // Main routine calling all other matrix element calculation routines
-void calculate_frame_fm_matrix(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, FrameConfig* const frame_config, PairCellList pair_cell_list, ThreeBCellList three_body_cell_list, int trajectory_block_frame_index);
+void calculate_frame_fm_matrix(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, FrameConfig* const frame_config, PairCellList &pair_cell_list, ThreeBCellList &three_body_cell_list, int trajectory_block_frame_index);
+// As above, but using a set of thread-private computers in place of those in cg
+void calculate_frame_fm_matrix(CG_MODEL_DATA* const cg, FrameWorkerComputers* const computers, MATRIX_DATA* const mat, FrameConfig* const frame_config, PairCellList &pair_cell_list, ThreeBCellList &three_body_cell_list, int trajectory_block_frame_index);
 
 // Functions for calculating density values
-void calc_gaussian_density_values(InteractionClassComputer* const info, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat);
-void calc_switching_density_values(InteractionClassComputer* const info, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat);
-void calc_lucy_density_values(InteractionClassComputer* const info, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat);
-void calc_re_density_values(InteractionClassComputer* const info, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat);
+void calc_gaussian_density_values(InteractionClassComputer* const info, std::array<frame_real, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat);
+void calc_switching_density_values(InteractionClassComputer* const info, std::array<frame_real, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat);
+void calc_lucy_density_values(InteractionClassComputer* const info, std::array<frame_real, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat);
+void calc_re_density_values(InteractionClassComputer* const info, std::array<frame_real, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat);
 
 #endif
@@ -13,22 +13,24 @@
 #endif
 
 // Function prototypes for internal functions.
-void subtract_min_image_vectors(const int* particle_ids, const std::array<double, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, std::array<double, DIMENSION> &displacement);
+void subtract_min_image_vectors(const int* particle_ids, const std::array<frame_real, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, std::array<double, DIMENSION> &displacement);
 void subtract_min_image_particles(const std::array<double, DIMENSION> &particle_position1, const std::array<double, DIMENSION> &particle_position2, const real *simulation_box_half_lengths, std::array<double, DIMENSION> &displacement);
 void cross_product(const std::array<double, DIMENSION> &a, const std::array<double, DIMENSION> &b, std::array<double, DIMENSION> &c);
 double dot_product(const std::array<double, DIMENSION> &a, const std::array<double, DIMENSION> &b);
 double dot_product(const double* a, const double* b);
 inline void check_sine(double &s);
 inline void check_cos(double &cos_theta);
+inline void calc_angle_intermediates_from_distances(const std::array<double, DIMENSION> &dist_derivs_20, const double rr2_20, const std::array<double, DIMENSION> &dist_derivs_21, const double rr2_21, std::array<double, DIMENSION>* const derivatives, double &param_val, double &rr_20, double &rr_21);
+inline void calc_sw_prefactors(const double rr1, const double rr2, const double cutoff, const double gamma, double &angle_prefactor, double &dr1_prefactor, double &dr2_prefactor);
 
 //------------------------------------------------------------
 // Small helper functions used internally.
 //------------------------------------------------------------
 
-void subtract_min_image_vectors(const int* particle_ids, const std::array<double, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, std::array<double, DIMENSION> &displacement)
+void subtract_min_image_vectors(const int* particle_ids, const std::array<frame_real, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, std::array<double, DIMENSION> &displacement)
 {
     for (int i = 0; i < DIMENSION; i++) {
-        displacement[i] = particle_positions[particle_ids[1]][i] - particle_positions[particle_ids[0]][i];
+        displacement[i] = (double)particle_positions[particle_ids[1]][i] - (double)particle_positions[particle_ids[0]][i];
         if (displacement[i] > simulation_box_half_lengths[i]) displacement[i] -= 2.0 * simulation_box_half_lengths[i];
         else if (displacement[i] < -simulation_box_half_lengths[i]) displacement[i] += 2.0 * simulation_box_half_lengths[i];
     }
@@ -43,7 +45,7 @@ void subtract_min_image_particles(const std::array<double, DIMENSION> &particle_
     }
 }
 
-void get_minimum_image(const int l, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths)
+void get_minimum_image(const int l, std::array<frame_real, DIMENSION>* const &x, const real *simulation_box_half_lengths)
 {
     for (int i = 0; i < DIMENSION; i++) {
         if (x[l][i] < 0) x[l][i] += 2.0 * simulation_box_half_lengths[i];
@@ -80,7 +82,7 @@ double dot_product(const double* a, const double* b)
 
 // Calculate a squared distance and one derivative.
 
-bool conditionally_calc_squared_distance_and_derivatives(const int* particle_ids, const std::array<double, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, const double cutoff2, double &param_val, std::array<double, DIMENSION>* &derivatives)
+bool conditionally_calc_squared_distance_and_derivatives(const int* particle_ids, const std::array<frame_real, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, const double cutoff2, double &param_val, std::array<double, DIMENSION>* &derivatives)
 {
     double rr2 = 0.0;
     std::array<double, DIMENSION> displacement;
@@ -101,7 +103,7 @@ bool conditionally_calc_squared_distance_and_derivatives(const int* particle_ids
 
 // Calculate a distance and one derivative.
 
-bool conditionally_calc_distance_and_derivatives(const int* particle_ids, const std::array<double, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, const double cutoff2, double &param_val, std::array<double, DIMENSION>* &derivatives)
+bool conditionally_calc_distance_and_derivatives(const int* particle_ids, const std::array<frame_real, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, const double cutoff2, double &param_val, std::array<double, DIMENSION>* &derivatives)
 {
     bool within_cutoff = conditionally_calc_squared_distance_and_derivatives(particle_ids, particle_positions, simulation_box_half_lengths, cutoff2, param_val, derivatives);
 
@@ -118,7 +120,7 @@ bool conditionally_calc_distance_and_derivatives(const int* particle_ids, const
 
 // Calculate the angle between three particles and its derivatives.
 
-bool conditionally_calc_angle_and_derivatives(const int* particle_ids, const std::array<double, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, const double cutoff2, double &param_val, std::array<double, DIMENSION>* &derivatives)
+bool conditionally_calc_angle_and_derivatives(const int* particle_ids, const std::array<frame_real, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, const double cutoff2, double &param_val, std::array<double, DIMENSION>* &derivatives)
 {   
     std::array<double, DIMENSION>* dist_derivs_20 = new std::array<double, DIMENSION>[1];
     std::array<double, DIMENSION>* dist_derivs_21 = new std::array<double, DIMENSION>[1];
@@ -162,7 +164,7 @@ bool conditionally_calc_angle_and_derivatives(const int* particle_ids, const std
 
 // Calculate a the cosine of an angle along with its derivatives.
 
-bool conditionally_calc_angle_and_intermediates(const int* particle_ids, std::array<double, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, const double cutoff2, std::array<double, DIMENSION>* &dist_derivs_20, std::array<double, DIMENSION>* &dist_derivs_21, std::array<double, DIMENSION>* &derivatives, double &param_val, double &rr_20, double &rr_21)
+bool conditionally_calc_angle_and_intermediates(const int* particle_ids, std::array<frame_real, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, const double cutoff2, std::array<double, DIMENSION>* &dist_derivs_20, std::array<double, DIMENSION>* &dist_derivs_21, std::array<double, DIMENSION>* &derivatives, double &param_val, double &rr_20, double &rr_21)
 {
     int particle_ids_20[2] = {particle_ids[2], particle_ids[0]};
     int particle_ids_21[2] = {particle_ids[2], particle_ids[1]};
@@ -173,58 +175,90 @@ bool conditionally_calc_angle_and_intermediates(const int* particle_ids, std::ar
     if (!within_cutoff_20 || !within_cutoff_21) {
         return false;
     } else {
-        // Calculate the cosine
-        rr_20 = sqrt(rr2_20);
-        rr_21 = sqrt(rr2_21);
-		double cos_theta = dot_product(dist_derivs_20[0], dist_derivs_21[0]) / (4.0 * rr_20 * rr_21);
-        check_cos(cos_theta);
-        
-        // Calculate the angle.
-        double theta = acos(cos_theta);
-        param_val = theta * DEGREES_PER_RADIAN;
-
-        // Calculate the derivatives.
-        double sin_theta = sin(theta);
-        double rr_01_1 = 1.0 / (rr_20 * rr_21 * sin_theta);
-        double rr_00c = cos_theta / (rr_20 * rr_20 * sin_theta);
-        double rr_11c = cos_theta / (rr_21 * rr_21 * sin_theta);
-
-        for (unsigned i = 0; i < DIMENSION; i++) {
-            derivatives[0][i] = - 0.5 * (dist_derivs_21[0][i] * rr_01_1 + rr_00c * dist_derivs_20[0][i]);
-            derivatives[1][i] = - 0.5 * (dist_derivs_20[0][i] * rr_01_1 + rr_11c * dist_derivs_21[0][i]);
-        }
+        calc_angle_intermediates_from_distances(dist_derivs_20[0], rr2_20, dist_derivs_21[0], rr2_21, derivatives, param_val, rr_20, rr_21);
     }    
     return true;
 }
 
+// Calculate the angle and its derivatives from the distance derivatives 
+// (twice the displacements) and squared distances of the two end particles.
+
+inline void calc_angle_intermediates_from_distances(const std::array<double, DIMENSION> &dist_derivs_20, const double rr2_20, const std::array<double, DIMENSION> &dist_derivs_21, const double rr2_21, std::array<double, DIMENSION>* const derivatives, double &param_val, double &rr_20, double &rr_21)
+{
+    // Calculate the cosine
+    rr_20 = sqrt(rr2_20);
+    rr_21 = sqrt(rr2_21);
+	double cos_theta = dot_product(dist_derivs_20, dist_derivs_21) / (4.0 * rr_20 * rr_21);
+    check_cos(cos_theta);
+    
+    // Calculate the angle.
+    double theta = acos(cos_theta);
+    param_val = theta * DEGREES_PER_RADIAN;
+
+    // Calculate the derivatives.
+    double sin_theta = sin(theta);
+    double rr_01_1 = 1.0 / (rr_20 * rr_21 * sin_theta);
+    double rr_00c = cos_theta / (rr_20 * rr_20 * sin_theta);
+    double rr_11c = cos_theta / (rr_21 * rr_21 * sin_theta);
+
+    for (unsigned i = 0; i < DIMENSION; i++) {
+        derivatives[0][i] = - 0.5 * (dist_derivs_21[i] * rr_01_1 + rr_00c * dist_derivs_20[i]);
+        derivatives[1][i] = - 0.5 * (dist_derivs_20[i] * rr_01_1 + rr_11c * dist_derivs_21[i]);
+    }
+}
+
 // Calculate a terms for Stillinger-Weber interactions.
 
-bool conditionally_calc_sw_angle_and_intermediates(const int* particle_ids, std::array<double, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, const double cutoff, const double gamma, std::array<double, DIMENSION>* &dist_derivs_01, std::array<double, DIMENSION>* &dist_derivs_02, std::array<double, DIMENSION>* &derivatives, double &param_val, double &rr1, double &rr2, double &angle_prefactor, double &dr1_prefactor, double &dr2_prefactor)
+bool conditionally_calc_sw_angle_and_intermediates(const int* particle_ids, std::array<frame_real, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, const double cutoff, const double gamma, std::array<double, DIMENSION>* &dist_derivs_01, std::array<double, DIMENSION>* &dist_derivs_02, std::array<double, DIMENSION>* &derivatives, double &param_val, double &rr1, double &rr2, double &angle_prefactor, double &dr1_prefactor, double &dr2_prefactor)
 {	
 	bool within_cutoff = conditionally_calc_angle_and_intermediates(particle_ids, particle_positions, simulation_box_half_lengths, cutoff*cutoff, dist_derivs_01, dist_derivs_02, derivatives, param_val, rr1, rr2);
 	if(within_cutoff == false) {
 		return false;
 	} else {
-		double r1_less_cutoff = rr1 - cutoff;
-		double r2_less_cutoff = rr2 - cutoff;
-
-		double sw_exp1 = exp(gamma / r1_less_cutoff);
-		double sw_exp2 = exp(gamma / r2_less_cutoff);
+		calc_sw_prefactors(rr1, rr2, cutoff, gamma, angle_prefactor, dr1_prefactor, dr2_prefactor);
+	}
+	return true;
+}
 
-		double sw_exp_dr1 = gamma / (r1_less_cutoff * r1_less_cutoff) * sw_exp1;
-		double sw_exp_dr2 = gamma / (r2_less_cutoff * r2_less_cutoff) * sw_exp2;
+// As above, but starting from the minimum image displacements of the two end particles
+// from the central particle and their squared distances, which have already been found.
 
-		angle_prefactor = sw_exp1 * sw_exp2 * DEGREES_PER_RADIAN;
-		dr1_prefactor = sw_exp2 * sw_exp_dr1;
-		dr2_prefactor = sw_exp1 * sw_exp_dr2;
+bool conditionally_calc_sw_angle_and_intermediates_from_displacements(const std::array<double, DIMENSION> &displacement_20, const double rr2_20, const std::array<double, DIMENSION> &displacement_21, const double rr2_21, const double cutoff, const double gamma, std::array<double, DIMENSION>* const dist_derivs_01, std::array<double, DIMENSION>* const dist_derivs_02, std::array<double, DIMENSION>* const derivatives, double &param_val, double &rr1, double &rr2, double &angle_prefactor, double &dr1_prefactor, double &dr2_prefactor)
+{
+	double cutoff2 = cutoff * cutoff;
+	if (rr2_20 > cutoff2 || rr2_21 > cutoff2) return false;
+	
+	for (int i = 0; i < DIMENSION; i++) {
+		dist_derivs_01[0][i] = 2.0 * displacement_20[i];
+		dist_derivs_02[0][i] = 2.0 * displacement_21[i];
 	}
+	calc_angle_intermediates_from_distances(dist_derivs_01[0], rr2_20, dist_derivs_02[0], rr2_21, derivatives, param_val, rr1, rr2);
+	calc_sw_prefactors(rr1, rr2, cutoff, gamma, angle_prefactor, dr1_prefactor, dr2_prefactor);
 	return true;
 }
 
+// Calculate the Stillinger-Weber distance terms of an angle's prefactor and their derivatives.
+
+inline void calc_sw_prefactors(const double rr1, const double rr2, const double cutoff, const double gamma, double &angle_prefactor, double &dr1_prefactor, double &dr2_prefactor)
+{
+	double r1_less_cutoff = rr1 - cutoff;
+	double r2_less_cutoff = rr2 - cutoff;
+
+	double sw_exp1 = exp(gamma / r1_less_cutoff);
+	double sw_exp2 = exp(gamma / r2_less_cutoff);
+
+	double sw_exp_dr1 = gamma / (r1_less_cutoff * r1_less_cutoff) * sw_exp1;
+	double sw_exp_dr2 = gamma / (r2_less_cutoff * r2_less_cutoff) * sw_exp2;
+
+	angle_prefactor = sw_exp1 * sw_exp2 * DEGREES_PER_RADIAN;
+	dr1_prefactor = sw_exp2 * sw_exp_dr1;
+	dr2_prefactor = sw_exp1 * sw_exp_dr2;
+}
+
 // Calculate a dihedral angle and its derivatives.
 // Thanks to Andrew Jewett (jewett.aij  g m ail) for inspiration from LAMMPS dihedral_table.cpp
 
-bool conditionally_calc_dihedral_and_derivatives(const int* particle_ids, const std::array<double, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, const double cutoff2, double &param_val, std::array<double, DIMENSION>* &derivatives)
+bool conditionally_calc_dihedral_and_derivatives(const int* particle_ids, const std::array<frame_real, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, const double cutoff2, double &param_val, std::array<double, DIMENSION>* &derivatives)
 {
     // Find the relevant displacements for defining the angle.
     std::array<double, DIMENSION> disp03, disp23, disp12;
@@ -286,7 +320,7 @@ bool conditionally_calc_dihedral_and_derivatives(const int* particle_ids, const
 
 // Calculate a squared distance.
 
-void calc_squared_distance(const int* particle_ids, const std::array<double, DIMENSION>*const &particle_positions, const real *simulation_box_half_lengths, double &param_val)
+void calc_squared_distance(const int* particle_ids, const std::array<frame_real, DIMENSION>*const &particle_positions, const real *simulation_box_half_lengths, double &param_val)
 {
 	std::array<double, DIMENSION> displacement;
 	double rr2 = 0.0;
@@ -299,7 +333,7 @@ void calc_squared_distance(const int* particle_ids, const std::array<double, DIM
 
 // Calculate a distance.
 
-void calc_distance(const int* particle_ids, std::array<double, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, double &param_val)
+void calc_distance(const int* particle_ids, std::array<frame_real, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, double &param_val)
 {
     calc_squared_distance(particle_ids, particle_positions, simulation_box_half_lengths, param_val);
     param_val = sqrt(param_val);
@@ -307,7 +341,7 @@ void calc_distance(const int* particle_ids, std::array<double, DIMENSION>* const
 
 // Calculate the angle between three particles.
 
-void calc_angle(const int* particle_ids, const std::array<double, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, double &param_val)
+void calc_angle(const int* particle_ids, const std::array<frame_real, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, double &param_val)
 {   
     std::array<double, DIMENSION>* dist_derivs_20 = new std::array<double, DIMENSION>[1];
     std::array<double, DIMENSION>* dist_derivs_21 = new std::array<double, DIMENSION>[1];
@@ -334,7 +368,7 @@ void calc_angle(const int* particle_ids, const std::array<double, DIMENSION>* co
 // Calculate a dihedral angle.
 // Thanks to Andrew Jewett (jewett.aij  g m ail) for inspiration from LAMMPS dihedral_table.cpp
 
-void calc_dihedral(const int* particle_ids, const std::array<double, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, double &param_val)
+void calc_dihedral(const int* particle_ids, const std::array<frame_real, DIMENSION>* const &particle_positions, const real *simulation_box_half_lengths, double &param_val)
 {
     // Find the relevant displacements for defining the angle.
     std::array<double, DIMENSION> disp03, disp23, disp12;
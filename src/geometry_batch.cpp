@@ -0,0 +1,51 @@
+//
+//  geometry_batch.cpp
+//  
+//
+//  Copyright (c) 2016 The Voth Group at The University of Chicago. All rights reserved.
+//
+
+// The batched geometry loops used by the pair nonbonded kernel.
+// They only vectorize when comparisons need not trap and sqrt need not set errno,
+// so the build compiles this file alone with -fno-trapping-math and -fno-math-errno.
+// Neither flag changes any of the values calculated here, and no other file is affected.
+
+#include <cmath>
+#include "geometry.h"
+
+// Calculate the minimum image displacements of a batch of particles and their squared lengths.
+// The minimum image convention is applied without branches so that the loop vectorizes;
+// like sqrt below, that needs -fno-trapping-math.
+
+void calc_min_image_displacements_batch(const int n, const double* position_0, const real *simulation_box_half_lengths, double* const* displacements, double* const rr2)
+{
+    #pragma omp simd
+    for (int p = 0; p < n; p++) rr2[p] = 0.0;
+    for (int i = 0; i < DIMENSION; i++) {
+        double* displacement = displacements[i];
+        double x_0 = position_0[i];
+        double half_length = simulation_box_half_lengths[i];
+        double box_length = 2.0 * half_length;
+        #pragma omp simd
+        for (int p = 0; p < n; p++) {
+            double dd = displacement[p] - x_0;
+            dd -= box_length * ((double)(dd > half_length) - (double)(dd < -half_length));
+            displacement[p] = dd;
+            rr2[p] += dd * dd;
+        }
+    }
+}
+
+// Calculate the distances and distance derivatives for a batch of displacements.
+
+void calc_distances_and_derivatives_batch(const int n, double* const* displacements, const double* const rr2, double* const distances, double* const* derivatives)
+{
+    #pragma omp simd
+    for (int p = 0; p < n; p++) {
+        distances[p] = sqrt(rr2[p]);
+        #pragma GCC unroll 4
+        for (int i = 0; i < DIMENSION; i++) {
+            derivatives[i][p] = 0.5 * (2.0 * displacements[i][p]) / distances[p];
+        }
+    }
+}
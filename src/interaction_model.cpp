@@ -143,7 +143,7 @@ void check_input_values(CG_MODEL_DATA* cg)
 			printf("Invalid bspline_k (%d) for %s!\n (Must be at least 3)\n", (*iclass_iterator)->get_bspline_k(), (*iclass_iterator)->get_full_name().c_str());
 			exit(EXIT_FAILURE);
 		}
-		if ( (*iclass_iterator)->output_parameter_distribution < 0 || (*iclass_iterator)->output_parameter_distribution > 2 ) {
+		if ( (*iclass_iterator)->output_parameter_distribution < 0 || (*iclass_iterator)->output_parameter_distribution > 3 ) {
 			 printf("Invalid output_parameter_distribution (%d) for %s!\n", (*iclass_iterator)->output_parameter_distribution, (*iclass_iterator)->get_full_name().c_str());
 			 (*iclass_iterator)->output_parameter_distribution = 0;
 		}
@@ -550,7 +550,7 @@ void InteractionClassSpec::setup_indices_in_fm_matrix(void)
 void ThreeBodyNonbondedClassSpec::setup_indices_in_fm_matrix(void)
 { 
     if (class_subtype > 0) {
-		interaction_column_indices = std::vector<unsigned>(get_n_defined(), 0);
+		interaction_column_indices = std::vector<unsigned>(get_n_defined() + 1, 0);
 		interaction_column_indices[0] = 0;
 
 		n_tabulated = 0;
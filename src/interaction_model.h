@@ -19,6 +19,7 @@
 #include "topology.h"
 #include "misc.h"
 #include "control_input.h"
+#include "trajectory_input.h"
 
 #ifndef DIMENSION
 #define DIMENSION 3
@@ -42,7 +43,7 @@ void check_input_values(CG_MODEL_DATA* cg);
 
 enum InteractionClassType {kPairNonbonded = 2, kPairBonded = -2, kAngularBonded = -3, kDihedralBonded = -4, kThreeBodyNonbonded = 3, kDensity = 4};
 // function pointer "type" used for polymorphism of matrix element calculation (for pair nonbonded types)
-typedef void (*calc_pair_matrix_elements)(InteractionClassComputer* const, std::array<double, DIMENSION>* const &, const real*, MATRIX_DATA* const);
+typedef void (*calc_pair_matrix_elements)(InteractionClassComputer* const, std::array<frame_real, DIMENSION>* const &, const real*, MATRIX_DATA* const);
 typedef void (*calc_interaction_matrix_elements)(InteractionClassComputer* const info, MATRIX_DATA* const mat, const int n_body, int* particle_ids, std::array<double, DIMENSION>* derivatives, const double param_value, const int virial_flag, const double param_deriv, const double distance);
 
 //-------------------------------------------------------------
@@ -51,10 +52,19 @@ typedef void (*calc_interaction_matrix_elements)(InteractionClassComputer* const
 
 // This stores parameters that define an interaction class.
 
+// Counts of the parameter values sampled by rangefinder for one interaction,
+// in fine bins starting from zero; counts[0] is bin number first_bin.
+struct ParameterHistogram {
+	int first_bin;
+	std::vector<unsigned long> counts;
+	ParameterHistogram() : first_bin(0) {}
+};
+
 struct InteractionClassSpec {
 	protected:
 	BasisType basis_type;
     int bspline_k;
+    int native_bspline_flag;		// 1 to evaluate B-splines with the native uniform-knot routines when possible; 0 to always use GSL
     double fm_binwidth;
 
 	public:
@@ -67,6 +77,7 @@ struct InteractionClassSpec {
     double output_binwidth;
 	int output_parameter_distribution;
 	FILE** output_range_file_handles;
+	std::vector<ParameterHistogram> parameter_histograms;
 
 	// n_defined is the number of unique type combinations for n_cg_sites and the interaction type.
 	// defined_to_possible is used for bonded-type interactions and converts the type combination hash
@@ -155,6 +166,9 @@ struct InteractionClassSpec {
 	inline int get_bspline_k(void) {
 		return bspline_k;
 	};
+	inline int get_native_bspline_flag(void) {
+		return native_bspline_flag;
+	};
 	inline double get_fm_binwidth(void) {
 		return fm_binwidth;
 	};
@@ -213,7 +227,7 @@ struct InteractionClassComputer {
     double stillinger_weber_angle_parameter;   // Current interaction's SW angle param (three-body interactions only).
     
     // Function called to calculate matrix elements corresponding to an interaction in the current class of interactions.
-    void (*calculate_fm_matrix_elements)(InteractionClassComputer* const self, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat);
+    void (*calculate_fm_matrix_elements)(InteractionClassComputer* const self, std::array<frame_real, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat);
     // Function called to evaluate the values of functions in an interaction's basis set
     void (*set_up_fm_bases)(void);
 	// Function called to accumulate the interactions into the matrix for the interaction.
@@ -224,7 +238,7 @@ struct InteractionClassComputer {
     // Function to calculate index of an actual interaction among all possible interactions for the current class
 	virtual int calculate_hash_number(int* const cg_site_types, const int n_cg_types) = 0;
 	
-	virtual void calculate_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths) = 0;
+	virtual void calculate_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, std::array<frame_real, DIMENSION>* const &x, const real* simulation_box_half_lengths) = 0;
 	
 	void set_up_computer(InteractionClassSpec* const ispec_pt, int *curr_iclass_col_index);	
 
@@ -233,9 +247,6 @@ struct InteractionClassComputer {
 	void calc_grid_of_force_vals(const std::vector<double> &spline_coeffs, const int index_among_defined_intrxns, const double binwidth, std::vector<double> &axis_vals, std::vector<double> &force_vals);
 	void calc_grid_of_force_and_deriv_vals(const std::vector<double> &spline_coeffs, const int index_among_defined_intrxns, const double binwidth, std::vector<double> &axis_vals, std::vector<double> &force_vals, std::vector<double> &deriv_vals);
 	
-	void walk_neighbor_list(MATRIX_DATA* const mat, calc_pair_matrix_elements calc_matrix_elements, const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths);
-	void walk_3B_neighbor_list(MATRIX_DATA* const mat, const int n_cg_types, const TopologyData& topo_data, const ThreeBCellList& three_body_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths);
-
 	void set_indices(void) {
 		index_among_matched_interactions   = ispec->defined_to_matched_intrxn_index_map[index_among_defined_intrxns];
 		index_among_tabulated_interactions = ispec->defined_to_tabulated_intrxn_index_map[index_among_defined_intrxns];
@@ -251,6 +262,7 @@ struct InteractionClassComputer {
     std::vector<double> table_basis_fn_vals;
 
 	InteractionClassComputer() {
+		ispec = NULL;
 		fm_s_comp = NULL;
 		table_s_comp = NULL;
 	}
@@ -261,6 +273,8 @@ struct InteractionClassComputer {
 };
 
 struct PairNonbondedClassSpec: InteractionClassSpec {
+	int batched_kernel_flag;		// 1 to force match through the batched pair kernel; 0 one pair at a time
+	
 	inline PairNonbondedClassSpec(ControlInputs* control_input) {
 		class_type = kPairNonbonded;
 		class_subtype = 1;
@@ -269,6 +283,8 @@ struct PairNonbondedClassSpec: InteractionClassSpec {
 		output_spline_coeffs_flag = control_input->output_spline_coeffs_flag;
 		fm_binwidth = control_input->pair_nonbonded_fm_binwidth;
 		bspline_k = control_input->nonbonded_bspline_k;
+		native_bspline_flag = control_input->native_bspline_flag;
+		batched_kernel_flag = control_input->batched_pair_kernel_flag;
 		output_binwidth = control_input->pair_nonbonded_output_binwidth;
 		output_parameter_distribution = control_input->output_pair_nonbonded_parameter_distribution;
 	}
@@ -294,6 +310,7 @@ struct PairBondedClassSpec: InteractionClassSpec {
 		output_spline_coeffs_flag = control_input->output_spline_coeffs_flag;
 		fm_binwidth = control_input->pair_bond_fm_binwidth;
 		bspline_k = control_input->pair_bond_bspline_k;
+		native_bspline_flag = control_input->native_bspline_flag;
 		output_binwidth = control_input->pair_bond_output_binwidth;
 		output_parameter_distribution = control_input->output_pair_bond_parameter_distribution;
 	}
@@ -323,6 +340,7 @@ struct AngularClassSpec: InteractionClassSpec {
     	class_subtype = control_input->angle_interaction_style;
     	fm_binwidth = control_input->angle_fm_binwidth;
     	bspline_k = control_input->angle_bspline_k;
+    	native_bspline_flag = control_input->native_bspline_flag;
     	output_binwidth = control_input->angle_output_binwidth;
 		output_parameter_distribution = control_input->output_angle_parameter_distribution;
 		cutoff = VERYLARGE;
@@ -353,6 +371,7 @@ struct DihedralClassSpec: InteractionClassSpec {
     	class_subtype = control_input->dihedral_interaction_style;
     	fm_binwidth = control_input->dihedral_fm_binwidth;
 		bspline_k = control_input->dihedral_bspline_k;
+		native_bspline_flag = control_input->native_bspline_flag;
 		output_binwidth = control_input->dihedral_output_binwidth;
 		output_parameter_distribution = control_input->output_dihedral_parameter_distribution;
 		cutoff = VERYLARGE;
@@ -394,6 +413,7 @@ struct ThreeBodyNonbondedClassSpec: InteractionClassSpec {
 		class_subtype = control_input->three_body_flag;
 		fm_binwidth = control_input->three_body_fm_binwidth;
 		bspline_k = control_input->three_body_bspline_k;
+		native_bspline_flag = control_input->native_bspline_flag;
 		output_binwidth = control_input->three_body_nonbonded_output_binwidth;
 		three_body_gamma = control_input->gamma;
 		n_defined = 0;
@@ -491,6 +511,7 @@ struct DensityClassSpec: InteractionClassSpec {
 		density_weights_flag = control_input->density_weights_flag;
 		fm_binwidth = control_input->density_fm_binwidth;
 		bspline_k = control_input->density_bspline_k;
+		native_bspline_flag = control_input->native_bspline_flag;
 		output_binwidth = control_input->density_output_binwidth;
 		output_parameter_distribution = control_input->output_density_parameter_distribution;
 		
@@ -536,9 +557,38 @@ struct DensityClassSpec: InteractionClassSpec {
 };
 
 struct PairNonbondedClassComputer : InteractionClassComputer {
+	// Set when force matching (unless batched_pair_kernel_flag is 0) so that pairs go
+	// through the batched pair kernel rather than one at a time through calculate_fm_matrix_elements.
+	bool use_batched_kernel;
+	
+	// Structure-of-arrays buffers for the candidate partners of one particle in the batched pair kernel.
+	std::vector<int> batch_partners;			// Candidate partners gathered from the cell list.
+	std::vector<double> batch_displacements[DIMENSION];
+	std::vector<double> batch_rr2;
+	std::vector<double> batch_distances;
+	std::vector<double> batch_derivatives[DIMENSION];
+	std::vector<int> batch_within_cutoff;		// Partners within the cutoff, packed in the order they were found.
+	std::vector<int> batch_interacting;			// Positions among those of the partners that interact.
+	std::vector<int> batch_index_among_defined;	// Interaction of each of those partners.
+	
+	// The interacting force matched pairs grouped by interaction for basis function evaluation.
+	std::vector<int> group_starts;				// Start of each interaction's group; one extra entry for the end.
+	std::vector<int> group_fill;
+	std::vector<int> group_defined_indices;
+	std::vector<int> batch_group_positions;		// Position of each interacting pair among the grouped pairs.
+	std::vector<double> group_params;
+	std::vector<int> group_first_nonzero_basis_indices;
+	std::vector<double> group_basis_fn_vals;
+	
+	PairNonbondedClassComputer() {
+		use_batched_kernel = false;
+	}
+	
 	void class_set_up_computer(void);
 	//void class_set_up_range(void);
-	void calculate_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths);
+	void calculate_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, std::array<frame_real, DIMENSION>* const &x, const real* simulation_box_half_lengths);
+	void walk_neighbor_list(MATRIX_DATA* const mat, const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, std::array<frame_real, DIMENSION>* const &x, const real* simulation_box_half_lengths);
+	void process_pair_batch(const int* const partners, const int n_partners, MATRIX_DATA* const mat, const int n_cg_types, const TopologyData& topo_data, std::array<frame_real, DIMENSION>* const &x, const real* simulation_box_half_lengths);
 
     int calculate_hash_number(int* const cg_site_types, const int n_cg_types) {
 	    return calc_two_body_interaction_hash(cg_site_types[k], cg_site_types[l], n_cg_types);
@@ -548,7 +598,7 @@ struct PairNonbondedClassComputer : InteractionClassComputer {
 struct PairBondedClassComputer : InteractionClassComputer {
 	void class_set_up_computer(void);
 	//void class_set_up_range(void);
-	void calculate_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths); 
+	void calculate_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, std::array<frame_real, DIMENSION>* const &x, const real* simulation_box_half_lengths); 
 
     int calculate_hash_number(int* const cg_site_types, const int n_cg_types) {
 	    return calc_two_body_interaction_hash(cg_site_types[k], cg_site_types[l], n_cg_types);
@@ -558,7 +608,7 @@ struct PairBondedClassComputer : InteractionClassComputer {
 struct AngularClassComputer : InteractionClassComputer {
 	void class_set_up_computer(void);
 	//void class_set_up_range(void);
-	void calculate_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths);
+	void calculate_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, std::array<frame_real, DIMENSION>* const &x, const real* simulation_box_half_lengths);
 
     int calculate_hash_number(int* const cg_site_types, const int n_cg_types) {
 	    return calc_three_body_interaction_hash(cg_site_types[j], cg_site_types[k], cg_site_types[l], n_cg_types);
@@ -568,7 +618,7 @@ struct AngularClassComputer : InteractionClassComputer {
 struct DihedralClassComputer : InteractionClassComputer {
 	void class_set_up_computer(void);
 	//void class_set_up_range(void);
-	void calculate_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths);
+	void calculate_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, std::array<frame_real, DIMENSION>* const &x, const real* simulation_box_half_lengths);
 
     int calculate_hash_number(int* const cg_site_types, const int n_cg_types) {
 		return calc_four_body_interaction_hash(cg_site_types[i], cg_site_types[j], cg_site_types[k], cg_site_types[l], n_cg_types);
@@ -577,12 +627,25 @@ struct DihedralClassComputer : InteractionClassComputer {
 
 struct ThreeBodyNonbondedClassComputer : InteractionClassComputer {
 	double coef1[100];
+	
+	// Neighbors of the current central particle within the largest three body cutoff,
+	// with their minimum image displacements from it, squared distances, and whether the
+	// pair is excluded with the neighbor as the first (k) or second (l) end particle.
+	std::vector<int> shell_ids;
+	std::vector<std::array<double, DIMENSION> > shell_displacements;
+	std::vector<double> shell_rr2;
+	std::vector<bool> shell_excluded_as_k;
+	std::vector<bool> shell_excluded_as_l;
+	int shell_k, shell_l;					// Shell positions of the current end particles k and l.
+	std::vector<double> fm_basis_deriv_vals;	// Scratch space for basis function derivative values.
  	
 	void special_set_up_computer(InteractionClassSpec* const ispec_pt, int *curr_iclass_col_index);
 	void class_set_up_computer(void) {} ;
 	//void class_set_up_range(void);
-	void calculate_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths) {};
-	void calculate_3B_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, const ThreeBCellList& three_body_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths);
+	void calculate_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, std::array<frame_real, DIMENSION>* const &x, const real* simulation_box_half_lengths) {};
+	void calculate_3B_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, const ThreeBCellList& three_body_cell_list, std::array<frame_real, DIMENSION>* const &x, const real* simulation_box_half_lengths);
+	void walk_3B_neighbor_shells(MATRIX_DATA* const mat, const int n_cg_types, const TopologyData& topo_data, const ThreeBCellList& three_body_cell_list, std::array<frame_real, DIMENSION>* const &x, const real* simulation_box_half_lengths);
+	inline void add_to_shell(const int n, const TopologyData& topo_data, const double shell_cutoff2, std::array<frame_real, DIMENSION>* const &x, const real* simulation_box_half_lengths);
 	
     void calculate_bspline_elements_and_deriv_elements(double* coef1);
 	void calculate_bspline_deriv_elements(double* coef1);
@@ -615,22 +678,23 @@ struct DensityClassComputer : InteractionClassComputer {
 	// Specific Implementaitons of InteractionClassComputer functions
 	void class_set_up_computer(void);
 	//void class_set_up_range(void);
-	void calculate_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths);
-	void walk_density_neighbor_list(MATRIX_DATA* const mat, calc_pair_matrix_elements calc_matrix_elements, const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, std::array<double, DIMENSION>* const &x, const real* simulation_box_half_lengths);
+	void calculate_interactions(MATRIX_DATA* const mat, int traj_block_frame_index, int curr_frame_starting_row, const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, std::array<frame_real, DIMENSION>* const &x, const real* simulation_box_half_lengths);
+	void walk_density_neighbor_list(MATRIX_DATA* const mat, calc_pair_matrix_elements calc_matrix_elements, const int n_cg_types, const TopologyData& topo_data, const PairCellList& pair_cell_list, std::array<frame_real, DIMENSION>* const &x, const real* simulation_box_half_lengths);
 	
 	// Additional Computer functions specific to Density.
 	void reset_density_array(void);
 	
 	// Additional function pointer to calculate the density_values array before computing the interaction
-	void (*calculate_density_values)(InteractionClassComputer* const self, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat);
-   	void (*process_density)(InteractionClassComputer* const self, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat);
+	void (*calculate_density_values)(InteractionClassComputer* const self, std::array<frame_real, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat);
+   	void (*process_density)(InteractionClassComputer* const self, std::array<frame_real, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat);
 	double (*calculate_density_derivative)(DensityClassComputer* const icomp, DensityClassSpec* const ispec, const double distance);
 	
 	// Need to implement these functions
 	int calculate_hash_number(int* const cg_site_types, const int n_cg_types) {return -1;}
 		
 	inline ~DensityClassComputer() {
-		if(ispec->get_n_defined() > 0) {
+		// ispec is only set once the force computers are set up.
+		if( (ispec != NULL) && (ispec->get_n_defined() > 0) ) {
 			delete [] denomenator;
 			delete [] u_cutoff;
 			delete [] f_cutoff;
@@ -655,6 +719,8 @@ struct CG_MODEL_DATA {
     double pair_nonbonded_cutoff;           // Nonbonded pair interaction cutoff
     double pair_nonbonded_cutoff2;          // Squared cutoff distance for pair nonbonded interactions
     double three_body_nonbonded_cutoff2;    // Squared cutoff distance for three body nonbonded interactions
+    double verlet_skin;                     // Skin distance for the pair Verlet list; 0 to search the cell list every frame
+    PairVerletList pair_verlet_list;        // Pair Verlet list reused across frames when verlet_skin > 0
 
     // Topology specifications.
     TopologyData topo_data;
@@ -689,6 +755,8 @@ struct CG_MODEL_DATA {
 
 	inline CG_MODEL_DATA(ControlInputs* control_input) :
 		pair_nonbonded_cutoff(control_input->pair_nonbonded_cutoff),
+		verlet_skin(control_input->verlet_skin),
+		pair_verlet_list(control_input->pair_nonbonded_cutoff, control_input->verlet_skin),
 		topo_data(control_input->max_pair_bonds_per_site, control_input->max_angles_per_site, control_input->max_dihedrals_per_site),
 		pair_nonbonded_interactions(control_input), pair_bonded_interactions(control_input),
 		angular_interactions(control_input), dihedral_interactions(control_input),
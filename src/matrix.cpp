@@ -5,6 +5,7 @@
 //  Copyright (c) 2016 The Voth Group at The University of Chicago. All rights reserved.
 //
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <cstdio>
@@ -29,6 +30,7 @@ void initialize_accumulation_matrix(MATRIX_DATA* const mat, ControlInputs* const
 void initialize_sparse_matrix(MATRIX_DATA* const mat, ControlInputs* const control_input, CG_MODEL_DATA* const cg);
 void initialize_sparse_dense_normal_matrix(MATRIX_DATA* const mat, ControlInputs* const control_input, CG_MODEL_DATA* const cg);
 void initialize_sparse_sparse_normal_matrix(MATRIX_DATA* const mat, ControlInputs* const control_input, CG_MODEL_DATA* const cg);
+void initialize_direct_normal_matrix(MATRIX_DATA* const mat, ControlInputs* const control_input, CG_MODEL_DATA* const cg);
 void initialize_dummy_matrix(MATRIX_DATA* const mat, ControlInputs* const control_input, CG_MODEL_DATA* const cg);
 
 // Helper matrix initialization routines
@@ -44,6 +46,7 @@ void determine_BI_interaction_rows_and_cols(MATRIX_DATA* mat, InteractionClassCo
 void set_dense_matrix_to_zero(MATRIX_DATA* const mat);
 void set_sparse_matrix_to_zero(MATRIX_DATA* const mat);
 void set_sparse_accumulation_matrix_to_zero(MATRIX_DATA* const mat);
+void set_direct_normal_matrix_to_zero(MATRIX_DATA* const mat);
 void set_accumulation_matrix_to_zero(MATRIX_DATA* const mat);
 void set_accumulation_matrix_to_zero(MATRIX_DATA* const mat, dense_matrix* const dense_fm_matrix);
 void set_dummy_matrix_to_zero(MATRIX_DATA* const mat);
@@ -77,8 +80,8 @@ void accumulate_constraint_into_accumulation_target_vector(MATRIX_DATA *mat, int
 void calculate_target_virial_in_dense_vector(MATRIX_DATA* const mat, double *pressure_constraint_rhs_vector);
 void calculate_target_virial_in_accumulation_vector(MATRIX_DATA* const mat, double *pressure_constraint_rhs_vector);
 
-void calculate_target_force_dense_vector(int shift_i, int site_i, MATRIX_DATA* const mat, std::array<double, DIMENSION>* const &f);
-void calculate_target_force_accumulation_vector(int shift_i, int site_i, MATRIX_DATA* const mat, std::array<double, DIMENSION>* const &f);
+void calculate_target_force_dense_vector(int shift_i, int site_i, MATRIX_DATA* const mat, std::array<frame_real, DIMENSION>* const &f);
+void calculate_target_force_accumulation_vector(int shift_i, int site_i, MATRIX_DATA* const mat, std::array<frame_real, DIMENSION>* const &f);
 
 // Post-frame-block routines
 
@@ -88,22 +91,35 @@ void accumulate_accumulation_matrices(MATRIX_DATA* const mat);
 void solve_sparse_matrix(MATRIX_DATA* const mat);
 void convert_sparse_fm_equation_to_sparse_normal_form_and_accumulate(MATRIX_DATA* const mat);
 void convert_sparse_fm_equation_to_dense_normal_form_and_accumulate(MATRIX_DATA* const mat);
+void accumulate_direct_normal_form(MATRIX_DATA* const mat);
 void do_nothing_to_fm_matrix(MATRIX_DATA* const mat);
 
 // Helper solver routines
 
 int get_n_nonzero_matrix_elements(MATRIX_DATA* const mat);
-void convert_linked_list_to_csr_matrix(MATRIX_DATA* const mat, csr_matrix& csr_fm_matrix);
+void convert_sparse_block_to_csr_matrix(MATRIX_DATA* const mat, csr_matrix& csr_fm_matrix);
 void precondition_sparse_matrix(int const fm_matrix_columns, double* h, csr_matrix* csr_normal_matrix);
-void sparse_matrix_addition(MATRIX_DATA* const mat, double frame_weight, int nnzmax, csr_matrix& csr_normal_matrix, csr_matrix* main_normal_matrix);
+void sparse_matrix_addition(MATRIX_DATA* const mat, double frame_weight, csr_matrix& csr_normal_matrix, csr_matrix* main_normal_matrix);
 void regularize_sparse_matrix(MATRIX_DATA* const mat);
 void regularize_vector_sparse_matrix(MATRIX_DATA* const mat, double* regularization_vector);
 void regularize_sparse_matrix(MATRIX_DATA* const mat, csr_matrix* csr_matrix);
 void regularize_vector_sparse_matrix(MATRIX_DATA* const mat, csr_matrix* csr_normal_matrix, double* regularization_vector);
 void pardiso_solve(MATRIX_DATA* const mat, csr_matrix* const sparse_matrix, double* const dense_fm_normal_rhs_vector);
+void solve_sparse_normal_equations(MATRIX_DATA* const mat, csr_matrix* const sparse_matrix, double* const dense_fm_normal_rhs_vector);
+#if _mkl_flag == 0
+void csr_transpose_times_csr(const int n_rows, const int n_cols, const csr_matrix& csr_in, csr_matrix& csr_product);
+void csr_transpose_times_csr_dense(const int n_rows, const int n_cols, const csr_matrix& csr_in, double* const dense_product);
+void csr_transpose_times_vector(const int n_rows, const int n_cols, const csr_matrix& csr_in, const double* const x, double* const y);
+void csr_times_vector(const int n_rows, const csr_matrix& csr_in, const double* const x, double* const y);
+void csr_matrix_addition(const int n_rows, const int n_cols, const double beta, const csr_matrix& csr_addend, csr_matrix* const csr_sum);
+void conjugate_gradient_solve(MATRIX_DATA* const mat, csr_matrix* const sparse_matrix, double* const dense_fm_normal_rhs_vector, double* const h);
+#endif
 void solve_this_sparse_matrix(MATRIX_DATA* const mat);
 inline void create_sparse_normal_form_matrix(MATRIX_DATA* const mat, const int nnzmax, csr_matrix& csr_fm_matrix, csr_matrix& csr_normal_matrix, double* const dense_fm_rhs_vector, double* const dense_rhs_normal_vector);
 inline void create_dense_normal_form(MATRIX_DATA* const mat, const double frame_weight, dense_matrix* const dense_fm_matrix, dense_matrix* normal_matrix, double* const dense_fm_rhs_vector, double* dense_fm_normal_rhs_vector);
+inline bool dense_block_frame_weights_are_uniform(MATRIX_DATA* const mat, const double* const frame_weights);
+void add_weighted_dense_block_normal_form(MATRIX_DATA* const mat, const double* const frame_weights, const double scale, dense_matrix* const normal_matrix, double* const normal_rhs_vector, dense_matrix* const scaled_fm_matrix, double* const scaled_fm_rhs_vector);
+void add_direct_block_normal_form(MATRIX_DATA* const mat, const double* const frame_weights, const double scale, dense_matrix* const normal_matrix, double* const normal_rhs_vector);
 inline double calculate_dense_residual(MATRIX_DATA* const mat, dense_matrix* const dense_fm_normal_matrix, double* const dense_fm_rhs_vector, std::vector<double> &fm_solution, double normalziation);
 inline double calculate_sparse_residual(MATRIX_DATA* const mat, csr_matrix* sparse_fm_normal_matrix, double* const dense_fm_rhs_vector, std::vector<double> &fm_solution, double normalization);
 inline void calculate_and_apply_dense_preconditioning(MATRIX_DATA* mat, dense_matrix* dense_fm_normal_matrix, double* h);
@@ -120,10 +136,12 @@ void solve_accumulation_form_fm_equations(MATRIX_DATA* const mat);
 // Bootstrapping routines
 
 void convert_dense_fm_equation_to_normal_form_and_bootstrap(MATRIX_DATA* const mat);
+void convert_dense_fm_block_to_normal_form_and_bootstrap(MATRIX_DATA* const mat);
 void solve_sparse_matrix_for_bootstrap(MATRIX_DATA* const mat);
 void convert_sparse_fm_equation_to_sparse_normal_form_and_bootstrap(MATRIX_DATA* const mat);
 void accumulate_accumulation_matrices_for_bootstrap(MATRIX_DATA* const mat);
 void convert_sparse_fm_equation_to_dense_normal_form_and_bootstrap(MATRIX_DATA* const mat);
+void accumulate_direct_normal_form_and_bootstrap(MATRIX_DATA* const mat);
 void average_sparse_bootstrapping_solutions(MATRIX_DATA* const mat);
 void solve_sparse_fm_bootstrapping_equations(MATRIX_DATA* const mat);
 void solve_dense_fm_normal_bootstrapping_equations(MATRIX_DATA* const mat);
@@ -155,11 +173,16 @@ MATRIX_DATA::MATRIX_DATA(ControlInputs* const control_input, CG_MODEL_DATA *cons
     
     // Copy over basic data members.
     output_style 					= control_input->output_style;
+    binary_output_filename			= "result.out";
     output_normal_equations_rhs_flag= control_input->output_normal_equations_rhs_flag;
     output_solution_flag 			= control_input->output_solution_flag;
     rcond							= control_input->rcond;
     itnlim 							= control_input->itnlim;
+    sparse_solver_tolerance 		= control_input->sparse_solver_tolerance;
+    sparse_solver_max_iterations 	= control_input->sparse_solver_max_iterations;
 	num_sparse_threads 				= control_input->num_sparse_threads;
+	num_frame_threads 				= control_input->num_frame_threads;
+	frame_worker_flag 				= 0;
 	position_dimension 				= control_input->position_dimension;
 	volume_weighting_flag 			= control_input->volume_weighting_flag;
 
@@ -183,6 +206,9 @@ MATRIX_DATA::MATRIX_DATA(ControlInputs* const control_input, CG_MODEL_DATA *cons
     // Set blockwise composition weighting factors
     frames_per_traj_block 			= control_input->frames_per_traj_block;
 	current_frame_weight 			= 1.0;
+	block_frame_weights				= std::vector<double>(frames_per_traj_block, 0.0);
+	dense_fm_scaled_matrix			= NULL;
+	dense_fm_scaled_rhs_vector		= NULL;
 	use_statistical_reweighting 	= control_input->use_statistical_reweighting;
 	dynamic_state_samples_per_frame = 1;
 	if(control_input->dynamic_state_sampling == 1) dynamic_state_samples_per_frame = control_input->dynamic_state_samples_per_frame;
@@ -220,6 +246,10 @@ MATRIX_DATA::MATRIX_DATA(ControlInputs* const control_input, CG_MODEL_DATA *cons
     	matrix_type = kSparseSparse;
         initialize_sparse_sparse_normal_matrix(this, control_input, cg);
         break;
+    case kDirectNormal:
+    	matrix_type = kDirectNormal;
+        initialize_direct_normal_matrix(this, control_input, cg);
+        break;
 	case kDummy: // Used as a placeholder (e.g., rangefinder)
         matrix_type = kDummy;
         initialize_dummy_matrix(this, control_input, cg);
@@ -242,47 +272,38 @@ void matrix_sanity_checks(ControlInputs* const control_input) {
 
     #if _mkl_flag == 1
 	mkl_set_num_threads(control_input->num_sparse_threads);
-	#else 
-	if (MatrixType(control_input->matrix_type) == kSparse || MatrixType(control_input->matrix_type) == kSparseSparse) {
-        printf("Cannot use sparse solving (matrix_type 1 or 4) unless compiling with MKL (use newfm_mkl.x in makefile).\n");
-		exit(EXIT_FAILURE);
-    }
-	if (MatrixType(control_input->matrix_type) == kSparseNormal) {
-        printf("Cannot use sparse accumulation (matrix_type 3) unless compiling with MKL for the time being (use newfm_mkl.x in makefile).\n");
-		exit(EXIT_FAILURE);
-    }
 	#endif
     
     // Ignore a user's choice to output certain quantities if they will not be calculated.
-    if ( ((MatrixType)(control_input->matrix_type) != kDense) && ((MatrixType)(control_input->matrix_type) != kSparseNormal) && (control_input->output_normal_equations_rhs_flag != 0) ) {
+    if ( ((MatrixType)(control_input->matrix_type) != kDense) && ((MatrixType)(control_input->matrix_type) != kSparseNormal) && ((MatrixType)(control_input->matrix_type) != kDirectNormal) && (control_input->output_normal_equations_rhs_flag != 0) ) {
         printf("Cannot output normal equations if normal equations are not being calculated.\n");
         printf("Use a different FM matrix format.\n");
         exit(EXIT_FAILURE);
     }
     
-    // Override a user's choice of block_size if it conflicts with use_statistical_reweighting flag
-    if ( (control_input->use_statistical_reweighting == 1) && (control_input->frames_per_traj_block != 1) ) {
+    // Override a user's choice of block_size if it conflicts with use_statistical_reweighting flag.
+    // Dense and direct normal matrices weight each frame's rows separately, so they can use any block size.
+    if ( (control_input->use_statistical_reweighting == 1) && (control_input->frames_per_traj_block != 1) && ((MatrixType)(control_input->matrix_type) != kDense) && ((MatrixType)(control_input->matrix_type) != kDirectNormal) ) {
     	printf("Cannot use statistical reweighting with %d frames per trajectory block.\n", control_input->frames_per_traj_block);
     	printf("Setting block_size to 1.\n");
     	control_input->frames_per_traj_block = 1;
     }
 	
-	if ( (control_input->bootstrapping_flag == 1) && (control_input->frames_per_traj_block != 1) ) {
+	if ( (control_input->bootstrapping_flag == 1) && (control_input->frames_per_traj_block != 1) && ((MatrixType)(control_input->matrix_type) != kDense) && ((MatrixType)(control_input->matrix_type) != kDirectNormal) ) {
 		printf("Cannot use bootstrapping with %d frames per trajectory block.\n", control_input->bootstrapping_flag);
 		printf("Please change the block size to 1 and recheck your inputs before rerunning.\n");
 		exit(EXIT_FAILURE);
 	}
 	
-	if ( (control_input->volume_weighting_flag == 1) && (control_input->frames_per_traj_block != 1) ) {
+	if ( (control_input->volume_weighting_flag == 1) && (control_input->frames_per_traj_block != 1) && ((MatrixType)(control_input->matrix_type) != kDense) && ((MatrixType)(control_input->matrix_type) != kDirectNormal) ) {
 		printf("Cannot use volume weighting with %d frames per trajectory block.\n", control_input->bootstrapping_flag);
 		printf("Please change the block size to 1 and recheck your inputs before rerunning.\n");
 		exit(EXIT_FAILURE);
 	}
 
-	if ( ((MatrixType)(control_input->matrix_type) == kDense) && (control_input->frames_per_traj_block != 1) ) {
-		printf("Cannot use dense matrix_type (0) with %d frames per trajectory block\n", control_input->frames_per_traj_block);
-		printf("Setting block_size to 1.\n");
-		control_input->frames_per_traj_block = 1;
+	if (control_input->num_frame_threads < 1) {
+		printf("Please change num_frame_threads to a positive number and recheck your inputs before rerunning.\n");
+		exit(EXIT_FAILURE);
 	}
 	
 	if (control_input->frames_per_traj_block < 1) {
@@ -351,7 +372,7 @@ void initialize_dense_matrix(MATRIX_DATA* const mat, ControlInputs* const contro
         exit(EXIT_FAILURE);
     }
     
-    printf("Size of per-frame matrix: %lu bytes \n", mat->fm_matrix_rows * mat->fm_matrix_columns * sizeof(double));
+    printf("Size of per-block matrix: %lu bytes \n", mat->fm_matrix_rows * mat->fm_matrix_columns * sizeof(double));
     printf("Size of normal matrix: %lu bytes \n", mat->fm_matrix_columns * mat->fm_matrix_columns * sizeof(double));
 
     // Allocate memory for the FM matrix and target vector as well as their normal form
@@ -362,6 +383,12 @@ void initialize_dense_matrix(MATRIX_DATA* const mat, ControlInputs* const contro
     
     if (control_input->bootstrapping_flag == 1) {
 		allocate_bootstrapping(mat, control_input, mat->fm_matrix_columns, mat->fm_matrix_columns);
+		
+		// Each estimate weights the frames of a block differently, so it needs a row-weighted copy of the block.
+		if (mat->frames_per_traj_block > 1) {
+			mat->dense_fm_scaled_matrix = new dense_matrix(mat->fm_matrix_rows, mat->fm_matrix_columns);
+			mat->dense_fm_scaled_rhs_vector = new double[mat->fm_matrix_rows]();
+		}
     }
 	mat->dense_fm_normal_matrix = new dense_matrix(mat->fm_matrix_columns , mat->fm_matrix_columns);
     mat->dense_fm_normal_rhs_vector = new double[mat->fm_matrix_columns]();
@@ -479,15 +506,11 @@ void initialize_sparse_matrix(MATRIX_DATA* const mat, ControlInputs* const contr
     	exit(EXIT_FAILURE);
     }
     
-    // Allocate memory for the FM matrix in linked list format and a dense target 
+    // Allocate memory for the FM matrix in sparse block format and a dense target 
     // vector as well as temp space for the solution routines and final 
     // solution averaging operation.
     mat->dense_fm_rhs_vector = new double[mat->fm_matrix_rows]();
-    mat->ll_sparse_matrix_row_heads = new linked_list_sparse_matrix_row_head[mat->rows_less_constraint_rows];
-	for(int i = 0; i < mat->rows_less_constraint_rows; i++) {
-    	mat->ll_sparse_matrix_row_heads[i].n = 0;
-    	mat->ll_sparse_matrix_row_heads[i].h = NULL;
-    }
+    mat->sparse_fm_block = new sparse_block_builder(mat->rows_less_constraint_rows);
     if (control_input->pressure_constraint_flag == 1) mat->dense_fm_matrix = new dense_matrix(control_input->frames_per_traj_block, mat->fm_matrix_columns);
     
     // Allocate a preconditioning temp array.
@@ -567,15 +590,11 @@ void initialize_sparse_dense_normal_matrix(MATRIX_DATA* const mat, ControlInputs
     
     printf("Size of dense normal matrix: %lu bytes \n", mat->fm_matrix_columns * mat->fm_matrix_columns * sizeof(double));
 
-    // Allocate memory for the FM matrix in linked list format and a dense target 
+    // Allocate memory for the FM matrix in sparse block format and a dense target 
     // vector as well as temp space for the solution routines and final 
     // solution averaging operation.
     mat->dense_fm_rhs_vector = new double[mat->fm_matrix_rows]();
-    mat->ll_sparse_matrix_row_heads = new linked_list_sparse_matrix_row_head[mat->rows_less_constraint_rows];
-	for(int i = 0; i < mat->rows_less_constraint_rows; i++) {
-    	mat->ll_sparse_matrix_row_heads[i].n = 0;
-    	mat->ll_sparse_matrix_row_heads[i].h = NULL;
-    }
+    mat->sparse_fm_block = new sparse_block_builder(mat->rows_less_constraint_rows);
     if (control_input->pressure_constraint_flag == 1) mat->dense_fm_matrix = new dense_matrix(control_input->frames_per_traj_block, mat->fm_matrix_columns);
 	else mat->dense_fm_matrix = new dense_matrix(1, 1); // This is to line-up with memory allocation in solve_dense_matrix
 	
@@ -651,15 +670,11 @@ void initialize_sparse_sparse_normal_matrix(MATRIX_DATA* const mat, ControlInput
     
     printf("Size of dense normal matrix: %lu bytes \n", mat->fm_matrix_columns * mat->fm_matrix_columns * sizeof(double));
 
-    // Allocate memory for the FM matrix in linked list format and a dense target 
+    // Allocate memory for the FM matrix in sparse block format and a dense target 
     // vector as well as temp space for the solution routines and final 
     // solution averaging operation.
     mat->dense_fm_rhs_vector = new double[mat->fm_matrix_rows]();
-    mat->ll_sparse_matrix_row_heads = new linked_list_sparse_matrix_row_head[mat->rows_less_constraint_rows];
-	for(int i = 0; i < mat->rows_less_constraint_rows; i++) {
-    	mat->ll_sparse_matrix_row_heads[i].n = 0;
-    	mat->ll_sparse_matrix_row_heads[i].h = NULL;
-    }
+    mat->sparse_fm_block = new sparse_block_builder(mat->rows_less_constraint_rows);
     if (control_input->pressure_constraint_flag == 1) mat->dense_fm_matrix = new dense_matrix(control_input->frames_per_traj_block, mat->fm_matrix_columns);
 
 	mat->fm_solution = std::vector<double>(mat->fm_matrix_columns);
@@ -672,6 +687,10 @@ void initialize_sparse_sparse_normal_matrix(MATRIX_DATA* const mat, ControlInput
 	// These matrices are used for accumulation of sparse normal form before solving
 	if (control_input->bootstrapping_flag == 1) {
 		allocate_bootstrapping(mat, control_input, mat->fm_matrix_columns, mat->fm_matrix_columns);
+		mat->bootstrapping_sparse_fm_normal_matrices = new csr_matrix*[control_input->bootstrapping_num_estimates];
+		for (int i = 0; i < control_input->bootstrapping_num_estimates; i++) {
+			mat->bootstrapping_sparse_fm_normal_matrices[i] = new csr_matrix(mat->fm_matrix_columns, mat->fm_matrix_columns, mat->max_nonzero_normal_elements);
+		}
 	}
 	mat->dense_fm_normal_rhs_vector = new double[mat->fm_matrix_columns]();
     mat->sparse_matrix = new csr_matrix(mat->fm_matrix_columns, mat->fm_matrix_columns, mat->max_nonzero_normal_elements);
@@ -679,6 +698,73 @@ void initialize_sparse_sparse_normal_matrix(MATRIX_DATA* const mat, ControlInput
 	printf("Initialized a sparse-sparse normal FM matrix.\n");
 }
 
+// Initialize a direct accumulation of the dense normal form from sparse FM matrix rows.
+// Only the sparse rows of the current block and the normal equations themselves are stored.
+
+void initialize_direct_normal_matrix(MATRIX_DATA* const mat, ControlInputs* const control_input, CG_MODEL_DATA* const)
+{
+    // Set pseudopolymorphic methods
+    mat->set_fm_matrix_to_zero = set_direct_normal_matrix_to_zero;
+    mat->accumulate_fm_matrix_element = insert_sparse_matrix_element;
+    mat->accumulate_target_force_element = accumulate_force_into_dense_target_vector;
+    mat->accumulate_target_constraint_element = accumulate_constraint_into_dense_target_vector;
+    mat->sparse_matrix = NULL;
+    
+    if (control_input->bootstrapping_flag == 1) {
+    	mat->do_end_of_frameblock_matrix_manipulations = accumulate_direct_normal_form_and_bootstrap;
+    } else {
+    	mat->do_end_of_frameblock_matrix_manipulations = accumulate_direct_normal_form;
+    }
+    
+    mat->accumulate_virial_constraint_matrix_element = insert_sparse_matrix_virial_element;
+    
+    if (control_input->bootstrapping_flag == 1) {
+    	mat->finish_fm = solve_dense_fm_normal_bootstrapping_equations;
+    } else {
+		mat->finish_fm = solve_dense_fm_normal_equations;
+	}
+	
+    // Check that the matrix dimensions are enough that that the equations
+    // will be overdetermined (in a perfect world where all the data is 
+    // linearly independent for each row).
+    if ( (unsigned)(mat->fm_matrix_rows / mat->frames_per_traj_block) * (unsigned)(control_input->n_frames) < (unsigned)(mat->fm_matrix_columns) ) {
+        printf("Current number of frames in this trajectory is too low to provide a fully-determined set of FM equations. Provide more frames in the input trajectory.\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    mat->accumulation_matrix_columns = mat->fm_matrix_columns;
+    mat->accumulation_matrix_rows = mat->fm_matrix_rows;
+ 
+    printf("Number of rows for direct normal matrix algorithm: %d \n", mat->fm_matrix_rows);
+    printf("Number of columns for direct normal matrix algorithm: %d \n", mat->fm_matrix_columns);
+ 
+    // Check that the memory usage is reasonable and print 
+    // memory diagnostics if so. These are checks for integer 
+    // overflow when calculating the size of the matrices.
+
+    if ( (int(INT_MAX) / mat->fm_matrix_columns) <
+        (mat->fm_matrix_columns * (int)(sizeof(double))) ) {
+        printf("Using this number of columns will lead to integer overflow in memory allocation for the normal matrix equations. Decrease the number of basis functions.\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    printf("Size of dense normal matrix: %lu bytes \n", mat->fm_matrix_columns * mat->fm_matrix_columns * sizeof(double));
+
+    // Allocate memory for the sparse rows of one block, a dense target vector,
+    // and a dense matrix for the virial rows.
+    mat->dense_fm_rhs_vector = new double[mat->fm_matrix_rows]();
+    mat->sparse_fm_block = new sparse_block_builder(mat->rows_less_constraint_rows);
+    if (control_input->pressure_constraint_flag == 1) mat->dense_fm_matrix = new dense_matrix(control_input->frames_per_traj_block, mat->fm_matrix_columns);
+	else mat->dense_fm_matrix = new dense_matrix(1, 1); // This is to line-up with memory allocation in solve_dense_matrix
+	
+    if (control_input->bootstrapping_flag == 1) {
+		allocate_bootstrapping(mat, control_input, mat->fm_matrix_columns, mat->fm_matrix_columns);
+    }
+	mat->dense_fm_normal_matrix = new dense_matrix(mat->fm_matrix_columns, mat->fm_matrix_columns);
+	mat->dense_fm_normal_rhs_vector = new double[mat->fm_matrix_columns]();
+	printf("Initialized a direct normal FM matrix.\n");
+}
+
 // "Initialize" a dummy matrix.
 
 void initialize_dummy_matrix(MATRIX_DATA* const mat, ControlInputs* const control_input, CG_MODEL_DATA* const cg) 
@@ -704,8 +790,8 @@ void initialize_first_BI_matrix(MATRIX_DATA* const mat, CG_MODEL_DATA* const cg)
   mat->accumulate_target_force_element = accumulate_scalar_into_dense_target_vector;
   
   // reset output files
-  FILE* BI_matrix = fopen("BI_matrix.dat","w");
-  FILE* BI_vector = fopen("BI_vector.dat","w");
+  FILE* BI_matrix = fopen(output_file_name("BI_matrix.dat").c_str(),"w");
+  FILE* BI_vector = fopen(output_file_name("BI_vector.dat").c_str(),"w");
   fclose(BI_matrix);
   fclose(BI_vector);
 }
@@ -837,7 +923,30 @@ void allocate_bootstrapping(MATRIX_DATA* mat, ControlInputs* const control_input
   		mat->bootstrap_solutions[i] = std::vector<double>(cols);
 	}
 }
-    
+
+// Make a thread-private copy of the matrix for processing frames concurrently.
+// Every frame of a block writes to its own rows of the shared target vector and virial rows,
+// and for dense matrices to its own rows of the shared blockwise FM matrix as well.
+// For sparse matrices, each copy collects its elements in its own sparse block, which the
+// caller should append to the original's in frame order.
+// The copy keeps its own force_sq_total and frame weights, which the caller should copy back
+// to the original before the end-of-frameblock routine is called for the original.
+
+MATRIX_DATA* make_frame_worker_matrix(MATRIX_DATA* const mat)
+{
+	if (mat->matrix_type != kDense && mat->matrix_type != kSparseNormal && mat->matrix_type != kDirectNormal) {
+		printf("Threaded frame processing is only implemented for matrix_type 0, 3 and 5.\n");
+		exit(EXIT_FAILURE);
+	}
+	MATRIX_DATA* worker = new MATRIX_DATA(*mat);
+	worker->frame_worker_flag = 1;
+	worker->force_sq_total = 0.0;
+	if (mat->matrix_type == kSparseNormal || mat->matrix_type == kDirectNormal) {
+		worker->sparse_fm_block = new sparse_block_builder(mat->rows_less_constraint_rows);
+	}
+	return worker;
+}
+
 // Estimate upper and lower bounds for the number of non-zero elements in normal matrix
 
 void estimate_number_of_sparse_elements(MATRIX_DATA* const mat, CG_MODEL_DATA* const cg)
@@ -881,13 +990,14 @@ void estimate_number_of_sparse_elements(MATRIX_DATA* const mat, CG_MODEL_DATA* c
 inline void set_dense_matrix_to_zero(MATRIX_DATA* const mat)
 {
     mat->dense_fm_matrix->reset_matrix();
+    std::fill(mat->block_frame_weights.begin(), mat->block_frame_weights.end(), 0.0);
 }
 
-// Set all elements of a linked-list sparse matrix to zero.
+// Set all elements of a sparse block matrix to zero.
 
 inline void set_sparse_matrix_to_zero(MATRIX_DATA* const mat)
 {
-	// The row head and element information is cleared in convert_linked_list_to_csr_matrix.
+	// The sparse block elements are cleared in convert_sparse_block_to_csr_matrix.
 
     // Set the elements of the dense part of the matrix to zero.
 	for (int k = 0; k < mat->virial_constraint_rows * mat->fm_matrix_columns; k++) {
@@ -895,11 +1005,11 @@ inline void set_sparse_matrix_to_zero(MATRIX_DATA* const mat)
     }
 }
 
-// Set all elements of a linked-list sparse matrix to zero when accumulating normal matrix.
+// Set all elements of a sparse block matrix to zero when accumulating normal matrix.
 
 inline void set_sparse_accumulation_matrix_to_zero(MATRIX_DATA* const mat)
 {
-	// The row head and element information is cleared in convert_linked_list_to_csr_matrix.
+	// The sparse block elements are cleared in convert_sparse_block_to_csr_matrix.
 
     // Set the elements of the dense part of the matrix to zero.
    for (int k = 0; k < mat->virial_constraint_rows * mat->fm_matrix_columns; k++) {
@@ -907,6 +1017,18 @@ inline void set_sparse_accumulation_matrix_to_zero(MATRIX_DATA* const mat)
     }
 }
 
+// Reset a direct normal matrix for the next block. Its sparse rows are cleared 
+// once they have been added to the normal equations, so only the virial rows 
+// and frame weights need to be reset.
+
+void set_direct_normal_matrix_to_zero(MATRIX_DATA* const mat)
+{
+	for (int k = 0; k < mat->virial_constraint_rows * mat->fm_matrix_columns; k++) {
+        mat->dense_fm_matrix->values[k] = 0.0;
+    }
+    std::fill(mat->block_frame_weights.begin(), mat->block_frame_weights.end(), 0.0);
+}
+
 // Set all elements of an accumulation matrix to zero.
 
 void set_accumulation_matrix_to_zero(MATRIX_DATA* const mat)
@@ -1016,72 +1138,12 @@ void accumulate_tabulated_error(InteractionClassComputer* const info, const doub
 // Matrix insertion routines
 //--------------------------------------------------------------------
 
-// Add a three-component nonzero force value to a linked list format sparse matrix.
+// Add a three-component nonzero force value to a sparse block matrix.
+// Repeated (row, column) pairs are summed when the block is merged.
 
 void insert_sparse_matrix_element(const int i, const int j, double* const x, MATRIX_DATA* const mat)
 {
-    struct linked_list_sparse_matrix_element* curr_elem, *prev_elem, *head, *pt;
-    int k;
-    
-    head = mat->ll_sparse_matrix_row_heads[i].h;
-    
-    // If the linked list is empty
-    if (head == NULL) {
-        pt = new linked_list_sparse_matrix_element;
-        mat->ll_sparse_matrix_row_heads[i].h = pt;
-        pt->col = j;
-        for (k = 0; k < DIMENSION; k++) pt->valx[k] = x[k];
-        pt->next = NULL;
-        mat->ll_sparse_matrix_row_heads[i].n += 1;
-        
-    // If the linked list is not empty
-    } else {
-        curr_elem = head;
-        prev_elem = NULL;
-        while (curr_elem != NULL) {
-            // If the element exists, add
-            if (curr_elem->col == j) {
-                for (k = 0; k < DIMENSION; k++) curr_elem->valx[k] += x[k];
-                prev_elem = curr_elem;
-                break;
-            
-            // If the new element should be ahead of the next in the list
-            } else if (curr_elem->col > j) {
-                
-                // If the new element should be the first in the list
-                if (prev_elem == NULL) {
-                    pt = new linked_list_sparse_matrix_element;
-                    mat->ll_sparse_matrix_row_heads[i].h = pt;
-                    pt->col = j;
-                    for (k = 0; k < DIMENSION; k++) pt->valx[k] = x[k];
-                    pt->next = curr_elem;
-
-                // General case
-                } else {
-                    pt = new linked_list_sparse_matrix_element;
-                    prev_elem->next = pt;
-                    pt->col = j;
-                    for (k = 0; k < DIMENSION; k++) pt->valx[k] = x[k];
-                    pt->next = curr_elem;
-                }
-                mat->ll_sparse_matrix_row_heads[i].n += 1;
-                prev_elem = curr_elem;
-                break;
-            }
-            prev_elem = curr_elem;
-            curr_elem = prev_elem->next;
-        }
-        
-        // If the new element should be the last
-        if (prev_elem->col < j) {
-            pt = new linked_list_sparse_matrix_element;
-            prev_elem->next = pt;
-            pt->col = j;
-            for (k = 0; k < DIMENSION; k++) pt->valx[k] = x[k];
-            pt->next = NULL;
-            mat->ll_sparse_matrix_row_heads[i].n += 1;
-        }
-    }   
+    mat->sparse_fm_block->add_element(i, j, x);
 }
 
 // Add a dimension-sized force element to a dense matrix.
@@ -1111,7 +1173,7 @@ inline void insert_scalar_matrix_element(const int i, const int j, double const
 
 inline void insert_dense_matrix_virial_element(const int m, const int n, const double x, MATRIX_DATA* const mat)
 {
-    mat->dense_fm_matrix->add_scalar(mat->rows_less_constraint_rows * DIMENSION, n, x);
+    mat->dense_fm_matrix->add_scalar(mat->rows_less_constraint_rows * DIMENSION + m, n, x);
 }
 
 // Add a scalar virial contribution to a sparse matrix.
@@ -1134,7 +1196,7 @@ inline void insert_accumulation_matrix_virial_element(const int m, const int n,
 
 void add_target_virials_from_trajectory(MATRIX_DATA* const mat, double *pressure_constraint_rhs_vector)
 {
-    if (mat->matrix_type == kDense || mat->matrix_type == kSparse) {
+    if (mat->matrix_type == kDense || mat->matrix_type == kSparse || mat->matrix_type == kDirectNormal) {
         calculate_target_virial_in_dense_vector(mat, pressure_constraint_rhs_vector);
     } else if (mat->matrix_type == kAccumulation) {
         calculate_target_virial_in_accumulation_vector(mat, pressure_constraint_rhs_vector);
@@ -1151,7 +1213,6 @@ void calculate_target_virial_in_dense_vector(MATRIX_DATA* const mat, double *pre
 	int frame_sample  =  mat->trajectory_block_index * mat->virial_constraint_rows;
     for (int k = 0; k < mat->virial_constraint_rows; k++) {
         mat->dense_fm_rhs_vector[mat->rows_less_constraint_rows * DIMENSION + k] = pressure_constraint_rhs_vector[(int)((frame_sample + k)/ mat->dynamic_state_samples_per_frame)];
-        frame_sample++;
     }
 }
 
@@ -1163,13 +1224,12 @@ void calculate_target_virial_in_accumulation_vector(MATRIX_DATA* const mat, doub
 	int frame_sample  =  mat->trajectory_block_index * mat->virial_constraint_rows;
     for (int k = 0; k < mat->virial_constraint_rows; k++) {
         mat->dense_fm_matrix->values[mat->fm_matrix_columns * mat->accumulation_matrix_rows + mat->rows_less_constraint_rows * DIMENSION + mat->accumulation_row_shift + k] = pressure_constraint_rhs_vector[(int)((frame_sample + k) / mat->dynamic_state_samples_per_frame)];
-    	frame_sample++;
     }
 }
 
-void add_target_force_from_trajectory(int shift_i, int site_i, MATRIX_DATA* const mat, std::array<double, DIMENSION>* const &f) 
+void add_target_force_from_trajectory(int shift_i, int site_i, MATRIX_DATA* const mat, std::array<frame_real, DIMENSION>* const &f) 
 {
-    if (mat->matrix_type == kDense || mat->matrix_type == kSparse || mat->matrix_type == kSparseNormal || mat->matrix_type == kSparseSparse) {
+    if (mat->matrix_type == kDense || mat->matrix_type == kSparse || mat->matrix_type == kSparseNormal || mat->matrix_type == kSparseSparse || mat->matrix_type == kDirectNormal) {
         calculate_target_force_dense_vector(shift_i, site_i, mat, f);
     } else if (mat->matrix_type == kAccumulation) {
         calculate_target_force_accumulation_vector(shift_i, site_i, mat, f);
@@ -1178,7 +1238,7 @@ void add_target_force_from_trajectory(int shift_i, int site_i, MATRIX_DATA* cons
 
 // Calculate the RHS vector for dense or sparse matrix calculations
 
-void calculate_target_force_dense_vector(int shift_i, int site_i, MATRIX_DATA* const mat, std::array<double, DIMENSION>* const &f)
+void calculate_target_force_dense_vector(int shift_i, int site_i, MATRIX_DATA* const mat, std::array<frame_real, DIMENSION>* const &f)
 {
     int tn = DIMENSION * (site_i + shift_i);
     double force_sq = 0.0;
@@ -1193,7 +1253,7 @@ void calculate_target_force_dense_vector(int shift_i, int site_i, MATRIX_DATA* c
 
 // Calculate the RHS vector for accumulation matrix calculations
 
-inline void calculate_target_force_accumulation_vector(int shift_i, int site_i, MATRIX_DATA* const mat, std::array<double, DIMENSION>* const &f)
+inline void calculate_target_force_accumulation_vector(int shift_i, int site_i, MATRIX_DATA* const mat, std::array<frame_real, DIMENSION>* const &f)
 {
 	mat->dense_fm_matrix->assign_vector(DIMENSION * (site_i + shift_i) + mat->accumulation_row_shift, mat->fm_matrix_columns, f[site_i]);
 }
@@ -1233,19 +1293,24 @@ void accumulate_scalar_into_dense_target_vector(MATRIX_DATA* mat, int particle_i
 // End-of-frame-block routines
 //--------------------------------------------------------------------
 
-// The dense matrix calculation uses single-frame blocks and proceeds
-// by taking the normal form of each frame's MS-CG equations and
-// adding all of those up frame by frame until the trajectory is
-// exhausted.
+// The dense matrix calculation proceeds by taking the normal form of
+// each block's MS-CG equations and adding all of those up block by 
+// block until the trajectory is exhausted. The rows of each frame in
+// a block are weighted by that frame's weight, so a whole block of 
+// frames is folded in by a single rank-k update.
 
 void convert_dense_fm_equation_to_normal_form_and_accumulate(MATRIX_DATA* const mat)
 {
-    double frame_weight = mat->get_frame_weight() * mat->normalization;
- 	create_dense_normal_form(mat, frame_weight, mat->dense_fm_matrix,mat->dense_fm_normal_matrix, mat->dense_fm_rhs_vector, mat->dense_fm_normal_rhs_vector);
+	add_weighted_dense_block_normal_form(mat, &mat->block_frame_weights[0], mat->normalization, mat->dense_fm_normal_matrix, mat->dense_fm_normal_rhs_vector, mat->dense_fm_matrix, mat->dense_fm_rhs_vector);
 }
 
 void convert_dense_fm_equation_to_normal_form_and_bootstrap(MATRIX_DATA* const mat)
 {
+	if (mat->frames_per_traj_block > 1) {
+		convert_dense_fm_block_to_normal_form_and_bootstrap(mat);
+		return;
+	}
+	
 	int onei = 1.0;
 	int matrix_size = mat->fm_matrix_columns * mat->fm_matrix_columns;
 
@@ -1278,6 +1343,29 @@ void convert_dense_fm_equation_to_normal_form_and_bootstrap(MATRIX_DATA* const m
 	delete [] temp_normal_rhs_vector;
 }
 
+// For blocks of several frames, each bootstrapping estimate weights the frames of the block
+// differently, so each estimate takes its own rank-k update of a copy of the block with its
+// rows weighted by that estimate's frame weights.
+
+void convert_dense_fm_block_to_normal_form_and_bootstrap(MATRIX_DATA* const mat)
+{
+	int first_frame_index = mat->trajectory_block_index * mat->frames_per_traj_block;
+	std::vector<double> estimate_frame_weights(mat->frames_per_traj_block);
+	
+	for (int i = 0; i < mat->bootstrapping_num_estimates; i++) {
+		
+		// Frames that were not processed have no rows, so their bootstrapping weight does not matter.
+		for (int f = 0; f < mat->frames_per_traj_block; f++) {
+			if (mat->block_frame_weights[f] == 0.0) estimate_frame_weights[f] = 0.0;
+			else estimate_frame_weights[f] = mat->bootstrapping_weights[i][first_frame_index + f];
+		}
+		add_weighted_dense_block_normal_form(mat, &estimate_frame_weights[0], mat->bootstrapping_normalization[i], mat->bootstrapping_dense_fm_normal_matrices[i], mat->bootstrapping_dense_fm_normal_rhs_vectors[i], mat->dense_fm_scaled_matrix, mat->dense_fm_scaled_rhs_vector);
+	}
+	
+	// The main normal equations are done last since their row weighting is done in place.
+	add_weighted_dense_block_normal_form(mat, &mat->block_frame_weights[0], mat->normalization, mat->dense_fm_normal_matrix, mat->dense_fm_normal_rhs_vector, mat->dense_fm_matrix, mat->dense_fm_rhs_vector);
+}
+
 // As above, but ignoring the FM matrix.
 // Used for Lanyuan's iterative method, in which only the FM target vector is recalculated.
 
@@ -1285,9 +1373,23 @@ void convert_dense_target_force_vector_to_normal_form_and_accumulate(MATRIX_DATA
 {
     int onei = 1;
     double oned = 1.0;
-    double frame_weight = mat->get_frame_weight();
+    double frame_weight;
 
-    // Take normal form of the current frame's target vector and add to the existing normal form target vector.
+	// Weight the target vector frame by frame unless all frames of the block have the same weight.
+	if (dense_block_frame_weights_are_uniform(mat, &mat->block_frame_weights[0])) {
+		frame_weight = mat->block_frame_weights[0];
+	} else {
+		int frame_rows = mat->rows_less_constraint_rows * DIMENSION / mat->frames_per_traj_block;
+		for (int f = 0; f < mat->frames_per_traj_block; f++) {
+			for (int k = f * frame_rows; k < (f + 1) * frame_rows; k++) mat->dense_fm_rhs_vector[k] *= mat->block_frame_weights[f];
+		}
+		for (int k = 0; k < mat->virial_constraint_rows; k++) {
+			mat->dense_fm_rhs_vector[mat->rows_less_constraint_rows * DIMENSION + k] *= mat->block_frame_weights[k];
+		}
+		frame_weight = 1.0;
+	}
+	
+    // Take normal form of the current block's target vector and add to the existing normal form target vector.
     cblas_dgemv(CblasColMajor, CblasTrans, mat->fm_matrix_rows, mat->fm_matrix_columns, frame_weight, mat->dense_fm_matrix->values, mat->fm_matrix_rows, mat->dense_fm_rhs_vector, onei, oned, mat->dense_fm_normal_rhs_vector, onei);
 }
 
@@ -1403,11 +1505,11 @@ void convert_sparse_fm_equation_to_sparse_normal_form_and_accumulate(MATRIX_DATA
     // Calculate the weight of this part of the normal equations in the overall equations
 	double frame_weight = mat->get_frame_weight() * mat->normalization;
 
-    // Convert from linked list format to CSR format
+    // Convert from sparse block format to CSR format
     // Note: These MKL functions use a one-based index for row_sizes and column_indices
     int n_nonzero_matrix_elements = get_n_nonzero_matrix_elements(mat);
     csr_matrix csr_fm_matrix(mat->fm_matrix_rows, mat->fm_matrix_columns, n_nonzero_matrix_elements);
-    convert_linked_list_to_csr_matrix(mat, csr_fm_matrix);
+    convert_sparse_block_to_csr_matrix(mat, csr_fm_matrix);
 	
    // Convert CSR matrix and dense RHS vector to normal-form    
    // Form sparse normal-form left-hand side matrix using mkl_dcsrmultcsr
@@ -1435,15 +1537,13 @@ void convert_sparse_fm_equation_to_sparse_normal_form_and_accumulate(MATRIX_DATA
 
    // Accumulate normal form matrix with previous/future normal form matrices
    // Frame weight is applied to normal matrix in this step
-   sparse_matrix_addition(mat, frame_weight, nnzmax, csr_normal_matrix, mat->sparse_matrix);
+   sparse_matrix_addition(mat, frame_weight, csr_normal_matrix, mat->sparse_matrix);
 
-   #if _mkl_flag == 1
    int onei = 1;	
    // Accumulate normal form right-hand size vector with previous/future vectors
    // Frame weight is applied to normal vector in this step
    cblas_daxpy(mat->fm_matrix_columns, frame_weight,
 		dense_rhs_normal_vector, onei, mat->dense_fm_normal_rhs_vector, onei);
-   #endif
 		
    // CSR formatted FM and normal temp matrices are freed by destructor at end of function
    // Free the intermediate normal form matrix and vector
@@ -1453,11 +1553,11 @@ void convert_sparse_fm_equation_to_sparse_normal_form_and_accumulate(MATRIX_DATA
 void convert_sparse_fm_equation_to_sparse_normal_form_and_bootstrap(MATRIX_DATA* const mat)
 {
 	double frame_weight = 1.0;
-    // Convert from linked list format to CSR format
+    // Convert from sparse block format to CSR format
     // Note: These MKL functions use a one-based index for row_sizes and column_indices
     int n_nonzero_matrix_elements = get_n_nonzero_matrix_elements(mat);
     csr_matrix csr_fm_matrix(mat->fm_matrix_rows, mat->fm_matrix_columns, n_nonzero_matrix_elements);
-    convert_linked_list_to_csr_matrix(mat, csr_fm_matrix);
+    convert_sparse_block_to_csr_matrix(mat, csr_fm_matrix);
    
    // Convert CSR matrix and dense RHS vector to normal-form    
    // Form sparse normal-form left-hand side matrix using mkl_dcsrmultcsr
@@ -1495,7 +1595,7 @@ void convert_sparse_fm_equation_to_sparse_normal_form_and_bootstrap(MATRIX_DATA*
    if (frame_weight != 0.0) {
 	   // Accumulate normal form matrix with previous/future normal form matrices
    	   // Frame weight is applied to normal matrix in this step
-	   sparse_matrix_addition(mat, frame_weight, nnzmax, csr_normal_matrix, mat->sparse_matrix);
+	   sparse_matrix_addition(mat, frame_weight, csr_normal_matrix, mat->sparse_matrix);
 
        // Accumulate normal form right-hand size vector with previous/future vectors
        // Frame weight is applied to normal vector in this step
@@ -1511,7 +1611,7 @@ void convert_sparse_fm_equation_to_sparse_normal_form_and_bootstrap(MATRIX_DATA*
 	   
 	   // Accumulate normal form matrix with previous/future normal form matrices
    	   // Frame weight is applied to normal matrix in this step
-	   sparse_matrix_addition(mat, frame_weight, nnzmax, csr_normal_matrix, mat->bootstrapping_sparse_fm_normal_matrices[i]);
+	   sparse_matrix_addition(mat, frame_weight, csr_normal_matrix, mat->bootstrapping_sparse_fm_normal_matrices[i]);
 
        // Accumulate normal form right-hand size vector with previous/future vectors
        // Frame weight is applied to normal vector in this step
@@ -1532,11 +1632,11 @@ void convert_sparse_fm_equation_to_dense_normal_form_and_accumulate(MATRIX_DATA*
     // Calculate the weight of this part of the normal equations in the overall equations
     double frame_weight = mat->get_frame_weight() * mat->normalization; 
 
-   // Convert from linked list format to CSR format
+   // Convert from sparse block format to CSR format
    // Note: These MKL functions use a one-based index for row_sizes and column_indices
    int n_nonzero_matrix_elements = get_n_nonzero_matrix_elements(mat);
    csr_matrix csr_fm_matrix(mat->fm_matrix_rows, mat->fm_matrix_columns, n_nonzero_matrix_elements);
-   convert_linked_list_to_csr_matrix(mat, csr_fm_matrix);
+   convert_sparse_block_to_csr_matrix(mat, csr_fm_matrix);
    
    // Convert CSR matrix and dense RHS vector to normal-form    
    // Form sparse normal-form left-hand side matrix using mkl_dcsrmultcsr
@@ -1555,12 +1655,14 @@ void convert_sparse_fm_equation_to_dense_normal_form_and_accumulate(MATRIX_DATA*
    mkl_dcsrgemv(&trans, &(mat->fm_matrix_rows), csr_fm_matrix.values, 
 		csr_fm_matrix.row_sizes, csr_fm_matrix.column_indices,
    		mat->dense_fm_rhs_vector, dense_rhs_normal_vector);
+   #else
+   csr_transpose_times_vector(mat->fm_matrix_rows, mat->fm_matrix_columns, csr_fm_matrix, mat->dense_fm_rhs_vector, dense_rhs_normal_vector);
+   #endif
 
    // Accumulate normal form right-hand size vector with previous/future vectors
    // Frame weight is applied to normal vector in this step  
    cblas_daxpy( mat->fm_matrix_columns, frame_weight,
 		dense_rhs_normal_vector, 1, mat->dense_fm_normal_rhs_vector, 1);
-   #endif
    
 	// Free the intermediate normal form vector
 	delete [] dense_rhs_normal_vector;
@@ -1578,12 +1680,14 @@ void convert_sparse_fm_equation_to_dense_normal_form_and_accumulate(MATRIX_DATA*
 	    csr_fm_matrix.values, csr_fm_matrix.column_indices, csr_fm_matrix.row_sizes, 
    		csr_fm_matrix.values, csr_fm_matrix.column_indices, csr_fm_matrix.row_sizes, 
    	    normal_matrix, &(mat->fm_matrix_columns) );
+	  #else
+	  csr_transpose_times_csr_dense(mat->fm_matrix_rows, mat->fm_matrix_columns, csr_fm_matrix, normal_matrix);
+	  #endif
 	  
 	  // Accumulate normal form matrix with previous/future normal form matrices
 	  // This operation also applies the frame weight
 	  cblas_daxpy( mat->fm_matrix_columns * mat->fm_matrix_columns, frame_weight,
 	  	normal_matrix, 1, mat->dense_fm_normal_matrix->values, 1);
-	  #endif
 	    
 	  // Free the temp normal matrix
 	  delete [] normal_matrix;
@@ -1604,6 +1708,8 @@ void convert_sparse_fm_equation_to_dense_normal_form_and_accumulate(MATRIX_DATA*
    		printf("Error: Value returned from mkl_dcsrmultcsr is %d!\n", info);
    		exit(EXIT_FAILURE);
       }
+	  #else
+	  csr_transpose_times_csr(mat->fm_matrix_rows, mat->fm_matrix_columns, csr_fm_matrix, csr_normal_matrix);
 	  #endif
 	
 	  // Accumulate normal form matrix with previous/future normal form matrices
@@ -1611,7 +1717,7 @@ void convert_sparse_fm_equation_to_dense_normal_form_and_accumulate(MATRIX_DATA*
 	  // but for now it is being done manually.
 	  for( k = 0; k < mat->fm_matrix_columns; k++) { // k is actually rows of normal matrix is this context
 		for( l = csr_normal_matrix.row_sizes[k] - 1; l < csr_normal_matrix.row_sizes[k+1] - 1; l++) {
-			mat->dense_fm_normal_matrix->values[ k * mat->fm_matrix_columns + csr_normal_matrix.column_indices[l] ] += csr_normal_matrix.values[l] * frame_weight;
+			mat->dense_fm_normal_matrix->values[ k * mat->fm_matrix_columns + csr_normal_matrix.column_indices[l] - 1 ] += csr_normal_matrix.values[l] * frame_weight;
 		}
 	  } 
       // CSR formatted FM and normal temp matrices are freed by destructor at end of function
@@ -1626,11 +1732,11 @@ void convert_sparse_fm_equation_to_dense_normal_form_and_bootstrap(MATRIX_DATA*
    int num_elements = mat->fm_matrix_columns * mat->fm_matrix_columns;
    int onei=1;
 	
-   // Convert from linked list format to CSR format
+   // Convert from sparse block format to CSR format
    // Note: These MKL functions use a one-based index for row_sizes and column_indices
    int n_nonzero_matrix_elements = get_n_nonzero_matrix_elements(mat);
    csr_matrix csr_fm_matrix(mat->fm_matrix_rows, mat->fm_matrix_columns, n_nonzero_matrix_elements);
-   convert_linked_list_to_csr_matrix(mat, csr_fm_matrix);
+   convert_sparse_block_to_csr_matrix(mat, csr_fm_matrix);
    
    // Convert CSR matrix and dense RHS vector to normal-form    
    // Form sparse normal-form left-hand side matrix using mkl_dcsrmultcsr
@@ -1649,7 +1755,9 @@ void convert_sparse_fm_equation_to_dense_normal_form_and_bootstrap(MATRIX_DATA*
    mkl_dcsrgemv(&trans, &(mat->fm_matrix_rows), csr_fm_matrix.values, 
 		csr_fm_matrix.row_sizes, csr_fm_matrix.column_indices,
    		mat->dense_fm_rhs_vector, dense_rhs_normal_vector);
-	#endif
+   #else
+   csr_transpose_times_vector(mat->fm_matrix_rows, mat->fm_matrix_columns, csr_fm_matrix, mat->dense_fm_rhs_vector, dense_rhs_normal_vector);
+   #endif
    
    // Accumulate for master.
    frame_weight = mat->get_frame_weight() * mat->normalization; 
@@ -1679,6 +1787,8 @@ void convert_sparse_fm_equation_to_dense_normal_form_and_bootstrap(MATRIX_DATA*
 	    csr_fm_matrix.values, csr_fm_matrix.column_indices, csr_fm_matrix.row_sizes, 
    		csr_fm_matrix.values, csr_fm_matrix.column_indices, csr_fm_matrix.row_sizes, 
    	    normal_matrix, &(mat->fm_matrix_columns) );
+	  #else
+	  csr_transpose_times_csr_dense(mat->fm_matrix_rows, mat->fm_matrix_columns, csr_fm_matrix, normal_matrix);
 	  #endif
 	  
 	  // Accumulate for master.
@@ -1714,13 +1824,15 @@ void convert_sparse_fm_equation_to_dense_normal_form_and_bootstrap(MATRIX_DATA*
    		printf("Error: Value returned from mkl_dcsrmultcsr is %d!\n", info);
    		exit(EXIT_FAILURE);
       }
+	  #else
+	  csr_transpose_times_csr(mat->fm_matrix_rows, mat->fm_matrix_columns, csr_fm_matrix, csr_normal_matrix);
 	  #endif
 	
 	  // Accumulate for master.
 	  frame_weight = mat->get_frame_weight() * mat->normalization; 
 	  for( k = 0; k < mat->fm_matrix_columns; k++) { // k is actually rows of normal matrix is this context
 		for( l = csr_normal_matrix.row_sizes[k] - 1; l < csr_normal_matrix.row_sizes[k+1] - 1; l++) {
-			mat->dense_fm_normal_matrix->values[ k * mat->fm_matrix_columns + csr_normal_matrix.column_indices[l] ] += csr_normal_matrix.values[l] * frame_weight;
+			mat->dense_fm_normal_matrix->values[ k * mat->fm_matrix_columns + csr_normal_matrix.column_indices[l] - 1 ] += csr_normal_matrix.values[l] * frame_weight;
 		}
 	  } 
       
@@ -1734,7 +1846,7 @@ void convert_sparse_fm_equation_to_dense_normal_form_and_bootstrap(MATRIX_DATA*
 
 	    for( k = 0; k < mat->fm_matrix_columns; k++) { // k is actually rows of normal matrix is this context
 			for( l = csr_normal_matrix.row_sizes[k] - 1; l < csr_normal_matrix.row_sizes[k+1] - 1; l++) {
-				mat->bootstrapping_dense_fm_normal_matrices[i]->values[ k * mat->fm_matrix_columns + csr_normal_matrix.column_indices[l] ] += csr_normal_matrix.values[l] * frame_weight;
+				mat->bootstrapping_dense_fm_normal_matrices[i]->values[ k * mat->fm_matrix_columns + csr_normal_matrix.column_indices[l] - 1 ] += csr_normal_matrix.values[l] * frame_weight;
 			}
 	  	}
 	  } 
@@ -1742,19 +1854,46 @@ void convert_sparse_fm_equation_to_dense_normal_form_and_bootstrap(MATRIX_DATA*
   	 }
 }
 
+// Add the normal form of the current block's sparse rows directly to the normal equations.
+
+void accumulate_direct_normal_form(MATRIX_DATA* const mat)
+{
+	add_direct_block_normal_form(mat, &mat->block_frame_weights[0], mat->normalization, mat->dense_fm_normal_matrix, mat->dense_fm_normal_rhs_vector);
+	mat->sparse_fm_block->clear();
+}
+
+void accumulate_direct_normal_form_and_bootstrap(MATRIX_DATA* const mat)
+{
+	int first_frame_index = mat->trajectory_block_index * mat->frames_per_traj_block;
+	std::vector<double> estimate_frame_weights(mat->frames_per_traj_block);
+	
+	add_direct_block_normal_form(mat, &mat->block_frame_weights[0], mat->normalization, mat->dense_fm_normal_matrix, mat->dense_fm_normal_rhs_vector);
+	for (int i = 0; i < mat->bootstrapping_num_estimates; i++) {
+		
+		// Frames that were not processed have no rows, so their bootstrapping weight does not matter.
+		for (int f = 0; f < mat->frames_per_traj_block; f++) {
+			if (mat->block_frame_weights[f] == 0.0) estimate_frame_weights[f] = 0.0;
+			else estimate_frame_weights[f] = mat->bootstrapping_weights[i][first_frame_index + f];
+		}
+		add_direct_block_normal_form(mat, &estimate_frame_weights[0], mat->bootstrapping_normalization[i], mat->bootstrapping_dense_fm_normal_matrices[i], mat->bootstrapping_dense_fm_normal_rhs_vectors[i]);
+	}
+	mat->sparse_fm_block->clear();
+}
+
 void do_nothing_to_fm_matrix(MATRIX_DATA* const mat) {}
 
 // Helper routines for sparse matrix operations.
 
-// This function determines the number of non-zero matrix elements by walking the linked-list matrix and dense virial constraint data
+// This function determines the number of non-zero matrix elements by merging the sparse block matrix and counting the dense virial constraint data
 
 int get_n_nonzero_matrix_elements(MATRIX_DATA* const mat)
 {
 	int n_nonzero_matrix_elements = 0;	
 	
     // Begin by calculating the total number of non-zero elements in this block
+    mat->sparse_fm_block->merge_rows();
     for (int k = 0; k < mat->rows_less_constraint_rows; k++) {
-        n_nonzero_matrix_elements += mat->ll_sparse_matrix_row_heads[k].n;
+        n_nonzero_matrix_elements += mat->sparse_fm_block->row_sizes[k];
     }
     n_nonzero_matrix_elements *= DIMENSION;
     if (mat->virial_constraint_rows > 0) {
@@ -1768,47 +1907,92 @@ int get_n_nonzero_matrix_elements(MATRIX_DATA* const mat)
    printf("Rectangular FM matrix has %d non-zero elements. The sparsity is %.2lf percent.\n", n_nonzero_matrix_elements, 100.0 * (1.0 - ((double) n_nonzero_matrix_elements / (double) (mat->fm_matrix_columns * mat->fm_matrix_rows))) );    
    return n_nonzero_matrix_elements;
 }
+
+// Group the elements of a sparse block by row using a counting sort, which keeps elements
+// of the same row in the order they were added, then sort each row by column and sum
+// elements sharing a column. The sums are therefore taken in the same order as if
+// they had been accumulated element by element.
+
+void sparse_block_builder::merge_rows(void)
+{
+	if (merged_flag == 1) return;
+	
+	// Count the elements in each row and find where each row starts.
+	std::fill(row_starts.begin(), row_starts.end(), 0);
+	for (size_t e = 0; e < elements.size(); e++) row_starts[elements[e].row + 1]++;
+	for (int k = 0; k < n_rows; k++) row_starts[k + 1] += row_starts[k];
+	
+	// Bucket the elements by row.
+	row_elements.resize(elements.size());
+	for (int k = 0; k < n_rows; k++) row_sizes[k] = row_starts[k];
+	for (size_t e = 0; e < elements.size(); e++) row_elements[row_sizes[elements[e].row]++] = elements[e];
+	
+	// Sort each row by column and merge repeated columns.
+	for (int k = 0; k < n_rows; k++) {
+		sparse_block_element* row = row_elements.data() + row_starts[k];
+		int num_in_row = row_starts[k + 1] - row_starts[k];
+		if (num_in_row < 32) {
+			// Insertion sort is stable and fastest for short rows.
+			for (int a = 1; a < num_in_row; a++) {
+				sparse_block_element element = row[a];
+				int b = a;
+				while (b > 0 && row[b - 1].col > element.col) {
+					row[b] = row[b - 1];
+					b--;
+				}
+				row[b] = element;
+			}
+		} else {
+			std::stable_sort(row, row + num_in_row, [](const sparse_block_element &a, const sparse_block_element &b) { return a.col < b.col; });
+		}
+		
+		int num_merged = 0;
+		for (int a = 0; a < num_in_row; a++) {
+			if (num_merged > 0 && row[num_merged - 1].col == row[a].col) {
+				for (int i = 0; i < DIMENSION; i++) row[num_merged - 1].valx[i] += row[a].valx[i];
+			} else {
+				row[num_merged] = row[a];
+				num_merged++;
+			}
+		}
+		row_sizes[k] = num_merged;
+	}
+	merged_flag = 1;
+}
  
-// Helper function to convert the sparse matrix accumulated as a linked list to CSR format
-void convert_linked_list_to_csr_matrix(MATRIX_DATA* const mat, csr_matrix& csr_fm_matrix)
+// Helper function to convert the sparse block matrix to CSR format
+void convert_sparse_block_to_csr_matrix(MATRIX_DATA* const mat, csr_matrix& csr_fm_matrix)
 {   
-   int row_counter, row_size, num_in_row, rowD;
-   struct linked_list_sparse_matrix_element* curr_elem, *prev_elem;
+   int row_size, num_in_row, rowD;
+   int row_counter;
    double value;
-   	
+   sparse_block_builder* const sparse_fm_block = mat->sparse_fm_block;
+   
+   sparse_fm_block->merge_rows();
    for (int k = 0; k < mat->rows_less_constraint_rows; k++) {
-        curr_elem = mat->ll_sparse_matrix_row_heads[k].h;
-        row_counter = 0;
-        while (curr_elem != NULL) {
-            row_size = csr_fm_matrix.row_sizes[DIMENSION * k];
-            num_in_row = mat->ll_sparse_matrix_row_heads[k].n;
-
+        sparse_block_element* row = sparse_fm_block->row_elements.data() + sparse_fm_block->row_starts[k];
+        row_size = csr_fm_matrix.row_sizes[DIMENSION * k];
+        num_in_row = sparse_fm_block->row_sizes[k];
+        for (row_counter = 0; row_counter < num_in_row; row_counter++) {
             for (int i = 0; i < DIMENSION; i++) {
 	            // add to element values list (adjust for built-in one-base added in row_size[0] above
-	            csr_fm_matrix.values[row_size + i * num_in_row + row_counter - 1] = curr_elem->valx[i];
+	            csr_fm_matrix.values[row_size + i * num_in_row + row_counter - 1] = row[row_counter].valx[i];
     	
     	        // add to column indices list
-        	    csr_fm_matrix.column_indices[row_size + i * num_in_row + row_counter - 1] = curr_elem->col + 1;					// convert to one-base for columns
+        	    csr_fm_matrix.column_indices[row_size + i * num_in_row + row_counter - 1] = row[row_counter].col + 1;					// convert to one-base for columns
 			}
-			
-            //move on and delete previous element
-            prev_elem = curr_elem;
-            curr_elem = prev_elem->next;
-            delete prev_elem;
-            row_counter++;
         }
         // add to row size list
         rowD =  DIMENSION * k;
         // Note: one-base in taken into account at element 0, so no further modification is needed for rows
         
         for (int i = 0; i < DIMENSION; i++) {
-	        csr_fm_matrix.row_sizes[rowD + 1 + i] = csr_fm_matrix.row_sizes[rowD + i] + row_counter;		
+	        csr_fm_matrix.row_sizes[rowD + 1 + i] = csr_fm_matrix.row_sizes[rowD + i] + num_in_row;		
 		}
-				
-		// reset row head information
-		mat->ll_sparse_matrix_row_heads[k].h = NULL;
-        mat->ll_sparse_matrix_row_heads[k].n = 0;
 	}
+	
+	// reset the block for the next frames
+	sparse_fm_block->clear();
 
     if (mat->virial_constraint_rows > 0) {
         row_counter = csr_fm_matrix.row_sizes[mat->rows_less_constraint_rows * DIMENSION] - 1; // remove one-base for processing
@@ -1870,11 +2054,9 @@ void regularize_sparse_matrix(MATRIX_DATA* const mat)
    }
    csr_regularization_matrix.row_sizes[mat->fm_matrix_columns] = mat->fm_matrix_columns + 1;
         
-   // Add diagonal regularization matrix to current normal matrix using extra normal matrix as intermediate
-   // Resulting matrix will have at most the sum of each matrix's number of non-zero elements
-   int nnzmax = mat->sparse_matrix->row_sizes[mat->fm_matrix_columns] + mat->fm_matrix_columns;
+   // Add diagonal regularization matrix to current normal matrix
    double beta = 1.0;	// no scaling of either matrix is needed
-   sparse_matrix_addition(mat, beta, nnzmax, csr_regularization_matrix, mat->sparse_matrix);
+   sparse_matrix_addition(mat, beta, csr_regularization_matrix, mat->sparse_matrix);
    // temp regularization matrix is automatically deleted at end of function
 }
 
@@ -1888,21 +2070,23 @@ void regularize_vector_sparse_matrix(MATRIX_DATA* const mat, double* regularizat
    }
    csr_regularization_matrix.row_sizes[mat->fm_matrix_columns] = mat->fm_matrix_columns + 1;
         
-   // Add diagonal regularization matrix to current normal matrix using extra normal matrix as intermediate
-   // Resulting matrix will have at most the sum of each matrix's number of non-zero elements
-   int nnzmax = mat->sparse_matrix->row_sizes[mat->fm_matrix_columns] + mat->fm_matrix_columns;
+   // Add diagonal regularization matrix to current normal matrix
    double beta = 1.0;	// no scaling of either matrix is needed
-   sparse_matrix_addition(mat, beta, nnzmax, csr_regularization_matrix, mat->sparse_matrix);
+   sparse_matrix_addition(mat, beta, csr_regularization_matrix, mat->sparse_matrix);
    // temp regularization matrix is automatically deleted at end of function
 }
  
-void sparse_matrix_addition(MATRIX_DATA* const mat, double frame_weight, int nnzmax, csr_matrix& csr_normal_matrix, csr_matrix* main_normal_matrix)
+void sparse_matrix_addition(MATRIX_DATA* const mat, double frame_weight, csr_matrix& csr_normal_matrix, csr_matrix* main_normal_matrix)
 {
+   #if _mkl_flag == 1
+   // The sum has at most the combined number of non-zero elements of both matrices; 
+   // it is formed in an extra matrix that then replaces the accumulated one.
+   // A freshly allocated matrix has a final row size of zero, so empty matrices are clamped.
+   int nnzmax = std::max(main_normal_matrix->row_sizes[mat->fm_matrix_columns] - 1, 0) + std::max(csr_normal_matrix.row_sizes[mat->fm_matrix_columns] - 1, 0);
    double* extra_csr_normal_matrix_values = new double[nnzmax]();
    int* extra_csr_normal_matrix_column_indices = new int[nnzmax]();
    int* extra_csr_normal_matrix_row_sizes = new int[mat->fm_matrix_columns + 1]();
 
-   #if _mkl_flag == 1
    char trans='n';
    int request=0;
    int sort=0;
@@ -1916,11 +2100,13 @@ void sparse_matrix_addition(MATRIX_DATA* const mat, double frame_weight, int nnz
    		printf("Error: Value returned from mkl_dcsradd is %d!\n", info);
    		exit(EXIT_FAILURE);
    	}
-	#endif
 	
    	// Switch accumulated normal matrix with extra (temp array)
 	main_normal_matrix->set_csr_matrix(mat->fm_matrix_columns, mat->fm_matrix_columns, nnzmax, 
 						 extra_csr_normal_matrix_values, extra_csr_normal_matrix_column_indices, extra_csr_normal_matrix_row_sizes);
+	#else
+	csr_matrix_addition(mat->fm_matrix_columns, mat->fm_matrix_columns, frame_weight, csr_normal_matrix, main_normal_matrix);
+	#endif
 }
 
 // Helper function to perform regularization
@@ -1936,11 +2122,9 @@ void regularize_sparse_matrix(MATRIX_DATA* const mat, csr_matrix* csr_normal_mat
    }
    csr_regularization_matrix.row_sizes[mat->fm_matrix_columns] = mat->fm_matrix_columns + 1;
         
-   // Add diagonal regularization matrix to current normal matrix using extra normal matrix as intermediate
-   // Resulting matrix will have at most the sum of each matrix's number of non-zero elements
-   int nnzmax = csr_normal_matrix->row_sizes[mat->fm_matrix_columns] + mat->fm_matrix_columns;
+   // Add diagonal regularization matrix to current normal matrix
    double beta = 1.0;	// no scaling of either matrix is needed
-   sparse_matrix_addition(mat, beta, nnzmax, csr_regularization_matrix, csr_normal_matrix);
+   sparse_matrix_addition(mat, beta, csr_regularization_matrix, csr_normal_matrix);
    // temp regularization matrix is automatically deleted at end of function
 }
 
@@ -1954,14 +2138,296 @@ void regularize_vector_sparse_matrix(MATRIX_DATA* const mat, csr_matrix* csr_nor
    }
    csr_regularization_matrix.row_sizes[mat->fm_matrix_columns] = mat->fm_matrix_columns + 1;
         
-   // Add diagonal regularization matrix to current normal matrix using extra normal matrix as intermediate
-   // Resulting matrix will have at most the sum of each matrix's number of non-zero elements
-   int nnzmax = csr_normal_matrix->row_sizes[mat->fm_matrix_columns] + mat->fm_matrix_columns;
+   // Add diagonal regularization matrix to current normal matrix
    double beta = 1.0;	// no scaling of either matrix is needed
-   sparse_matrix_addition(mat, beta, nnzmax, csr_regularization_matrix, csr_normal_matrix);
+   sparse_matrix_addition(mat, beta, csr_regularization_matrix, csr_normal_matrix);
    // temp regularization matrix is automatically deleted at end of function
 }
  
+//-------------------------------------------------------------
+// Native CSR routines for builds without MKL
+//-------------------------------------------------------------
+
+// These stand in for the MKL sparse BLAS and PARDISO calls above and below.
+// As with MKL, row_sizes and column_indices are one-based and the column indices
+// within each row are kept in ascending order.
+
+#if _mkl_flag == 0
+
+// Form the n_cols x n_cols normal matrix A^T A of an n_rows x n_cols CSR matrix.
+// The result replaces the contents of csr_product and is sized exactly.
+
+void csr_transpose_times_csr(const int n_rows, const int n_cols, const csr_matrix& csr_in, csr_matrix& csr_product)
+{
+	int nnz = csr_in.row_sizes[n_rows] - 1;
+	
+	// Transpose the input by a counting sort on its columns so that 
+	// the rows contributing to each column can be visited directly.
+	std::vector<int> transpose_starts(n_cols + 1, 0);
+	std::vector<int> transpose_rows(nnz);
+	std::vector<double> transpose_values(nnz);
+	for (int l = 0; l < nnz; l++) transpose_starts[csr_in.column_indices[l]]++;
+	for (int k = 0; k < n_cols; k++) transpose_starts[k + 1] += transpose_starts[k];
+	std::vector<int> next_position(transpose_starts.begin(), transpose_starts.end() - 1);
+	for (int i = 0; i < n_rows; i++) {
+		for (int l = csr_in.row_sizes[i] - 1; l < csr_in.row_sizes[i + 1] - 1; l++) {
+			int position = next_position[csr_in.column_indices[l] - 1]++;
+			transpose_rows[position] = i;
+			transpose_values[position] = csr_in.values[l];
+		}
+	}
+	
+	// Count the non-zero elements in each row of the product.
+	std::vector<int> row_marker(n_cols, -1);
+	int* product_row_sizes = new int[n_cols + 1];
+	product_row_sizes[0] = 1;
+	for (int k = 0; k < n_cols; k++) {
+		int row_count = 0;
+		for (int t = transpose_starts[k]; t < transpose_starts[k + 1]; t++) {
+			int i = transpose_rows[t];
+			for (int l = csr_in.row_sizes[i] - 1; l < csr_in.row_sizes[i + 1] - 1; l++) {
+				int col = csr_in.column_indices[l] - 1;
+				if (row_marker[col] != k) {
+					row_marker[col] = k;
+					row_count++;
+				}
+			}
+		}
+		product_row_sizes[k + 1] = product_row_sizes[k] + row_count;
+	}
+	
+	// Accumulate each row of the product in a dense work vector and gather it in column order.
+	int product_nnz = product_row_sizes[n_cols] - 1;
+	double* product_values = new double[product_nnz];
+	int* product_column_indices = new int[product_nnz];
+	std::vector<double> row_values(n_cols, 0.0);
+	std::fill(row_marker.begin(), row_marker.end(), -1);
+	for (int k = 0; k < n_cols; k++) {
+		int* row_columns = product_column_indices + product_row_sizes[k] - 1;
+		int row_count = 0;
+		for (int t = transpose_starts[k]; t < transpose_starts[k + 1]; t++) {
+			int i = transpose_rows[t];
+			double a_ik = transpose_values[t];
+			for (int l = csr_in.row_sizes[i] - 1; l < csr_in.row_sizes[i + 1] - 1; l++) {
+				int col = csr_in.column_indices[l] - 1;
+				if (row_marker[col] != k) {
+					row_marker[col] = k;
+					row_columns[row_count++] = col;
+					row_values[col] = a_ik * csr_in.values[l];
+				} else {
+					row_values[col] += a_ik * csr_in.values[l];
+				}
+			}
+		}
+		std::sort(row_columns, row_columns + row_count);
+		for (int m = 0; m < row_count; m++) {
+			product_values[product_row_sizes[k] - 1 + m] = row_values[row_columns[m]];
+			row_columns[m]++;
+		}
+	}
+	
+	csr_product.set_csr_matrix(n_cols, n_cols, product_nnz, product_values, product_column_indices, product_row_sizes);
+}
+
+// Form the normal matrix A^T A of an n_rows x n_cols CSR matrix in a dense n_cols x n_cols array.
+// The product is symmetric, so the array may be read in either row or column-major order.
+
+void csr_transpose_times_csr_dense(const int n_rows, const int n_cols, const csr_matrix& csr_in, double* const dense_product)
+{
+	std::fill(dense_product, dense_product + (size_t)n_cols * (size_t)n_cols, 0.0);
+	for (int i = 0; i < n_rows; i++) {
+		for (int l = csr_in.row_sizes[i] - 1; l < csr_in.row_sizes[i + 1] - 1; l++) {
+			double* product_row = dense_product + (size_t)(csr_in.column_indices[l] - 1) * (size_t)n_cols;
+			for (int m = csr_in.row_sizes[i] - 1; m < csr_in.row_sizes[i + 1] - 1; m++) {
+				product_row[csr_in.column_indices[m] - 1] += csr_in.values[l] * csr_in.values[m];
+			}
+		}
+	}
+}
+
+// Calculate y = A^T x for an n_rows x n_cols CSR matrix; y must hold n_cols elements.
+
+void csr_transpose_times_vector(const int n_rows, const int n_cols, const csr_matrix& csr_in, const double* const x, double* const y)
+{
+	std::fill(y, y + n_cols, 0.0);
+	for (int i = 0; i < n_rows; i++) {
+		if (x[i] == 0.0) continue;
+		for (int l = csr_in.row_sizes[i] - 1; l < csr_in.row_sizes[i + 1] - 1; l++) {
+			y[csr_in.column_indices[l] - 1] += csr_in.values[l] * x[i];
+		}
+	}
+}
+
+// Calculate y = A x for a CSR matrix with n_rows rows.
+
+void csr_times_vector(const int n_rows, const csr_matrix& csr_in, const double* const x, double* const y)
+{
+	for (int i = 0; i < n_rows; i++) {
+		double sum = 0.0;
+		for (int l = csr_in.row_sizes[i] - 1; l < csr_in.row_sizes[i + 1] - 1; l++) {
+			sum += csr_in.values[l] * x[csr_in.column_indices[l] - 1];
+		}
+		y[i] = sum;
+	}
+}
+
+// Replace the n_rows x n_cols CSR matrix csr_sum with csr_sum + beta * csr_addend
+// by merging the sorted column indices of each row.
+
+void csr_matrix_addition(const int n_rows, const int n_cols, const double beta, const csr_matrix& csr_addend, csr_matrix* const csr_sum)
+{
+	// Count the non-zero elements in each row of the result.
+	// A freshly allocated matrix has row_sizes of zero after the first row, so empty ranges are clamped.
+	int* sum_row_sizes = new int[n_rows + 1];
+	sum_row_sizes[0] = 1;
+	for (int i = 0; i < n_rows; i++) {
+		int a = csr_sum->row_sizes[i] - 1, a_end = std::max(a, csr_sum->row_sizes[i + 1] - 1);
+		int b = csr_addend.row_sizes[i] - 1, b_end = std::max(b, csr_addend.row_sizes[i + 1] - 1);
+		int row_count = 0;
+		while (a < a_end && b < b_end) {
+			if (csr_sum->column_indices[a] < csr_addend.column_indices[b]) a++;
+			else if (csr_sum->column_indices[a] > csr_addend.column_indices[b]) b++;
+			else { a++; b++; }
+			row_count++;
+		}
+		row_count += (a_end - a) + (b_end - b);
+		sum_row_sizes[i + 1] = sum_row_sizes[i] + row_count;
+	}
+	
+	// Merge the rows.
+	int sum_nnz = sum_row_sizes[n_rows] - 1;
+	double* sum_values = new double[sum_nnz];
+	int* sum_column_indices = new int[sum_nnz];
+	for (int i = 0; i < n_rows; i++) {
+		int a = csr_sum->row_sizes[i] - 1, a_end = std::max(a, csr_sum->row_sizes[i + 1] - 1);
+		int b = csr_addend.row_sizes[i] - 1, b_end = std::max(b, csr_addend.row_sizes[i + 1] - 1);
+		int s = sum_row_sizes[i] - 1;
+		while (a < a_end || b < b_end) {
+			if (b == b_end || (a < a_end && csr_sum->column_indices[a] < csr_addend.column_indices[b])) {
+				sum_column_indices[s] = csr_sum->column_indices[a];
+				sum_values[s] = csr_sum->values[a];
+				a++;
+			} else if (a == a_end || csr_sum->column_indices[a] > csr_addend.column_indices[b]) {
+				sum_column_indices[s] = csr_addend.column_indices[b];
+				sum_values[s] = beta * csr_addend.values[b];
+				b++;
+			} else {
+				sum_column_indices[s] = csr_sum->column_indices[a];
+				sum_values[s] = csr_sum->values[a] + beta * csr_addend.values[b];
+				a++;
+				b++;
+			}
+			s++;
+		}
+	}
+	
+	csr_sum->set_csr_matrix(n_rows, n_cols, sum_nnz, sum_values, sum_column_indices, sum_row_sizes);
+}
+
+// Solve the sparse normal equations by the Jacobi-preconditioned conjugate gradient method.
+// precondition_sparse_matrix scales the columns of the normal matrix N by h, so the stored 
+// matrix S = N H is not symmetric. Scaling its rows by h as well gives the symmetric positive 
+// semi-definite system (H S) y = H b, which has the same solution y as S y = b.
+
+void conjugate_gradient_solve(MATRIX_DATA* const mat, csr_matrix* const sparse_matrix, double* const dense_fm_normal_rhs_vector, double* const h)
+{
+	int n = mat->fm_matrix_columns;
+	int max_iterations = mat->sparse_solver_max_iterations;
+	if (max_iterations <= 0) max_iterations = 2 * n;
+	double* solution = mat->block_fm_solution;
+	std::vector<double> residual(n), direction(n), product(n), preconditioned(n), inverse_diagonal(n);
+	
+	// Set up the Jacobi preconditioner from the diagonal of the symmetrized matrix.
+	// Basis functions with no data have an empty row and column and are left at zero.
+	for (int k = 0; k < n; k++) {
+		inverse_diagonal[k] = 0.0;
+		for (int l = sparse_matrix->row_sizes[k] - 1; l < sparse_matrix->row_sizes[k + 1] - 1; l++) {
+			if (sparse_matrix->column_indices[l] - 1 == k) {
+				double diagonal = h[k] * sparse_matrix->values[l];
+				if (diagonal > VERYSMALL) inverse_diagonal[k] = 1.0 / diagonal;
+				break;
+			}
+		}
+	}
+	
+	// Start from a zero solution.
+	double rhs_norm = 0.0;
+	for (int k = 0; k < n; k++) {
+		solution[k] = 0.0;
+		residual[k] = h[k] * dense_fm_normal_rhs_vector[k];
+		preconditioned[k] = inverse_diagonal[k] * residual[k];
+		direction[k] = preconditioned[k];
+		rhs_norm += residual[k] * residual[k];
+	}
+	rhs_norm = sqrt(rhs_norm);
+	if (rhs_norm == 0.0) {
+		printf("Right-hand side of the sparse normal equations is zero.\n");
+		return;
+	}
+	double residual_dot_preconditioned = cblas_ddot(n, &residual[0], 1, &preconditioned[0], 1);
+	double relative_residual = 1.0;
+	
+	int iteration;
+	for (iteration = 0; iteration < max_iterations; iteration++) {
+		// product = H S direction
+		#ifdef _OPENMP
+		#pragma omp parallel for schedule(static) num_threads(mat->num_sparse_threads)
+		#endif
+		for (int k = 0; k < n; k++) {
+			double sum = 0.0;
+			for (int l = sparse_matrix->row_sizes[k] - 1; l < sparse_matrix->row_sizes[k + 1] - 1; l++) {
+				sum += sparse_matrix->values[l] * direction[sparse_matrix->column_indices[l] - 1];
+			}
+			product[k] = h[k] * sum;
+		}
+		
+		double curvature = cblas_ddot(n, &direction[0], 1, &product[0], 1);
+		if (curvature <= 0.0) break;
+		double step = residual_dot_preconditioned / curvature;
+		
+		double residual_norm = 0.0;
+		for (int k = 0; k < n; k++) {
+			solution[k] += step * direction[k];
+			residual[k] -= step * product[k];
+			residual_norm += residual[k] * residual[k];
+		}
+		relative_residual = sqrt(residual_norm) / rhs_norm;
+		if (relative_residual < mat->sparse_solver_tolerance) {
+			iteration++;
+			break;
+		}
+		
+		for (int k = 0; k < n; k++) preconditioned[k] = inverse_diagonal[k] * residual[k];
+		double next_residual_dot_preconditioned = cblas_ddot(n, &residual[0], 1, &preconditioned[0], 1);
+		double beta = next_residual_dot_preconditioned / residual_dot_preconditioned;
+		residual_dot_preconditioned = next_residual_dot_preconditioned;
+		for (int k = 0; k < n; k++) direction[k] = preconditioned[k] + beta * direction[k];
+	}
+	
+	printf("Conjugate gradient solve finished after %d iterations with relative residual %le.\n", iteration, relative_residual);
+	if (relative_residual >= mat->sparse_solver_tolerance) {
+		printf("Warning: Conjugate gradient solve did not reach sparse_solver_tolerance (%le).\n", mat->sparse_solver_tolerance);
+		printf("Consider increasing sparse_solver_max_iterations or using regularization.\n");
+	}
+}
+
+#endif
+
+// Solve the preconditioned sparse normal equations with PARDISO when 
+// compiled with MKL and with the conjugate gradient method otherwise.
+// The solution is written to mat->block_fm_solution.
+
+void solve_sparse_normal_equations(MATRIX_DATA* const mat, csr_matrix* const sparse_matrix, double* const dense_fm_normal_rhs_vector)
+{
+	#if _mkl_flag == 1
+	pardiso_solve(mat, sparse_matrix, dense_fm_normal_rhs_vector);
+	#else
+	printf("Solving sparse normal matrix using preconditioned conjugate gradient.\n");
+	fflush(stdout);
+	conjugate_gradient_solve(mat, sparse_matrix, dense_fm_normal_rhs_vector, mat->h);
+	#endif
+}
+
 // Wrapper function for PARDISO sparse matrix solver
 
 void pardiso_solve(MATRIX_DATA* const mat, csr_matrix* const sparse_matrix, double* const dense_fm_normal_rhs_vector)
@@ -2038,11 +2504,11 @@ void pardiso_solve(MATRIX_DATA* const mat, csr_matrix* const sparse_matrix, doub
 
 void solve_this_sparse_matrix(MATRIX_DATA* const mat)
 {
-    // Convert from linked list format to CSR format
+    // Convert from sparse block format to CSR format
     // Note: These MKL functions use a one-based index for row_sizes and column_indices
     int n_nonzero_matrix_elements = get_n_nonzero_matrix_elements(mat);
 	csr_matrix csr_fm_matrix(mat->fm_matrix_rows, mat->fm_matrix_columns, n_nonzero_matrix_elements);
-    convert_linked_list_to_csr_matrix(mat, csr_fm_matrix);
+    convert_sparse_block_to_csr_matrix(mat, csr_fm_matrix);
 	
    // Convert CSR matrix and dense RHS vector to normal-form    
    // Form sparse normal-form left-hand side matrix using mkl_dcsrmultcsr
@@ -2066,6 +2532,8 @@ void solve_this_sparse_matrix(MATRIX_DATA* const mat)
    		printf("Error: Value returned from mkl_dcsrmultcsr is %d!\n", info);
    		exit(EXIT_FAILURE);
    	}
+	#else
+	csr_transpose_times_csr(mat->fm_matrix_rows, mat->fm_matrix_columns, csr_fm_matrix, *(mat->sparse_matrix));
 	#endif
    	
    	printf("Actual number of non-zero normal form matrix entries is %d.\n This is a density of %.2lf percent.\n", mat->sparse_matrix->row_sizes[mat->fm_matrix_columns] - 1, 100.0 * (double) (mat->sparse_matrix->row_sizes[mat->fm_matrix_columns] - 1)/ (double) nnzmax);
@@ -2078,6 +2546,8 @@ void solve_this_sparse_matrix(MATRIX_DATA* const mat)
    mkl_dcsrgemv(&trans, &(mat->fm_matrix_rows), csr_fm_matrix.values, 
 		csr_fm_matrix.row_sizes, csr_fm_matrix.column_indices,
    		mat->dense_fm_rhs_vector, mat->dense_fm_normal_rhs_vector);
+   #else
+   csr_transpose_times_vector(mat->fm_matrix_rows, mat->fm_matrix_columns, csr_fm_matrix, mat->dense_fm_rhs_vector, mat->dense_fm_normal_rhs_vector);
    #endif
    	
    // Apply vector regularization if requested by user.
@@ -2098,13 +2568,15 @@ void solve_this_sparse_matrix(MATRIX_DATA* const mat)
     	regularize_sparse_matrix(mat);
     }
   
-    // Solve the normal equations using PARDISO
-	pardiso_solve(mat, mat->sparse_matrix, mat->dense_fm_normal_rhs_vector);
+    // Solve the normal equations using PARDISO (or conjugate gradient without MKL)
+	solve_sparse_normal_equations(mat, mat->sparse_matrix, mat->dense_fm_normal_rhs_vector);
 	   
    // CSR formatted FM temp matrix is freed by destructor at end of function
    // Free the CSR formatting normal matrix and rhs vector
    delete mat->sparse_matrix;
    mat->sparse_matrix = NULL;
+   delete [] mat->dense_fm_normal_rhs_vector;
+   mat->dense_fm_normal_rhs_vector = NULL;
 }
 
 inline void create_sparse_normal_form_matrix(MATRIX_DATA* const mat, const int nnzmax, csr_matrix& csr_fm_matrix, csr_matrix& csr_normal_matrix, double* const dense_fm_rhs_vector, double* const dense_rhs_normal_vector)
@@ -2129,6 +2601,8 @@ inline void create_sparse_normal_form_matrix(MATRIX_DATA* const mat, const int n
    		printf("Error: Value returned from mkl_dcsrmultcsr is %d!\n", info);
    		exit(EXIT_FAILURE);
    	}
+	#else
+	csr_transpose_times_csr(mat->fm_matrix_rows, mat->fm_matrix_columns, csr_fm_matrix, csr_normal_matrix);
 	#endif
     printf("Actual number of non-zero normal form matrix entries is %d.\n This is a density of %.2lf percent.\n", csr_normal_matrix.row_sizes[mat->fm_matrix_columns] - 1, 100.0 * (double) (csr_normal_matrix.row_sizes[mat->fm_matrix_columns] - 1)/ (double) nnzmax);
 
@@ -2137,6 +2611,8 @@ inline void create_sparse_normal_form_matrix(MATRIX_DATA* const mat, const int n
    mkl_dcsrgemv(&trans, &(mat->fm_matrix_rows), csr_fm_matrix.values, 
 		csr_fm_matrix.row_sizes, csr_fm_matrix.column_indices,
    		dense_fm_rhs_vector, dense_rhs_normal_vector);
+   #else
+   csr_transpose_times_vector(mat->fm_matrix_rows, mat->fm_matrix_columns, csr_fm_matrix, dense_fm_rhs_vector, dense_rhs_normal_vector);
    #endif  
 }
 
@@ -2155,6 +2631,105 @@ inline void create_dense_normal_form(MATRIX_DATA* const mat, const double frame_
 	cblas_dgemv(CblasColMajor, CblasTrans, mat->fm_matrix_rows, mat->fm_matrix_columns, frame_weight, dense_fm_matrix->values, mat->fm_matrix_rows, dense_fm_rhs_vector, 1, 1.0, dense_fm_normal_rhs_vector, 1);
 }
 
+// Check whether every frame of the current block has the same weight.
+
+inline bool dense_block_frame_weights_are_uniform(MATRIX_DATA* const mat, const double* const frame_weights)
+{
+	for (int f = 1; f < mat->frames_per_traj_block; f++) {
+		if (frame_weights[f] != frame_weights[0]) return false;
+	}
+	return true;
+}
+
+// Add the normal form of the current block's equations to a normal matrix and target vector,
+// weighting the rows of each frame by scale times that frame's weight.
+// If all frames have the same weight, this is one update with that weight. Otherwise, the rows of 
+// the block are copied to scaled_fm_matrix and scaled_fm_rhs_vector multiplied by the square root 
+// of their weights first; these may be the blockwise matrix and vector themselves to scale them in place.
+
+void add_weighted_dense_block_normal_form(MATRIX_DATA* const mat, const double* const frame_weights, const double scale, dense_matrix* const normal_matrix, double* const normal_rhs_vector, dense_matrix* const scaled_fm_matrix, double* const scaled_fm_rhs_vector)
+{
+	if (dense_block_frame_weights_are_uniform(mat, frame_weights)) {
+		if (frame_weights[0] != 0.0) create_dense_normal_form(mat, scale * frame_weights[0], mat->dense_fm_matrix, normal_matrix, mat->dense_fm_rhs_vector, normal_rhs_vector);
+		return;
+	}
+	
+	// Find the weight of each row: the force rows of each frame, then one virial row per frame if present.
+	int frame_rows = mat->rows_less_constraint_rows * DIMENSION / mat->frames_per_traj_block;
+	std::vector<double> row_scales(mat->fm_matrix_rows);
+	for (int f = 0; f < mat->frames_per_traj_block; f++) {
+		if (frame_weights[f] < 0.0) {
+			printf("Frame weight %lf is negative; cannot weight the rows of a block of %d frames.\n", frame_weights[f], mat->frames_per_traj_block);
+			printf("Please change the block size to 1 and recheck your inputs before rerunning.\n");
+			exit(EXIT_FAILURE);
+		}
+		double row_scale = sqrt(frame_weights[f]);
+		for (int k = f * frame_rows; k < (f + 1) * frame_rows; k++) row_scales[k] = row_scale;
+	}
+	for (int k = 0; k < mat->virial_constraint_rows; k++) {
+		row_scales[mat->rows_less_constraint_rows * DIMENSION + k] = sqrt(frame_weights[k]);
+	}
+	
+	for (int j = 0; j < mat->fm_matrix_columns; j++) {
+		double* column = mat->dense_fm_matrix->values + (size_t)(j) * mat->fm_matrix_rows;
+		double* scaled_column = scaled_fm_matrix->values + (size_t)(j) * mat->fm_matrix_rows;
+		for (int k = 0; k < mat->fm_matrix_rows; k++) scaled_column[k] = column[k] * row_scales[k];
+	}
+	for (int k = 0; k < mat->fm_matrix_rows; k++) scaled_fm_rhs_vector[k] = mat->dense_fm_rhs_vector[k] * row_scales[k];
+	
+	create_dense_normal_form(mat, scale, scaled_fm_matrix, normal_matrix, scaled_fm_rhs_vector, normal_rhs_vector);
+}
+
+// Add the normal form of the current block's sparse rows and virial rows to the upper triangle 
+// of a normal matrix and to a normal target vector, weighting the rows of each frame by 
+// scale times that frame's weight. Each merged row only touches the columns it contains, 
+// so the cost is quadratic in the number of nonzeros per row rather than in the number of columns.
+
+void add_direct_block_normal_form(MATRIX_DATA* const mat, const double* const frame_weights, const double scale, dense_matrix* const normal_matrix, double* const normal_rhs_vector)
+{
+	sparse_block_builder* const sparse_fm_block = mat->sparse_fm_block;
+	int n_cols = mat->fm_matrix_columns;
+	int frame_sites = mat->rows_less_constraint_rows / mat->frames_per_traj_block;
+	
+	sparse_fm_block->merge_rows();
+	for (int k = 0; k < mat->rows_less_constraint_rows; k++) {
+		double row_weight = scale * frame_weights[k / frame_sites];
+		int num_in_row = sparse_fm_block->row_sizes[k];
+		if (row_weight == 0.0 || num_in_row == 0) continue;
+		
+		// Columns are sorted within each row, so every pair (b, a) with b <= a lies in the upper triangle.
+		sparse_block_element* row = sparse_fm_block->row_elements.data() + sparse_fm_block->row_starts[k];
+		double* target = mat->dense_fm_rhs_vector + DIMENSION * k;
+		for (int a = 0; a < num_in_row; a++) {
+			double* normal_column = normal_matrix->values + (size_t)(row[a].col) * n_cols;
+			double rhs_product = 0.0;
+			for (int i = 0; i < DIMENSION; i++) rhs_product += row[a].valx[i] * target[i];
+			normal_rhs_vector[row[a].col] += row_weight * rhs_product;
+			
+			for (int b = 0; b <= a; b++) {
+				double product = 0.0;
+				for (int i = 0; i < DIMENSION; i++) product += row[a].valx[i] * row[b].valx[i];
+				normal_column[row[b].col] += row_weight * product;
+			}
+		}
+	}
+	
+	// The virial rows are dense with one row per frame.
+	for (int k = 0; k < mat->virial_constraint_rows; k++) {
+		double row_weight = scale * frame_weights[k];
+		if (row_weight == 0.0) continue;
+		double target = mat->dense_fm_rhs_vector[mat->rows_less_constraint_rows * DIMENSION + k];
+		for (int l = 0; l < n_cols; l++) {
+			double value = mat->dense_fm_matrix->values[l * mat->virial_constraint_rows + k];
+			if (value == 0.0) continue;
+			normal_rhs_vector[l] += row_weight * value * target;
+			for (int m = 0; m <= l; m++) {
+				normal_matrix->values[(size_t)(l) * n_cols + m] += row_weight * value * mat->dense_fm_matrix->values[m * mat->virial_constraint_rows + k];
+			}
+		}
+	}
+}
+
 // Calculate the residual for a dense matrix.
 inline double calculate_dense_residual(MATRIX_DATA* const mat, dense_matrix* const dense_fm_normal_matrix, double* const dense_fm_normal_rhs_vector, std::vector<double> &fm_solution, double normalization)
 {
@@ -2220,6 +2795,8 @@ inline double calculate_sparse_residual(MATRIX_DATA* const mat, csr_matrix* csr_
    mkl_dcsrgemv(&none, &mat->fm_matrix_columns, csr_normal_matrix->values, 
 		csr_normal_matrix->row_sizes, csr_normal_matrix->column_indices,
    		solution, intermediate);
+   #else
+   csr_times_vector(mat->fm_matrix_columns, *csr_normal_matrix, solution, intermediate);
    #endif  
 	
 	normal_matrix = cblas_ddot(mat->fm_matrix_columns, intermediate, onei, solution, onei);
@@ -2288,6 +2865,8 @@ inline double calculate_sparse_residual(MATRIX_DATA* const mat, csr_matrix* csr_
    mkl_dcsrgemv(&none, &mat->fm_matrix_columns, csr_normal_matrix->values, 
 		csr_normal_matrix->row_sizes, csr_normal_matrix->column_indices,
    		solution, intermediate);
+   #else
+   csr_times_vector(mat->fm_matrix_columns, *csr_normal_matrix, solution, intermediate);
    #endif  
 	
 	normal_matrix = cblas_ddot(mat->fm_matrix_columns, intermediate, onei, solution, onei);
@@ -2414,7 +2993,7 @@ void average_sparse_block_fm_solutions(MATRIX_DATA* const mat)
     if (mat->output_style >= 2) {
         FILE* mat_out;
         double inv_norm = 1.0/mat->normalization;
-        mat_out = open_file("result.out", "wb");
+        mat_out = open_file(mat->binary_output_filename.c_str(), "wb");
         fwrite(&mat->fm_solution[0], sizeof(double), mat->fm_matrix_columns, mat_out);
         fwrite(&mat->fm_solution_normalization_factors[0], sizeof(double), mat->fm_matrix_columns, mat_out);
         fwrite(&mat->force_sq_total, sizeof(double), 1, mat_out);
@@ -2438,7 +3017,7 @@ void average_sparse_bootstrapping_solutions(MATRIX_DATA* const mat)
     // Write a binary output of the coefficient vector if desired
     if (mat->output_style >= 2) {
         FILE* mat_out;
-        mat_out = open_file("result.out", "wb");
+        mat_out = open_file(mat->binary_output_filename.c_str(), "wb");
         for (int i = 0; i < mat->bootstrapping_num_estimates; i++) {
 	        fwrite(&mat->bootstrap_solutions[i][0], sizeof(double), mat->fm_matrix_columns, mat_out);
     	    fwrite(&mat->fm_solution_normalization_factors[0], sizeof(double), mat->fm_matrix_columns, mat_out);
@@ -2478,7 +3057,7 @@ void solve_sparse_fm_normal_equations(MATRIX_DATA* const mat)
 {
    // Back up RHS.
    double* backup_rhs = new double[mat->fm_matrix_columns];
-   int matrix_size = mat->sparse_matrix->row_sizes[mat->fm_matrix_columns];
+   int matrix_size = mat->sparse_matrix->row_sizes[mat->fm_matrix_columns] - 1;
    csr_matrix* backup_normal_matrix = new csr_matrix(mat->fm_matrix_columns, mat->fm_matrix_columns, matrix_size);
    for (int i = 0; i < mat->fm_matrix_columns; i++) {
      backup_rhs[i] = mat->dense_fm_normal_rhs_vector[i];
@@ -2498,7 +3077,7 @@ void solve_sparse_fm_normal_equations(MATRIX_DATA* const mat)
         fprintf(csr_out, "%lf\n", 1.0/mat->normalization);
 		fclose(csr_out);
 	
-		FILE* mat_out = open_file("result.out", "wb");
+		FILE* mat_out = open_file(mat->binary_output_filename.c_str(), "wb");
 		int counter = 0;
 		int low, high;
 		double zero = 0.0;
@@ -2552,11 +3131,11 @@ void solve_sparse_fm_normal_equations(MATRIX_DATA* const mat)
     	regularize_sparse_matrix(mat);
     }
   
-    // Solve the normal equations using PARDISO
+    // Solve the normal equations using PARDISO (or conjugate gradient without MKL)
 	printf("Computing solution of FM normal equations using sparse matrix operations.\n");
 	mat->block_fm_solution = &(mat->fm_solution[0]);
-	pardiso_solve(mat, mat->sparse_matrix, mat->dense_fm_normal_rhs_vector);
-    printf("Finished PARDISO solve.\n");
+	solve_sparse_normal_equations(mat, mat->sparse_matrix, mat->dense_fm_normal_rhs_vector);
+    printf("Finished sparse solve.\n");
 	
    // Remove preconditioning effect from solution
    for (int k = 0; k < mat->fm_matrix_columns; k++) {
@@ -2596,17 +3175,17 @@ void solve_sparse_fm_normal_equations(MATRIX_DATA* const mat)
 			alpha_vec[i] = alpha;
 		}
 				
-		FILE* alpha_fp = fopen("alpha.out", "w");
-		FILE* beta_fp  = fopen("beta.out",  "w");
-		FILE* sol_fp   = fopen("solution.out", "w");
-		FILE* res_fp   = fopen("residual.out", "w");
-		FILE* ext_fp   = fopen("ext_residual.out", "w");
+		FILE* alpha_fp = fopen(output_file_name("alpha.out").c_str(), "w");
+		FILE* beta_fp  = fopen(output_file_name("beta.out").c_str(),  "w");
+		FILE* sol_fp   = fopen(output_file_name("solution.out").c_str(), "w");
+		FILE* res_fp   = fopen(output_file_name("residual.out").c_str(), "w");
+		FILE* ext_fp   = fopen(output_file_name("ext_residual.out").c_str(), "w");
 		write_iteration(alpha_vec, beta, mat->fm_solution, residual, iteration, alpha_fp, beta_fp, sol_fp, res_fp);
 		FILE* mat_fp;
 		FILE* inv_fp;
 		if (mat->bayesian_flag == 2) {
-			mat_fp   = fopen("matrix.out", "w");
-			inv_fp   = fopen("inverse.out", "w");
+			mat_fp   = fopen(output_file_name("matrix.out").c_str(), "w");
+			inv_fp   = fopen(output_file_name("inverse.out").c_str(), "w");
 			backup_normal_matrix->print_matrix(mat_fp);
 		}
 		for (int i = 0; i < mat->fm_matrix_columns; i++) {
@@ -2642,8 +3221,8 @@ void solve_sparse_fm_normal_equations(MATRIX_DATA* const mat)
 			// // Then, apply preconditioning
 			precondition_sparse_matrix(mat->fm_matrix_columns, mat->h, mat->sparse_matrix);
 
-    		// Solve the normal equations using PARDISO
-			pardiso_solve(mat, mat->sparse_matrix, mat->dense_fm_normal_rhs_vector);
+    		// Solve the normal equations using PARDISO (or conjugate gradient without MKL)
+			solve_sparse_normal_equations(mat, mat->sparse_matrix, mat->dense_fm_normal_rhs_vector);
     
    			// Remove preconditioning effect from solution
    			for (int k = 0; k < mat->fm_matrix_columns; k++) {
@@ -2766,18 +3345,14 @@ void solve_sparse_fm_bootstrapping_equations(MATRIX_DATA* const mat)
     	 regularize_sparse_matrix(mat, mat->bootstrapping_sparse_fm_normal_matrices[i]);
        }
   
-      // Solve the normal equations using PARDISO
+      // Solve the normal equations using PARDISO (or conjugate gradient without MKL)
 	   printf("Computing solution of FM normal equations using sparse matrix operations.\n");
 
 	   mat->block_fm_solution = &(mat->bootstrap_solutions[i][0]);
 
-	   pardiso_solve(mat, mat->bootstrapping_sparse_fm_normal_matrices[i], mat->bootstrapping_dense_fm_normal_rhs_vectors[i]);
-       printf("Finished PARDISO solve.\n");
+	   solve_sparse_normal_equations(mat, mat->bootstrapping_sparse_fm_normal_matrices[i], mat->bootstrapping_dense_fm_normal_rhs_vectors[i]);
+       printf("Finished sparse solve.\n");
 	
-       // Free the CSR formatted normal matrix
-       delete mat->bootstrapping_sparse_fm_normal_matrices[i];
-       delete [] mat->bootstrapping_dense_fm_normal_rhs_vectors[i];
-       
       // Remove preconditioning effect from solution
       for (int k = 0; k < mat->fm_matrix_columns; k++) {
          mat->bootstrap_solutions[i][k] *= mat->h[k];
@@ -2787,6 +3362,10 @@ void solve_sparse_fm_bootstrapping_equations(MATRIX_DATA* const mat)
          double residual = calculate_sparse_residual(mat, mat->bootstrapping_sparse_fm_normal_matrices[i], mat->bootstrapping_dense_fm_normal_rhs_vectors[i], mat->bootstrap_solutions[i], mat->normalization);
          printf("estimate %d: residual %lf\n", i, residual);
       }
+      
+       // Free the CSR formatted normal matrix
+       delete mat->bootstrapping_sparse_fm_normal_matrices[i];
+       delete [] mat->bootstrapping_dense_fm_normal_rhs_vectors[i];
    }
    delete [] mat->h;
    delete [] mat->bootstrapping_sparse_fm_normal_matrices;
@@ -2843,7 +3422,7 @@ void solve_dense_fm_normal_equations(MATRIX_DATA* const mat)
     } else {
         // Save the results in binary form for parallel runs.
         if (mat->output_style >= 2) {
-            FILE* mat_out = open_file("result.out", "wb");
+            FILE* mat_out = open_file(mat->binary_output_filename.c_str(), "wb");
             for (i = 0; i < mat->fm_matrix_columns; i++) {
                 fwrite(&mat->dense_fm_normal_matrix->values[i * mat->fm_matrix_columns], sizeof(double), i + 1, mat_out);
             }
@@ -2949,17 +3528,17 @@ void solve_dense_fm_normal_equations(MATRIX_DATA* const mat)
 			alpha_vec[i] = alpha;
 		}
 				
-		FILE* alpha_fp = fopen("alpha.out", "w");
-		FILE* beta_fp  = fopen("beta.out",  "w");
-		FILE* sol_fp   = fopen("solution.out", "w");
-		FILE* res_fp   = fopen("residual.out", "w");
-		FILE* ext_fp   = fopen("ext_residual.out", "w");
+		FILE* alpha_fp = fopen(output_file_name("alpha.out").c_str(), "w");
+		FILE* beta_fp  = fopen(output_file_name("beta.out").c_str(),  "w");
+		FILE* sol_fp   = fopen(output_file_name("solution.out").c_str(), "w");
+		FILE* res_fp   = fopen(output_file_name("residual.out").c_str(), "w");
+		FILE* ext_fp   = fopen(output_file_name("ext_residual.out").c_str(), "w");
 		write_iteration(alpha_vec, beta, mat->fm_solution, residual, iteration, alpha_fp, beta_fp, sol_fp, res_fp);
 		FILE* mat_fp;
 		FILE* inv_fp;
 		if (mat->bayesian_flag == 2) {
-			mat_fp   = fopen("matrix.out", "w");
-			inv_fp   = fopen("inverse.out", "w");
+			mat_fp   = fopen(output_file_name("matrix.out").c_str(), "w");
+			inv_fp   = fopen(output_file_name("inverse.out").c_str(), "w");
 		}
 			
 		while (iteration < mat->bayesian_max_iter) {
@@ -3102,14 +3681,17 @@ void solve_dense_fm_normal_equations(MATRIX_DATA* const mat)
  	delete backup_normal_matrix;
  	delete mat->dense_fm_normal_matrix;
     delete [] backup_rhs;
- 	if(mat->matrix_type == 3) delete [] mat->dense_fm_normal_rhs_vector;
+ 	if(mat->matrix_type == 3) {
+ 		delete [] mat->dense_fm_normal_rhs_vector;
+ 		mat->dense_fm_normal_rhs_vector = NULL;
+ 	}
 }
   
 void solve_this_BI_equation(MATRIX_DATA* const mat, int &solution_counter)
 {
   // Output BI matrix and vector before solving.
-  FILE* BI_matrix = fopen("BI_matrix.dat","a");
-  FILE* BI_vector = fopen("BI_vector.dat","a");
+  FILE* BI_matrix = fopen(output_file_name("BI_matrix.dat").c_str(),"a");
+  FILE* BI_vector = fopen(output_file_name("BI_vector.dat").c_str(),"a");
   mat->dense_fm_matrix->print_matrix(BI_matrix);
   for(int i = 0; i < mat->fm_matrix_rows;i++)  {
       fprintf(BI_vector,"%lf\n",mat->dense_fm_rhs_vector[i]);
@@ -3187,7 +3769,7 @@ void solve_dense_fm_normal_bootstrapping_equations(MATRIX_DATA* const mat)
     
         // Save the results in binary form for parallel runs.
         if (mat->output_style >= 2) {
-            FILE* mat_out = open_file("result.out", "wb");
+            FILE* mat_out = open_file(mat->binary_output_filename.c_str(), "wb");
             for (int j = 0; j < mat->bootstrapping_num_estimates; j++) {
             	for (int i = 0; i < mat->fm_matrix_columns; i++) {
                 	fwrite(&mat->bootstrapping_dense_fm_normal_matrices[j]->values[i * mat->fm_matrix_columns], sizeof(double), i + 1, mat_out);
@@ -3515,7 +4097,7 @@ void solve_accumulation_form_bootstrapping_equations(MATRIX_DATA* const mat)
 void read_binary_matrix(MATRIX_DATA* const mat)
 {
     switch (mat->matrix_type) {
-    case kDense: case kSparseNormal:
+    case kDense: case kSparseNormal: case kDirectNormal:
         read_binary_dense_fm_matrix(mat);
         break;
     case kSparse: case kSparseSparse:
@@ -3556,14 +4138,19 @@ int read_res_av_file(std::string* &filenames)
 
 void read_binary_dense_fm_matrix(MATRIX_DATA* const mat)
 {
-    double matrix_element;
-    double inv_norm_sum = 0.0;
-    double inv_norm;
-
 	// Read the number of files to combine in this batch
     // and the file names for each.
     std::string* filenames;
     int n_batch = read_res_av_file(filenames);
+    combine_binary_dense_fm_matrices(mat, n_batch, filenames);
+    delete [] filenames;
+}
+
+void combine_binary_dense_fm_matrices(MATRIX_DATA* const mat, const int n_batch, const std::string* const filenames)
+{
+    double matrix_element;
+    double inv_norm_sum = 0.0;
+    double inv_norm;
 
     // Read each file's dense matrix, adding them together element-by-
     // element to get a final set of normal form equations.
@@ -3613,7 +4200,6 @@ void read_binary_dense_fm_matrix(MATRIX_DATA* const mat)
         }
         fclose(single_binary_matrix_input);
     }
-    delete [] filenames;
     delete [] read_rhs;
     delete read_matrix;
      
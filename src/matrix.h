@@ -29,21 +29,56 @@ void solve_this_BI_equation(MATRIX_DATA* const mat, int &solution_counter);
 // Matrix-equation-related type definitions
 //-------------------------------------------------------------
 
-enum MatrixType {kDense = 0, kSparse = 1, kAccumulation = 2, kSparseNormal = 3, kSparseSparse = 4, kDummy = -1};
+enum MatrixType {kDense = 0, kSparse = 1, kAccumulation = 2, kSparseNormal = 3, kSparseSparse = 4, kDirectNormal = 5, kDummy = -1};
 
-// Linked-list-based sparse row matrix element struct. x,y,z components are stored together.
+// Sparse row matrix element struct for building one block of the FM matrix. x,y,z components are stored together.
 
-struct linked_list_sparse_matrix_element { 
+struct sparse_block_element { 
+    int row;                                        // Row (site) number
     int col;                                        // Column number
-    double valx[DIMENSION];                                 // x,y,z components
-    struct linked_list_sparse_matrix_element* next; // Pointer to the next element in the linked list
+    double valx[DIMENSION];                         // x,y,z components
 };
 
-// Linked-list-based sparse row matrix row head struct, one linked list for each row.
+// Arena-based sparse row matrix for one block of frames. Elements are appended as they are found
+// and are only grouped by row, sorted by column, and summed once at the end of the block.
 
-struct linked_list_sparse_matrix_row_head { 
-    int n;                                          // Total number of nonzero elements in this row
-    struct linked_list_sparse_matrix_element* h;    // Link to first nonzero element in the row
+struct sparse_block_builder {
+    int n_rows;
+    int merged_flag;                                        // 1 if row_elements holds the merged form of elements; 0 otherwise
+    std::vector<sparse_block_element> elements;             // All elements added in this block in the order they were added
+    std::vector<sparse_block_element> row_elements;         // Merged elements grouped by row and sorted by column within each row
+    std::vector<int> row_starts;                            // Index of the first element of each row in row_elements
+    std::vector<int> row_sizes;                             // Total number of nonzero elements in each row after merging
+
+    inline sparse_block_builder(const int new_n_rows) :
+        n_rows(new_n_rows), merged_flag(0), row_starts(new_n_rows + 1), row_sizes(new_n_rows) {
+    }
+    
+    inline void add_element(const int i, const int j, double* const x) {
+        sparse_block_element element;
+        element.row = i;
+        element.col = j;
+        for (int k = 0; k < DIMENSION; k++) element.valx[k] = x[k];
+        elements.push_back(element);
+        merged_flag = 0;
+    }
+    
+    // Move all elements of another block (e.g. a thread-private one) to the end of this one.
+    inline void append_elements(sparse_block_builder* const other) {
+        elements.insert(elements.end(), other->elements.begin(), other->elements.end());
+        other->elements.clear();
+        merged_flag = 0;
+    }
+    
+    // Group elements by row and sum those sharing a column in the order they were added.
+    void merge_rows(void);
+    
+    // Empty the block while keeping its memory for the next block.
+    inline void clear(void) {
+        elements.clear();
+        row_elements.clear();
+        merged_flag = 0;
+    }
 };
 
 // CSR sparse matrix struct w/ constructor & destructor.
@@ -94,11 +129,11 @@ struct csr_matrix {
 
 	inline void write_file(FILE* fh) const {
 		fprintf(fh, "%d %d %d\n", n_rows, n_cols, max_entries);
-		for (int i = 0; i < row_sizes[n_rows]; i++) {
+		for (int i = 0; i < row_sizes[n_rows] - 1; i++) {
 			fprintf(fh, "%lf ", values[i]);
 		}
 		fprintf(fh, "\n");
-		for (int i = 0; i < row_sizes[n_rows]; i++) {
+		for (int i = 0; i < row_sizes[n_rows] - 1; i++) {
 			fprintf(fh, "%d ", column_indices[i]);
 		}
 		fprintf(fh, "\n");
@@ -233,7 +268,7 @@ struct dense_matrix {
     	}
     }
 
-    void assign_vector(const int row, const int col, const std::array<double, DIMENSION> &x) {
+    void assign_vector(const int row, const int col, const std::array<frame_real, DIMENSION> &x) {
     	for(int i = 0; i < DIMENSION; i++) {
     		values[ col * n_rows + row + i] = x[i];
     	}
@@ -300,6 +335,9 @@ struct MATRIX_DATA {
 	
     // Optional extras for dense-matrix-based calculations
     double current_frame_weight;
+    std::vector<double> block_frame_weights;	// Weight of each frame of the current block, as given by get_frame_weight; 0 for frames not processed
+    dense_matrix* dense_fm_scaled_matrix;		// Row-weighted copy of the blockwise FM matrix for bootstrapping with block_size > 1
+    double* dense_fm_scaled_rhs_vector;			// Row-weighted copy of the blockwise target vector for bootstrapping with block_size > 1
     int iterative_calculation_flag;         // 0 for a non-iterative calculation; 1 to use Lanyuan's iterative force matching method
 	
 	// Optional extras for bootstrapping (dense and sparse)
@@ -317,9 +355,13 @@ struct MATRIX_DATA {
     int max_nonzero_normal_elements;                // Total number of nonzero values in the sparse normal matrix
 	int min_nonzero_normal_elements;				// Lower bound for safe size of sparse normal matrix
 	int num_sparse_threads;							// Number of threads for sparse solver
+	int num_frame_threads;							// Number of threads used to process the frames of the trajectory concurrently
+	int frame_worker_flag;							// 1 if this is a thread-private copy made by make_frame_worker_matrix; 0 otherwise
 	int itnlim;										// Maximum number of iterative refinement
+	double sparse_solver_tolerance;					// Relative residual to stop the conjugate gradient sparse solver (without MKL)
+	int sparse_solver_max_iterations;				// Maximum number of conjugate gradient iterations (without MKL); 0 for twice the number of columns
 	double sparse_safety_factor;					// % to oversize the next frame-block's normal matrix from the current one (matrix_type = 4)
-	struct linked_list_sparse_matrix_row_head* ll_sparse_matrix_row_heads;      // A linked-list-based sparse matrix
+	sparse_block_builder* sparse_fm_block;			// Arena-based sparse FM matrix for one block of frames
    	csr_matrix* sparse_matrix;						// CSR matrix "object" (matrix_type = 4)
 	double* block_fm_solution;                      // FM solutions from one single block
     double* h;                                      // Temp for preconditioning
@@ -349,6 +391,7 @@ struct MATRIX_DATA {
     
     // Output specifications for matrix-based routines
     int output_style;                       // 0 to output only tables; 2 to output tables and binary block equations; 3 to output only binary block equations
+    std::string binary_output_filename;     // File for the binary equations written if output_style >= 2 (result.out by default)
     int output_normal_equations_rhs_flag;   // 1 to output the final right hand side vector of the MS-CG normal equations as well as force tables; 0 otherwise
     int output_solution_flag;               // 0 to not output the solution vector; 1 to output the solution vector in x.out
 
@@ -356,6 +399,14 @@ struct MATRIX_DATA {
 	MATRIX_DATA(ControlInputs* const control_input, CG_MODEL_DATA *const cg);
 	
 	~MATRIX_DATA() {
+		// Thread-private copies only own their blockwise matrix and target vector.
+		if (frame_worker_flag == 1) {
+			if (matrix_type == kSparseNormal || matrix_type == kDirectNormal) {
+				delete sparse_fm_block;
+			}
+			return;
+		}
+		
 		if (bootstrapping_flag == 1) {
 			delete [] bootstrap_solutions;
     		delete [] bootstrapping_normalization;
@@ -370,20 +421,28 @@ struct MATRIX_DATA {
 		if (matrix_type == kDense) {
 			delete [] dense_fm_rhs_vector;
 			delete [] dense_fm_normal_rhs_vector;
+			if (dense_fm_scaled_matrix != NULL) {
+				delete dense_fm_scaled_matrix;
+				delete [] dense_fm_scaled_rhs_vector;
+			}
 		} else if (matrix_type == kSparse) {
-			delete [] ll_sparse_matrix_row_heads;
+			delete sparse_fm_block;
 			delete [] block_fm_solution;
 			delete [] dense_fm_rhs_vector;
 		} else if (matrix_type == kAccumulation) {
 			delete [] lapack_temp_workspace;
 			delete [] lapack_tau;
 		} else if (matrix_type == kSparseNormal) {
-			delete [] ll_sparse_matrix_row_heads;
+			delete sparse_fm_block;
 			delete [] dense_fm_rhs_vector;
 			delete [] dense_fm_normal_rhs_vector;
 		} else if (matrix_type == kSparseSparse) {
-			delete [] ll_sparse_matrix_row_heads;
+			delete sparse_fm_block;
 			delete [] dense_fm_rhs_vector;
+		} else if (matrix_type == kDirectNormal) {
+			delete sparse_fm_block;
+			delete [] dense_fm_rhs_vector;
+			delete [] dense_fm_normal_rhs_vector;
 		} else if (matrix_type == kDummy) {
 		    delete [] dense_fm_rhs_vector;
 			delete [] dense_fm_normal_rhs_vector;
@@ -417,7 +476,13 @@ struct MATRIX_DATA {
 		if (matrix_type == kDense) {
 		    delete dense_fm_matrix;
 		    dense_fm_matrix = new dense_matrix(fm_matrix_rows, fm_matrix_columns);
-		} else if ( (matrix_type == kSparse) || (matrix_type == kSparseNormal) || (matrix_type == kSparseSparse) ) {
+		    if (dense_fm_scaled_matrix != NULL) {
+		    	delete dense_fm_scaled_matrix;
+		    	delete [] dense_fm_scaled_rhs_vector;
+		    	dense_fm_scaled_matrix = new dense_matrix(fm_matrix_rows, fm_matrix_columns);
+		    	dense_fm_scaled_rhs_vector = new double[fm_matrix_rows]();
+		    }
+		} else if ( (matrix_type == kSparse) || (matrix_type == kSparseNormal) || (matrix_type == kSparseSparse) || (matrix_type == kDirectNormal) ) {
 			if (sparse_matrix != NULL) {
 				int max_entries = sparse_matrix->max_entries;
 				delete sparse_matrix;   		
@@ -448,13 +513,19 @@ inline void set_normalization(MATRIX_DATA* mat, const double new_normalization_c
 void set_bootstrapping_normalization(MATRIX_DATA* mat, double** const bootstrapping_weights, int const n_frames);
 void allocate_bootstrapping(MATRIX_DATA* mat, ControlInputs* const control_input, const int rows, const int cols);
 
+// Thread-private copies of the blockwise matrix for threaded frame processing
+
+MATRIX_DATA* make_frame_worker_matrix(MATRIX_DATA* const mat);
+
 // Target (RHS) vector calculation routines
 
 void add_target_virials_from_trajectory(MATRIX_DATA* const mat, double *pressure_constraint_rhs_vector);
-void add_target_force_from_trajectory(int shift_i, int site_i, MATRIX_DATA* const mat, std::array<double, DIMENSION>* const &f);
+void add_target_force_from_trajectory(int shift_i, int site_i, MATRIX_DATA* const mat, std::array<frame_real, DIMENSION>* const &f);
 
 // Read serialized, partially-completed post-frameblock matrix calculation intermediates
 
 void read_binary_matrix(MATRIX_DATA* const mat);
+// Sum the dense normal equations written by several runs (as listed in res_av.in for read_binary_matrix).
+void combine_binary_dense_fm_matrices(MATRIX_DATA* const mat, const int n_batch, const std::string* const filenames);
 
 #endif
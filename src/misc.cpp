@@ -22,19 +22,39 @@ const double MAX_INPUT_FORCE_VALUE = 1000.0; // Filter some noisy data
 const int MAX_CG_TYPE_NAME_LENGTH = 24; // Max length for CG type names
 const double DEGREES_PER_RADIAN = 180.0 / M_PI;
 
+// Prefix for the names of output files written by this thread.
+static thread_local std::string output_prefix;
+
 // An error-catching wrapper for fopen.
 
 FILE* open_file(const char* file_name, const char* mode)
 {
-    FILE* filepointer = fopen(file_name, mode);
+    std::string opened_name = (mode[0] == 'r') ? std::string(file_name) : output_file_name(file_name);
+    FILE* filepointer = fopen(opened_name.c_str(), mode);
     if (filepointer == NULL) {
-        fprintf(stderr, "Failed to open file %s.\n", file_name);
+        fprintf(stderr, "Failed to open file %s.\n", opened_name.c_str());
         fflush(stderr);
         exit(EXIT_FAILURE);
     }
     return filepointer;
 }
 
+std::string output_file_name(const char* file_name)
+{
+    if (file_name[0] == '/') return std::string(file_name);
+    return output_prefix + file_name;
+}
+
+ScopedOutputPrefix::ScopedOutputPrefix(const std::string &prefix) : previous_prefix_(output_prefix)
+{
+    output_prefix = prefix;
+}
+
+ScopedOutputPrefix::~ScopedOutputPrefix()
+{
+    output_prefix = previous_prefix_;
+}
+
 // Integrate function to calculate a potential from a force and distance vectors.
 
 void integrate_force(const std::vector<double> &axis_vals, const std::vector<double> &force_vals, std::vector<double> &potential_vals) 
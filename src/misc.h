@@ -11,6 +11,15 @@
 typedef float real;
 typedef real rvec[3];
 
+// Precision of the particle positions and forces stored for each frame.
+// Compile with -D_single_precision_frames=1 to store them in single precision;
+// geometry is still evaluated and accumulated in double precision.
+#if _single_precision_frames == 1
+typedef float frame_real;
+#else
+typedef double frame_real;
+#endif
+
 #include <fstream>
 #include <string>
 #include "stdio.h"
@@ -32,8 +41,21 @@ extern const double DEGREES_PER_RADIAN;
 //-------------------------------------------------------------
 
 // An error-catching wrapper for fopen.
+// Files opened for writing are named with the calling thread's output prefix (see ScopedOutputPrefix).
 FILE* open_file(const char* file_name, const char* mode);
 
+// The name an output file is written under: file_name preceded by the calling thread's output prefix,
+// unless file_name is an absolute path.
+std::string output_file_name(const char* file_name);
+
+// Set the output prefix (such as a directory name ending in '/') of the calling thread 
+// for the lifetime of this object; the previous prefix is restored afterwards. The prefix is empty by default.
+struct ScopedOutputPrefix {
+	explicit ScopedOutputPrefix(const std::string &prefix);
+	~ScopedOutputPrefix();
+	std::string previous_prefix_;
+};
+
 // An error-catching wrapper for open c++ filestreams for input
 void check_and_open_in_stream(std::ifstream &in_stream, const char* filename);
 
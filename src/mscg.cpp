@@ -31,13 +31,35 @@
 
 #include "mscg.h"
 
+#include <mutex>
+#include <string>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 // Prototype function definition for functions called internal to this file
+struct MSCG_struct;
 void finish_fix_reading(FrameSource *const frame_source);
 inline void dynamic_state_sampling_error(void);
+inline void copy_frame_vectors(FrameConfig* const frame_config, double* const x, double* const f);
+void update_cell_lists(MSCG_struct* const mscg_struct);
+void* process_fm_frame(MSCG_struct* const mscg_struct);
+void* process_range_frame(MSCG_struct* const mscg_struct);
+void* process_frame_in_place(MSCG_struct* const mscg_struct, double* const x, double* const f, void* (*process_frame)(MSCG_struct* const mscg_struct));
+void* process_frames(MSCG_struct* const mscg_struct, const int n_frames, double* const x, double* const f, double* const box_half_lengths, double* const weights, void* (*process_frame)(MSCG_struct* const mscg_struct));
+#ifdef _OPENMP
+void process_fm_frames_threaded(MSCG_struct* const mscg_struct, const int n_frames, double* const x, double* const f, double* const box_half_lengths, double* const weights);
+#endif
+void free_frame_workers(MSCG_struct* const mscg_struct);
 
 // Data structure holding all MSCG information.
 // It is passed to the driver function (LAMMPS fix) as an opaque pointer.
+// Each one holds its own model, interaction computers and matrix, so separate
+// handles can be used from separate threads at the same time.
 struct MSCG_struct {
+	std::recursive_mutex handle_mutex;	// Held during every library call on this handle so that calls from several threads take turns
+	std::string output_prefix;		// Prefix for the names of the output files written for this handle (empty by default)
 	int curr_frame;
 	int nblocks;
 	int trajectory_block_frame_index;
@@ -47,6 +69,29 @@ struct MSCG_struct {
     CG_MODEL_DATA *cg;  			// CG model parameters and data
     ControlInputs *control_input;	// Input settings read from control.in
     MATRIX_DATA *mat;				// Matrix storage structure
+    PairCellList pair_cell_list;			// Cell lists kept from frame to frame
+    ThreeBCellList three_body_cell_list;
+    int cell_list_n_sites;					// Number of sites when the cell lists were last set up (0 before the first frame)
+    real cell_list_box_half_lengths[DIMENSION];	// Box when the cell lists were last set up
+    int cell_list_version;					// Incremented each time the cell lists are set up
+    double* caller_frame_weight;			// Weight given with the current frame by mscg_process_frames; NULL if none was given
+    
+    // Thread-private matrices and computers and the per-frame data of one block used by mscg_process_frames;
+    // these are empty until frames are first processed with more than one thread.
+    std::vector<MATRIX_DATA*> thread_mats;
+    std::vector<FrameWorkerComputers*> thread_computers;
+    std::vector<FrameConfig*> batch_frame_configs;
+    std::vector<PairCellList> batch_pair_cell_lists;
+    std::vector<ThreeBCellList> batch_three_body_cell_lists;
+    std::vector<int> batch_cell_list_versions;
+};
+
+// Held for the length of a library call on a handle: it locks the handle
+// and names the output files written during the call with the handle's output prefix.
+struct HandleCall {
+	std::lock_guard<std::recursive_mutex> handle_lock;
+	ScopedOutputPrefix output_prefix;
+	explicit HandleCall(MSCG_struct* const mscg_struct) : handle_lock(mscg_struct->handle_mutex), output_prefix(mscg_struct->output_prefix) {}
 };
 
 // This function starts the MSCG process by allocating memory for the mscg_struct
@@ -77,6 +122,9 @@ void* mscg_startup_part1(void* void_in)
     
     mscg_struct->cg = new CG_MODEL_DATA(p_control_input);   // CG model parameters and data; put here to initialize without default constructor
     copy_control_inputs_to_frd(p_control_input, p_frame_source);
+    mscg_struct->cell_list_n_sites = 0;
+    mscg_struct->cell_list_version = 0;
+    mscg_struct->caller_frame_weight = NULL;
 	    
 	if (mscg_struct->control_input->dynamic_state_sampling != 0) dynamic_state_sampling_error();
 
@@ -84,6 +132,18 @@ void* mscg_startup_part1(void* void_in)
 }
     
     
+// Name the output files written for this handle with prefix, such as the name of 
+// an existing directory ending in '/', so that several handles can run in one working 
+// directory without overwriting each other's output. Input files are still read from 
+// the working directory. It should be called before mscg_startup_part2 or rangefinder_startup_part2.
+void* set_output_prefix(void* void_in, const char* prefix)
+{
+	MSCG_struct* mscg_struct = (MSCG_struct*)(void_in);
+	HandleCall handle_call(mscg_struct);
+	mscg_struct->output_prefix = std::string(prefix);
+	return (void*)(mscg_struct);
+}
+
 // This function starts the range finding utility.
 // Since this is almost identical to MSCG setup,
 // it is a thin wrapper of mscg_setup_part1
@@ -116,6 +176,7 @@ void* mscg_startup_part2(void* void_in)
 	int n_blocks = 0;
 
 	MSCG_struct* mscg_struct = (MSCG_struct*)(void_in);
+	HandleCall handle_call(mscg_struct);
 	FrameSource *p_frame_source = mscg_struct->frame_source;
     ControlInputs *p_control_input = mscg_struct->control_input;
 	CG_MODEL_DATA *p_cg = mscg_struct->cg;
@@ -195,9 +256,9 @@ void* mscg_startup_part2(void* void_in)
 	}
 	
 	printf("Check matrix type, block size, and samples per frame\n"); fflush(stdout);
-    if (mscg_struct->mat->matrix_type == kDense) {
-        n_blocks = total_frame_samples;
-        mscg_struct->mat->frames_per_traj_block = 1;
+    if (mscg_struct->mat->matrix_type == kDense || mscg_struct->mat->matrix_type == kDirectNormal) {
+    	// The frames of a dense or direct normal block are weighted separately, so the last block may be partial.
+        n_blocks = (total_frame_samples + mscg_struct->mat->frames_per_traj_block - 1) / mscg_struct->mat->frames_per_traj_block;
     } else {
 		// Check if number of frames is divisible by frames per trajectory block.
 		if (total_frame_samples % mscg_struct->mat->frames_per_traj_block != 0) {
@@ -221,7 +282,7 @@ void* mscg_startup_part2(void* void_in)
 
     // Record the dimensions of the matrix after initialization in a
     // solution file.
-    FILE* solution_file = fopen("sol_info.out", "w");
+    FILE* solution_file = fopen(output_file_name("sol_info.out").c_str(), "w");
     fprintf(solution_file, "fm_matrix_rows:%d; fm_matrix_columns:%d;\n",
             mscg_struct->mat->fm_matrix_rows, mscg_struct->mat->fm_matrix_columns);
     fclose(solution_file);
@@ -240,6 +301,7 @@ void* mscg_startup_part2(void* void_in)
 void* rangefinder_startup_part2(void* void_in)
 {
 	MSCG_struct* mscg_struct = (MSCG_struct*)(void_in);
+	HandleCall handle_call(mscg_struct);
     int total_frame_samples = mscg_struct->control_input->n_frames;
 	int n_blocks = 0;
 
@@ -275,9 +337,8 @@ void* rangefinder_startup_part2(void* void_in)
 	mscg_struct->traj_frame_num = 0;
 
 	// Check and modify matrix settings.
-    if (mscg_struct->mat->matrix_type == kDense) {
-        mscg_struct->nblocks = total_frame_samples;
-        mscg_struct->mat->frames_per_traj_block = 1;
+    if (mscg_struct->mat->matrix_type == kDense || mscg_struct->mat->matrix_type == kDirectNormal) {
+        mscg_struct->nblocks = (total_frame_samples + mscg_struct->mat->frames_per_traj_block - 1) / mscg_struct->mat->frames_per_traj_block;
     } else {
 		// Check if number of frames is divisible by frames per trajectory block.
 		if (total_frame_samples % mscg_struct->mat->frames_per_traj_block != 0) {
@@ -300,32 +361,65 @@ void* rangefinder_startup_part2(void* void_in)
 // This function should be called after mscg_setup_part2, but before
 // mscg_solve_and_output.
 void* mscg_process_frame(void* void_in, double* const x, double* const f)
-{       		
+{
+	MSCG_struct* mscg_struct = (MSCG_struct*)(void_in);
+	HandleCall handle_call(mscg_struct);
+	copy_frame_vectors(mscg_struct->frame_source->frame_config, x, f);
+	return process_fm_frame(mscg_struct);
+}
+
+// As mscg_process_frame, but the frame is processed directly from the caller's
+// x and f arrays instead of copies of them. Positions in x may be wrapped into the 
+// periodic box in place. Both arrays only need to remain valid during the call.
+void* mscg_process_frame_in_place(void* void_in, double* const x, double* const f)
+{
+	MSCG_struct* mscg_struct = (MSCG_struct*)(void_in);
+	HandleCall handle_call(mscg_struct);
+	return process_frame_in_place(mscg_struct, x, f, process_fm_frame);
+}
+
+// Process n_frames frames given in one call, as mscg_process_frame_in_place would process them one at a time.
+// The positions and forces of frame i start at x + 3 * n_cg_sites * i and f + 3 * n_cg_sites * i.
+// If box_half_lengths is not NULL, it holds 3 box half lengths for each frame;
+// otherwise the box last set by setup_frame_config or update_frame_config is used for every frame.
+// If weights is not NULL, it holds a weight for each frame that is used in place of 
+// any weights from frame_weights.in; frames with zero weight are skipped.
+// If num_frame_threads is greater than 1 in control.in, the frames of each block are processed concurrently.
+void* mscg_process_frames(void* void_in, const int n_frames, double* const x, double* const f, double* const box_half_lengths, double* const weights)
+{
 	MSCG_struct* mscg_struct = (MSCG_struct*)(void_in);
+	HandleCall handle_call(mscg_struct);
+	MATRIX_DATA* mat = mscg_struct->mat;
+	
+	if (mat->num_frame_threads > 1) {
+#ifdef _OPENMP
+		if ( ((mat->matrix_type != kDense) && (mat->matrix_type != kSparseNormal) && (mat->matrix_type != kDirectNormal)) || (mscg_struct->frame_source->dynamic_types == 1) ) {
+			printf("Threaded frame processing is only available for matrix_type 0, 3 and 5 without dynamic types. Processing frames serially.\n");
+		} else {
+			process_fm_frames_threaded(mscg_struct, n_frames, x, f, box_half_lengths, weights);
+			if ( (weights != NULL) && (mscg_struct->frame_source->use_statistical_reweighting == 0) ) mat->current_frame_weight = 1.0;
+			return (void*)(mscg_struct);
+		}
+#else
+		printf("Ignoring num_frame_threads since this library was compiled without OpenMP. Processing frames serially.\n");
+#endif
+	}
+	
+	process_frames(mscg_struct, n_frames, x, f, box_half_lengths, weights, process_fm_frame);
+	if ( (weights != NULL) && (mscg_struct->frame_source->use_statistical_reweighting == 0) ) mat->current_frame_weight = 1.0;
+	return (void*)(mscg_struct);
+}
+
+void* process_fm_frame(MSCG_struct* const mscg_struct)
+{
 	FrameSource *p_frame_source = mscg_struct->frame_source;
 	CG_MODEL_DATA *p_cg = mscg_struct->cg;
-
-	// Convert 1D x and f arrays into rvec array
 	FrameConfig* p_frame_config = p_frame_source->frame_config;
-	for(int i = 0; i < p_frame_config->current_n_sites; i++) {
-		for(int j = 0; j < 3; j++) {
-			p_frame_config->x[i][j] = x[i*3 + j];
-			p_frame_config->f[i][j] = f[i*3 + j];
-		}
-	}	
 	
-	// Initialize the cell linked lists for finding neighbors in the provided frames;
-    // NVT trajectories are assumed, so this only needs to be done once.
-    PairCellList pair_cell_list = PairCellList();
-    ThreeBCellList three_body_cell_list = ThreeBCellList();
-    pair_cell_list.init(p_cg->pair_nonbonded_interactions.cutoff, p_frame_source);
-    if (p_cg->three_body_nonbonded_interactions.class_subtype > 0) {
-        double max_cutoff = 0.0;
-        for (int i = 0; i < p_cg->three_body_nonbonded_interactions.get_n_defined(); i++) {
-            max_cutoff = fmax(max_cutoff, p_cg->three_body_nonbonded_interactions.three_body_nonbonded_cutoffs[i]);
-        }
-        three_body_cell_list.init(max_cutoff, p_frame_source);
-    }
+	// Set up the cell linked lists for finding neighbors if this is the first frame or the box has changed.
+	update_cell_lists(mscg_struct);
+	PairCellList &pair_cell_list = mscg_struct->pair_cell_list;
+	ThreeBCellList &three_body_cell_list = mscg_struct->three_body_cell_list;
 
     // The trajectory_block_frame_index is incremented for each frame-sample processed.
     // When this index reaches the block size (frames_per_traj_block),
@@ -338,16 +432,19 @@ void* mscg_process_frame(void* void_in, double* const x, double* const f)
     
     // If reweighting is being used, scale the block of the FM matrix for this frame
     // by the appropriate weighting factor
-    if (p_frame_source->use_statistical_reweighting == 1) {
+    if (mscg_struct->caller_frame_weight != NULL) {
+       mscg_struct->mat->current_frame_weight = *(mscg_struct->caller_frame_weight);
+    } else if (p_frame_source->use_statistical_reweighting == 1) {
        printf("Reweighting entries for trajectory frame %d. ", traj_frame_num);
        mscg_struct->mat->current_frame_weight = p_frame_source->frame_weights[traj_frame_num];
 	}
+	int weighted_flag = (mscg_struct->caller_frame_weight != NULL) || (p_frame_source->use_statistical_reweighting == 1);
             
     //Skip processing frame if frame weight is 0.
-    if (p_frame_source->use_statistical_reweighting && mscg_struct->mat->current_frame_weight == 0.0) {
+    if (weighted_flag && mscg_struct->mat->current_frame_weight == 0.0) {
     	traj_frame_num++;
     	if (p_frame_source->dynamic_state_sampling != 0) times_sampled = p_frame_source->dynamic_state_samples_per_frame;
-    	mscg_struct->trajectory_block_frame_index += times_sampled;
+    	trajectory_block_frame_index += times_sampled;
     	
     	if(trajectory_block_frame_index >= mscg_struct->mat->frames_per_traj_block) {
     		// Print status and do end-of-block computations before wiping the blockwise matrix and beginning anew.
@@ -397,30 +494,37 @@ void* mscg_process_frame(void* void_in, double* const x, double* const f)
 void* rangefinder_process_frame(void* void_in, double* const x, double* const f)
 {
 	MSCG_struct* mscg_struct = (MSCG_struct*)(void_in);
+	HandleCall handle_call(mscg_struct);
+	copy_frame_vectors(mscg_struct->frame_source->frame_config, x, f);
+	return process_range_frame(mscg_struct);
+}
+
+// As rangefinder_process_frame, but without copying x and f (see mscg_process_frame_in_place).
+void* rangefinder_process_frame_in_place(void* void_in, double* const x, double* const f)
+{
+	MSCG_struct* mscg_struct = (MSCG_struct*)(void_in);
+	HandleCall handle_call(mscg_struct);
+	return process_frame_in_place(mscg_struct, x, f, process_range_frame);
+}
+
+// Process several frames in one call (see mscg_process_frames); frames are always processed serially.
+void* rangefinder_process_frames(void* void_in, const int n_frames, double* const x, double* const f, double* const box_half_lengths, double* const weights)
+{
+	MSCG_struct* mscg_struct = (MSCG_struct*)(void_in);
+	HandleCall handle_call(mscg_struct);
+	return process_frames(mscg_struct, n_frames, x, f, box_half_lengths, weights, process_range_frame);
+}
+
+void* process_range_frame(MSCG_struct* const mscg_struct)
+{
 	FrameSource *p_frame_source = mscg_struct->frame_source;
 	CG_MODEL_DATA *p_cg = mscg_struct->cg;
-
-	// Convert 1D x and f arrays into rvec array
 	FrameConfig* p_frame_config = p_frame_source->frame_config;
-	for(int i = 0; i < p_frame_config->current_n_sites; i++) {
-		for(int j = 0; j < 3; j++) {
-			p_frame_config->x[i][j] = x[i*3 + j];
-			p_frame_config->f[i][j] = f[i*3 + j];
-		}
-	}	
 	
-	// Initialize the cell linked lists for finding neighbors in the provided frames;
-    // NVT trajectories are assumed, so this only needs to be done once.
-    PairCellList pair_cell_list = PairCellList();
-    ThreeBCellList three_body_cell_list = ThreeBCellList();
-    pair_cell_list.init(p_cg->pair_nonbonded_interactions.cutoff, p_frame_source);
-    if (p_cg->three_body_nonbonded_interactions.class_subtype > 0) {
-        double max_cutoff = 0.0;
-        for (int i = 0; i < p_cg->three_body_nonbonded_interactions.get_n_defined(); i++) {
-            max_cutoff = fmax(max_cutoff, p_cg->three_body_nonbonded_interactions.three_body_nonbonded_cutoffs[i]);
-        }
-        three_body_cell_list.init(max_cutoff, p_frame_source);
-    }
+	// Set up the cell linked lists for finding neighbors if this is the first frame or the box has changed.
+	update_cell_lists(mscg_struct);
+	PairCellList &pair_cell_list = mscg_struct->pair_cell_list;
+	ThreeBCellList &three_body_cell_list = mscg_struct->three_body_cell_list;
         
     // The trajectory_block_frame_index is incremented for each frame-sample processed.
     // When this index reaches the block size (frames_per_traj_block),
@@ -430,18 +534,21 @@ void* rangefinder_process_frame(void* void_in, double* const x, double* const f)
 	int trajectory_block_frame_index = mscg_struct->trajectory_block_frame_index;
 	int times_sampled = 1;
       
-  	// If reweighting is being used, scale the block of the FM matrix for this frame
+    // If reweighting is being used, scale the block of the FM matrix for this frame
     // by the appropriate weighting factor
-    if (p_frame_source->use_statistical_reweighting) {
+    if (mscg_struct->caller_frame_weight != NULL) {
+       mscg_struct->mat->current_frame_weight = *(mscg_struct->caller_frame_weight);
+    } else if (p_frame_source->use_statistical_reweighting == 1) {
        printf("Reweighting entries for trajectory frame %d. ", traj_frame_num);
        mscg_struct->mat->current_frame_weight = p_frame_source->frame_weights[traj_frame_num];
 	}
+	int weighted_flag = (mscg_struct->caller_frame_weight != NULL) || (p_frame_source->use_statistical_reweighting == 1);
             
     //Skip processing frame if frame weight is 0.
-    if (p_frame_source->use_statistical_reweighting && mscg_struct->mat->current_frame_weight == 0.0) {
+    if (weighted_flag && mscg_struct->mat->current_frame_weight == 0.0) {
     	traj_frame_num++;
     	if (p_frame_source->dynamic_state_sampling != 0) times_sampled = p_frame_source->dynamic_state_samples_per_frame;
-    	mscg_struct->trajectory_block_frame_index += times_sampled;
+    	trajectory_block_frame_index += times_sampled;
     	
     	if(trajectory_block_frame_index >= mscg_struct->mat->frames_per_traj_block) {
     		// Print status and do end-of-block computations before wiping the blockwise matrix and beginning anew.
@@ -491,6 +598,7 @@ void* rangefinder_process_frame(void* void_in, double* const x, double* const f)
 void* mscg_solve_and_output(void* void_in) 
 {
 	MSCG_struct* mscg_struct = (MSCG_struct*)(void_in);
+	HandleCall handle_call(mscg_struct);
 	FrameSource *p_frame_source = mscg_struct->frame_source;
     ControlInputs *p_control_input = mscg_struct->control_input;
     MATRIX_DATA *mat = mscg_struct->mat;
@@ -502,7 +610,14 @@ void* mscg_solve_and_output(void* void_in)
 
     // Close the trajectory and free the relevant temp variables.
     p_frame_source->cleanup(p_frame_source);
+    free_frame_workers(mscg_struct);
 
+    // Fold in the frames of a partial last block for dense and direct normal matrices.
+    if ( (mat->matrix_type == kDense || mat->matrix_type == kDirectNormal) && (mscg_struct->trajectory_block_frame_index > 0) ) {
+    	(*mat->do_end_of_frameblock_matrix_manipulations)(mat);
+    	mscg_struct->trajectory_block_frame_index = 0;
+    }
+    
     printf("Finished constructing FM equations.\n");
     if (p_frame_source->bootstrapping_flag == 1) {
 		free_bootstrapping_weights(p_frame_source);
@@ -520,7 +635,7 @@ void* mscg_solve_and_output(void* void_in)
 		if (p_frame_source->dynamic_state_sampling == 1) {
 			total_frame_samples *= p_frame_source->dynamic_state_samples_per_frame;
 		}
-		if (total_frame_samples % mscg_struct->mat->frames_per_traj_block != 0) {
+		if ( (mscg_struct->mat->matrix_type != kDense) && (mscg_struct->mat->matrix_type != kDirectNormal) && (total_frame_samples % mscg_struct->mat->frames_per_traj_block != 0) ) {
 			printf("Warning: Total number of actual frame samples %d is not divisible by block size %d.\n", total_frame_samples, mscg_struct->mat->frames_per_traj_block);
 			printf("This can cause some frames to be excluded from the calculation of interactions.\n"); 
 			fflush(stdout);
@@ -560,6 +675,7 @@ void* mscg_solve_and_output(void* void_in)
 void* rangefinder_solve_and_output(void* void_in) 
 {
 	MSCG_struct* mscg_struct = (MSCG_struct*)(void_in);
+	HandleCall handle_call(mscg_struct);
     
     // Close the trajectory and free the relevant temp variables.
     mscg_struct->frame_source->cleanup(mscg_struct->frame_source);
@@ -616,6 +732,7 @@ void* setup_frame_config(void* void_in, const int n_cg_sites, int * cg_site_type
 	assert(n_cg_sites > 0);	
 	
 	MSCG_struct* mscg_struct = (MSCG_struct*)(void_in);
+	HandleCall handle_call(mscg_struct);
 	mscg_struct->frame_source->frame_config = new FrameConfig(n_cg_sites);
 	
 	// Set number of sites types.
@@ -644,12 +761,17 @@ void* update_frame_config(void* void_in, const int n_cg_sites, int * cg_site_typ
 {
 	assert(n_cg_sites > 0);	
 	MSCG_struct* mscg_struct = (MSCG_struct*)(void_in);
+	HandleCall handle_call(mscg_struct);
 	FrameConfig* p_frame_config = mscg_struct->frame_source->frame_config;
 	
 	// Resize frame config and the arrays only if the number of sites has changed.
 	if(p_frame_config->current_n_sites != n_cg_sites) {
 		delete p_frame_config;
 		p_frame_config = new FrameConfig(n_cg_sites);
+		mscg_struct->frame_source->frame_config = p_frame_config;
+		
+		// Threaded frame processing will set itself up again for the new number of sites.
+		free_frame_workers(mscg_struct);
 		
 		// Also, update other copies of n_cg_sites.
 		mscg_struct->cg->topo_data.n_cg_sites = n_cg_sites;
@@ -672,6 +794,250 @@ void* update_frame_config(void* void_in, const int n_cg_sites, int * cg_site_typ
 	return (void*)(mscg_struct);
 }
 
+// Convert the 1D x and f arrays passed in by the caller into the frame's vector arrays.
+inline void copy_frame_vectors(FrameConfig* const frame_config, double* const x, double* const f)
+{
+	for(int i = 0; i < frame_config->current_n_sites; i++) {
+		for(int j = 0; j < 3; j++) {
+			frame_config->x[i][j] = x[i*3 + j];
+			frame_config->f[i][j] = f[i*3 + j];
+		}
+	}
+}
+
+// Process a frame with the frame's positions and forces pointing at the caller's arrays,
+// then point them back at the frame's own arrays.
+// Single precision frames cannot share the caller's double precision arrays, so they are copied instead.
+void* process_frame_in_place(MSCG_struct* const mscg_struct, double* const x, double* const f, void* (*process_frame)(MSCG_struct* const mscg_struct))
+{
+	FrameConfig* p_frame_config = mscg_struct->frame_source->frame_config;
+#if _single_precision_frames == 1
+	copy_frame_vectors(p_frame_config, x, f);
+	return process_frame(mscg_struct);
+#else
+	static_assert(sizeof(std::array<frame_real, DIMENSION>) == DIMENSION * sizeof(double), "Frame vectors must be laid out as flat arrays of doubles.");
+	std::array<frame_real, DIMENSION>* own_x = p_frame_config->x;
+	std::array<frame_real, DIMENSION>* own_f = p_frame_config->f;
+	p_frame_config->x = reinterpret_cast<std::array<frame_real, DIMENSION>*>(x);
+	p_frame_config->f = reinterpret_cast<std::array<frame_real, DIMENSION>*>(f);
+	void* void_out = process_frame(mscg_struct);
+	p_frame_config->x = own_x;
+	p_frame_config->f = own_f;
+	return void_out;
+#endif
+}
+
+// Process frames one at a time in place, setting the box and weight of each first.
+void* process_frames(MSCG_struct* const mscg_struct, const int n_frames, double* const x, double* const f, double* const box_half_lengths, double* const weights, void* (*process_frame)(MSCG_struct* const mscg_struct))
+{
+	FrameConfig* p_frame_config = mscg_struct->frame_source->frame_config;
+	int frame_stride = DIMENSION * p_frame_config->current_n_sites;
+	for (int frame = 0; frame < n_frames; frame++) {
+		if (box_half_lengths != NULL) {
+			for (int i = 0; i < DIMENSION; i++) p_frame_config->simulation_box_half_lengths[i] = box_half_lengths[frame * DIMENSION + i];
+		}
+		if (weights != NULL) mscg_struct->caller_frame_weight = &weights[frame];
+		process_frame_in_place(mscg_struct, x + frame * frame_stride, f + frame * frame_stride, process_frame);
+	}
+	mscg_struct->caller_frame_weight = NULL;
+	return (void*)(mscg_struct);
+}
+
+#ifdef _OPENMP
+// Process frames with num_frame_threads threads computing matrix elements for several
+// frames of the same block at once, as in construct_full_fm_matrix_threaded in newfm.cpp.
+// The box, weight and cell lists of each frame are set up in order by the calling thread,
+// then the frames are processed concurrently with thread-private matrices and computers
+// and their results are folded into the shared matrix in frame order.
+
+void process_fm_frames_threaded(MSCG_struct* const mscg_struct, const int n_frames, double* const x, double* const f, double* const box_half_lengths, double* const weights)
+{
+	FrameSource *p_frame_source = mscg_struct->frame_source;
+	CG_MODEL_DATA *p_cg = mscg_struct->cg;
+	MATRIX_DATA *mat = mscg_struct->mat;
+	FrameConfig* p_frame_config = p_frame_source->frame_config;
+	int n_sites = p_frame_config->current_n_sites;
+	int frame_stride = DIMENSION * n_sites;
+	int n_threads = mat->num_frame_threads;
+	int batch_size = mat->frames_per_traj_block;
+	
+	// Set up the thread-private matrices and interaction computers and the per-frame data the first time through.
+	if (mscg_struct->thread_mats.empty()) {
+		printf("Setting up %d threads for frame processing.\n", n_threads);
+		if (batch_size < n_threads) {
+			printf("Warning: block_size %d is smaller than num_frame_threads %d, so at most %d of the threads can work on the frames of each block at once. Increase block_size to use them all.\n", batch_size, n_threads, batch_size);
+		}
+		for (int t = 0; t < n_threads; t++) {
+			mscg_struct->thread_mats.push_back(make_frame_worker_matrix(mat));
+			mscg_struct->thread_computers.push_back(new FrameWorkerComputers(p_cg));
+		}
+		for (int b = 0; b < batch_size; b++) {
+			mscg_struct->batch_frame_configs.push_back(new FrameConfig(n_sites, p_frame_config->cg_site_types));
+		}
+		mscg_struct->batch_pair_cell_lists.resize(batch_size);
+		mscg_struct->batch_three_body_cell_lists.resize(batch_size);
+		mscg_struct->batch_cell_list_versions.assign(batch_size, -1);
+	}
+	std::vector<FrameConfig*> &batch_frame_configs = mscg_struct->batch_frame_configs;
+	std::vector<double> batch_frame_weights(batch_size, 1.0);
+	std::vector<int> batch_process_flags(batch_size, 1);
+#if _single_precision_frames != 1
+	// The batch frames point at the caller's arrays while a chunk is processed.
+	std::vector<std::array<frame_real, DIMENSION>*> own_x(batch_size), own_f(batch_size);
+	for (int b = 0; b < batch_size; b++) {
+		own_x[b] = batch_frame_configs[b]->x;
+		own_f[b] = batch_frame_configs[b]->f;
+	}
+#endif
+	
+	// Process the frames in chunks that do not cross the end of a block.
+	for (int chunk_start = 0; chunk_start < n_frames; ) {
+		int first_block_frame = mscg_struct->trajectory_block_frame_index;
+		int n_chunk_frames = std::min(n_frames - chunk_start, batch_size - first_block_frame);
+		
+		// Set up the box, weight and cell lists of each frame in order.
+		for (int c = 0; c < n_chunk_frames; c++) {
+			int frame = chunk_start + c;
+			int b = first_block_frame + c;
+			
+			if (box_half_lengths != NULL) {
+				for (int i = 0; i < DIMENSION; i++) p_frame_config->simulation_box_half_lengths[i] = box_half_lengths[frame * DIMENSION + i];
+			}
+			if (weights != NULL) {
+				mat->current_frame_weight = weights[frame];
+			} else if (p_frame_source->use_statistical_reweighting == 1) {
+				printf("Reweighting entries for trajectory frame %d. ", mscg_struct->traj_frame_num + c);
+				mat->current_frame_weight = p_frame_source->frame_weights[mscg_struct->traj_frame_num + c];
+			}
+			int weighted_flag = (weights != NULL) || (p_frame_source->use_statistical_reweighting == 1);
+			
+			// Skip processing frame if frame weight is 0.
+			batch_process_flags[b] = 1;
+			if (weighted_flag && mat->current_frame_weight == 0.0) {
+				batch_process_flags[b] = 0;
+			} else {
+				update_cell_lists(mscg_struct);
+				FrameConfig* batch_config = batch_frame_configs[b];
+				for (int i = 0; i < DIMENSION; i++) batch_config->simulation_box_half_lengths[i] = p_frame_config->simulation_box_half_lengths[i];
+#if _single_precision_frames == 1
+				copy_frame_vectors(batch_config, x + frame * frame_stride, f + frame * frame_stride);
+#else
+				batch_config->x = reinterpret_cast<std::array<frame_real, DIMENSION>*>(x + frame * frame_stride);
+				batch_config->f = reinterpret_cast<std::array<frame_real, DIMENSION>*>(f + frame * frame_stride);
+#endif
+				
+				// Each batch slot keeps its own cell lists; refresh them only after they have been set up again.
+				if (mscg_struct->batch_cell_list_versions[b] != mscg_struct->cell_list_version) {
+					mscg_struct->batch_pair_cell_lists[b] = mscg_struct->pair_cell_list;
+					mscg_struct->batch_three_body_cell_lists[b] = mscg_struct->three_body_cell_list;
+					mscg_struct->batch_cell_list_versions[b] = mscg_struct->cell_list_version;
+				}
+			}
+			batch_frame_weights[b] = mat->current_frame_weight;
+		}
+		
+		// Apply virial constraint, if appropriate.
+		add_target_virials_from_trajectory(mat, p_frame_source->pressure_constraint_rhs_vector);
+		
+		// Compute the matrix elements for all frames in the chunk.
+		#pragma omp parallel for ordered schedule(static, 1) num_threads(n_threads)
+		for (int c = 0; c < n_chunk_frames; c++) {
+			int thread_index = omp_get_thread_num();
+			MATRIX_DATA* thread_mat = mscg_struct->thread_mats[thread_index];
+			int b = first_block_frame + c;
+			
+			thread_mat->current_frame_weight = batch_frame_weights[b];
+			thread_mat->trajectory_block_index = mat->trajectory_block_index;
+			thread_mat->force_sq_total = 0.0;
+			if (batch_process_flags[b] == 1) {
+				calculate_frame_fm_matrix(p_cg, mscg_struct->thread_computers[thread_index], thread_mat, batch_frame_configs[b], mscg_struct->batch_pair_cell_lists[b], mscg_struct->batch_three_body_cell_lists[b], b);
+			}
+			
+			// Fold the frame's results into the shared totals in frame order.
+			#pragma omp ordered
+			{
+				mat->force_sq_total += thread_mat->force_sq_total;
+				if (batch_process_flags[b] == 1) mat->block_frame_weights[b] = thread_mat->block_frame_weights[b];
+				if (mat->matrix_type == kSparseNormal || mat->matrix_type == kDirectNormal) {
+					mat->sparse_fm_block->append_elements(thread_mat->sparse_fm_block);
+				}
+			}
+		}
+		
+		mscg_struct->curr_frame += n_chunk_frames;
+		mscg_struct->traj_frame_num += n_chunk_frames;
+		mscg_struct->trajectory_block_frame_index += n_chunk_frames;
+		p_frame_source->current_frame_n += n_chunk_frames;
+		chunk_start += n_chunk_frames;
+		
+		if (mscg_struct->trajectory_block_frame_index >= batch_size) {
+			// Print status and do end-of-block computations before wiping the blockwise matrix and beginning anew.
+			printf("\r%d (%d) frames have been sampled. ", p_frame_source->current_frame_n, (mat->trajectory_block_index + 1) * batch_size);
+			fflush(stdout);
+			mat->current_frame_weight = batch_frame_weights[batch_size - 1];
+			(*mat->do_end_of_frameblock_matrix_manipulations)(mat);
+			(*mat->set_fm_matrix_to_zero)(mat);
+			mscg_struct->trajectory_block_frame_index = 0;
+			mat->trajectory_block_index++;
+		} else {
+			mat->current_frame_weight = batch_frame_weights[mscg_struct->trajectory_block_frame_index - 1];
+		}
+	}
+	
+#if _single_precision_frames != 1
+	for (int b = 0; b < batch_size; b++) {
+		batch_frame_configs[b]->x = own_x[b];
+		batch_frame_configs[b]->f = own_f[b];
+	}
+#endif
+}
+#endif
+
+// Free the thread-private matrices and computers and per-frame data of mscg_process_frames.
+void free_frame_workers(MSCG_struct* const mscg_struct)
+{
+	for (unsigned t = 0; t < mscg_struct->thread_mats.size(); t++) {
+		delete mscg_struct->thread_mats[t];
+		delete mscg_struct->thread_computers[t];
+	}
+	for (unsigned b = 0; b < mscg_struct->batch_frame_configs.size(); b++) {
+		delete mscg_struct->batch_frame_configs[b];
+	}
+	mscg_struct->thread_mats.clear();
+	mscg_struct->thread_computers.clear();
+	mscg_struct->batch_frame_configs.clear();
+	mscg_struct->batch_pair_cell_lists.clear();
+	mscg_struct->batch_three_body_cell_lists.clear();
+	mscg_struct->batch_cell_list_versions.clear();
+}
+
+// Set up the cell lists for the current box the first time a frame is processed,
+// and again only when the box or the number of sites has changed since.
+void update_cell_lists(MSCG_struct* const mscg_struct)
+{
+	FrameSource *p_frame_source = mscg_struct->frame_source;
+	CG_MODEL_DATA *p_cg = mscg_struct->cg;
+	FrameConfig* p_frame_config = p_frame_source->frame_config;
+	
+	int box_change = (mscg_struct->cell_list_n_sites != p_frame_config->current_n_sites);
+	for (int i = 0; i < DIMENSION; i++) {
+		if ( fabs(mscg_struct->cell_list_box_half_lengths[i] - p_frame_config->simulation_box_half_lengths[i]) > VERYSMALL_F ) box_change = 1;
+	}
+	if (box_change == 0) return;
+	
+    mscg_struct->pair_cell_list.init(p_cg->pair_nonbonded_interactions.cutoff + p_cg->verlet_skin, p_frame_source);
+    if (p_cg->three_body_nonbonded_interactions.class_subtype > 0) {
+        double max_cutoff = 0.0;
+        for (int i = 0; i < p_cg->three_body_nonbonded_interactions.get_n_defined(); i++) {
+            max_cutoff = fmax(max_cutoff, p_cg->three_body_nonbonded_interactions.three_body_nonbonded_cutoffs[i]);
+        }
+        mscg_struct->three_body_cell_list.init(max_cutoff, p_frame_source);
+    }
+    mscg_struct->cell_list_n_sites = p_frame_config->current_n_sites;
+    for (int i = 0; i < DIMENSION; i++) mscg_struct->cell_list_box_half_lengths[i] = p_frame_config->simulation_box_half_lengths[i];
+    mscg_struct->cell_list_version++;
+}
+
 // Clean-up function after all frames are read.
 void finish_fix_reading(FrameSource *const frame_source)
 {
@@ -692,6 +1058,7 @@ void finish_fix_reading(FrameSource *const frame_source)
 void* setup_topology_and_frame(void* void_in, int const n_cg_sites, int const n_cg_types, char ** type_names, int* cg_site_types, double* box_half_lengths)
 {
 	MSCG_struct* mscg_struct = (MSCG_struct*)(void_in);
+	HandleCall handle_call(mscg_struct);
 	CG_MODEL_DATA *p_cg = mscg_struct->cg;
     TopologyData* p_topo_data = &(p_cg->topo_data);
 
@@ -792,6 +1159,7 @@ void* setup_topology_and_frame(void* void_in, int const n_cg_sites, int const n_
 void* set_bond_topology(void* void_in, unsigned** bond_partners, unsigned* bond_partner_numbers) 
 {
 	MSCG_struct* mscg_struct = (MSCG_struct*)(void_in);
+	HandleCall handle_call(mscg_struct);
     CG_MODEL_DATA *p_cg = mscg_struct->cg;
     TopologyData* p_topo_data = &(p_cg->topo_data);
 
@@ -839,6 +1207,7 @@ void* set_bond_topology(void* void_in, unsigned** bond_partners, unsigned* bond_
 void* set_angle_topology(void* void_in, unsigned** angle_partners, unsigned* angle_partner_numbers) 
 {
 	MSCG_struct* mscg_struct = (MSCG_struct*)(void_in);
+	HandleCall handle_call(mscg_struct);
     CG_MODEL_DATA *p_cg = mscg_struct->cg;
     TopologyData* p_topo_data = &(p_cg->topo_data);
 
@@ -894,6 +1263,7 @@ void* set_angle_topology(void* void_in, unsigned** angle_partners, unsigned* ang
 void* set_dihedral_topology(void* void_in, unsigned** dihedral_partners, unsigned* dihedral_partner_numbers) 
 {
 	MSCG_struct* mscg_struct = (MSCG_struct*)(void_in);
+	HandleCall handle_call(mscg_struct);
     CG_MODEL_DATA *p_cg = mscg_struct->cg;
     TopologyData* p_topo_data = &(p_cg->topo_data);
 
@@ -953,6 +1323,7 @@ void* set_dihedral_topology(void* void_in, unsigned** dihedral_partners, unsigne
 void* set_exclusion_topology(void* void_in, unsigned** exclusion_partners, unsigned* exclusion_partner_numbers) 
 {
 	MSCG_struct* mscg_struct = (MSCG_struct*)(void_in);
+	HandleCall handle_call(mscg_struct);
     CG_MODEL_DATA *p_cg = mscg_struct->cg;
     TopologyData* p_topo_data = &(p_cg->topo_data);
 
@@ -970,6 +1341,7 @@ void* set_exclusion_topology(void* void_in, unsigned** exclusion_partners, unsig
 	p_topo_data->exclusion_list->partners_ = exclusion_partners;
 	// For a given CG site, it lists the CG site indices of all partnered particles (for this topological attribute).
 	p_topo_data->exclusion_list->partner_numbers_ = exclusion_partner_numbers;
+	p_topo_data->exclusion_list->build_lookup();
 	
 	return (void*)(mscg_struct);
 }
@@ -984,6 +1356,7 @@ void* set_exclusion_topology(void* void_in, unsigned** exclusion_partners, unsig
 void* generate_exclusion_topology(void* void_in)
 {
 	MSCG_struct* mscg_struct = (MSCG_struct*)(void_in);
+	HandleCall handle_call(mscg_struct);
     CG_MODEL_DATA *p_cg = mscg_struct->cg;
     TopologyData* p_topo_data = &(p_cg->topo_data);
 	setup_excluded_list(p_topo_data, p_topo_data->exclusion_list, p_topo_data->excluded_style);
@@ -998,6 +1371,7 @@ void* generate_exclusion_topology(void* void_in)
 void* generate_angle_dihedral_and_exclusion_topology(void* void_in)
 {
 	MSCG_struct* mscg_struct = (MSCG_struct*)(void_in);
+	HandleCall handle_call(mscg_struct);
     CG_MODEL_DATA *p_cg = mscg_struct->cg;
     TopologyData* p_topo_data = &(p_cg->topo_data);
 
@@ -1079,6 +1453,7 @@ void* generate_angle_dihedral_and_exclusion_topology(void* void_in)
 int get_n_frames(void* void_in)
 {
   MSCG_struct* mscg_struct = (MSCG_struct*)(void_in);
+  HandleCall handle_call(mscg_struct);
   return mscg_struct->control_input->n_frames;
 }
 
@@ -1086,6 +1461,7 @@ int get_n_frames(void* void_in)
 int get_block_size(void* void_in)
 {
   MSCG_struct* mscg_struct = (MSCG_struct*)(void_in);
+  HandleCall handle_call(mscg_struct);
   return mscg_struct->control_input->frames_per_traj_block;
 }
 
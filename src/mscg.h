@@ -14,7 +14,7 @@
 // setup_bond_topology, setup_angle_topology, and setup_dihedral_topology
 // either setup_exclusion_topology or generate_exclusion_topology
 // mscg_startup_part2
-// mscg_process_frame for each frame
+// mscg_process_frame (or mscg_process_frame_in_place) for each frame, or mscg_process_frames for several at once
 // mscg_solve_and output.
 // Additional functions are provided for updating or modifying certain information
 // after the data is initially set using one of the functions before or during 
@@ -26,7 +26,7 @@
 // setup_bond_topology, setup_angle_topology, and setup_dihedral_topology
 // either setup_exclusion_topology or generate_exclusion_topology
 // rangefinder_startup_part2
-// rangefinder_process_frame for each frame
+// rangefinder_process_frame (or rangefinder_process_frame_in_place) for each frame, or rangefinder_process_frames for several at once
 // rangefinder_solve_and output.
 
 #include <cassert>
@@ -48,10 +48,17 @@
 
 void* mscg_startup_part1(void* void_in);
 void* rangefinder_startup_part1(void* void_in);
+void* set_output_prefix(void* void_in, const char* prefix);
 void* mscg_startup_part2(void* void_in);
 void* rangefinder_startup_part2(void* void_in);
 void* rangefinder_process_frame(void* void_in, double* const x, double* const f);
 void* mscg_process_frame(void* void_in, double* const x, double* const f);
+// Variants that process the frame directly from the caller's arrays without copying them.
+void* rangefinder_process_frame_in_place(void* void_in, double* const x, double* const f);
+void* mscg_process_frame_in_place(void* void_in, double* const x, double* const f);
+// Variants that process a number of frames stored one after another in x and f.
+void* rangefinder_process_frames(void* void_in, const int n_frames, double* const x, double* const f, double* const box_half_lengths, double* const weights);
+void* mscg_process_frames(void* void_in, const int n_frames, double* const x, double* const f, double* const box_half_lengths, double* const weights);
 void* mscg_solve_and_output(void* void_in);
 void* rangefinder_solve_and_output(void* void_in);
 
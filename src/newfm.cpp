@@ -7,9 +7,15 @@
 //  Copyright (c) 2016 The Voth Group at The University of Chicago. All rights reserved.
 //
 
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
 #include <ctime>
+#include <string>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "control_input.h"
 #include "force_computation.h"
 #include "fm_output.h"
@@ -17,9 +23,20 @@
 #include "interaction_model.h"
 #include "matrix.h"
 #include "misc.h"
+#include "range_finding.h"
 #include "trajectory_input.h"
 
 void construct_full_fm_matrix(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, FrameSource* const frame_source);
+void init_cell_lists(CG_MODEL_DATA* const cg, FrameSource* const frame_source, PairCellList &pair_cell_list, ThreeBCellList &three_body_cell_list);
+int launch_fm_worker_processes(ControlInputs* const control_input, FrameSource* const frame_source, std::vector<std::string> &result_filenames);
+void combine_fm_worker_results(CG_MODEL_DATA* const cg, ControlInputs* const control_input, const std::vector<std::string> &result_filenames);
+void find_ranges_and_cache_frames(ControlInputs* const control_input, FrameSource* const frame_source);
+
+// Frames read while finding ranges with range_finding_flag 1 are kept here for force matching.
+const char range_pass_frames_filename[] = "range_pass_frames.cgtrj";
+#ifdef _OPENMP
+void construct_full_fm_matrix_threaded(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, FrameSource* const frame_source, PairCellList &pair_cell_list, ThreeBCellList &three_body_cell_list, double* const ref_box_half_lengths, const int total_frame_samples, const int n_blocks);
+#endif
 
 int main(int argc, char* argv[])
 {
@@ -55,6 +72,13 @@ int main(int argc, char* argv[])
     printf("Reading topology file.\n");
     read_topology_file(&cg.topo_data, &cg);
     
+    // If 'range_finding_flag' is set, find the interaction ranges
+    // and write the range files first, as rangefinder.x does, keeping
+    // the frames that are read for force matching below.
+    if (control_input.range_finding_flag == 1) {
+        find_ranges_and_cache_frames(&control_input, &frame_source);
+    }
+    
     // Read the range files rmin.in and rmax.in to determine the
     // ranges over which the FM basis functions should be defined.
     // These ranges are also used to record which interactions
@@ -75,9 +99,29 @@ int main(int argc, char* argv[])
         read_tabulated_interaction_file(&cg, cg.topo_data.n_cg_types);
     } 
     
+    // If 'num_worker_processes' is more than 1, split the frames across
+    // that many worker processes. Each worker continues below with its
+    // own share of the frames and writes its normal equations to file,
+    // while this process only combines and solves them.
+    int worker_index = -1;
+    std::vector<std::string> worker_result_filenames;
+    if (control_input.num_worker_processes > 1) {
+        worker_index = launch_fm_worker_processes(&control_input, &frame_source, worker_result_filenames);
+        if (worker_index < 0) {
+            combine_fm_worker_results(&cg, &control_input, worker_result_filenames);
+            if (control_input.range_finding_flag == 1) remove(range_pass_frames_filename);
+            double end_cputime = clock();
+            double elapsed_cputime = ((double)(end_cputime - start_cputime)) / CLOCKS_PER_SEC;
+            printf("%f seconds used (not counting worker processes).\n", elapsed_cputime);
+            return 0;
+        }
+    }
+    
     // Read statistical weights for each frame if the 
     // 'use_statistical_reweighting' flag is set in control.in.
-    if (frame_source.use_statistical_reweighting == 1) {
+    // Weights already read while finding ranges are reused unless
+    // this is a worker process with its own share of the frames.
+    if (frame_source.use_statistical_reweighting == 1 && (frame_source.frame_weights == NULL || worker_index >= 0)) {
         printf("Reading per-frame statistical reweighting factors.\n");
         fflush(stdout);
         read_frame_weights(&frame_source, control_input.starting_frame, control_input.n_frames, "in"); 
@@ -103,6 +147,8 @@ int main(int argc, char* argv[])
     printf("Beginning to read frames.\n");
     printf("Finding first frame...\n");
     frame_source.get_first_frame(&frame_source, cg.topo_data.n_cg_sites, cg.topo_data.cg_site_types);
+    // The cached frames stay readable through their memory map after the file is removed.
+    if (control_input.range_finding_flag == 1 && worker_index < 0) remove(range_pass_frames_filename);
 	if (frame_source.dynamic_state_sampling == 1) frame_source.sampleTypesFromProbs();
 	
     // Assign a host of function pointers in 'cg' new definitions
@@ -124,12 +170,18 @@ int main(int argc, char* argv[])
     	set_bootstrapping_normalization(&mat, frame_source.bootstrapping_weights, frame_source.n_frames);
     }
         
-    // Record the dimensions of the matrix after initialization in a
-    // solution file.
-    FILE* solution_file = open_file("sol_info.out", "w");
-    fprintf(solution_file, "fm_matrix_rows:%d; fm_matrix_columns:%d;\n",
-            mat.fm_matrix_rows, mat.fm_matrix_columns);
-    fclose(solution_file);
+    // A worker only writes its normal equations for the parent process to combine.
+    if (worker_index >= 0) {
+        mat.output_style = 3;
+        mat.binary_output_filename = worker_result_filenames[worker_index];
+    } else {
+        // Record the dimensions of the matrix after initialization in a
+        // solution file.
+        FILE* solution_file = open_file("sol_info.out", "w");
+        fprintf(solution_file, "fm_matrix_rows:%d; fm_matrix_columns:%d;\n",
+                mat.fm_matrix_rows, mat.fm_matrix_columns);
+        fclose(solution_file);
+    }
 
     //----------------------------------------------------------------
     // Do the force matching
@@ -167,6 +219,106 @@ int main(int argc, char* argv[])
     return 0;
 }
 
+// Split the frames across num_worker_processes local worker processes after checking
+// that the FM settings allow it, and name the file each worker writes its normal equations to.
+// Returns the worker's index in each worker and -1 in the parent once all workers have finished.
+
+int launch_fm_worker_processes(ControlInputs* const control_input, FrameSource* const frame_source, std::vector<std::string> &result_filenames)
+{
+    MatrixType matrix_type = (MatrixType)control_input->matrix_type;
+    if (matrix_type != kDense && matrix_type != kSparseNormal && matrix_type != kDirectNormal) {
+        printf("Worker processes are only implemented for matrix_type 0, 3 and 5.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (control_input->bootstrapping_flag == 1 || control_input->iterative_calculation_flag == 1) {
+        printf("Worker processes cannot be used with bootstrapping or the iterative method.\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    // Hand out whole blocks of frames so that each share is blocked as it would be in a single run.
+    return launch_frame_worker_processes(control_input, frame_source, std::max(control_input->frames_per_traj_block, 1), "result_worker_%d.out", result_filenames);
+}
+
+// Find the interaction ranges over the frames to be used and write rmin.in and rmin_b.in 
+// as rangefinder.x would, while copying each frame to a binary trajectory in memory or on file.
+// frame_source is then set to read that binary trajectory, so force matching
+// replays the same frames without reading the original trajectory again.
+
+void find_ranges_and_cache_frames(ControlInputs* const control_input, FrameSource* const frame_source)
+{
+    if (control_input->three_body_flag != 0) {
+        printf("Range finding does not support three body nonbonded interaction ranges.\n");
+        exit(EXIT_FAILURE);
+    }
+    printf("Finding interaction ranges.\n");
+    
+    // Use a separate model for range finding so that force matching
+    // starts from the ranges as read from the range files.
+    ControlInputs range_control_input = *control_input;
+    range_control_input.matrix_type = kDummy;
+    range_control_input.frames_per_traj_block = 1;
+    CG_MODEL_DATA range_cg(&range_control_input);
+    read_topology_file(&range_cg.topo_data, &range_cg);
+    
+    // Frame weights are only used to skip frames with no weight here; p_con.in is read later.
+    int pressure_constraint_flag = frame_source->pressure_constraint_flag;
+    frame_source->pressure_constraint_flag = 0;
+    if (frame_source->use_statistical_reweighting == 1) {
+        read_frame_weights(frame_source, control_input->starting_frame, control_input->n_frames, "in");
+    }
+    frame_source->get_first_frame(frame_source, range_cg.n_cg_sites, range_cg.topo_data.cg_site_types);
+    initialize_range_finding_temps(&range_cg);
+    MATRIX_DATA range_mat(&range_control_input, &range_cg);
+    
+    // Keep the frames in memory instead if they fit within frame_cache_memory_mb.
+    size_t memory_budget = (size_t)std::max(control_input->frame_cache_memory_mb, 0) * 1048576;
+    BinaryTrajectoryWriter* frame_cache = open_binary_trajectory_writer(frame_source, range_pass_frames_filename, sizeof(frame_real), memory_budget);
+    // Closing the trajectory frees the frame weights; keep them for force matching.
+    std::vector<double> frame_weights;
+    if (frame_source->use_statistical_reweighting == 1) {
+        frame_weights.assign(frame_source->frame_weights, frame_source->frame_weights + control_input->n_frames);
+    }
+    find_interaction_ranges(&range_cg, &range_mat, frame_source, frame_cache);
+    close_binary_trajectory_writer(frame_cache);
+    frame_source->pressure_constraint_flag = pressure_constraint_flag;
+    if (frame_source->use_statistical_reweighting == 1) {
+        frame_source->frame_weights = new double[frame_weights.size()];
+        std::copy(frame_weights.begin(), frame_weights.end(), frame_source->frame_weights);
+    }
+    
+    printf("Writing range files.\n");
+    write_range_files(&range_cg, &range_mat);
+    free_name(&range_cg);
+    
+    // The cached frames begin with the first frame to be used.
+    use_binary_trajectory(frame_source, range_pass_frames_filename);
+    frame_source->starting_frame = 1;
+}
+
+// Sum the normal equations written by the worker processes and solve them
+// as a single run over all of their frames would have.
+
+void combine_fm_worker_results(CG_MODEL_DATA* const cg, ControlInputs* const control_input, const std::vector<std::string> &result_filenames)
+{
+    set_up_force_computers(cg);
+    
+    printf("Combining FM equations from %d worker processes.\n", (int)result_filenames.size());
+    MATRIX_DATA mat(control_input, cg);
+    FILE* solution_file = open_file("sol_info.out", "w");
+    fprintf(solution_file, "fm_matrix_rows:%d; fm_matrix_columns:%d;\n",
+            mat.fm_matrix_rows, mat.fm_matrix_columns);
+    fclose(solution_file);
+    
+    combine_binary_dense_fm_matrices(&mat, (int)result_filenames.size(), &result_filenames[0]);
+    for (unsigned i = 0; i < result_filenames.size(); i++) remove(result_filenames[i].c_str());
+    
+    printf("Finishing FM.\n");
+    mat.finish_fm(&mat);
+    
+    printf("Writing final output.\n"); fflush(stdout);
+    write_fm_interaction_output_files(cg, &mat);
+}
+
 void construct_full_fm_matrix(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, FrameSource* const frame_source)
 {
     int n_blocks;
@@ -179,6 +331,9 @@ void construct_full_fm_matrix(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, F
     // Skip the desired number of frames before starting the matrix building loops.
     frame_source->move_to_start_frame(frame_source);
     
+    // Read the remaining frames ahead in a separate thread if requested.
+    start_frame_prefetch(frame_source, frame_source->n_frames - 1);
+    
     // Perform initial generation of cell lists user for generating neighbor lists.
     // This list will only be rebuilt if the box dimensions change.
     
@@ -187,14 +342,7 @@ void construct_full_fm_matrix(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, F
     ThreeBCellList three_body_cell_list = ThreeBCellList();
     
     // Populate the cell linked lists.
-    pair_cell_list.init(cg->pair_nonbonded_interactions.cutoff, frame_source);
-    if (cg->three_body_nonbonded_interactions.class_subtype > 0) {
-    	double max_cutoff = 0.0;
-        for (int i = 0; i < cg->three_body_nonbonded_interactions.get_n_defined(); i++) {
-        	max_cutoff = fmax(max_cutoff, cg->three_body_nonbonded_interactions.three_body_nonbonded_cutoffs[i]);
-        }
-    three_body_cell_list.init(max_cutoff, frame_source);
-    }
+    init_cell_lists(cg, frame_source, pair_cell_list, three_body_cell_list);
     
 	// Record this box's dimensions.
 	for (int i = 0; i < frame_source->position_dimension; i++) {
@@ -211,9 +359,9 @@ void construct_full_fm_matrix(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, F
     if (frame_source->dynamic_state_sampling == 1) {
 		total_frame_samples = frame_source->n_frames * frame_source->dynamic_state_samples_per_frame;
 	}	
-    if (mat->matrix_type == kDense) {
-        n_blocks = total_frame_samples;
-	    mat->frames_per_traj_block = 1;
+    if (mat->matrix_type == kDense || mat->matrix_type == kDirectNormal) {
+    	// The frames of a dense or direct normal block are weighted separately, so the last block may be partial.
+        n_blocks = (total_frame_samples + mat->frames_per_traj_block - 1) / mat->frames_per_traj_block;
     } else {
 		// Check if number of frames is divisible by frames per trajectory block.
 		if (total_frame_samples % mat->frames_per_traj_block != 0) {
@@ -225,6 +373,23 @@ void construct_full_fm_matrix(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, F
 
     mat->accumulation_row_shift = 0;
 
+	// Use the threaded frame loop if it was requested and it reproduces the serial results for this calculation.
+	if (mat->num_frame_threads > 1) {
+#ifdef _OPENMP
+		if ( ((mat->matrix_type != kDense) && (mat->matrix_type != kSparseNormal) && (mat->matrix_type != kDirectNormal)) || (frame_source->dynamic_types == 1) || (frame_source->dynamic_state_sampling == 1) ) {
+			printf("Threaded frame processing is only available for matrix_type 0, 3 and 5 without dynamic types or dynamic state sampling. Processing frames serially.\n");
+		} else {
+			construct_full_fm_matrix_threaded(cg, mat, frame_source, pair_cell_list, three_body_cell_list, ref_box_half_lengths, total_frame_samples, n_blocks);
+		    printf("\nFinishing frame parsing.\n");
+		    frame_source->cleanup(frame_source);
+		    delete [] ref_box_half_lengths;
+			return;
+		}
+#else
+		printf("Ignoring num_frame_threads since this executable was compiled without OpenMP. Processing frames serially.\n");
+#endif
+	}
+
     // For each block of frame samples.
     printf("Entering primary matrix-building loop.\n"); fflush(stdout);
     for (mat->trajectory_block_index = 0; mat->trajectory_block_index < n_blocks; mat->trajectory_block_index++) {
@@ -232,9 +397,10 @@ void construct_full_fm_matrix(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, F
         // Wipe the matrix, then calculate the target virial for all frames in this block.
         (*mat->set_fm_matrix_to_zero)(mat);
         add_target_virials_from_trajectory(mat, frame_source->pressure_constraint_rhs_vector);
+        int n_block_frames = std::min(mat->frames_per_traj_block, total_frame_samples - mat->trajectory_block_index * mat->frames_per_traj_block);
 
         // For each frame sample in this block
-        for (int trajectory_block_frame_index = 0; trajectory_block_frame_index < mat->frames_per_traj_block; trajectory_block_frame_index++) {
+        for (int trajectory_block_frame_index = 0; trajectory_block_frame_index < n_block_frames; trajectory_block_frame_index++) {
 	
 		    // Check that the last frame was read successfully (read at end of each iteration)
     		if (read_stat == 0) {
@@ -266,16 +432,7 @@ void construct_full_fm_matrix(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, F
 				// Redo cell list set-up and update reference box size if box has changed.
 				if (box_change == 1) {
 	            	// Re-initialize the cell linked lists for finding neighbors in the provided frames;
-  					pair_cell_list = PairCellList();
-    				three_body_cell_list = ThreeBCellList();
-    				pair_cell_list.init(cg->pair_nonbonded_interactions.cutoff, frame_source);
-    				if (cg->three_body_nonbonded_interactions.class_subtype > 0) {
-        				double max_cutoff = 0.0;
-        				for (int i = 0; i < cg->three_body_nonbonded_interactions.get_n_defined(); i++) {
-            				max_cutoff = fmax(max_cutoff, cg->three_body_nonbonded_interactions.three_body_nonbonded_cutoffs[i]);
-        				}
-        				three_body_cell_list.init(max_cutoff, frame_source);
-    				}
+    				init_cell_lists(cg, frame_source, pair_cell_list, three_body_cell_list);
     			
     				// Update the reference_box_half_lengths for this new box size.
     				for (int i = 0; i < frame_source->position_dimension; i++) {
@@ -301,7 +458,7 @@ void construct_full_fm_matrix(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, F
             if (frame_source->dynamic_state_sampling == 0) {
 				// Read next frame.
 				// Only do this if we are not currently process the last frame.
-				if ( ((trajectory_block_frame_index + 1) < mat->frames_per_traj_block) ||
+				if ( ((trajectory_block_frame_index + 1) < n_block_frames) ||
 			         ((mat->trajectory_block_index + 1) < n_blocks) ) {
 					read_stat = (*frame_source->get_next_frame)(frame_source);  
 				}
@@ -315,7 +472,7 @@ void construct_full_fm_matrix(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, F
 			} else {
 				// Read next frame, sample frame, and reset sampling counter.
 				// Only do this if we are not currently process the last frame.
-				if ( ((trajectory_block_frame_index + 1) < mat->frames_per_traj_block) ||
+				if ( ((trajectory_block_frame_index + 1) < n_block_frames) ||
 			         ((mat->trajectory_block_index + 1) < n_blocks) ) {
 					read_stat = (*frame_source->get_next_frame)(frame_source);  
 				}
@@ -326,7 +483,7 @@ void construct_full_fm_matrix(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, F
 		}
 		
         // Print status and do end-of-block computations before wiping the blockwise matrix and beginning anew
-        printf("\r%d (%d) frames have been sampled. ", frame_source->current_frame_n, (mat->trajectory_block_index + 1) * mat->frames_per_traj_block);
+        printf("\r%d (%d) frames have been sampled. ", frame_source->current_frame_n, mat->trajectory_block_index * mat->frames_per_traj_block + n_block_frames);
         fflush(stdout);
         (*mat->do_end_of_frameblock_matrix_manipulations)(mat);
 	}
@@ -337,3 +494,180 @@ void construct_full_fm_matrix(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, F
     frame_source->cleanup(frame_source);
     delete [] ref_box_half_lengths;
 }
+
+// (Re)initialize the cell linked lists for finding neighbors using the box of the current frame.
+
+void init_cell_lists(CG_MODEL_DATA* const cg, FrameSource* const frame_source, PairCellList &pair_cell_list, ThreeBCellList &three_body_cell_list)
+{
+    pair_cell_list.init(cg->pair_nonbonded_interactions.cutoff + cg->verlet_skin, frame_source);
+    if (cg->three_body_nonbonded_interactions.class_subtype > 0) {
+    	double max_cutoff = 0.0;
+        for (int i = 0; i < cg->three_body_nonbonded_interactions.get_n_defined(); i++) {
+        	max_cutoff = fmax(max_cutoff, cg->three_body_nonbonded_interactions.three_body_nonbonded_cutoffs[i]);
+        }
+        three_body_cell_list.init(max_cutoff, frame_source);
+    }
+}
+
+#ifdef _OPENMP
+// Build the FM equations with num_frame_threads threads computing matrix elements for
+// several frames at once. Frames are still read, weighted and given cell lists in order 
+// by a single thread, then the matrix elements for a batch of frames are computed concurrently 
+// using thread-private matrices and interaction computers.
+// A batch is one frame block, and each frame fills its own rows of the block matrix
+// before the block is folded in as usual, so the normal equations are built in the 
+// same order as in the serial loop.
+
+void construct_full_fm_matrix_threaded(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, FrameSource* const frame_source, PairCellList &pair_cell_list, ThreeBCellList &three_body_cell_list, double* const ref_box_half_lengths, const int total_frame_samples, const int n_blocks)
+{
+	int read_stat = 1;
+	int n_threads = mat->num_frame_threads;
+	int batch_size = mat->frames_per_traj_block;
+	int n_sites = frame_source->frame_config->current_n_sites;
+	
+	// Allocate copies of the frame data and cell lists for every frame in a batch.
+	std::vector<FrameConfig*> batch_frame_configs(batch_size);
+	std::vector<PairCellList> batch_pair_cell_lists(batch_size);
+	std::vector<ThreeBCellList> batch_three_body_cell_lists(batch_size);
+	std::vector<int> batch_cell_list_versions(batch_size, -1);
+	int cell_list_version = 0;
+	std::vector<double> batch_frame_weights(batch_size, 1.0);
+	std::vector<int> batch_process_flags(batch_size, 1);
+	for (int b = 0; b < batch_size; b++) {
+		batch_frame_configs[b] = new FrameConfig(n_sites);
+	}
+	
+	// Set up the thread-private matrices and interaction computers.
+	printf("Setting up %d threads for frame processing.\n", n_threads);
+	if (batch_size < n_threads) {
+		printf("Warning: block_size %d is smaller than num_frame_threads %d, so at most %d of the threads can work on the frames of each block at once. Increase block_size to use them all.\n", batch_size, n_threads, batch_size);
+	}
+	std::vector<MATRIX_DATA*> thread_mats(n_threads);
+	std::vector<FrameWorkerComputers*> thread_computers(n_threads);
+	for (int t = 0; t < n_threads; t++) {
+		thread_mats[t] = make_frame_worker_matrix(mat);
+		thread_computers[t] = new FrameWorkerComputers(cg);
+	}
+	
+	printf("Entering primary matrix-building loop.\n"); fflush(stdout);
+	for (int batch_start = 0; batch_start < total_frame_samples; batch_start += batch_size) {
+		int n_batch_frames = std::min(batch_size, total_frame_samples - batch_start);
+		
+		// Read this batch of frames in order, doing all the per-frame bookkeeping of the serial loop.
+		for (int b = 0; b < n_batch_frames; b++) {
+			int frame_index = batch_start + b;
+			
+		    // Check that the last frame was read successfully.
+    		if (read_stat == 0) {
+        		printf("Failure reading frame %d (%d). Check trajectory for errors.\n", frame_source->current_frame_n, frame_index);
+        		exit(EXIT_FAILURE);
+    		}
+			
+            if (frame_source->use_statistical_reweighting) {
+                printf("Reweighting entries for frame %d. ", frame_index);
+                mat->current_frame_weight = frame_source->frame_weights[frame_index];
+            }
+            
+            // Skip processing frame if frame weight is 0.
+            batch_process_flags[b] = 1;
+            if (frame_source->use_statistical_reweighting && mat->current_frame_weight == 0.0) {
+            	batch_process_flags[b] = 0;
+            } else {
+            	FrameConfig* frame_config = frame_source->getFrameConfig();
+            	
+            	// Redo cell list set-up and update reference box size if box has changed.
+            	int box_change = 0;
+            	for (int i = 0; i < frame_source->position_dimension; i++) {
+					if ( fabs(ref_box_half_lengths[i] - frame_config->simulation_box_half_lengths[i]) > VERYSMALL_F ) {
+						box_change = 1;
+						break;
+					}
+				}
+				if (box_change == 1) {
+    				init_cell_lists(cg, frame_source, pair_cell_list, three_body_cell_list);
+    				cell_list_version++;
+    				for (int i = 0; i < frame_source->position_dimension; i++) {
+    					ref_box_half_lengths[i] = frame_config->simulation_box_half_lengths[i];
+    				}
+    			}
+    			
+    			// Modify frame weight if using volume weighting.
+    			if (mat->volume_weighting_flag == 1) {
+    				double volume = 1.0;
+    				for (int i = 0; i < mat->position_dimension; i++) volume *= 2.0 * frame_config->simulation_box_half_lengths[i];
+    				mat->current_frame_weight *= volume * volume;
+    			}
+    			
+    			// Keep a copy of this frame since the frame source buffer is reused by the next read.
+    			FrameConfig* batch_config = batch_frame_configs[b];
+    			for (int i = 0; i < n_sites; i++) {
+    				batch_config->x[i] = frame_config->x[i];
+    				batch_config->f[i] = frame_config->f[i];
+    			}
+    			for (int i = 0; i < DIMENSION; i++) {
+    				batch_config->simulation_box_half_lengths[i] = frame_config->simulation_box_half_lengths[i];
+    			}
+    			
+    			// Each batch slot keeps its own cell lists; refresh them only after the box has changed.
+    			if (batch_cell_list_versions[b] != cell_list_version) {
+	    			batch_pair_cell_lists[b] = pair_cell_list;
+    				batch_three_body_cell_lists[b] = three_body_cell_list;
+    				batch_cell_list_versions[b] = cell_list_version;
+    			}
+    		}
+    		batch_frame_weights[b] = mat->current_frame_weight;
+    		
+    		// Read the next frame unless this is the last one.
+    		if (frame_index + 1 < total_frame_samples) {
+    			read_stat = (*frame_source->get_next_frame)(frame_source);
+    		}
+		}
+		
+		// The whole batch is a single frame block.
+		mat->trajectory_block_index = batch_start / mat->frames_per_traj_block;
+        (*mat->set_fm_matrix_to_zero)(mat);
+	    add_target_virials_from_trajectory(mat, frame_source->pressure_constraint_rhs_vector);
+		
+		// Compute the matrix elements for all frames in the batch.
+		#pragma omp parallel for ordered schedule(static, 1) num_threads(n_threads)
+		for (int b = 0; b < n_batch_frames; b++) {
+			int thread_index = omp_get_thread_num();
+			MATRIX_DATA* thread_mat = thread_mats[thread_index];
+			int frame_index = batch_start + b;
+			
+			thread_mat->current_frame_weight = batch_frame_weights[b];
+			thread_mat->trajectory_block_index = frame_index / mat->frames_per_traj_block;
+			thread_mat->force_sq_total = 0.0;
+			if (batch_process_flags[b] == 1) {
+				calculate_frame_fm_matrix(cg, thread_computers[thread_index], thread_mat, batch_frame_configs[b], batch_pair_cell_lists[b], batch_three_body_cell_lists[b], frame_index % mat->frames_per_traj_block);
+			}
+			
+			// Fold the frame's results into the shared totals in frame order.
+			#pragma omp ordered
+			{
+				mat->force_sq_total += thread_mat->force_sq_total;
+				if (batch_process_flags[b] == 1) mat->block_frame_weights[b] = thread_mat->block_frame_weights[b];
+				if (mat->matrix_type == kSparseNormal || mat->matrix_type == kDirectNormal) {
+					mat->sparse_fm_block->append_elements(thread_mat->sparse_fm_block);
+				}
+			}
+		}
+		
+		// Do end-of-block computations.
+		mat->current_frame_weight = batch_frame_weights[n_batch_frames - 1];
+        (*mat->do_end_of_frameblock_matrix_manipulations)(mat);
+        printf("\r%d (%d) frames have been sampled. ", frame_source->current_frame_n, batch_start + n_batch_frames);
+        fflush(stdout);
+	}
+	mat->trajectory_block_index = n_blocks;
+	
+	// Free the batch and thread-private temps.
+	for (int b = 0; b < batch_size; b++) {
+		delete batch_frame_configs[b];
+	}
+	for (int t = 0; t < n_threads; t++) {
+		delete thread_mats[t];
+		delete thread_computers[t];
+	}
+}
+#endif
@@ -33,11 +33,11 @@ void allocate_and_initialize_density_computer_for_range_finding(DensityClassComp
 void setup_site_to_density_group_index_for_range(DensityClassSpec* iclass);
 
 // Functions for computing the full range of sampling of a given class of interaction in a given trajectory.
-void calc_isotropic_two_body_sampling_range(InteractionClassComputer* const icomp, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat);
-void calc_angular_three_body_sampling_range(InteractionClassComputer* const icomp, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat);
-void calc_dihedral_four_body_interaction_sampling_range(InteractionClassComputer* const icomp, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat);
-void evaluate_density_sampling_range(InteractionClassComputer* const info, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat);
-void calc_nothing(InteractionClassComputer* const icomp, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat);
+void calc_isotropic_two_body_sampling_range(InteractionClassComputer* const icomp, std::array<frame_real, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat);
+void calc_angular_three_body_sampling_range(InteractionClassComputer* const icomp, std::array<frame_real, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat);
+void calc_dihedral_four_body_interaction_sampling_range(InteractionClassComputer* const icomp, std::array<frame_real, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat);
+void evaluate_density_sampling_range(InteractionClassComputer* const info, std::array<frame_real, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat);
+void calc_nothing(InteractionClassComputer* const icomp, std::array<frame_real, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat);
 
 void write_interaction_range_data_to_file(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat,  FILE* const nonbonded_spline_output_filep, FILE* const bonded_spline_output_filep, FILE* const density_interaction_output_filep);
 
@@ -54,8 +54,13 @@ void read_one_param_dist_file_other(InteractionClassComputer* const icomp, char
 void open_parameter_distribution_files_for_class(InteractionClassComputer* const icomp, char **name); 
 void close_parameter_distribution_files_for_class(InteractionClassComputer* const icomp);
 void remove_dist_files(InteractionClassComputer* const icomp, char **name);
+inline void record_parameter_value(InteractionClassComputer* const icomp, const double param);
 void generate_parameter_distribution_histogram(InteractionClassComputer* const icomp, char **name);
 
+// With output_*_parameter_distribution 3, parameter histograms are accumulated 
+// in bins this many times finer than the output bins.
+const int parameter_histogram_subbins = 32;
+
 // Dummy implementations
 void do_not_initialize_fm_matrix(MATRIX_DATA* const mat);
 
@@ -159,10 +164,12 @@ void initialize_single_class_range_finding_temps(InteractionClassSpec *iclass, I
     iclass->interaction_column_indices = std::vector<unsigned>(iclass->n_to_force_match + 1);
 	
 	char** name = select_name(iclass, topo_data->name);
-	if(iclass->output_parameter_distribution == 1 || iclass->output_parameter_distribution == 2 ){
+	if(iclass->output_parameter_distribution != 0){
 		if (iclass->class_type == kPairNonbonded || iclass->class_type == kPairBonded || 
-		           iclass->class_type == kAngularBonded || iclass->class_type == kDihedralBonded) {
-		    open_parameter_distribution_files_for_class(icomp, name);
+		           iclass->class_type == kAngularBonded || iclass->class_type == kDihedralBonded ||
+		           iclass->class_type == kDensity) {
+		    if (iclass->output_parameter_distribution == 3) iclass->parameter_histograms = std::vector<ParameterHistogram>(iclass->get_n_defined());
+		    else open_parameter_distribution_files_for_class(icomp, name);
 		} else {
 			// do nothing here
 		}
@@ -288,7 +295,7 @@ void setup_site_to_density_group_index_for_range(DensityClassSpec* iclass)
 
 //--------------------------------------------------------------------------
 
-void calc_isotropic_two_body_sampling_range(InteractionClassComputer* const icomp, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat)
+void calc_isotropic_two_body_sampling_range(InteractionClassComputer* const icomp, std::array<frame_real, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat)
 {
     int particle_ids[2] = {icomp->k, icomp->l};
     double param;
@@ -297,16 +304,16 @@ void calc_isotropic_two_body_sampling_range(InteractionClassComputer* const icom
     if (icomp->ispec->lower_cutoffs[icomp->index_among_defined_intrxns] > param) icomp->ispec->lower_cutoffs[icomp->index_among_defined_intrxns] = param;
     if (icomp->ispec->upper_cutoffs[icomp->index_among_defined_intrxns] < param) icomp->ispec->upper_cutoffs[icomp->index_among_defined_intrxns] = param;
 	
-	if (icomp->ispec->output_parameter_distribution == 1 || icomp->ispec->output_parameter_distribution == 2) {
+	if (icomp->ispec->output_parameter_distribution != 0) {
 		if (icomp->ispec->class_type == kPairBonded || icomp->ispec->class_type == kAngularBonded || icomp->ispec->class_type == kDihedralBonded) {
-			fprintf(icomp->ispec->output_range_file_handles[icomp->index_among_defined_intrxns], "%lf\n", param);
+			record_parameter_value(icomp, param);
 		} else if( (icomp->ispec->class_type == kPairNonbonded) && (param < icomp->ispec->cutoff)) {
-		 	fprintf(icomp->ispec->output_range_file_handles[icomp->index_among_defined_intrxns], "%lf\n", param);
+		 	record_parameter_value(icomp, param);
 		}
 	}
 }
 
-void calc_angular_three_body_sampling_range(InteractionClassComputer* const icomp, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat)
+void calc_angular_three_body_sampling_range(InteractionClassComputer* const icomp, std::array<frame_real, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat)
 {
     int particle_ids[3] = {icomp->k, icomp->l, icomp->j}; // end indices (k, l) followed by center index (j)
     double param;
@@ -315,10 +322,10 @@ void calc_angular_three_body_sampling_range(InteractionClassComputer* const icom
     if (icomp->ispec->lower_cutoffs[icomp->index_among_defined_intrxns] > param) icomp->ispec->lower_cutoffs[icomp->index_among_defined_intrxns] = param;
     if (icomp->ispec->upper_cutoffs[icomp->index_among_defined_intrxns] < param) icomp->ispec->upper_cutoffs[icomp->index_among_defined_intrxns] = param;
 	
-	if (icomp->ispec->output_parameter_distribution == 1 || icomp->ispec->output_parameter_distribution == 2) fprintf(icomp->ispec->output_range_file_handles[icomp->index_among_defined_intrxns], "%lf\n", param);
+	if (icomp->ispec->output_parameter_distribution != 0) record_parameter_value(icomp, param);
 }
 
-void calc_dihedral_four_body_interaction_sampling_range(InteractionClassComputer* const icomp, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat)
+void calc_dihedral_four_body_interaction_sampling_range(InteractionClassComputer* const icomp, std::array<frame_real, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat)
 {
 	if (mat->position_dimension != 3) {
     	printf("Dihedral calculations are currently only implemented for 3-dimensional systems.\n");
@@ -332,10 +339,10 @@ void calc_dihedral_four_body_interaction_sampling_range(InteractionClassComputer
     if (icomp->ispec->lower_cutoffs[icomp->index_among_defined_intrxns] > param) icomp->ispec->lower_cutoffs[icomp->index_among_defined_intrxns] = param;
     if (icomp->ispec->upper_cutoffs[icomp->index_among_defined_intrxns] < param) icomp->ispec->upper_cutoffs[icomp->index_among_defined_intrxns] = param;
 	
-	if (icomp->ispec->output_parameter_distribution == 1 || icomp->ispec->output_parameter_distribution == 2) fprintf(icomp->ispec->output_range_file_handles[icomp->index_among_defined_intrxns], "%lf\n", param);
+	if (icomp->ispec->output_parameter_distribution != 0) record_parameter_value(icomp, param);
 }
 
-void evaluate_density_sampling_range(InteractionClassComputer* const info, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat)
+void evaluate_density_sampling_range(InteractionClassComputer* const info, std::array<frame_real, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat)
 {
 	DensityClassComputer* icomp = static_cast<DensityClassComputer*>(info);
 	DensityClassSpec* ispec = static_cast<DensityClassSpec*>(icomp->ispec);	
@@ -344,10 +351,180 @@ void evaluate_density_sampling_range(InteractionClassComputer* const info, std::
 	if (icomp->ispec->lower_cutoffs[icomp->index_among_defined_intrxns] > param) icomp->ispec->lower_cutoffs[icomp->index_among_defined_intrxns] = param;
     if (icomp->ispec->upper_cutoffs[icomp->index_among_defined_intrxns] < param) icomp->ispec->upper_cutoffs[icomp->index_among_defined_intrxns] = param;
 	
-	if (icomp->ispec->output_parameter_distribution == 1 || icomp->ispec->output_parameter_distribution == 2) fprintf(icomp->ispec->output_range_file_handles[icomp->index_among_defined_intrxns], "%lf\n", param);
+	if (icomp->ispec->output_parameter_distribution != 0) record_parameter_value(icomp, param);
+}
+
+void calc_nothing(InteractionClassComputer* const icomp, std::array<frame_real, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat) {
 }
 
-void calc_nothing(InteractionClassComputer* const icomp, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat) {
+//--------------------------------------------------------------------------
+
+// Find the range of every interaction over all frames of frame_source.
+// If frame_cache is not NULL, every frame read is also appended to it.
+
+void find_interaction_ranges(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, FrameSource* const frame_source, BinaryTrajectoryWriter* const frame_cache)
+{
+    int n_blocks;
+	int total_frame_samples = frame_source->n_frames;
+	int traj_frame_num = 0;
+	int times_sampled = 1;
+    int read_stat = 1;
+	double* ref_box_half_lengths = new double[frame_source->position_dimension];
+	    
+    // Skip the desired number of frames before starting the matrix building loops.
+    frame_source->move_to_start_frame(frame_source);
+    
+    // Read the remaining frames ahead in a separate thread if requested.
+    start_frame_prefetch(frame_source, frame_source->n_frames - 1);
+    
+    // Perform initial generation of cell lists user for generating neighbor lists.
+    // This list will only be rebuilt if the box dimensions change.
+    
+    // Initialize the cell linked lists for finding neighbors in the provided frames;
+  	PairCellList pair_cell_list = PairCellList();
+    ThreeBCellList three_body_cell_list = ThreeBCellList();
+    pair_cell_list.init(cg->pair_nonbonded_interactions.cutoff + cg->verlet_skin, frame_source);
+    if (cg->three_body_nonbonded_interactions.class_subtype > 0) {
+    	double max_cutoff = 0.0;
+        for (int i = 0; i < cg->three_body_nonbonded_interactions.get_n_defined(); i++) {
+        	max_cutoff = fmax(max_cutoff, cg->three_body_nonbonded_interactions.three_body_nonbonded_cutoffs[i]);
+        }
+    three_body_cell_list.init(max_cutoff, frame_source);
+    }
+	
+	// Record this box's dimensions.
+	for (int i = 0; i < frame_source->position_dimension; i++) {
+		ref_box_half_lengths[i] = frame_source->frame_config->simulation_box_half_lengths[i];
+	}
+
+    // Begin the main building loops. This routine operates as a for loop
+    // over frame blocks wrapped around a loop over frames within each block.
+    // In the inner loop, frames are read every iteration and new matrix elements are computed.
+    // In the outer loop, the blockwise matrix is incorporated into the total equations, 
+    // then wiped for the process to start again with the next iteration.
+
+    // Set up the loop index limits for the inner and outer loops.
+	if (frame_source->dynamic_state_sampling == 1) {
+		total_frame_samples = frame_source->n_frames * frame_source->dynamic_state_samples_per_frame;
+	}
+	
+    if (mat->matrix_type == kDense) {
+        n_blocks = total_frame_samples;
+        mat->frames_per_traj_block = 1;
+    } else {
+		// Check if number of frames is divisible by frames per trajectory block.
+		if (total_frame_samples % mat->frames_per_traj_block != 0) {
+			printf("Total number of frame samples %d is not divisible by block size %d.\n", total_frame_samples, mat->frames_per_traj_block);
+			exit(EXIT_FAILURE);
+		}
+		n_blocks = total_frame_samples / mat->frames_per_traj_block;
+	}
+
+    mat->accumulation_row_shift = 0;
+
+    // For each block of frame samples.
+    printf("Entering primary matrix-building loop.\n"); fflush(stdout);
+    for (mat->trajectory_block_index = 0; mat->trajectory_block_index < n_blocks; mat->trajectory_block_index++) {
+        
+        // Wipe the matrix, then calculate the target virial for all frames in this block.
+        (*mat->set_fm_matrix_to_zero)(mat);
+        add_target_virials_from_trajectory(mat, frame_source->pressure_constraint_rhs_vector);
+
+        // For each frame sample in this block
+        for (int trajectory_block_frame_index = 0; trajectory_block_frame_index < mat->frames_per_traj_block; trajectory_block_frame_index++) {
+	
+		    // Check that the last frame was read successfully (read at end of each iteration)
+    		if (read_stat == 0) {
+        		printf("Failure reading frame %d (%d). Check trajectory for errors.\n", frame_source->current_frame_n, mat->trajectory_block_index * mat->frames_per_traj_block + trajectory_block_frame_index);
+        		exit(EXIT_FAILURE);
+    		}
+
+    		// Keep a copy of each newly read frame (not of each resampling of it) if requested.
+    		if (frame_cache != NULL && times_sampled == 1) write_binary_trajectory_frame(frame_cache, frame_source);
+
+            // If reweighting is being used, scale the block of the FM matrix for this frame
+            // by the appropriate weighting factor
+            if (frame_source->use_statistical_reweighting) {
+                printf("Reweighting entries for trajectory frame %d. ", traj_frame_num);
+                mat->current_frame_weight = frame_source->frame_weights[traj_frame_num];
+            }
+            
+            //Skip processing frame if frame weight is 0.
+            if (frame_source->use_statistical_reweighting && mat->current_frame_weight == 0.0) {
+            } else {
+            
+            	// Check if the simulation box has changed.
+            	int box_change = 0;
+            	for (int i = 0; i < frame_source->position_dimension; i++) {
+					if ( fabs(ref_box_half_lengths[i] - frame_source->frame_config->simulation_box_half_lengths[i]) > VERYSMALL_F ) {
+						box_change = 1;
+						break;
+					}
+				}
+				
+				// Redo cell list set-up and update reference box size if box has changed.
+				if (box_change == 1) {
+	            	// Re-initialize the cell linked lists for finding neighbors in the provided frames;
+    				pair_cell_list.init(cg->pair_nonbonded_interactions.cutoff + cg->verlet_skin, frame_source);
+    				if (cg->three_body_nonbonded_interactions.class_subtype > 0) {
+        				double max_cutoff = 0.0;
+        				for (int i = 0; i < cg->three_body_nonbonded_interactions.get_n_defined(); i++) {
+            				max_cutoff = fmax(max_cutoff, cg->three_body_nonbonded_interactions.three_body_nonbonded_cutoffs[i]);
+        				}
+        				three_body_cell_list.init(max_cutoff, frame_source);
+    				}
+    				
+    				// Update the reference_box_half_lengths for this new box size.
+    				for (int i = 0; i < frame_source->position_dimension; i++) {
+    					ref_box_half_lengths[i] = frame_source->frame_config->simulation_box_half_lengths[i];
+    				}
+    			}
+                FrameConfig* frame_config = frame_source->getFrameConfig();
+    			calculate_frame_fm_matrix(cg, mat, frame_config, pair_cell_list, three_body_cell_list, trajectory_block_frame_index);
+            }
+
+            // Read the next frame; the success of this read will be
+            // checked at the start of the next iteration of the loop.
+            if (frame_source->dynamic_state_sampling == 0) {
+				// Read next frame.
+				// Only do this if we are not currently process the last frame.
+				if ( ((trajectory_block_frame_index + 1) < mat->frames_per_traj_block) ||
+			         ((mat->trajectory_block_index + 1) < n_blocks) ) {
+					read_stat = (*frame_source->get_next_frame)(frame_source);  
+				}
+				traj_frame_num++;
+			
+			} else if (times_sampled < frame_source->dynamic_state_samples_per_frame) {
+				// Resample this frame.
+				frame_source->sampleTypesFromProbs();
+				times_sampled++;
+			
+			} else {
+				// Read next frame, sample frame, and reset sampling counter.
+				// Only do this if we are not currently process the last frame.
+				if ( ((trajectory_block_frame_index + 1) < mat->frames_per_traj_block) ||
+			         ((mat->trajectory_block_index + 1) < n_blocks) ) {
+					read_stat = (*frame_source->get_next_frame)(frame_source);  
+				}
+				frame_source->sampleTypesFromProbs();
+				times_sampled = 1;
+				traj_frame_num++;
+			
+			}
+		}
+
+        // Print status and do end-of-block computations before wiping the blockwise matrix and beginning anew
+        printf("\r%d (%d) frames have been sampled. ", frame_source->current_frame_n, (mat->trajectory_block_index + 1) * mat->frames_per_traj_block);
+        fflush(stdout);
+        (*mat->do_end_of_frameblock_matrix_manipulations)(mat);
+	}
+
+    printf("\nFinishing frame parsing.\n");
+    
+    // Close the trajectory and free the relevant temp variables.
+    frame_source->cleanup(frame_source);
+    delete [] ref_box_half_lengths;
+    
 }
 
 //--------------------------------------------------------------------------
@@ -393,14 +570,14 @@ void write_iclass_range_specifications(InteractionClassComputer* const icomp, ch
         }
     }
 	
-	if (iclass->output_parameter_distribution == 1 || iclass->output_parameter_distribution == 2) {
+	if (iclass->output_parameter_distribution != 0) {
 		if(iclass->class_type == kDensity && iclass->class_subtype > 0) {
-			close_parameter_distribution_files_for_class(icomp);
+			if (iclass->output_parameter_distribution != 3) close_parameter_distribution_files_for_class(icomp);
 			generate_parameter_distribution_histogram(icomp, name); // name is set correctly in write_interaction_range_data_to_file
 			remove_dist_files(icomp, name);
 		} else if (iclass->class_type == kPairNonbonded || iclass->class_type == kPairBonded || 
 		           iclass->class_type == kAngularBonded || iclass->class_type == kDihedralBonded) {
-			close_parameter_distribution_files_for_class(icomp);
+			if (iclass->output_parameter_distribution != 3) close_parameter_distribution_files_for_class(icomp);
 			generate_parameter_distribution_histogram(icomp, name);
 			remove_dist_files(icomp, name);
 		} else {
@@ -516,10 +693,37 @@ void remove_dist_files(InteractionClassComputer* const icomp, char **name)
 		// get name of dist file
 		std::string filename = ispec->get_basename(name, i, "_") + ".dist";
 		// remove file
-		remove(filename.c_str());
+		remove(output_file_name(filename.c_str()).c_str());
 	}
 }
 
+// Add one sampled parameter value to the interaction's .dist file or,
+// when output_parameter_distribution is 3, to its in-memory histogram.
+
+inline void record_parameter_value(InteractionClassComputer* const icomp, const double param)
+{
+	InteractionClassSpec* ispec = icomp->ispec;
+	if (ispec->output_parameter_distribution != 3) {
+		fprintf(ispec->output_range_file_handles[icomp->index_among_defined_intrxns], "%lf\n", param);
+		return;
+	}
+	
+	ParameterHistogram& hist = ispec->parameter_histograms[icomp->index_among_defined_intrxns];
+	int bin = (int)(floor(param * parameter_histogram_subbins / (0.5 * ispec->get_fm_binwidth())));
+	
+	// Grow the histogram in either direction to cover this bin.
+	if (hist.counts.empty()) {
+		hist.first_bin = bin;
+		hist.counts.resize(1, 0);
+	} else if (bin < hist.first_bin) {
+		hist.counts.insert(hist.counts.begin(), hist.first_bin - bin, 0);
+		hist.first_bin = bin;
+	} else if (bin - hist.first_bin >= (int)(hist.counts.size())) {
+		hist.counts.resize(bin - hist.first_bin + 1, 0);
+	}
+	hist.counts[bin - hist.first_bin]++;
+}
+
 void generate_parameter_distribution_histogram(InteractionClassComputer* const icomp, char **name)
 {
 	// Name is selected in calling function 2x up named write_interaction_range_data_to_file.
@@ -531,6 +735,7 @@ void generate_parameter_distribution_histogram(InteractionClassComputer* const i
 	int num_bins = 0;
 	int	curr_bin;
 	double value; 
+	double half_binwidth = 0.5 * ispec->get_fm_binwidth();
 	double* bin_centers;
 	unsigned long* bin_counts;
 	for (int i = 0; i < ispec->get_n_defined(); i++) {
@@ -550,26 +755,44 @@ void generate_parameter_distribution_histogram(InteractionClassComputer* const i
 	      bin_centers[j] = bin_centers[j - 1] + (0.5 * ispec->get_fm_binwidth());
         }
 		
-		// Open distribution file
-	 	filename = ispec->get_basename(name, i, "_") + ".dist";
-		check_and_open_in_stream(dist_stream, filename.c_str()); 
-		
-		// Populate histogram by reading distribution file
-		dist_stream >> value;
-		while (!dist_stream.fail()) {
-		  curr_bin = (int)(floor((value - ispec->lower_cutoffs[i] + VERYSMALL_F) / (0.5 * ispec->get_fm_binwidth())));	
-			if( (curr_bin < num_bins) && (curr_bin >= 0) ) {
-				bin_counts[curr_bin]++;
-			} else if (curr_bin > num_bins) {
-				printf("Warning: Bin %d is out-of-bounds. Array size: %d\n", curr_bin, num_bins);
-				fflush(stdout);
-			}
+		if (ispec->output_parameter_distribution != 3) {
+			// Open distribution file
+		 	filename = ispec->get_basename(name, i, "_") + ".dist";
+			check_and_open_in_stream(dist_stream, output_file_name(filename.c_str()).c_str()); 
+			
+			// Populate histogram by reading distribution file
 			dist_stream >> value;
+			while (!dist_stream.fail()) {
+			  curr_bin = (int)(floor((value - ispec->lower_cutoffs[i] + VERYSMALL_F) / half_binwidth));	
+				if( (curr_bin < num_bins) && (curr_bin >= 0) ) {
+					bin_counts[curr_bin]++;
+				} else if (curr_bin > num_bins) {
+					printf("Warning: Bin %d is out-of-bounds. Array size: %d\n", curr_bin, num_bins);
+					fflush(stdout);
+				}
+				dist_stream >> value;
+			}
+			dist_stream.close();
+		} else {
+			// Move the counts accumulated during range finding onto these bins.
+			// The output bins start at the final lower cutoff, which is only known now,
+			// so each finer accumulated bin goes to the output bin containing its center.
+			ParameterHistogram& hist = ispec->parameter_histograms[i];
+			for (unsigned j = 0; j < hist.counts.size(); j++) {
+				double center = (hist.first_bin + (int)(j) + 0.5) * half_binwidth / parameter_histogram_subbins;
+				curr_bin = (int)(floor((center - ispec->lower_cutoffs[i] + VERYSMALL_F) / half_binwidth));
+				if( (curr_bin < num_bins) && (curr_bin >= 0) ) {
+					bin_counts[curr_bin] += hist.counts[j];
+				} else if (curr_bin > num_bins && hist.counts[j] > 0) {
+					printf("Warning: Bin %d is out-of-bounds. Array size: %d\n", curr_bin, num_bins);
+					fflush(stdout);
+				}
+			}
 		}
 
 		// Write histogram to file
 		filename = ispec->get_basename(name, i, "_") + ".hist";
-		hist_stream.open(filename, std::ofstream::out);
+		hist_stream.open(output_file_name(filename.c_str()), std::ofstream::out);
 		hist_stream << "#center\tcounts\n";
 		for (int j = 0; j < num_bins; j++) {
 			hist_stream << bin_centers[j] << "\t" << bin_counts[j] << "\n";
@@ -577,12 +800,114 @@ void generate_parameter_distribution_histogram(InteractionClassComputer* const i
 		
 		// Close files
 		hist_stream.close();
-		dist_stream.close();
 		delete [] bin_centers;
 		delete [] bin_counts;
 	}
 }
 
+// Write the sampled range and parameter histogram of every interaction, followed by the 
+// last box read, so that another process can combine them with those from other frames.
+
+void write_partial_range_results(CG_MODEL_DATA* const cg, FrameSource* const fs, const char* filename)
+{
+	FILE* partial_file = open_file(filename, "wb");
+	size_t n_written = 0, n_expected = 0;
+	std::list<InteractionClassComputer*>::iterator icomp_iterator;
+	for(icomp_iterator = cg->icomp_list.begin(); icomp_iterator != cg->icomp_list.end(); icomp_iterator++) {
+		InteractionClassSpec* ispec = (*icomp_iterator)->ispec;
+		int n_defined = ispec->get_n_defined();
+		n_written += fwrite(ispec->lower_cutoffs, sizeof(double), n_defined, partial_file);
+		n_written += fwrite(ispec->upper_cutoffs, sizeof(double), n_defined, partial_file);
+		n_expected += 2 * n_defined;
+		
+		int n_histograms = (int)(ispec->parameter_histograms.size());
+		n_written += fwrite(&n_histograms, sizeof(int), 1, partial_file);
+		n_expected++;
+		for (int i = 0; i < n_histograms; i++) {
+			ParameterHistogram& hist = ispec->parameter_histograms[i];
+			int n_bins = (int)(hist.counts.size());
+			n_written += fwrite(&hist.first_bin, sizeof(int), 1, partial_file);
+			n_written += fwrite(&n_bins, sizeof(int), 1, partial_file);
+			n_expected += 2;
+			if (n_bins > 0) n_written += fwrite(&hist.counts[0], sizeof(unsigned long), n_bins, partial_file);
+			n_expected += n_bins;
+		}
+	}
+	n_written += fwrite(fs->simulation_box_limits, sizeof(matrix), 1, partial_file);
+	n_expected++;
+	// A worker that cannot write all of its results fails so that the parent process discards them.
+	if ( (fclose(partial_file) != 0) || (n_written != n_expected) ) {
+		printf("Could not write partial range results to %s.\n", filename);
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Combine the files written by write_partial_range_results in frame order: ranges are widened
+// to cover every file, histograms are summed, and the box is taken from the last file.
+
+void combine_partial_range_results(CG_MODEL_DATA* const cg, FrameSource* const fs, const int n_files, const std::string* const filenames)
+{
+	size_t n_read = 0, n_expected = 0;
+	for (int f = 0; f < n_files; f++) {
+		FILE* partial_file = open_file(filenames[f].c_str(), "rb");
+		std::list<InteractionClassComputer*>::iterator icomp_iterator;
+		for(icomp_iterator = cg->icomp_list.begin(); icomp_iterator != cg->icomp_list.end(); icomp_iterator++) {
+			InteractionClassSpec* ispec = (*icomp_iterator)->ispec;
+			int n_defined = ispec->get_n_defined();
+			std::vector<double> cutoffs(2 * n_defined + 1);
+			n_read += fread(&cutoffs[0], sizeof(double), 2 * n_defined, partial_file);
+			n_expected += 2 * n_defined;
+			for (int i = 0; i < n_defined; i++) {
+				if (cutoffs[i] < ispec->lower_cutoffs[i]) ispec->lower_cutoffs[i] = cutoffs[i];
+				if (cutoffs[n_defined + i] > ispec->upper_cutoffs[i]) ispec->upper_cutoffs[i] = cutoffs[n_defined + i];
+			}
+			
+			int n_histograms = 0;
+			n_read += fread(&n_histograms, sizeof(int), 1, partial_file);
+			n_expected++;
+			if (n_histograms != (int)(ispec->parameter_histograms.size())) {
+				printf("Partial range result file %s does not match this model.\n", filenames[f].c_str());
+				fclose(partial_file);
+				for (int g = 0; g < n_files; g++) remove(filenames[g].c_str());
+				exit(EXIT_FAILURE);
+			}
+			for (int i = 0; i < n_histograms; i++) {
+				ParameterHistogram& hist = ispec->parameter_histograms[i];
+				int first_bin = 0, n_bins = 0;
+				n_read += fread(&first_bin, sizeof(int), 1, partial_file);
+				n_read += fread(&n_bins, sizeof(int), 1, partial_file);
+				n_expected += 2;
+				if (n_bins <= 0) continue;
+				std::vector<unsigned long> counts(n_bins);
+				n_read += fread(&counts[0], sizeof(unsigned long), n_bins, partial_file);
+				n_expected += n_bins;
+				
+				// Grow this histogram to cover the bins read before adding them.
+				if (hist.counts.empty()) {
+					hist.first_bin = first_bin;
+					hist.counts.resize(n_bins, 0);
+				}
+				if (first_bin < hist.first_bin) {
+					hist.counts.insert(hist.counts.begin(), hist.first_bin - first_bin, 0);
+					hist.first_bin = first_bin;
+				}
+				if (first_bin + n_bins > hist.first_bin + (int)(hist.counts.size())) {
+					hist.counts.resize(first_bin + n_bins - hist.first_bin, 0);
+				}
+				for (int j = 0; j < n_bins; j++) hist.counts[first_bin - hist.first_bin + j] += counts[j];
+			}
+		}
+		n_read += fread(fs->simulation_box_limits, sizeof(matrix), 1, partial_file);
+		n_expected++;
+		fclose(partial_file);
+		if (n_read != n_expected) {
+			printf("Partial range result file %s is incomplete.\n", filenames[f].c_str());
+			for (int g = 0; g < n_files; g++) remove(filenames[g].c_str());
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
 void calculate_BI(CG_MODEL_DATA* const cg, MATRIX_DATA* mat, FrameSource* const fs)
 {
   initialize_first_BI_matrix(mat, cg);
@@ -8,15 +8,24 @@
 #ifndef _range_finding_h
 #define _range_finding_h
 
+#include <string>
+
 struct CG_MODEL_DATA;
 struct MATRIX_DATA;
 
 // Initialization of storage for the range value arrays and their computation
 void initialize_range_finding_temps(CG_MODEL_DATA* const cg);
 
+// Range finding over all frames of a trajectory, optionally copying each frame to frame_cache
+void find_interaction_ranges(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, FrameSource* const frame_source, BinaryTrajectoryWriter* const frame_cache);
+
 // Main output function
 void write_range_files(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat);
 
+// Passing partial results between rangefinder worker processes
+void write_partial_range_results(CG_MODEL_DATA* const cg, FrameSource* const fs, const char* filename);
+void combine_partial_range_results(CG_MODEL_DATA* const cg, FrameSource* const fs, const int n_files, const std::string* const filenames);
+
 // BI implementations
 void calculate_BI(CG_MODEL_DATA* const cg, MATRIX_DATA* mat, FrameSource* const fs);
 bool any_active_parameter_distributions(CG_MODEL_DATA* const cg);
@@ -5,7 +5,11 @@
 //  Copyright (c) 2016 The Voth Group at The University of Chicago. All rights reserved.
 //
 
+#include <algorithm>
 #include <cassert>
+#include <cfloat>
+#include <cstdio>
+#include <cstdlib>
 #include "splines.h"
 #include "interaction_model.h"
 
@@ -18,6 +22,14 @@ inline void check_bspline_sizing(const size_t coeffs_size, const int first_nonze
 inline void adjust_splines_for_periodicity(const InteractionClassType class_type, const int n_coef, const std::vector<unsigned> defined_to_periodic_intrxn_index_map, std::vector<unsigned> &interaction_column_indices);
 inline void shift_remaining_indices(const int start, const int bspline_k, std::vector<unsigned> &interaction_column_indices, const int size);
 
+// Helper functions for evaluating B-splines without GSL
+template<int K> void uniform_bspline_values(const double* const knots, const int left, const double x, double* const vals);
+template<int K> void uniform_bspline_derivs(const double* const knots, const int left, const double x, double* const derivs);
+template<int K> void uniform_bspline_values_batch(const double* const knots, const int n, const int* const left, const double* const x, double* const vals);
+
+// Number of values evaluated together by uniform_bspline_values_batch.
+const int kBSplineBatchLanes = 32;
+
 SplineComputer* set_up_fm_spline_comp(InteractionClassSpec *ispec)
 {
     if (ispec->n_to_force_match > 0) {
@@ -76,6 +88,150 @@ double SplineComputer::get_param_less_lower_cutoff(const int index_among_defined
     return param_less_lower_cutoff;
 }
 
+// Evaluate the basis one value at a time; spline computers with a faster batched evaluation override this.
+void SplineComputer::calculate_basis_fn_vals_batch(const int index_among_defined, const int n, const double* const param_vals, int* const first_nonzero_basis_indices, double* const vals)
+{
+	batch_lane_vals.resize(n_coef);
+	for (int p = 0; p < n; p++) {
+		calculate_basis_fn_vals(index_among_defined, param_vals[p], first_nonzero_basis_indices[p], batch_lane_vals);
+		for (unsigned i = 0; i < n_coef; i++) vals[p * n_coef + i] = batch_lane_vals[i];
+	}
+}
+
+
+UniformBSplineBasis::UniformBSplineBasis(const int k, const int n_break, const double lower, const double upper) :
+	k(k), n_break(n_break), lower(lower), upper(upper)
+{
+	switch (k) {
+	case 4:
+		eval_values = uniform_bspline_values<4>;
+		eval_derivs = uniform_bspline_derivs<4>;
+		eval_values_batch = uniform_bspline_values_batch<4>;
+		break;
+	case 5:
+		eval_values = uniform_bspline_values<5>;
+		eval_derivs = uniform_bspline_derivs<5>;
+		eval_values_batch = uniform_bspline_values_batch<5>;
+		break;
+	case 6:
+		eval_values = uniform_bspline_values<6>;
+		eval_derivs = uniform_bspline_derivs<6>;
+		eval_values_batch = uniform_bspline_values_batch<6>;
+		break;
+	default:
+		fprintf(stderr, "No native B-spline evaluation for spline order %d.\n", k);
+		exit(EXIT_FAILURE);
+	}
+
+	// Place the knots the same way gsl_bspline_knots_uniform does so that
+	// both evaluations agree to rounding.
+	double delta = (upper - lower) / (double)(n_break - 1);
+	inv_delta = 1.0 / delta;
+	knots.resize(2 * k + n_break - 2);
+	for (int i = 0; i < k; i++) knots[i] = lower;
+	double x = lower + delta;
+	for (int i = 0; i < n_break - 2; i++) {
+		knots[k + i] = x;
+		x += delta;
+	}
+	for (int i = k + n_break - 2; i < 2 * k + n_break - 2; i++) knots[i] = upper;
+}
+
+// Find the knot interval [knots[left], knots[left + 1]) containing x.
+// The guess from the uniform spacing is corrected against the stored knots.
+int UniformBSplineBasis::find_interval(const double x) const
+{
+	if (x < lower || x > upper + DBL_EPSILON) {
+		fprintf(stderr, "Value to evaluate (%lf) is outside of this B-spline's knots (%lf to %lf)!\n", x, lower, upper);
+		exit(EXIT_FAILURE);
+	}
+	
+	int first = k - 1;
+	int last = k + n_break - 3;
+	int left = first + (int)((x - lower) * inv_delta);
+	if (left > last) left = last;
+	while (left > first && x < knots[left]) left--;
+	while (left < last && x >= knots[left + 1]) left++;
+	return left;
+}
+
+void UniformBSplineBasis::eval_nonzero_batch(const int n, const double* const x, int* const first_indices, double* const vals) const
+{
+	for (int p = 0; p < n; p++) first_indices[p] = find_interval(x[p]);
+	(*eval_values_batch)(&knots[0], n, first_indices, x, vals);
+	for (int p = 0; p < n; p++) first_indices[p] -= k - 1;
+}
+
+// Values of the K B-splines of order K that are nonzero on the interval
+// starting at knots[left], by the Cox-de Boor recurrence.
+template<int K> void uniform_bspline_values(const double* const knots, const int left, const double x, double* const vals)
+{
+	double delta_r[K];
+	double delta_l[K];
+	vals[0] = 1.0;
+	for (int j = 0; j < K - 1; j++) {
+		delta_r[j] = knots[left + j + 1] - x;
+		delta_l[j] = x - knots[left - j];
+		double saved = 0.0;
+		for (int i = 0; i <= j; i++) {
+			double term = vals[i] / (delta_r[i] + delta_l[j - i]);
+			vals[i] = saved + delta_r[i] * term;
+			saved = delta_l[j - i] * term;
+		}
+		vals[j + 1] = saved;
+	}
+}
+
+// The same recurrence as uniform_bspline_values for n values at once, each with its own interval.
+// Values are taken in groups of kBSplineBatchLanes with the recurrence innermost over the group,
+// so each step is vectorized across the group and gives the same results as the scalar version.
+template<int K> void uniform_bspline_values_batch(const double* const knots, const int n, const int* const left, const double* const x, double* const vals)
+{
+	double lane_vals[K][kBSplineBatchLanes];
+	double delta_r[K - 1][kBSplineBatchLanes];
+	double delta_l[K - 1][kBSplineBatchLanes];
+	double saved[kBSplineBatchLanes];
+	for (int start = 0; start < n; start += kBSplineBatchLanes) {
+		const int n_lanes = std::min(kBSplineBatchLanes, n - start);
+		const int* const lane_left = left + start;
+		const double* const lane_x = x + start;
+		for (int p = 0; p < n_lanes; p++) lane_vals[0][p] = 1.0;
+		for (int j = 0; j < K - 1; j++) {
+			for (int p = 0; p < n_lanes; p++) {
+				delta_r[j][p] = knots[lane_left[p] + j + 1] - lane_x[p];
+				delta_l[j][p] = lane_x[p] - knots[lane_left[p] - j];
+				saved[p] = 0.0;
+			}
+			for (int i = 0; i <= j; i++) {
+				#pragma omp simd
+				for (int p = 0; p < n_lanes; p++) {
+					double term = lane_vals[i][p] / (delta_r[i][p] + delta_l[j - i][p]);
+					lane_vals[i][p] = saved[p] + delta_r[i][p] * term;
+					saved[p] = delta_l[j - i][p] * term;
+				}
+			}
+			for (int p = 0; p < n_lanes; p++) lane_vals[j + 1][p] = saved[p];
+		}
+		for (int p = 0; p < n_lanes; p++) {
+			for (int i = 0; i < K; i++) vals[(start + p) * K + i] = lane_vals[i][p];
+		}
+	}
+}
+
+// First derivatives of the same K B-splines from the order K - 1 values.
+template<int K> void uniform_bspline_derivs(const double* const knots, const int left, const double x, double* const derivs)
+{
+	double lower_vals[K - 1];
+	uniform_bspline_values<K - 1>(knots, left, x, lower_vals);
+	
+	const double order_less_one = (double)(K - 1);
+	derivs[0] = 0.0;
+	for (int i = 0; i < K - 1; i++) {
+		double term = order_less_one * lower_vals[i] / (knots[left + i + 1] - knots[left + i + 2 - K]);
+		derivs[i] -= term;
+		derivs[i + 1] = term;
+	}
+}
 
 BSplineComputer::BSplineComputer(InteractionClassSpec* ispec) : SplineComputer(ispec)
 {
@@ -86,9 +242,17 @@ BSplineComputer::BSplineComputer(InteractionClassSpec* ispec) : SplineComputer(i
 		exit(EXIT_FAILURE);
     }
 
+    use_native_bsplines = (ispec->get_native_bspline_flag() != 0) && UniformBSplineBasis::has_native_order((int)(n_coef));
     printf("Allocating b-spline temporaries for %d interactions.\n", n_to_force_match);
-    bspline_workspaces = new gsl_bspline_workspace*[n_to_force_match];
-    bspline_vectors = gsl_vector_alloc(n_coef);
+    if (use_native_bsplines) {
+	    bspline_workspaces = NULL;
+	    bspline_vectors = NULL;
+	    native_bases.reserve(n_to_force_match);
+	    nonzero_vals.resize(n_coef);
+    } else {
+	    bspline_workspaces = new gsl_bspline_workspace*[n_to_force_match];
+	    bspline_vectors = gsl_vector_alloc(n_coef);
+	}
 	adjust_splines_for_periodicity(ispec->class_type, n_coef, ispec->defined_to_periodic_intrxn_index_map, interaction_column_indices_);
 	
     int counter = 0;
@@ -97,8 +261,12 @@ BSplineComputer::BSplineComputer(InteractionClassSpec* ispec) : SplineComputer(i
             ici_index = interaction_column_indices_[counter + 1] - interaction_column_indices_[counter];
             n_to_print_minus_bspline_k = ici_index - n_coef + 2;
             check_bspline_size(n_to_print_minus_bspline_k, (int)(n_coef));
-            bspline_workspaces[counter] = gsl_bspline_alloc(n_coef, n_to_print_minus_bspline_k);
-            gsl_bspline_knots_uniform(ispec_->lower_cutoffs[i] - VERYSMALL_F, ispec_->upper_cutoffs[i] + VERYSMALL_F, bspline_workspaces[counter]);
+            if (use_native_bsplines) {
+            	native_bases.push_back(UniformBSplineBasis((int)(n_coef), n_to_print_minus_bspline_k, ispec_->lower_cutoffs[i] - VERYSMALL_F, ispec_->upper_cutoffs[i] + VERYSMALL_F));
+            } else {
+	            bspline_workspaces[counter] = gsl_bspline_alloc(n_coef, n_to_print_minus_bspline_k);
+	            gsl_bspline_knots_uniform(ispec_->lower_cutoffs[i] - VERYSMALL_F, ispec_->upper_cutoffs[i] + VERYSMALL_F, bspline_workspaces[counter]);
+	        }
             counter++;
         }
     }
@@ -106,6 +274,7 @@ BSplineComputer::BSplineComputer(InteractionClassSpec* ispec) : SplineComputer(i
 
 BSplineComputer::~BSplineComputer()
 {
+    if (use_native_bsplines) return;
     for (unsigned i = 0; i < n_to_force_match; i++) {
         gsl_bspline_free(bspline_workspaces[i]);
     }
@@ -123,6 +292,10 @@ void BSplineComputer::calculate_basis_fn_vals(const int index_among_defined, con
     first_nonzero_basis_index = (int)(param_less_lower_cutoff / ispec_->get_fm_binwidth());
 
     int index_among_matched = ispec_->defined_to_matched_intrxn_index_map[index_among_defined] - 1;
+    if (use_native_bsplines) {
+    	first_nonzero_basis_index = native_bases[index_among_matched].eval_nonzero(param_less_lower_cutoff + ispec_->lower_cutoffs[index_among_defined], &vals[0]);
+    	return;
+    }
     gsl_bspline_eval_nonzero(param_less_lower_cutoff + ispec_->lower_cutoffs[index_among_defined], bspline_vectors, &istart, &iend, bspline_workspaces[index_among_matched]);
     first_nonzero_basis_index = istart;
     
@@ -131,6 +304,21 @@ void BSplineComputer::calculate_basis_fn_vals(const int index_among_defined, con
     }
 }
 
+// Batched version of the above; the native basis evaluates all the values together.
+void BSplineComputer::calculate_basis_fn_vals_batch(const int index_among_defined, const int n, const double* const param_vals, int* const first_nonzero_basis_indices, double* const vals)
+{
+	if (!use_native_bsplines) {
+		SplineComputer::calculate_basis_fn_vals_batch(index_among_defined, n, param_vals, first_nonzero_basis_indices, vals);
+		return;
+	}
+	batch_x.resize(n);
+	for (int p = 0; p < n; p++) {
+		batch_x[p] = get_param_less_lower_cutoff(index_among_defined, param_vals[p]) + ispec_->lower_cutoffs[index_among_defined];
+	}
+	int index_among_matched = ispec_->defined_to_matched_intrxn_index_map[index_among_defined] - 1;
+	native_bases[index_among_matched].eval_nonzero_batch(n, &batch_x[0], first_nonzero_basis_indices, vals);
+}
+
 double BSplineComputer::evaluate_spline(const int index_among_defined, const int first_nonzero_basis_index, const std::vector<double> &spline_coeffs, const double axis) 
 {
     size_t istart, iend;
@@ -138,13 +326,19 @@ double BSplineComputer::evaluate_spline(const int index_among_defined, const int
     double force = 0.0;
     int index_among_matched_interactions = ispec_->defined_to_matched_intrxn_index_map[index_among_defined];
     double axis_val = check_against_cutoffs(axis, ispec_->lower_cutoffs[index_among_defined], ispec_->upper_cutoffs[index_among_defined]);
-    gsl_bspline_eval_nonzero(axis_val, bspline_vectors, &istart, &iend, bspline_workspaces[index_among_matched_interactions - 1]);
+    if (use_native_bsplines) {
+    	istart = native_bases[index_among_matched_interactions - 1].eval_nonzero(axis_val, &nonzero_vals[0]);
+    	iend = istart + n_coef - 1;
+    } else {
+	    gsl_bspline_eval_nonzero(axis_val, bspline_vectors, &istart, &iend, bspline_workspaces[index_among_matched_interactions - 1]);
+	}
     if (index_among_matched_interactions > 0) {
 		ici_value = interaction_column_indices_[index_among_matched_interactions - 1];
     }
     for (int tn = int(istart); tn <= int(iend); tn++) {
         check_bspline_sizing(spline_coeffs.size(), first_nonzero_basis_index, index_among_matched_interactions, ici_value, tn, istart);
-        force += gsl_vector_get(bspline_vectors, tn - istart) * spline_coeffs[first_nonzero_basis_index + ici_value + tn];
+        double basis_val = use_native_bsplines ? nonzero_vals[tn - istart] : gsl_vector_get(bspline_vectors, tn - istart);
+        force += basis_val * spline_coeffs[first_nonzero_basis_index + ici_value + tn];
     }
     return force;
 }
@@ -161,14 +355,23 @@ BSplineAndDerivComputer::BSplineAndDerivComputer(InteractionClassSpec* ispec) :
 		exit(EXIT_FAILURE);
     }
  
+	use_native_bsplines = (ispec->get_native_bspline_flag() != 0) && UniformBSplineBasis::has_native_order((int)(n_coef));
 	printf("Allocating b-spline and derivative temporaries for %d interactions.\n", ispec_->get_n_defined());
-	bspline_vectors = gsl_vector_alloc(n_coef);
-	bspline_matrices = gsl_matrix_alloc(n_coef, 2);
-	
-	if (n_to_force_match < 1) {
-		bspline_workspaces = new gsl_bspline_workspace*[1];
+	if (use_native_bsplines) {
+		bspline_vectors = NULL;
+		bspline_matrices = NULL;
+		bspline_workspaces = NULL;
+		native_bases.reserve(n_to_force_match);
+		nonzero_vals.resize(n_coef);
 	} else {
-		bspline_workspaces = new gsl_bspline_workspace*[n_to_force_match];
+		bspline_vectors = gsl_vector_alloc(n_coef);
+		bspline_matrices = gsl_matrix_alloc(n_coef, 2);
+	
+		if (n_to_force_match < 1) {
+			bspline_workspaces = new gsl_bspline_workspace*[1];
+		} else {
+			bspline_workspaces = new gsl_bspline_workspace*[n_to_force_match];
+		}
 	}
 	
 	int counter = 0; // this is a stand in for index_among_matched_interxns
@@ -177,8 +380,12 @@ BSplineAndDerivComputer::BSplineAndDerivComputer(InteractionClassSpec* ispec) :
 			ici_index = interaction_column_indices_[counter + 1] - interaction_column_indices_[counter];
 			n_to_print_minus_bspline_k = ici_index - n_coef + 2;
 			check_bspline_size(n_to_print_minus_bspline_k, (int)(n_coef));
-			bspline_workspaces[counter] = gsl_bspline_alloc(n_coef, n_to_print_minus_bspline_k);
-			gsl_bspline_knots_uniform(ispec_->lower_cutoffs[i], ispec_->upper_cutoffs[i], bspline_workspaces[counter]);
+			if (use_native_bsplines) {
+				native_bases.push_back(UniformBSplineBasis((int)(n_coef), n_to_print_minus_bspline_k, ispec_->lower_cutoffs[i], ispec_->upper_cutoffs[i]));
+			} else {
+				bspline_workspaces[counter] = gsl_bspline_alloc(n_coef, n_to_print_minus_bspline_k);
+				gsl_bspline_knots_uniform(ispec_->lower_cutoffs[i], ispec_->upper_cutoffs[i], bspline_workspaces[counter]);
+			}
 			counter++;
 		}
 	}
@@ -186,6 +393,7 @@ BSplineAndDerivComputer::BSplineAndDerivComputer(InteractionClassSpec* ispec) :
 
 BSplineAndDerivComputer::~BSplineAndDerivComputer() 
 {
+	if (use_native_bsplines) return;
 	if (ispec_->class_type != kThreeBodyNonbonded) {
 		for (unsigned i = 0; i < n_to_force_match; i++)	gsl_bspline_free(bspline_workspaces[i]);
 	} else {
@@ -205,6 +413,11 @@ void BSplineAndDerivComputer::calculate_bspline_deriv_vals(const int index_among
     first_nonzero_basis_index = (int)(param_less_lower_cutoff / ispec_->get_fm_binwidth());
 
     int index_among_matched = ispec_->defined_to_matched_intrxn_index_map[index_among_defined] - 1;
+    if (use_native_bsplines) {
+    	first_nonzero_basis_index = native_bases[index_among_matched].eval_deriv_nonzero(param_less_lower_cutoff + ispec_->lower_cutoffs[index_among_defined], &vals[0]);
+    	for (unsigned i = 0; i < n_coef; i++) vals[i] = -vals[i];
+    	return;
+    }
     gsl_bspline_deriv_eval_nonzero(param_less_lower_cutoff + ispec_->lower_cutoffs[index_among_defined], (size_t)(1), bspline_matrices, &istart, &iend, bspline_workspaces[index_among_matched]);
     first_nonzero_basis_index = istart;
     
@@ -221,6 +434,10 @@ void BSplineAndDerivComputer::calculate_basis_fn_vals(const int index_among_defi
     first_nonzero_basis_index = (int)(param_less_lower_cutoff / ispec_->get_fm_binwidth());
     
     int index_among_matched = ispec_->defined_to_matched_intrxn_index_map[index_among_defined] - 1;
+    if (use_native_bsplines) {
+    	first_nonzero_basis_index = native_bases[index_among_matched].eval_nonzero(param_less_lower_cutoff + ispec_->lower_cutoffs[index_among_defined], &vals[0]);
+    	return;
+    }
     gsl_bspline_eval_nonzero(param_less_lower_cutoff + ispec_->lower_cutoffs[index_among_defined], bspline_vectors, &istart, &iend, bspline_workspaces[index_among_matched]);
     first_nonzero_basis_index = istart;
     
@@ -236,13 +453,19 @@ double BSplineAndDerivComputer::evaluate_spline(const int index_among_defined, c
     double force = 0.0;
     int index_among_matched_interactions = ispec_->defined_to_matched_intrxn_index_map[index_among_defined];
 	double axis_val = check_against_cutoffs(axis, ispec_->lower_cutoffs[index_among_defined], ispec_->upper_cutoffs[index_among_defined]);
-    gsl_bspline_eval_nonzero(axis_val, bspline_vectors, &istart, &iend, bspline_workspaces[index_among_matched_interactions - 1]);
+    if (use_native_bsplines) {
+    	istart = native_bases[index_among_matched_interactions - 1].eval_nonzero(axis_val, &nonzero_vals[0]);
+    	iend = istart + n_coef - 1;
+    } else {
+	    gsl_bspline_eval_nonzero(axis_val, bspline_vectors, &istart, &iend, bspline_workspaces[index_among_matched_interactions - 1]);
+	}
     if (index_among_matched_interactions > 0) {
 		ici_value = interaction_column_indices_[index_among_matched_interactions - 1];
     }
     for (int tn = int(istart); tn <= int(iend); tn++) {
     	check_bspline_sizing(spline_coeffs.size(), first_nonzero_basis_index, index_among_matched_interactions, ici_value, tn, istart);
-    	force += gsl_vector_get(bspline_vectors, tn - istart) * spline_coeffs[first_nonzero_basis_index + ici_value + tn];
+    	double basis_val = use_native_bsplines ? nonzero_vals[tn - istart] : gsl_vector_get(bspline_vectors, tn - istart);
+    	force += basis_val * spline_coeffs[first_nonzero_basis_index + ici_value + tn];
     }
     return force;
 }
@@ -254,13 +477,19 @@ double BSplineAndDerivComputer::evaluate_spline_deriv(const int index_among_defi
     int ici_value = 0;
     int index_among_matched_interactions = ispec_->defined_to_matched_intrxn_index_map[index_among_defined];
     double axis_val = check_against_cutoffs(axis, ispec_->lower_cutoffs[index_among_defined], ispec_->upper_cutoffs[index_among_defined]);
-	gsl_bspline_deriv_eval_nonzero(axis_val, size_t(1), bspline_matrices, &istart, &iend, bspline_workspaces[index_among_matched_interactions - 1]);
+    if (use_native_bsplines) {
+    	istart = native_bases[index_among_matched_interactions - 1].eval_deriv_nonzero(axis_val, &nonzero_vals[0]);
+    	iend = istart + n_coef - 1;
+    } else {
+		gsl_bspline_deriv_eval_nonzero(axis_val, size_t(1), bspline_matrices, &istart, &iend, bspline_workspaces[index_among_matched_interactions - 1]);
+	}
     if (index_among_matched_interactions > 0) {
 		ici_value = interaction_column_indices_[index_among_matched_interactions - 1];
     }
     for (int tn = int(istart); tn <= int(iend); tn++) {
     	check_bspline_sizing(spline_coeffs.size(), first_nonzero_basis_index, index_among_matched_interactions, ici_value, tn, istart);
-        deriv += gsl_matrix_get(bspline_matrices, tn - istart, 1) * spline_coeffs[first_nonzero_basis_index + ici_value + tn];
+    	double basis_deriv = use_native_bsplines ? nonzero_vals[tn - istart] : gsl_matrix_get(bspline_matrices, tn - istart, 1);
+        deriv += basis_deriv * spline_coeffs[first_nonzero_basis_index + ici_value + tn];
     }
     return deriv;
 }
@@ -25,6 +25,7 @@ protected:
 
     InteractionClassSpec *ispec_;
     std::vector<unsigned> interaction_column_indices_;
+    std::vector<double> batch_lane_vals;
     double get_param_less_lower_cutoff(const int index_among_defined, const double param_val) const;
     
 public:
@@ -33,15 +34,61 @@ public:
     void get_bin(void);
     inline int get_n_coef(void) { return n_coef; };
     virtual void calculate_basis_fn_vals(const int index_among_defined, const double param_val, int &first_nonzero_basis_index, std::vector<double> &vals) = 0;
+    // As calculate_basis_fn_vals for n values of one interaction; vals receives the n_coef values for each parameter value in turn.
+    virtual void calculate_basis_fn_vals_batch(const int index_among_defined, const int n, const double* const param_vals, int* const first_nonzero_basis_indices, double* const vals);
     virtual double evaluate_spline(const int index_among_defined, const int first_nonzero_basis_index, const std::vector<double> &spline_coeffs, const double axis) = 0;
 };
 
 SplineComputer* set_up_fm_spline_comp(InteractionClassSpec *ispec);
 SplineComputer* set_up_table_spline_comp(InteractionClassSpec *ispec);
 
+// Clamped B-spline basis on uniformly spaced breakpoints, with the same knots as gsl_bspline_knots_uniform.
+// The nonzero basis functions are found and evaluated directly rather than through a GSL workspace,
+// so a basis can be shared by several threads. Only the common orders 4 to 6 are handled.
+
+class UniformBSplineBasis {
+
+public:
+    UniformBSplineBasis(const int k, const int n_break, const double lower, const double upper);
+    static inline bool has_native_order(const int k) { return (k >= 4) && (k <= 6); };
+    
+    // Write the k basis function values (or first derivatives) that are nonzero at x into vals
+    // and return the index of the first of these basis functions.
+    inline int eval_nonzero(const double x, double* const vals) const {
+        int left = find_interval(x);
+        (*eval_values)(&knots[0], left, x, vals);
+        return left - k + 1;
+    };
+    inline int eval_deriv_nonzero(const double x, double* const derivs) const {
+        int left = find_interval(x);
+        (*eval_derivs)(&knots[0], left, x, derivs);
+        return left - k + 1;
+    };
+    // As eval_nonzero for n values at once, evaluating the recurrence for several values together;
+    // vals receives the k values for each x in turn. The intervals are written to first_indices as scratch space.
+    void eval_nonzero_batch(const int n, const double* const x, int* const first_indices, double* const vals) const;
+
+protected:
+    int k;
+    int n_break;
+    double lower;
+    double upper;
+    double inv_delta;
+    std::vector<double> knots;
+    void (*eval_values)(const double* const knots, const int left, const double x, double* const vals);
+    void (*eval_derivs)(const double* const knots, const int left, const double x, double* const derivs);
+    void (*eval_values_batch)(const double* const knots, const int n, const int* const left, const double* const x, double* const vals);
+    
+    int find_interval(const double x) const;
+};
+
 class BSplineComputer : public SplineComputer {  
 
 protected:
+    bool use_native_bsplines;
+    std::vector<UniformBSplineBasis> native_bases;
+    std::vector<double> nonzero_vals;
+    std::vector<double> batch_x;
     gsl_bspline_workspace** bspline_workspaces;
     gsl_vector* bspline_vectors;
 
@@ -50,6 +97,7 @@ public:
     virtual ~BSplineComputer();
     
    virtual void calculate_basis_fn_vals(const int index_among_defined, const double param_val, int &first_nonzero_basis_index, std::vector<double> &vals);
+   virtual void calculate_basis_fn_vals_batch(const int index_among_defined, const int n, const double* const param_vals, int* const first_nonzero_basis_indices, double* const vals);
    virtual double evaluate_spline(const int index_among_defined, const int first_nonzero_basis_index, const std::vector<double> &spline_coeffs, const double axis);
 };
 
@@ -57,6 +105,9 @@ class BSplineAndDerivComputer : public SplineComputer {
 
 protected:
     int class_subtype;
+    bool use_native_bsplines;
+    std::vector<UniformBSplineBasis> native_bases;
+    std::vector<double> nonzero_vals;
     gsl_bspline_workspace** bspline_workspaces;
     gsl_vector* bspline_vectors;
     gsl_matrix* bspline_matrices;
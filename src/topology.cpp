@@ -33,6 +33,8 @@ bool new_excluded_partner(unsigned** const excluded_partners, const int location
 void report_topology_input_format_error(const int line, char *parameter_name);
 // Search function for molecular exclusion.
 void recursive_exclusion_search(TopologyData const* topo_data, TopoList* &exclusion_list, std::vector<int> &path_list);
+// Add the exclusions for excluded_style to an exclusion list.
+void fill_excluded_list(TopologyData const* topo_data, TopoList* &exclusion_list, const int excluded_style);
 
 //---------------------------------------------------------------
 // Functions for managing TopoList structs
@@ -58,6 +60,19 @@ TopoList::~TopoList() {
 	}
 }
 
+void TopoList::build_lookup(void) {
+	assert(partners_per_ == 1);
+	lookup_starts_.assign(n_sites_ + 1, 0);
+	for (unsigned i = 0; i < n_sites_; i++) {
+		lookup_starts_[i + 1] = lookup_starts_[i] + partner_numbers_[i];
+	}
+	lookup_partners_.resize(lookup_starts_[n_sites_]);
+	for (unsigned i = 0; i < n_sites_; i++) {
+		std::copy(partners_[i], partners_[i] + partner_numbers_[i], lookup_partners_.begin() + lookup_starts_[i]);
+		std::sort(lookup_partners_.begin() + lookup_starts_[i], lookup_partners_.begin() + lookup_starts_[i + 1]);
+	}
+}
+
 //---------------------------------------------------------------
 // Functions for managing TopologyData structs
 //---------------------------------------------------------------
@@ -801,7 +816,14 @@ void setup_excluded_list( TopologyData const* topo_data, TopoList* &exclusion_li
     // bond, angle, and/or dihedral exclusion as appropriate.
 	printf("Setting up exclusion list for excluded_style %d.\n", excluded_style);
     if (excluded_style == 0) return;
-	
+    
+    fill_excluded_list(topo_data, exclusion_list, excluded_style);
+    // Keep the sorted lookup in step with the list, which may be regenerated after set-up through the library.
+    exclusion_list->build_lookup();
+}
+
+void fill_excluded_list(TopologyData const* topo_data, TopoList* &exclusion_list, const int excluded_style)
+{
 	unsigned max_excluded_number = get_max_exclusion_number(topo_data, excluded_style);
        
     if (excluded_style == 5) {
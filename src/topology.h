@@ -8,6 +8,9 @@
 #ifndef _topology_h
 #define _topology_h
 
+#include <algorithm>
+#include <vector>
+
 struct CG_MODEL_DATA;
 
 struct TopoList {
@@ -21,10 +24,27 @@ struct TopoList {
 
 	int modified;					// A flag indicating if the pointers for partners_ and partner_numbers_ arrays are shared (1 for yes, 0 for no).
 									// This is primarily useful in the LAMMPS fix when these arrays are allocated, freed, and owned by LAMMPS.
+	
+	std::vector<unsigned> lookup_starts_;	// Compressed, sorted copy of a single-partner list (such as an exclusion list) for fast membership checks.
+	std::vector<unsigned> lookup_partners_;	// The partners of site i are lookup_partners_[lookup_starts_[i]] through lookup_partners_[lookup_starts_[i + 1] - 1].
 									
     inline TopoList() : TopoList(0, 0, 0) {}
     TopoList(unsigned n_sites, unsigned partners_per, unsigned max_partners);
     ~TopoList();
+    
+    // (Re)build the sorted lookup once the list is complete.
+    void build_lookup(void);
+    
+    // Check whether j is a partner of i, falling back to a linear scan if no lookup has been built.
+    inline bool is_partner(const unsigned i, const unsigned j) const {
+    	if (lookup_starts_.empty()) {
+    		for (unsigned k = 0; k < partner_numbers_[i]; k++) {
+    			if (partners_[i][k] == j) return true;
+    		}
+    		return false;
+    	}
+    	return std::binary_search(lookup_partners_.begin() + lookup_starts_[i], lookup_partners_.begin() + lookup_starts_[i + 1], j);
+    }
 };
 
 // Struct responsible for keeping track of all cg site numbers, types, bonds,
@@ -5,16 +5,30 @@
 //  Copyright (c) 2016 The Voth Group at The University of Chicago. All rights reserved.
 //
 
+#include <algorithm>
 #include <cassert>
+#include <cctype>
+#include <condition_variable>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <mutex>
+#include <thread>
+#include <utility>
 #include <vector>
 #include <random>
 #include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "control_input.h"
+#include "geometry.h"
 #include "misc.h"
+#include "topology.h"
 #include "trajectory_input.h"
 
 extern "C" {
@@ -32,8 +46,21 @@ extern "C" {
 // struct for keeping track of LAMMPS frame data
 //-------------------------------------------------------------
 
+// One frame of a LAMMPS trajectory as recorded in its frame index file.
+struct LammpsFrameIndexEntry {
+	size_t offset;			// Byte offset of the first header line of the frame
+	int n_sites;			// Number of sites in the frame
+	double time;			// Value listed under ITEM: TIMESTEP for the frame
+	double box[DIMENSION];	// Box lengths of the frame
+};
+
 struct LammpsData {
 	std::ifstream trajectory_stream;
+	int mapped_flag;		// 1 if the trajectory is read through a memory map; 0 if it is read through trajectory_stream
+	const char* map_data;	// Start of the memory-mapped trajectory file
+	size_t map_size;		// Size of the memory-mapped trajectory file in bytes
+	size_t map_pos;			// Offset of the next unread line in the memory-mapped trajectory file
+	std::vector<LammpsFrameIndexEntry> frame_index;	// Location of every frame in the trajectory (used if frame_index_flag = 1)
 	int type_pos;			// Index for type element in frame body
 	int x_pos;				// Starting index for position elements in frame body
 	int f_pos;				// Starting index for force elements in frame body
@@ -44,10 +71,77 @@ struct LammpsData {
 	int (*read_lammps_body)(LammpsData *const lammps_data, FrameConfig *const frame_config, const int dynamic_types, const int dynamic_state_sampling, const int no_forces);
 };
 
+//-------------------------------------------------------------
+// struct for keeping track of MSCG binary trajectory data
+//-------------------------------------------------------------
+
+// An MSCG binary trajectory is written in native byte order as a 32-byte file header
+// (magic "MSCGTRJ", then int32 version, dimension, n_sites, value_size, contents, n_frames)
+// followed by one fixed-size record per frame:
+// float64 time, int32 timestep, int32 padding, float64 box lengths[dimension],
+// positions[n_sites][dimension] and (if stored) forces[n_sites][dimension] as value_size-byte floats,
+// (if stored) int32 types[n_sites], and (if stored) float64 state probabilities[n_sites].
+// Since all records have the same size, any frame can be reached directly.
+
+static const char binary_trajectory_magic[8] = "MSCGTRJ";
+const int32_t binary_trajectory_version = 1;
+const size_t binary_trajectory_header_size = 32;
+enum BinaryTrajectoryContents {kBinaryForces = 1, kBinaryTypes = 2, kBinaryStates = 4};
+
+struct BinaryTrajectoryData {
+	const char* map_data;	// Start of the memory-mapped trajectory file (or of the frame store)
+	size_t map_size;		// Size of the memory-mapped trajectory file in bytes
+	int mapped_flag;		// 1 if map_data is a memory map of the file; 0 if it is the frame store
+	size_t frame_size;		// Size of each frame record in bytes
+	int value_size;			// Size of each position and force value in bytes (4 or 8)
+	int contents;			// Bitwise OR of the BinaryTrajectoryContents stored for each frame
+	int n_frames;			// Number of complete frames in the trajectory
+	int next_frame;			// Index (from 0) of the next frame to read
+	double* cg_site_state_probabilities;   // A list of the probabilities for all states of all CG particles (used if dynamic_state_sampling = 1)
+};
+
+struct BinaryTrajectoryWriter {
+	FILE* output_file;				// NULL while the trajectory is kept in memory_image
+	std::string filename;
+	std::vector<char>* memory_image;	// Frame store holding the trajectory; NULL once it is written to file
+	size_t memory_budget;			// Largest size that memory_image may grow to in bytes
+	size_t frame_size;				// Size of each frame record in bytes
+	int32_t header[6];				// version, dimension, n_sites, value_size, contents, n_frames (as in the file header)
+	std::vector<float> float_values;	// Conversion buffer used if value_size is 4 and frames are stored in double precision
+	std::vector<double> double_values;	// Conversion buffer used if value_size is 8 and frames are stored in single precision
+	std::vector<int32_t> types;		// Conversion buffer used if types are stored
+};
+
 //-------------------------------------------------------------
 // struct for keeping track of GROMACS frame data
 //-------------------------------------------------------------
 
+#if _exclude_gromacs == 1
+#else
+// One XTC frame decoded ahead of its use by a decode thread.
+struct XTCDecodeSlot {
+	rvec* x;
+	rvec* f;
+	int current_timestep;
+	real time;
+	matrix simulation_box_limits;
+	int read_stat;
+	int filled;								// 1 once the frame has been decoded and until it is handed out
+};
+
+struct XTCDecoder {
+	int n_threads;
+	std::vector<XTCDecodeSlot> slots;		// Ring of decoded frames; the kth frame after the decoder started uses slot k % slots.size()
+	std::vector<std::thread> threads;		// Thread t decodes frames t, t + n_threads, t + 2 * n_threads, ...
+	std::vector<int> thread_finished;		// 1 once thread t has stopped decoding
+	int next_frame;							// Number of frames handed out since the decoder started
+	int stop_requested;
+	std::mutex ring_mutex;
+	std::condition_variable slot_emptied;
+	std::condition_variable slot_filled;
+};
+#endif
+
 struct XRDData {
 #if _exclude_gromacs == 1
 #else
@@ -57,10 +151,12 @@ struct XRDData {
     rvec* x;
     rvec* f;
     int read_fr;                                    // Return value holder for the gromacs xtc library functions; see gromacs documentation.
+    XTCDecoder* decoder;                            // Threads decoding frames ahead if num_xtc_decode_threads > 1; NULL otherwise
 	
 	inline XRDData(int n_sites) {
 		x = new rvec[n_sites + 1];
 		f = new rvec[n_sites + 1];
+		decoder = NULL;
 	};
 	
 	inline ~XRDData() {
@@ -68,7 +164,7 @@ struct XRDData {
 		delete [] f;
 	};
 	
-	inline void convert_rvec_to_vector(std::array<double, DIMENSION>* &position, std::array<double, DIMENSION>* &force, const int n_cg_sites) {
+	inline void convert_rvec_to_vector(std::array<frame_real, DIMENSION>* &position, std::array<frame_real, DIMENSION>* &force, const int n_cg_sites) {
 		for (int i = 0; i < n_cg_sites; i++) {
 			for(int j = 0; j < DIMENSION; j++) {
 				position[i][j] = x[i][j];
@@ -80,12 +176,47 @@ struct XRDData {
 #endif
 };
 
+//-------------------------------------------------------------
+// struct for reading frames ahead of their use in a separate thread
+//-------------------------------------------------------------
+
+// One buffered frame along with the frame-specific FrameSource data read with it.
+struct PrefetchSlot {
+	FrameConfig* frame_config;
+	int* cg_site_types;						// Types read for this frame (used if dynamic_types = 1)
+	double* cg_site_state_probabilities;	// State probabilities read for this frame (used if dynamic_state_sampling = 1)
+	int read_stat;
+	int current_timestep;
+	int current_frame_n;
+	real time;
+	matrix simulation_box_limits;
+};
+
+struct FramePrefetcher {
+	FrameSource reader_source;				// Copy of the FrameSource only touched by the reader thread
+	int (*read_next_frame)(FrameSource* const frame_source);	// The type-dependent reading function being run ahead
+	void (*cleanup)(FrameSource* const frame_source);			// The type-dependent cleanup function
+	std::vector<PrefetchSlot> slots;		// Ring of frame buffers
+	int n_frames_to_read;					// Number of frames the reader thread will read before stopping
+	int next_full_slot;						// Index of the next slot to hand to the calculation
+	int next_empty_slot;					// Index of the next slot to fill by the reader thread
+	int n_full_slots;
+	int reader_finished;
+	int stop_requested;
+	double* current_state_probabilities;	// State probabilities of the frame currently in use (used if dynamic_state_sampling = 1)
+	std::mutex ring_mutex;
+	std::condition_variable slot_emptied;
+	std::condition_variable slot_filled;
+	std::thread reader_thread;
+};
+
 // Prototypes for exclusively internal functions.
 
 // Helper for command line to file type setup
 void trr_setup(FrameSource* const frame_source, const char* filename);
 void lammps_setup(FrameSource* const frame_source, const char* filename);
 void xtc_setup(FrameSource* const frame_source, const char* filename1, const char* filename2);
+void binary_setup(FrameSource* const frame_source, const char* filename);
 
 // Misc. small helpers.
 inline void report_traj_input_suffix_error(const char *suffix);
@@ -98,17 +229,22 @@ inline void check_file_extension(const char* name, const char* suffix);
 void read_initial_trr_frame(FrameSource* const frame_source, const int n_cg_sites, int* cg_site_types);
 void read_initial_xtc_frame(FrameSource* const frame_source, const int n_cg_sites,  int* cg_site_types);
 void read_initial_lammps_frame(FrameSource* const frame_source, const int n_cg_sites, int* cg_site_types);
+void read_initial_binary_frame(FrameSource* const frame_source, const int n_cg_sites, int* cg_site_types);
 void initial_nothing(FrameSource* const frame_source, const int n_cg_sites, int* cg_site_types);
 
 // Read a frame of a trajectory after the first has been read.
 int read_next_trr_frame(FrameSource* const frame_source);
 int read_next_xtc_frame(FrameSource* const frame_source);
+int read_junk_xtc_frame(FrameSource* const frame_source);
 int read_next_lammps_frame(FrameSource* const frame_source);
 int read_junk_lammps_frame(FrameSource* const frame_source);
+int read_next_binary_frame(FrameSource* const frame_source);
+int read_junk_binary_frame(FrameSource* const frame_source);
 int next_nothing(FrameSource* const frame_source);
 
 // Read all frames up until a starting frame.
 void default_move_to_starting_frame(FrameSource* const frame_source);
+void indexed_move_to_starting_frame(FrameSource* const frame_source);
 
 // Read frame-wise entries into an array.
 inline void read_stream_into_array(std::ifstream &in_file, const int start_frame, const int n_frames, double* &values);
@@ -118,12 +254,44 @@ inline void finish_general_reading(FrameSource *const frame_source);
 void finish_trr_reading(FrameSource* const frame_source);
 void finish_xtc_reading(FrameSource* const frame_source);
 void finish_lammps_reading(FrameSource* const frame_source);
+void finish_binary_reading(FrameSource* const frame_source);
+
+// Read frames ahead in a separate thread and hand them out in order.
+void prefetch_frames(FramePrefetcher* const prefetcher);
+int read_next_prefetched_frame(FrameSource* const frame_source);
+void finish_prefetched_reading(FrameSource* const frame_source);
 
 // Additional helper functions.
+void open_lammps_trajectory(LammpsData* const lammps_data, const char* filename);
+#if _exclude_gromacs == 1
+#else
+int skip_xtc_frame(XDRFILE* const xtc_file, std::vector<char> &buffer);
+void start_xtc_decoder(FrameSource* const frame_source);
+void decode_xtc_frames(XTCDecoder* const decoder, const int thread_index, const std::string position_filename, const std::string force_filename, const int n_frames_to_skip, const int n_sites);
+int read_next_decoded_xtc_frame(FrameSource* const frame_source);
+void stop_xtc_decoder(XTCDecoder* const decoder);
+#endif
+void read_next_lammps_line(LammpsData* const lammps_data, std::string &line);
+void skip_lammps_lines(LammpsData* const lammps_data, const int n_lines);
+int try_skip_lammps_lines(LammpsData* const lammps_data, const int n_lines);
+int at_end_of_lammps_trajectory(LammpsData* const lammps_data);
+size_t get_lammps_position(LammpsData* const lammps_data);
+void set_lammps_position(LammpsData* const lammps_data, const size_t position);
+void setup_lammps_frame_index(FrameSource* const frame_source);
+int read_lammps_frame_index(LammpsData* const lammps_data, const char* index_filename, const long long trajectory_size, const long long trajectory_mtime, const long long trajectory_mtime_ns);
+void build_lammps_frame_index(FrameSource* const frame_source);
+void write_lammps_frame_index(LammpsData* const lammps_data, const char* index_filename, const long long trajectory_size, const long long trajectory_mtime, const long long trajectory_mtime_ns);
+inline double parse_lammps_double(const char* start, const char* end);
+inline int parse_lammps_int(const char* start, const char* end);
 void read_lammps_header(LammpsData* const lammps_data, int* const current_n_sites, int* const timestep, real* const time, matrix box, const int dynamic_types, const int dynamic_state_sampling, const int no_forces);
 int read_dimension_lammps_body(LammpsData* const lammps_data, FrameConfig* const frame_config, const int dynamic_types, const int dynamic_state_sampling, const int no_forces);
+int read_mapped_lammps_body(LammpsData* const lammps_data, FrameConfig* const frame_config, const int dynamic_types, const int dynamic_state_sampling, const int no_forces);
 inline void set_random_number_seed(const uint_fast32_t random_num_seed);
 
+// Helpers for binary trajectories.
+void copy_binary_frame(FrameSource* const frame_source, const int body_flag);
+inline double* state_probability_buffer(FrameSource* const frame_source);
+
 //-------------------------------------------------------------
 // Misc. small file-reading helper functions.
 //-------------------------------------------------------------
@@ -132,7 +300,7 @@ inline void set_random_number_seed(const uint_fast32_t random_num_seed);
 
 inline void report_usage_error(const char *exe_name)
 {
-    printf("Usage: %s -f file.trr OR %s -f file.xtc -f1 file1.xtc OR %s -l file.lammpstrj\n", exe_name, exe_name, exe_name);
+    printf("Usage: %s -f file.trr OR %s -f file.xtc -f1 file1.xtc OR %s -l file.lammpstrj OR %s -b file.cgtrj\n", exe_name, exe_name, exe_name, exe_name);
     exit(EXIT_SUCCESS);
 }
 
@@ -203,6 +371,8 @@ void parse_command_line_arguments(const int num_arg, char** arg, FrameSource* co
         	trr_setup(frame_source, arg[2]); 
         } else if (strcmp(arg[1], "-l") == 0) {
             lammps_setup(frame_source, arg[2]);
+        } else if (strcmp(arg[1], "-b") == 0) {
+            binary_setup(frame_source, arg[2]);
         } else {
             report_usage_error(arg[0]);
         }
@@ -213,6 +383,12 @@ void parse_command_line_arguments(const int num_arg, char** arg, FrameSource* co
     frame_source->move_to_start_frame = default_move_to_starting_frame;
 }
 
+void use_binary_trajectory(FrameSource* const frame_source, const char* filename)
+{
+    binary_setup(frame_source, filename);
+    frame_source->move_to_start_frame = default_move_to_starting_frame;
+}
+
 void trr_setup(FrameSource* const frame_source, const char* filename)
 {
 	sscanf(filename, "%s", frame_source->trajectory_filename);
@@ -239,6 +415,17 @@ void lammps_setup(FrameSource* const frame_source, const char* filename)
 	frame_source->cleanup = finish_lammps_reading;
 }
 
+void binary_setup(FrameSource* const frame_source, const char* filename)
+{
+	sscanf(filename, "%s", frame_source->trajectory_filename);
+	check_file_extension(filename, "cgtrj");
+	frame_source->trajectory_type = kMSCGBinary;
+	frame_source->get_first_frame = read_initial_binary_frame;
+	frame_source->get_next_frame = read_next_binary_frame;
+	frame_source->get_junk_frame = read_junk_binary_frame;
+	frame_source->cleanup = finish_binary_reading;
+}
+
 void xtc_setup(FrameSource* const frame_source, const char* filename1, const char* filename2)
 {
 	sscanf(filename1, "%s", frame_source->trajectory_filename);
@@ -247,6 +434,8 @@ void xtc_setup(FrameSource* const frame_source, const char* filename1, const cha
 	fflush(stdout);
 	exit(EXIT_FAILURE);
 	#else
+	// Keep the force file name until the first frame is read.
+	frame_source->gromacs_data = new XRDData(0);
 	sscanf(filename2, "%s", frame_source->gromacs_data->extra_trajectory_filename);
 	#endif
 	check_file_extension(filename1, "xtc");
@@ -255,7 +444,7 @@ void xtc_setup(FrameSource* const frame_source, const char* filename1, const cha
 	frame_source->trajectory_type = kGromacsXTC;
 	frame_source->get_first_frame = read_initial_xtc_frame;
 	frame_source->get_next_frame = read_next_xtc_frame;
-	frame_source->get_junk_frame = read_next_xtc_frame;
+	frame_source->get_junk_frame = read_junk_xtc_frame;
 	frame_source->cleanup = finish_xtc_reading;
 }
 
@@ -273,7 +462,12 @@ void copy_control_inputs_to_frd(ControlInputs* const control_input, FrameSource*
     frame_source->position_dimension = control_input->position_dimension;
     frame_source->starting_frame = control_input->starting_frame;
     frame_source->n_frames = control_input->n_frames;
+    frame_source->num_prefetch_frames = control_input->num_prefetch_frames;
+    frame_source->num_xtc_decode_threads = control_input->num_xtc_decode_threads;
+    frame_source->frame_index_flag = control_input->frame_index_flag;
     frame_source->no_forces = 0;
+    frame_source->prefetcher = NULL;
+    frame_source->frame_weights = NULL;
     
     if(frame_source->position_dimension != DIMENSION) {
     	printf("The value of position_dimension(%d) in control_input does not match the compiled dimension(%d)!\n", control_input->position_dimension, DIMENSION);
@@ -284,7 +478,10 @@ void copy_control_inputs_to_frd(ControlInputs* const control_input, FrameSource*
 inline void finish_general_reading(FrameSource *const frame_source)
 {
     delete frame_source->frame_config;
-    if (frame_source->use_statistical_reweighting == 1) delete [] frame_source->frame_weights;
+    if (frame_source->use_statistical_reweighting == 1) {
+        delete [] frame_source->frame_weights;
+        frame_source->frame_weights = NULL;
+    }
     if (frame_source->pressure_constraint_flag == 1) delete [] frame_source->pressure_constraint_rhs_vector;
 }
 
@@ -302,6 +499,7 @@ void finish_xtc_reading(FrameSource *const frame_source)
 {
  	#if _exclude_gromacs == 1
 	#else
+	if (frame_source->gromacs_data->decoder != NULL) stop_xtc_decoder(frame_source->gromacs_data->decoder);
 	xdrfile_close(frame_source->gromacs_data->trajectory_filepointer);
     xdrfile_close(frame_source->gromacs_data->extra_trajectory_filepointer);
     delete frame_source->gromacs_data;
@@ -312,7 +510,8 @@ void finish_xtc_reading(FrameSource *const frame_source)
 void finish_lammps_reading(FrameSource *const frame_source)
 {
     //close trajectory file
-    frame_source->lammps_data->trajectory_stream.close();
+    if (frame_source->lammps_data->mapped_flag == 1) munmap((void*)frame_source->lammps_data->map_data, frame_source->lammps_data->map_size);
+    else frame_source->lammps_data->trajectory_stream.close();
     
     //cleanup allocated memory
     if ( (frame_source->dynamic_types == 1) || (frame_source->dynamic_state_sampling == 1) ) frame_source->frame_config->cg_site_types = NULL; //undo alias of cg.topo_data.cg_site_types
@@ -323,6 +522,17 @@ void finish_lammps_reading(FrameSource *const frame_source)
 	finish_general_reading(frame_source);
 }
 
+void finish_binary_reading(FrameSource *const frame_source)
+{
+	if (frame_source->binary_data->mapped_flag == 1) munmap((void*)frame_source->binary_data->map_data, frame_source->binary_data->map_size);
+	else std::vector<char>().swap(frame_source->frame_store);
+    if ( (frame_source->dynamic_types == 1) || (frame_source->dynamic_state_sampling == 1) ) frame_source->frame_config->cg_site_types = NULL; //undo alias of cg.topo_data.cg_site_types
+    if (frame_source->dynamic_state_sampling == 1) delete [] frame_source->binary_data->cg_site_state_probabilities;
+	delete frame_source->binary_data;
+	
+	finish_general_reading(frame_source);
+}
+
 //-------------------------------------------------------------
 // Frame-by-frame trajectory reading functions
 //-------------------------------------------------------------
@@ -398,7 +608,10 @@ void read_initial_xtc_frame(FrameSource* const frame_source, const int n_cg_site
         exit(EXIT_FAILURE);
     }
     frame_source->frame_config = new FrameConfig(n_sites);
-    frame_source->gromacs_data = new XRDData(n_sites);
+    XRDData* gromacs_data = new XRDData(n_sites);
+    strcpy(gromacs_data->extra_trajectory_filename, frame_source->gromacs_data->extra_trajectory_filename);
+    delete frame_source->gromacs_data;
+    frame_source->gromacs_data = gromacs_data;
     
     // Check that the trajectory is consistent with the desired CG model.
     check_molecule_sites(n_cg_sites, frame_source->frame_config->current_n_sites);
@@ -435,14 +648,13 @@ void read_initial_lammps_frame(FrameSource* const frame_source, const int n_cg_s
 	frame_source->lammps_data->header_size = 0;
 	int n_sites = 0;
 
-	frame_source->lammps_data->read_lammps_body = read_dimension_lammps_body;
-	
     // Get the number of sites in this initial frame and allocate memory to store their forces and positions.
-	frame_source->lammps_data->trajectory_stream.open(frame_source->trajectory_filename, std::ifstream::in);
-	if (frame_source->lammps_data->trajectory_stream.fail()) {
-		printf("Problem opening lammps trajcetory %s\n", frame_source->trajectory_filename);
-		exit(EXIT_FAILURE);
-	}
+	open_lammps_trajectory(frame_source->lammps_data, frame_source->trajectory_filename);
+	if (frame_source->lammps_data->mapped_flag == 1) frame_source->lammps_data->read_lammps_body = read_mapped_lammps_body;
+	else frame_source->lammps_data->read_lammps_body = read_dimension_lammps_body;
+	
+	// Locate every frame up front if requested so that frames can be reached directly.
+	if (frame_source->frame_index_flag == 1) setup_lammps_frame_index(frame_source);
 	
 	//read header for first frame 
 	read_lammps_header(frame_source->lammps_data, &n_sites, &frame_source->current_timestep, &frame_source->time, frame_source->simulation_box_limits, frame_source->dynamic_types, frame_source->dynamic_state_sampling, frame_source->no_forces);
@@ -489,6 +701,115 @@ void read_initial_lammps_frame(FrameSource* const frame_source, const int n_cg_s
     return;
 }
 
+// Read the initial frame of an MSCG binary trajectory.
+
+void read_initial_binary_frame(FrameSource* const frame_source, const int n_cg_sites, int* cg_site_types)
+{
+	assert(n_cg_sites > 0);
+	BinaryTrajectoryData* binary_data = new BinaryTrajectoryData;
+	frame_source->binary_data = binary_data;
+	
+	// Map the whole trajectory so that each frame is a plain copy out of memory,
+	// unless it is already held in the frame store.
+	if (frame_source->frame_store.size() >= binary_trajectory_header_size) {
+		binary_data->map_data = frame_source->frame_store.data();
+		binary_data->map_size = frame_source->frame_store.size();
+		binary_data->mapped_flag = 0;
+	} else {
+		int fd = open(frame_source->trajectory_filename, O_RDONLY);
+		struct stat file_stat;
+		if ( (fd < 0) || (fstat(fd, &file_stat) != 0) || !S_ISREG(file_stat.st_mode) || ((size_t)file_stat.st_size < binary_trajectory_header_size) ) {
+			printf("Problem opening binary trajectory %s\n", frame_source->trajectory_filename);
+			exit(EXIT_FAILURE);
+		}
+		void* map_data = mmap(NULL, (size_t)file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (map_data == MAP_FAILED) {
+			printf("Problem mapping binary trajectory %s into memory\n", frame_source->trajectory_filename);
+			exit(EXIT_FAILURE);
+		}
+		binary_data->map_data = (const char*)map_data;
+		binary_data->map_size = (size_t)file_stat.st_size;
+		binary_data->mapped_flag = 1;
+	}
+	
+	// Check the file header.
+	int32_t header[6];
+	std::memcpy(header, binary_data->map_data + sizeof(binary_trajectory_magic), sizeof(header));
+	if (std::memcmp(binary_data->map_data, binary_trajectory_magic, sizeof(binary_trajectory_magic)) != 0) {
+		printf("%s is not an MSCG binary trajectory!\n", frame_source->trajectory_filename);
+		exit(EXIT_FAILURE);
+	}
+	if (header[0] != binary_trajectory_version) {
+		if (header[0] == (int32_t)0x01000000) printf("Binary trajectory %s was written with a different byte order!\n", frame_source->trajectory_filename);
+		else printf("Binary trajectory %s has unsupported version %d!\n", frame_source->trajectory_filename, header[0]);
+		exit(EXIT_FAILURE);
+	}
+	if (header[1] != DIMENSION) {
+		printf("The dimension of binary trajectory %s (%d) does not match the compiled dimension(%d)!\n", frame_source->trajectory_filename, header[1], DIMENSION);
+		exit(EXIT_FAILURE);
+	}
+	int n_sites = header[2];
+	binary_data->value_size = header[3];
+	binary_data->contents = header[4];
+	if ( (n_sites <= 0) || ((binary_data->value_size != 4) && (binary_data->value_size != 8)) ) {
+		printf("Binary trajectory %s has an invalid header!\n", frame_source->trajectory_filename);
+		exit(EXIT_FAILURE);
+	}
+	if ( (frame_source->no_forces == 0) && ((binary_data->contents & kBinaryForces) == 0) ) {
+		printf("Binary trajectory %s does not contain forces!\n", frame_source->trajectory_filename);
+		exit(EXIT_FAILURE);
+	}
+	if ( (frame_source->dynamic_types == 1) && (frame_source->dynamic_state_sampling == 0) && ((binary_data->contents & kBinaryTypes) == 0) ) {
+		printf("Binary trajectory %s does not contain types, which are needed for dynamic_types!\n", frame_source->trajectory_filename);
+		exit(EXIT_FAILURE);
+	}
+	if ( (frame_source->dynamic_state_sampling == 1) && ((binary_data->contents & kBinaryStates) == 0) ) {
+		printf("Binary trajectory %s does not contain state probabilities, which are needed for dynamic_state_sampling!\n", frame_source->trajectory_filename);
+		exit(EXIT_FAILURE);
+	}
+	
+	// Determine the number of complete frames from the file size.
+	binary_data->frame_size = sizeof(double) + 2 * sizeof(int32_t) + DIMENSION * sizeof(double) + (size_t)n_sites * DIMENSION * binary_data->value_size;
+	if (binary_data->contents & kBinaryForces) binary_data->frame_size += (size_t)n_sites * DIMENSION * binary_data->value_size;
+	if (binary_data->contents & kBinaryTypes) binary_data->frame_size += (size_t)n_sites * sizeof(int32_t);
+	if (binary_data->contents & kBinaryStates) binary_data->frame_size += (size_t)n_sites * sizeof(double);
+	binary_data->n_frames = (int)((binary_data->map_size - binary_trajectory_header_size) / binary_data->frame_size);
+	if (binary_data->n_frames != header[5]) {
+		printf("Warning: Binary trajectory %s lists %d frames, but only %d complete frames are present.\n", frame_source->trajectory_filename, header[5], binary_data->n_frames);
+	}
+	if (binary_data->n_frames < 1) {
+		printf("Cannot read the first frame!\n");
+		exit(EXIT_FAILURE);
+	}
+	
+	// Allocate position and force vectors.
+	frame_source->frame_config = new FrameConfig(n_sites);
+	if (frame_source->dynamic_state_sampling == 1) binary_data->cg_site_state_probabilities = new double[n_sites];
+	else binary_data->cg_site_state_probabilities = NULL;
+	if ( (frame_source->dynamic_types == 1) || (frame_source->dynamic_state_sampling == 1) ) {
+		frame_source->frame_config->cg_site_types = cg_site_types;
+	}
+	
+	// Check that the trajectory is consistent with the desired CG model.
+	check_molecule_sites(n_cg_sites, frame_source->frame_config->current_n_sites);
+	
+	if ( (frame_source->dynamic_types == 1) && (frame_source->dynamic_state_sampling == 1) ) {
+		printf("Warning: Dynamic_state_sampling will override dynamic_types!\n");
+	}
+	
+	binary_data->next_frame = 0;
+	copy_binary_frame(frame_source, 1);
+	frame_source->current_frame_n = 1;
+	// Any frame can be reached directly, so skip to the starting frame by seeking.
+	frame_source->move_to_start_frame = indexed_move_to_starting_frame;
+	
+	// Setup random number generator, if appropriate.
+	if ( (frame_source->dynamic_state_sampling == 1) || (frame_source->bootstrapping_flag == 1) ) {
+		frame_source->mt_rand_gen = std::mt19937(frame_source->random_num_seed);
+	}
+}
+
 void initial_nothing(FrameSource* const frame_source, const int n_cg_sites, int* cg_site_types)
 {
 }
@@ -524,6 +845,12 @@ int read_next_xtc_frame(FrameSource* const frame_source)
     
     #if _exclude_gromacs == 1
     #else
+    // Hand out frames decoded ahead by separate threads if requested.
+    if (frame_source->num_xtc_decode_threads > 1) {
+    	if (frame_source->gromacs_data->decoder == NULL) start_xtc_decoder(frame_source);
+    	return read_next_decoded_xtc_frame(frame_source);
+    }
+    
     int junk_integer;
     real junk_floating_point;
     // Use Gromacs xtc library routines to read all the data stored in the .xtc files for a single frame.
@@ -572,7 +899,6 @@ int read_junk_lammps_frame(FrameSource* const frame_source)
 {
 	int return_value = 1;  
 	int reference_atoms  = frame_source->frame_config->current_n_sites;
-	std::string line;
 
 	read_lammps_header(frame_source->lammps_data, &frame_source->frame_config->current_n_sites, &frame_source->current_timestep, &frame_source->time, frame_source->simulation_box_limits, frame_source->dynamic_types, frame_source->dynamic_state_sampling, frame_source->no_forces);    
 
@@ -581,9 +907,7 @@ int read_junk_lammps_frame(FrameSource* const frame_source)
  		return_value = 0;
  	} else {
  		// Skip through expected number of lines in frame body without parsing.
-		for(int i=0; i < frame_source->frame_config->current_n_sites; i++) {
-			check_and_read_next_line(frame_source->lammps_data->trajectory_stream, line);
-    	}
+		skip_lammps_lines(frame_source->lammps_data, frame_source->frame_config->current_n_sites);
 	}
 	 
     // Finish up by changing information simply determined by the data just read.
@@ -594,6 +918,44 @@ int read_junk_lammps_frame(FrameSource* const frame_source)
  	return return_value;
 }
 
+// Read a frame of an MSCG binary trajectory after the first has been read.
+
+int read_next_binary_frame(FrameSource* const frame_source)
+{
+	if (frame_source->binary_data->next_frame >= frame_source->binary_data->n_frames) {
+		printf("Cannot read frame %d; the binary trajectory only has %d frames!\n", frame_source->binary_data->next_frame + 1, frame_source->binary_data->n_frames);
+		return 0;
+	}
+	copy_binary_frame(frame_source, 1);
+	frame_source->current_frame_n += 1;
+	return 1;
+}
+
+// Skip a frame of a .xtc-format trajectory pair without decompressing it.
+
+int read_junk_xtc_frame(FrameSource* const frame_source)
+{
+	int return_val = 0;
+	
+	#if _exclude_gromacs == 1
+	#else
+	if (frame_source->gromacs_data->decoder != NULL) return read_next_decoded_xtc_frame(frame_source);
+	std::vector<char> buffer;
+	return_val = skip_xtc_frame(frame_source->gromacs_data->extra_trajectory_filepointer, buffer) && skip_xtc_frame(frame_source->gromacs_data->trajectory_filepointer, buffer);
+	frame_source->current_frame_n += 1;
+	#endif
+	
+	return return_val;
+}
+
+int read_junk_binary_frame(FrameSource* const frame_source)
+{
+	if (frame_source->binary_data->next_frame >= frame_source->binary_data->n_frames) return 0;
+	copy_binary_frame(frame_source, 0);
+	frame_source->current_frame_n += 1;
+	return 1;
+}
+
 int next_nothing(FrameSource* const frame_source)
 {
 	return 1;
@@ -601,27 +963,440 @@ int next_nothing(FrameSource* const frame_source)
 
 void default_move_to_starting_frame(FrameSource* const frame_source) {
     for (int i = 0; i < frame_source->starting_frame - 1; i++) {
-        if ((*frame_source->get_junk_frame)(frame_source) == 0) {
+        // Skip all but the last frame; the last one becomes the starting frame and is read in full.
+        int read_stat;
+        if (i < frame_source->starting_frame - 2) read_stat = (*frame_source->get_junk_frame)(frame_source);
+        else read_stat = (*frame_source->get_next_frame)(frame_source);
+        if (read_stat == 0) {
             printf("Failure attempting to skip frame %d. Check the trajectory file for errors.\n", i);
             exit(EXIT_FAILURE);
         }
     }
 }
 
+// Move to the starting frame by seeking directly to it with the frame index.
+
+void indexed_move_to_starting_frame(FrameSource* const frame_source) {
+	int n_indexed_frames = get_n_indexed_frames(frame_source);
+	if (frame_source->starting_frame + frame_source->n_frames - 1 > n_indexed_frames) {
+		printf("Warning: The frame index lists %d frames, but frames %d to %d were requested.\n", n_indexed_frames, frame_source->starting_frame, frame_source->starting_frame + frame_source->n_frames - 1);
+	}
+	if (frame_source->starting_frame <= 1) return;
+	if (seek_to_frame(frame_source, frame_source->starting_frame) == 0) {
+		printf("Failure attempting to move to frame %d. Check the trajectory file for errors.\n", frame_source->starting_frame);
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Make frame frame_number the current frame by seeking to its recorded offset.
+
+int seek_to_frame(FrameSource* const frame_source, const int frame_number)
+{
+	if (frame_source->prefetcher != NULL) {
+		printf("Cannot seek to frame %d after frame prefetching has been started.\n", frame_number);
+		exit(EXIT_FAILURE);
+	}
+	int n_indexed_frames = get_n_indexed_frames(frame_source);
+	if (n_indexed_frames < 0) {
+		printf("Seeking to a frame requires a binary trajectory or a LAMMPS trajectory read with frame_index_flag 1.\n");
+		exit(EXIT_FAILURE);
+	}
+	if (frame_number < 1 || frame_number > n_indexed_frames) {
+		printf("Cannot seek to frame %d; the frame index lists %d frames.\n", frame_number, n_indexed_frames);
+		exit(EXIT_FAILURE);
+	}
+	
+	if (frame_source->trajectory_type == kMSCGBinary) {
+		frame_source->binary_data->next_frame = frame_number - 1;
+		frame_source->current_frame_n = frame_number - 1;
+		return read_next_binary_frame(frame_source);
+	}
+	
+	set_lammps_position(frame_source->lammps_data, frame_source->lammps_data->frame_index[frame_number - 1].offset);
+	// Keep the frame counters as if every frame in between had been read.
+	frame_source->current_timestep += frame_number - frame_source->current_frame_n - 1;
+	frame_source->current_frame_n = frame_number - 1;
+	return read_next_lammps_frame(frame_source);
+}
+
+int get_n_indexed_frames(FrameSource* const frame_source)
+{
+	if (frame_source->trajectory_type == kMSCGBinary) return frame_source->binary_data->n_frames;
+	if (frame_source->trajectory_type != kLAMMPSDump || frame_source->frame_index_flag != 1) return -1;
+	if (frame_source->lammps_data == NULL || frame_source->lammps_data->frame_index.empty()) return -1;
+	return (int)frame_source->lammps_data->frame_index.size();
+}
+
 //-------------------------------------------------------------
 // Helper functions for reading LAMMPS header and body
 //-------------------------------------------------------------
 
+// Open a LAMMPS trajectory, memory-mapping it if possible so that frame bodies
+// can be parsed in place. Otherwise, fall back to reading it as a stream.
+
+void open_lammps_trajectory(LammpsData* const lammps_data, const char* filename)
+{
+	lammps_data->mapped_flag = 0;
+	lammps_data->map_data = NULL;
+	lammps_data->map_size = 0;
+	lammps_data->map_pos = 0;
+	
+	int fd = open(filename, O_RDONLY);
+	if (fd >= 0) {
+		struct stat file_stat;
+		if ( (fstat(fd, &file_stat) == 0) && S_ISREG(file_stat.st_mode) && (file_stat.st_size > 0) ) {
+			void* map_data = mmap(NULL, (size_t)file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (map_data != MAP_FAILED) {
+				madvise(map_data, (size_t)file_stat.st_size, MADV_SEQUENTIAL);
+				lammps_data->mapped_flag = 1;
+				lammps_data->map_data = (const char*)map_data;
+				lammps_data->map_size = (size_t)file_stat.st_size;
+			}
+		}
+		close(fd);
+	}
+	if (lammps_data->mapped_flag == 1) return;
+	
+	lammps_data->trajectory_stream.open(filename, std::ifstream::in);
+	if (lammps_data->trajectory_stream.fail()) {
+		printf("Problem opening lammps trajcetory %s\n", filename);
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Read the next line of a LAMMPS trajectory (and wrap-up if end-of-file).
+
+void read_next_lammps_line(LammpsData* const lammps_data, std::string &line)
+{
+	if (lammps_data->mapped_flag == 0) {
+		check_and_read_next_line(lammps_data->trajectory_stream, line);
+		return;
+	}
+	
+	const char* start = lammps_data->map_data + lammps_data->map_pos;
+	const char* end = lammps_data->map_data + lammps_data->map_size;
+	if (start >= end) {
+		fprintf(stderr, "\nIt appears that the file is no longer open.\n");
+		fprintf(stderr, "Please check that you are not attempting to read past the end of the file and try again.\n");
+		fflush(stderr);
+		exit(EXIT_FAILURE);
+	}
+	const char* line_end = (const char*)memchr(start, '\n', end - start);
+	if (line_end == NULL) line_end = end;
+	line.assign(start, line_end - start);
+	lammps_data->map_pos = (line_end - lammps_data->map_data) + 1;
+}
+
+// Skip lines of a LAMMPS trajectory without parsing them.
+
+void skip_lammps_lines(LammpsData* const lammps_data, const int n_lines)
+{
+	std::string line;
+	if (lammps_data->mapped_flag == 0) {
+		for (int i = 0; i < n_lines; i++) check_and_read_next_line(lammps_data->trajectory_stream, line);
+		return;
+	}
+	
+	const char* end = lammps_data->map_data + lammps_data->map_size;
+	for (int i = 0; i < n_lines; i++) {
+		const char* start = lammps_data->map_data + lammps_data->map_pos;
+		const char* line_end = (start < end) ? (const char*)memchr(start, '\n', end - start) : NULL;
+		if (line_end == NULL) {
+			// Let the line reader report reading past the end of the file.
+			read_next_lammps_line(lammps_data, line);
+			continue;
+		}
+		lammps_data->map_pos = (line_end - lammps_data->map_data) + 1;
+	}
+}
+
+// Skip lines of a LAMMPS trajectory, stopping quietly at the end of the file.
+// Returns the number of lines actually skipped.
+
+int try_skip_lammps_lines(LammpsData* const lammps_data, const int n_lines)
+{
+	if (lammps_data->mapped_flag == 0) {
+		std::string line;
+		for (int i = 0; i < n_lines; i++) {
+			if (!std::getline(lammps_data->trajectory_stream, line)) return i;
+		}
+		return n_lines;
+	}
+	
+	const char* end = lammps_data->map_data + lammps_data->map_size;
+	for (int i = 0; i < n_lines; i++) {
+		const char* start = lammps_data->map_data + lammps_data->map_pos;
+		if (start >= end) return i;
+		const char* line_end = (const char*)memchr(start, '\n', end - start);
+		if (line_end == NULL) {
+			lammps_data->map_pos = lammps_data->map_size;
+			return i + 1;
+		}
+		lammps_data->map_pos = (line_end - lammps_data->map_data) + 1;
+	}
+	return n_lines;
+}
+
+// Skip any whitespace before the next frame and return 1 if nothing but whitespace remains.
+
+int at_end_of_lammps_trajectory(LammpsData* const lammps_data)
+{
+	if (lammps_data->mapped_flag == 0) {
+		lammps_data->trajectory_stream >> std::ws;
+		return (lammps_data->trajectory_stream.peek() == std::char_traits<char>::eof());
+	}
+	while (lammps_data->map_pos < lammps_data->map_size && isspace((unsigned char)lammps_data->map_data[lammps_data->map_pos])) lammps_data->map_pos++;
+	return (lammps_data->map_pos >= lammps_data->map_size);
+}
+
+size_t get_lammps_position(LammpsData* const lammps_data)
+{
+	if (lammps_data->mapped_flag == 1) return lammps_data->map_pos;
+	return (size_t)lammps_data->trajectory_stream.tellg();
+}
+
+void set_lammps_position(LammpsData* const lammps_data, const size_t position)
+{
+	if (lammps_data->mapped_flag == 1) {
+		lammps_data->map_pos = position;
+		return;
+	}
+	lammps_data->trajectory_stream.clear();
+	lammps_data->trajectory_stream.seekg((std::streamoff)position);
+}
+
+//-------------------------------------------------------------
+// Functions for the LAMMPS frame index file
+//-------------------------------------------------------------
+
+// The frame index is kept next to the trajectory as <trajectory>.idx.
+// It lists the byte offset, number of sites, timestep value, and box lengths of every frame
+// along with the size and modification time (to the nanosecond where available) of the trajectory it was built from,
+// so that it is rebuilt whenever the trajectory changes.
+// It is written under a temporary name and renamed into place so that concurrent 
+// worker processes or later runs never read a partially written index.
+
+void setup_lammps_frame_index(FrameSource* const frame_source)
+{
+	LammpsData* const lammps_data = frame_source->lammps_data;
+	struct stat file_stat;
+	if ( (stat(frame_source->trajectory_filename, &file_stat) != 0) || !S_ISREG(file_stat.st_mode) ) {
+		printf("Warning: Cannot index trajectory %s since it is not a regular file; frames will be read in order.\n", frame_source->trajectory_filename);
+		return;
+	}
+	long long trajectory_size = (long long)file_stat.st_size;
+	long long trajectory_mtime = (long long)file_stat.st_mtime;
+	// Sub-second modification times are named differently on macOS and are not available everywhere;
+	// without them, the index is checked against the size and whole-second modification time only.
+#if defined(__APPLE__)
+	long long trajectory_mtime_ns = (long long)file_stat.st_mtimespec.tv_nsec;
+#elif defined(__linux__)
+	long long trajectory_mtime_ns = (long long)file_stat.st_mtim.tv_nsec;
+#else
+	long long trajectory_mtime_ns = 0;
+#endif
+	
+	std::string index_filename = std::string(frame_source->trajectory_filename) + ".idx";
+	if (read_lammps_frame_index(lammps_data, index_filename.c_str(), trajectory_size, trajectory_mtime, trajectory_mtime_ns) == 1) {
+		printf("Read frame index %s listing %d frames.\n", index_filename.c_str(), (int)lammps_data->frame_index.size());
+		return;
+	}
+	
+	printf("Building frame index %s.\n", index_filename.c_str());
+	build_lammps_frame_index(frame_source);
+	write_lammps_frame_index(lammps_data, index_filename.c_str(), trajectory_size, trajectory_mtime, trajectory_mtime_ns);
+	printf("Indexed %d frames.\n", (int)lammps_data->frame_index.size());
+}
+
+// Read an existing frame index. Returns 1 if it was read and matches the trajectory; 0 otherwise.
+
+int read_lammps_frame_index(LammpsData* const lammps_data, const char* index_filename, const long long trajectory_size, const long long trajectory_mtime, const long long trajectory_mtime_ns)
+{
+	FILE* index_file = fopen(index_filename, "r");
+	if (index_file == NULL) return 0;
+	
+	char magic[64];
+	int version = 0;
+	long long index_size = -1;
+	long long index_mtime = -1;
+	long long index_mtime_ns = -1;
+	int n_indexed_frames = 0;
+	if ( (fscanf(index_file, "%63s LAMMPS frame index %d", magic, &version) != 2) || (strcmp(magic, "MSCG") != 0) || (version != 2) ||
+		 (fscanf(index_file, "%lld %lld %lld %d", &index_size, &index_mtime, &index_mtime_ns, &n_indexed_frames) != 4) ) {
+		printf("Warning: Frame index %s is not in a recognized format and will be rebuilt.\n", index_filename);
+		fclose(index_file);
+		return 0;
+	}
+	if ( (index_size != trajectory_size) || (index_mtime != trajectory_mtime) || (index_mtime_ns != trajectory_mtime_ns) || (n_indexed_frames < 1) ) {
+		printf("Frame index %s does not match the current trajectory and will be rebuilt.\n", index_filename);
+		fclose(index_file);
+		return 0;
+	}
+	
+	lammps_data->frame_index.resize(n_indexed_frames);
+	for (int i = 0; i < n_indexed_frames; i++) {
+		LammpsFrameIndexEntry &entry = lammps_data->frame_index[i];
+		unsigned long long offset;
+		int n_read = fscanf(index_file, "%llu %d %lf", &offset, &entry.n_sites, &entry.time);
+		for (int j = 0; j < DIMENSION; j++) n_read += fscanf(index_file, "%lf", &entry.box[j]);
+		if ( (n_read != 3 + DIMENSION) || (offset >= (unsigned long long)trajectory_size) ) {
+			printf("Warning: Frame index %s is incomplete and will be rebuilt.\n", index_filename);
+			lammps_data->frame_index.clear();
+			fclose(index_file);
+			return 0;
+		}
+		entry.offset = (size_t)offset;
+	}
+	fclose(index_file);
+	return 1;
+}
+
+// Scan the whole trajectory once, recording where each frame begins,
+// then return to the start of the trajectory.
+
+void build_lammps_frame_index(FrameSource* const frame_source)
+{
+	LammpsData* const lammps_data = frame_source->lammps_data;
+	int timestep = 0;
+	real time = 0.0;
+	matrix box;
+	lammps_data->frame_index.clear();
+	
+	while (at_end_of_lammps_trajectory(lammps_data) == 0) {
+		LammpsFrameIndexEntry entry;
+		entry.offset = get_lammps_position(lammps_data);
+		entry.n_sites = 0;
+		read_lammps_header(lammps_data, &entry.n_sites, &timestep, &time, box, frame_source->dynamic_types, frame_source->dynamic_state_sampling, frame_source->no_forces);
+		// Leave out a final frame that was only partially written.
+		if (try_skip_lammps_lines(lammps_data, entry.n_sites) < entry.n_sites) {
+			printf("Warning: Frame %d of the trajectory is incomplete and was left out of the frame index.\n", (int)lammps_data->frame_index.size() + 1);
+			break;
+		}
+		entry.time = time;
+		for (int j = 0; j < DIMENSION; j++) entry.box[j] = box[j][j];
+		lammps_data->frame_index.push_back(entry);
+	}
+	
+	set_lammps_position(lammps_data, 0);
+}
+
+// Write the frame index under a temporary name and rename it into place;
+// failing to do so only costs rebuilding it next time.
+
+void write_lammps_frame_index(LammpsData* const lammps_data, const char* index_filename, const long long trajectory_size, const long long trajectory_mtime, const long long trajectory_mtime_ns)
+{
+	std::string temporary_filename = std::string(index_filename) + ".tmp." + std::to_string((long long)getpid());
+	FILE* index_file = fopen(temporary_filename.c_str(), "w");
+	if (index_file == NULL) {
+		printf("Warning: Could not write frame index %s; the index will only be kept for this run.\n", index_filename);
+		return;
+	}
+	fprintf(index_file, "MSCG LAMMPS frame index 2\n");
+	fprintf(index_file, "%lld %lld %lld %d\n", trajectory_size, trajectory_mtime, trajectory_mtime_ns, (int)lammps_data->frame_index.size());
+	for (unsigned i = 0; i < lammps_data->frame_index.size(); i++) {
+		const LammpsFrameIndexEntry &entry = lammps_data->frame_index[i];
+		fprintf(index_file, "%llu %d %.17g", (unsigned long long)entry.offset, entry.n_sites, entry.time);
+		for (int j = 0; j < DIMENSION; j++) fprintf(index_file, " %.17g", entry.box[j]);
+		fprintf(index_file, "\n");
+	}
+	if ( (fclose(index_file) != 0) || (rename(temporary_filename.c_str(), index_filename) != 0) ) {
+		printf("Warning: Could not finish writing frame index %s.\n", index_filename);
+		remove(temporary_filename.c_str());
+	}
+}
+
+// Parse a floating point field that ends at end without copying it.
+// Plain decimal fields that fit in 53 bits with a small power of ten are converted 
+// with a single correctly rounded multiplication or division; 
+// anything else is passed to strtod, so the result is always the same as atof.
+
+inline double parse_lammps_double(const char* start, const char* end)
+{
+	static const double powers_of_ten[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+	const char* p = start;
+	int negative = 0;
+	if (p < end && (*p == '-' || *p == '+')) {
+		negative = (*p == '-');
+		p++;
+	}
+	
+	uint64_t mantissa = 0;
+	int n_digits = 0;
+	int exponent = 0;
+	const char* digits_start = p;
+	while (p < end && *p >= '0' && *p <= '9') {
+		mantissa = mantissa * 10 + (*p - '0');
+		n_digits++;
+		p++;
+	}
+	if (p < end && *p == '.') {
+		p++;
+		while (p < end && *p >= '0' && *p <= '9') {
+			mantissa = mantissa * 10 + (*p - '0');
+			n_digits++;
+			exponent--;
+			p++;
+		}
+	}
+	if (n_digits > 0 && p < end && (*p == 'e' || *p == 'E')) {
+		const char* q = p + 1;
+		int exponent_negative = 0;
+		int explicit_exponent = 0;
+		if (q < end && (*q == '-' || *q == '+')) {
+			exponent_negative = (*q == '-');
+			q++;
+		}
+		const char* exponent_start = q;
+		while (q < end && *q >= '0' && *q <= '9' && explicit_exponent < 10000) {
+			explicit_exponent = explicit_exponent * 10 + (*q - '0');
+			q++;
+		}
+		if (q > exponent_start) {
+			exponent += exponent_negative ? -explicit_exponent : explicit_exponent;
+			p = q;
+		}
+	}
+	
+	if ( (p == end) && (n_digits > 0) && (n_digits <= 19) && (p > digits_start) && (mantissa <= ((uint64_t)1 << 53)) && (exponent >= -22) && (exponent <= 22) ) {
+		double value = (double)mantissa;
+		if (exponent < 0) value /= powers_of_ten[-exponent];
+		else value *= powers_of_ten[exponent];
+		return negative ? -value : value;
+	}
+	
+	// Fall back to the C library on a terminated copy of the field.
+	char buffer[128];
+	size_t length = end - start;
+	if (length >= sizeof(buffer)) length = sizeof(buffer) - 1;
+	memcpy(buffer, start, length);
+	buffer[length] = '\0';
+	return atof(buffer);
+}
+
+// Parse an integer field that ends at end in the same way as atoi.
+
+inline int parse_lammps_int(const char* start, const char* end)
+{
+	char buffer[32];
+	size_t length = end - start;
+	if (length >= sizeof(buffer)) length = sizeof(buffer) - 1;
+	memcpy(buffer, start, length);
+	buffer[length] = '\0';
+	return atoi(buffer);
+}
+
 void read_lammps_header(LammpsData *const lammps_data, int* const current_n_sites, int *const timestep, real *const time, matrix box, const int dynamic_types, const int dynamic_state_sampling, const int no_forces)
 {
 	double low = 0.0;
 	double high = 0.0;
+	double time_value = 0.0;
 	std::string line;
 	int flag = 1; 
 	
 	while(flag == 1) {
 		//read next line of header (and wrap-up if end-of-file)
-		check_and_read_next_line(lammps_data->trajectory_stream, line);
+		read_next_lammps_line(lammps_data, line);
 		
 		//test if it is a labeled line (all LAMMPS labels start with "ITEM:")
 		if( line.compare(0, 5, "ITEM:") == 0 ) {
@@ -629,20 +1404,24 @@ void read_lammps_header(LammpsData *const lammps_data, int* const current_n_site
 			if( line.compare(6, 15, "NUMBER OF ATOMS") == 0) {
 				
 				//read number of atoms
-				lammps_data->trajectory_stream >> *current_n_sites;
+				read_next_lammps_line(lammps_data, line);
+				sscanf(line.c_str(), "%d", current_n_sites);
 				
 			} else if( line.compare(6, 10, "BOX BOUNDS") == 0) {
 					
 				//read in bounds (low high) for each dimensions
 				for(int pos=0; pos <  DIMENSION; pos++) {
-					lammps_data->trajectory_stream >> low >> high;
+					read_next_lammps_line(lammps_data, line);
+					sscanf(line.c_str(), "%lf %lf", &low, &high);
 					box[pos][pos] = high - low;
 				}	
 				
 			} else if( line.compare(6, 8, "TIMESTEP") == 0) {
 				
 				//read in timestep value
-				lammps_data->trajectory_stream >> *time;
+				read_next_lammps_line(lammps_data, line);
+				sscanf(line.c_str(), "%lf", &time_value);
+				*time = time_value;
 				(*timestep)++;
 			
 			} else if( line.compare(6, 5, "ATOMS") == 0) {
@@ -766,29 +1545,752 @@ int read_dimension_lammps_body(LammpsData *const lammps_data, FrameConfig *const
 	return return_value;
 }
 
+// Read a frame body from a memory-mapped trajectory, parsing only the needed fields 
+// in place and writing them directly into the frame.
+
+int read_mapped_lammps_body(LammpsData *const lammps_data, FrameConfig *const frame_config, const int dynamic_types, const int dynamic_state_sampling, const int no_forces)
+{
+	enum {kSkipField = 0, kPositionField = 1, kForceField = 2, kTypeField = 3, kStateField = 4};
+	
+	// Find what each column of the body is used for.
+	std::vector<int> field_kinds(lammps_data->header_size, kSkipField);
+	std::vector<int> field_components(lammps_data->header_size, 0);
+	for (int j = 0; j < DIMENSION; j++) {
+		field_kinds[j + lammps_data->x_pos] = kPositionField;
+		field_components[j + lammps_data->x_pos] = j;
+	}
+	if (no_forces == 0) {
+		for (int j = 0; j < DIMENSION; j++) {
+			field_kinds[j + lammps_data->f_pos] = kForceField;
+			field_components[j + lammps_data->f_pos] = j;
+		}
+	}
+	if (dynamic_types == 1) field_kinds[lammps_data->type_pos] = kTypeField;
+	if (dynamic_state_sampling == 1) field_kinds[lammps_data->state_pos] = kStateField;
+	
+	const char* end = lammps_data->map_data + lammps_data->map_size;
+	const char* p = lammps_data->map_data + lammps_data->map_pos;
+	std::string line;
+	for (int i = 0; i < frame_config->current_n_sites; i++) {
+		if (p >= end) {
+			// Let the line reader report reading past the end of the file.
+			read_next_lammps_line(lammps_data, line);
+			return -1;
+		}
+		const char* line_end = (const char*)memchr(p, '\n', end - p);
+		if (line_end == NULL) line_end = end;
+		
+		int n_fields = 0;
+		while (true) {
+			while (p < line_end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+			if (p >= line_end) break;
+			const char* field_end = p;
+			while (field_end < line_end && *field_end != ' ' && *field_end != '\t' && *field_end != '\r') field_end++;
+			
+			if (n_fields < lammps_data->header_size) {
+				switch (field_kinds[n_fields]) {
+				case kPositionField:
+					frame_config->x[i][field_components[n_fields]] = parse_lammps_double(p, field_end);
+					break;
+				case kForceField:
+					frame_config->f[i][field_components[n_fields]] = parse_lammps_double(p, field_end);
+					break;
+				case kTypeField:
+					frame_config->cg_site_types[i] = parse_lammps_int(p, field_end);
+					break;
+				case kStateField:
+					lammps_data->cg_site_state_probabilities[i] = parse_lammps_double(p, field_end);
+					break;
+				default:
+					break;
+				}
+			}
+			n_fields++;
+			p = field_end;
+		}
+		
+		if (n_fields != lammps_data->header_size) {
+			printf("Warning: Number of fields detected in frame body");
+			printf(" (%d) does not agree with number expected from frame header (%d)!\n", n_fields, lammps_data->header_size);
+			return -1;
+		}
+		p = line_end + 1;
+		lammps_data->map_pos = p - lammps_data->map_data;
+	}
+	if (lammps_data->map_pos > lammps_data->map_size) lammps_data->map_pos = lammps_data->map_size;
+	return 1;
+}
+
+//-------------------------------------------------------------
+// Helper functions for reading and writing MSCG binary trajectories
+//-------------------------------------------------------------
+
+// Copy the next frame record out of the mapped binary trajectory.
+// If body_flag is 0, only the time, timestep, and box are copied.
+
+void copy_binary_frame(FrameSource* const frame_source, const int body_flag)
+{
+	BinaryTrajectoryData* const binary_data = frame_source->binary_data;
+	FrameConfig* const frame_config = frame_source->frame_config;
+	const int n_values = frame_config->current_n_sites * DIMENSION;
+	const char* p = binary_data->map_data + binary_trajectory_header_size + (size_t)binary_data->next_frame * binary_data->frame_size;
+	binary_data->next_frame++;
+	
+	double time_value;
+	int32_t timestep;
+	double box[DIMENSION];
+	std::memcpy(&time_value, p, sizeof(double));
+	std::memcpy(&timestep, p + sizeof(double), sizeof(int32_t));
+	std::memcpy(box, p + sizeof(double) + 2 * sizeof(int32_t), sizeof(box));
+	p += sizeof(double) + 2 * sizeof(int32_t) + sizeof(box);
+	frame_source->time = time_value;
+	frame_source->current_timestep = timestep;
+	for (int i = 0; i < DIMENSION; i++) {
+		frame_source->simulation_box_limits[i][i] = box[i];
+		frame_config->simulation_box_half_lengths[i] = box[i] * 0.5;
+	}
+	if (body_flag == 0) return;
+	
+	// Positions and forces are stored exactly as FrameConfig holds them when value_size is sizeof(frame_real).
+	std::array<frame_real, DIMENSION>* vectors[2] = {frame_config->x, frame_config->f};
+	int n_vectors = (binary_data->contents & kBinaryForces) ? 2 : 1;
+	for (int v = 0; v < n_vectors; v++) {
+		if (binary_data->value_size == sizeof(frame_real)) {
+			std::memcpy(vectors[v], p, n_values * sizeof(frame_real));
+		} else if (binary_data->value_size == sizeof(double)) {
+			for (int k = 0; k < n_values; k++) {
+				double value;
+				std::memcpy(&value, p + k * sizeof(double), sizeof(double));
+				vectors[v][k / DIMENSION][k % DIMENSION] = value;
+			}
+		} else {
+			for (int k = 0; k < n_values; k++) {
+				float value;
+				std::memcpy(&value, p + k * sizeof(float), sizeof(float));
+				vectors[v][k / DIMENSION][k % DIMENSION] = value;
+			}
+		}
+		p += (size_t)n_values * binary_data->value_size;
+	}
+	if (binary_data->contents & kBinaryTypes) {
+		if ( (frame_source->dynamic_types == 1) && (frame_source->dynamic_state_sampling == 0) ) {
+			for (int i = 0; i < frame_config->current_n_sites; i++) {
+				int32_t type;
+				std::memcpy(&type, p + i * sizeof(int32_t), sizeof(int32_t));
+				frame_config->cg_site_types[i] = type;
+			}
+		}
+		p += (size_t)frame_config->current_n_sites * sizeof(int32_t);
+	}
+	if ( (binary_data->contents & kBinaryStates) && (frame_source->dynamic_state_sampling == 1) ) {
+		std::memcpy(binary_data->cg_site_state_probabilities, p, frame_config->current_n_sites * sizeof(double));
+	}
+}
+
+// Write frames to an MSCG binary trajectory, starting with the current frame.
+
+void write_binary_trajectory(FrameSource* const frame_source, const char* filename, const int value_size, const int n_frames_to_write)
+{
+	BinaryTrajectoryWriter* writer = open_binary_trajectory_writer(frame_source, filename, value_size);
+	for (int frame = 0; frame < n_frames_to_write; frame++) {
+		if ( (frame > 0) && (frame_source->get_next_frame(frame_source) == 0) ) {
+			printf("Warning: Stopped after %d frames since the next frame could not be read.\n", writer->header[5]);
+			break;
+		}
+		write_binary_trajectory_frame(writer, frame_source);
+	}
+	close_binary_trajectory_writer(writer);
+}
+
+// Append raw data to a binary trajectory, in memory or on file.
+
+inline void append_binary_trajectory_data(BinaryTrajectoryWriter* const writer, const void* data, const size_t size)
+{
+	if (writer->memory_image != NULL) {
+		const char* bytes = (const char*)data;
+		writer->memory_image->insert(writer->memory_image->end(), bytes, bytes + size);
+	} else {
+		fwrite(data, size, 1, writer->output_file);
+	}
+}
+
+void open_binary_trajectory_file(BinaryTrajectoryWriter* const writer)
+{
+	writer->output_file = fopen(writer->filename.c_str(), "wb");
+	if (writer->output_file == NULL) {
+		printf("Problem opening binary trajectory %s for writing\n", writer->filename.c_str());
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Move a binary trajectory kept in memory to its file and release the memory.
+
+void move_binary_trajectory_to_file(BinaryTrajectoryWriter* const writer)
+{
+	printf("Frames no longer fit in the memory budget of %.1f MB; writing them to %s instead.\n", writer->memory_budget / 1048576.0, writer->filename.c_str());
+	open_binary_trajectory_file(writer);
+	fwrite(writer->memory_image->data(), writer->memory_image->size(), 1, writer->output_file);
+	std::vector<char>().swap(*writer->memory_image);
+	writer->memory_image = NULL;
+}
+
+// Start a binary trajectory for the frames of frame_source, which must have read its first frame.
+
+BinaryTrajectoryWriter* open_binary_trajectory_writer(FrameSource* const frame_source, const char* filename, const int value_size, const size_t memory_budget)
+{
+	if ( (value_size != 4) && (value_size != 8) ) {
+		printf("Binary trajectories store values with 4 or 8 bytes, not %d!\n", value_size);
+		exit(EXIT_FAILURE);
+	}
+	BinaryTrajectoryWriter* writer = new BinaryTrajectoryWriter;
+	writer->filename = filename;
+	writer->output_file = NULL;
+	writer->memory_image = NULL;
+	writer->memory_budget = memory_budget;
+	
+	int n_sites = frame_source->frame_config->current_n_sites;
+	int contents = 0;
+	if (frame_source->no_forces == 0) contents |= kBinaryForces;
+	if ( (frame_source->dynamic_types == 1) && (frame_source->dynamic_state_sampling == 0) ) contents |= kBinaryTypes;
+	if (frame_source->dynamic_state_sampling == 1) contents |= kBinaryStates;
+	writer->frame_size = sizeof(double) + 2 * sizeof(int32_t) + DIMENSION * sizeof(double) + (size_t)n_sites * DIMENSION * value_size;
+	if (contents & kBinaryForces) writer->frame_size += (size_t)n_sites * DIMENSION * value_size;
+	if (contents & kBinaryTypes) writer->frame_size += (size_t)n_sites * sizeof(int32_t);
+	if (contents & kBinaryStates) writer->frame_size += (size_t)n_sites * sizeof(double);
+	
+	// Keep the trajectory in the frame store if at least one frame fits in the budget.
+	// Reserve the space expected for the frames to be read so that the store does not outgrow the budget.
+	if (memory_budget >= binary_trajectory_header_size + writer->frame_size) {
+		writer->memory_image = &frame_source->frame_store;
+		writer->memory_image->clear();
+		writer->memory_image->reserve(std::min(memory_budget, binary_trajectory_header_size + writer->frame_size * (size_t)std::max(frame_source->n_frames, 1)));
+	} else {
+		open_binary_trajectory_file(writer);
+	}
+	
+	// Write the header with the frame count filled in once all frames are written.
+	int32_t header[6] = {binary_trajectory_version, DIMENSION, n_sites, value_size, contents, 0};
+	std::memcpy(writer->header, header, sizeof(header));
+	append_binary_trajectory_data(writer, binary_trajectory_magic, sizeof(binary_trajectory_magic));
+	append_binary_trajectory_data(writer, writer->header, sizeof(writer->header));
+	
+	if (value_size != sizeof(frame_real)) {
+		if (value_size == sizeof(float)) writer->float_values.resize(n_sites * DIMENSION);
+		else writer->double_values.resize(n_sites * DIMENSION);
+	}
+	writer->types.resize((contents & kBinaryTypes) ? n_sites : 0);
+	return writer;
+}
+
+// Append the current frame of frame_source to a binary trajectory.
+
+void write_binary_trajectory_frame(BinaryTrajectoryWriter* const writer, FrameSource* const frame_source)
+{
+	FrameConfig* const frame_config = frame_source->frame_config;
+	const int n_sites = writer->header[2];
+	const int value_size = writer->header[3];
+	const int contents = writer->header[4];
+	if ( (writer->memory_image != NULL) && (writer->memory_image->size() + writer->frame_size > writer->memory_budget) ) {
+		move_binary_trajectory_to_file(writer);
+	}
+	
+	double time_value = frame_source->time;
+	int32_t frame_header[2] = {frame_source->current_timestep, 0};
+	double box[DIMENSION];
+	for (int i = 0; i < DIMENSION; i++) box[i] = frame_source->simulation_box_limits[i][i];
+	append_binary_trajectory_data(writer, &time_value, sizeof(double));
+	append_binary_trajectory_data(writer, frame_header, sizeof(frame_header));
+	append_binary_trajectory_data(writer, box, sizeof(box));
+	
+	std::array<frame_real, DIMENSION>* vectors[2] = {frame_config->x, frame_config->f};
+	int n_vectors = (contents & kBinaryForces) ? 2 : 1;
+	for (int v = 0; v < n_vectors; v++) {
+		if (value_size == sizeof(frame_real)) {
+			append_binary_trajectory_data(writer, vectors[v], n_sites * DIMENSION * sizeof(frame_real));
+		} else if (value_size == sizeof(double)) {
+			for (int k = 0; k < n_sites * DIMENSION; k++) writer->double_values[k] = vectors[v][k / DIMENSION][k % DIMENSION];
+			append_binary_trajectory_data(writer, writer->double_values.data(), n_sites * DIMENSION * sizeof(double));
+		} else {
+			for (int k = 0; k < n_sites * DIMENSION; k++) writer->float_values[k] = (float)vectors[v][k / DIMENSION][k % DIMENSION];
+			append_binary_trajectory_data(writer, writer->float_values.data(), n_sites * DIMENSION * sizeof(float));
+		}
+	}
+	if (contents & kBinaryTypes) {
+		for (int i = 0; i < n_sites; i++) writer->types[i] = frame_config->cg_site_types[i];
+		append_binary_trajectory_data(writer, writer->types.data(), n_sites * sizeof(int32_t));
+	}
+	if (contents & kBinaryStates) append_binary_trajectory_data(writer, get_current_state_probabilities(frame_source), n_sites * sizeof(double));
+	writer->header[5]++;
+}
+
+// Fill in the frame count and close a binary trajectory.
+
+void close_binary_trajectory_writer(BinaryTrajectoryWriter* const writer)
+{
+	if (writer->memory_image != NULL) {
+		std::memcpy(writer->memory_image->data() + sizeof(binary_trajectory_magic), writer->header, sizeof(writer->header));
+		printf("Kept %d frames (%.1f MB) in memory.\n", writer->header[5], writer->memory_image->size() / 1048576.0);
+		delete writer;
+		return;
+	}
+	fseek(writer->output_file, sizeof(binary_trajectory_magic), SEEK_SET);
+	fwrite(writer->header, sizeof(writer->header), 1, writer->output_file);
+	if ( ferror(writer->output_file) || (fclose(writer->output_file) != 0) ) {
+		printf("Problem writing binary trajectory %s\n", writer->filename.c_str());
+		exit(EXIT_FAILURE);
+	}
+	printf("Wrote %d frames to %s.\n", writer->header[5], writer->filename.c_str());
+	delete writer;
+}
+
+// The buffer that the format-specific reader fills with each frame's state probabilities.
+
+inline double* state_probability_buffer(FrameSource* const frame_source)
+{
+	if (frame_source->trajectory_type == kMSCGBinary) return frame_source->binary_data->cg_site_state_probabilities;
+	return frame_source->lammps_data->cg_site_state_probabilities;
+}
+
+double* get_current_state_probabilities(FrameSource* const frame_source)
+{
+	// The reader thread owns the format-specific buffers while frames are being prefetched.
+	if (frame_source->prefetcher != NULL) return frame_source->prefetcher->current_state_probabilities;
+	return state_probability_buffer(frame_source);
+}
+
 void FrameSource::sampleTypesFromProbs()
 {
 	double rand;
         std::uniform_real_distribution<double> uniform_dist(0.0, 1.0);
+	double* cg_site_state_probabilities = get_current_state_probabilities(this);
 	// Determine each site's type/state by comparing the probability against a random number
 	for(int i = 0; i < frame_config->current_n_sites; i++) {
 		// Generate random number [0,1] using Mersenne Twister.
 		rand = uniform_dist(mt_rand_gen);
 		// Make state assignment based on comparison.
-		if (rand > lammps_data->cg_site_state_probabilities[i]) frame_config->cg_site_types[i] = 2;
+		if (rand > cg_site_state_probabilities[i]) frame_config->cg_site_types[i] = 2;
 		else frame_config->cg_site_types[i] = 1;
 	}
 }
 
 
+//-------------------------------------------------------------
+// XTC decoding functions
+//-------------------------------------------------------------
+
+#if _exclude_gromacs == 1
+#else
+// Skip one frame of an .xtc file by reading its compressed coordinates without decompressing them.
+// Returns 1 on success and 0 at the end of the file or if the frame is malformed.
+
+int skip_xtc_frame(XDRFILE* const xtc_file, std::vector<char> &buffer)
+{
+	// Header: magic number, number of atoms, step and time; then the box and the number of coordinates.
+	int header[3];
+	float values[DIMENSION * 9];
+	int n_coords;
+	if ( (xdrfile_read_int(header, 3, xtc_file) != 3) || (header[0] != 1995) ) return 0;
+	if (xdrfile_read_float(values, 1 + DIMENSION * DIMENSION, xtc_file) != 1 + DIMENSION * DIMENSION) return 0;
+	if (xdrfile_read_int(&n_coords, 1, xtc_file) != 1) return 0;
+	
+	// Up to 9 coordinates are stored uncompressed.
+	if (n_coords <= 9) return (xdrfile_read_float(values, DIMENSION * n_coords, xtc_file) == DIMENSION * n_coords);
+	
+	// Otherwise: precision, minimum and maximum integer coordinates, smallest index, then the compressed bytes.
+	int limits[8];
+	if ( (xdrfile_read_float(values, 1, xtc_file) != 1) || (xdrfile_read_int(limits, 8, xtc_file) != 8) ) return 0;
+	int n_bytes = limits[7];
+	if (n_bytes < 0) return 0;
+	buffer.resize(n_bytes + 1);
+	return (xdrfile_read_opaque(&buffer[0], n_bytes, xtc_file) == n_bytes);
+}
+
+// Start num_xtc_decode_threads threads that decode the frames following the current one
+// ahead of their use. Each thread opens its own handles on both files, skipping the frames
+// decoded by the other threads without decompressing them, and decodes every n_threads-th frame
+// into a shared ring that read_next_decoded_xtc_frame hands out in trajectory order.
+
+void start_xtc_decoder(FrameSource* const frame_source)
+{
+	int n_sites = frame_source->frame_config->current_n_sites;
+	XTCDecoder* decoder = new XTCDecoder;
+	decoder->n_threads = frame_source->num_xtc_decode_threads;
+	decoder->next_frame = 0;
+	decoder->stop_requested = 0;
+	decoder->thread_finished.assign(decoder->n_threads, 0);
+	decoder->slots.resize(2 * decoder->n_threads);
+	for (unsigned i = 0; i < decoder->slots.size(); i++) {
+		decoder->slots[i].x = new rvec[n_sites + 1];
+		decoder->slots[i].f = new rvec[n_sites + 1];
+		decoder->slots[i].filled = 0;
+	}
+	frame_source->gromacs_data->decoder = decoder;
+	
+	printf("Decoding XTC frames in %d threads.\n", decoder->n_threads);
+	std::string position_filename(frame_source->trajectory_filename);
+	std::string force_filename(frame_source->gromacs_data->extra_trajectory_filename);
+	for (int t = 0; t < decoder->n_threads; t++) {
+		decoder->threads.push_back(std::thread(decode_xtc_frames, decoder, t, position_filename, force_filename, frame_source->current_frame_n, n_sites));
+	}
+}
+
+// Body of an XTC decode thread.
+
+void decode_xtc_frames(XTCDecoder* const decoder, const int thread_index, const std::string position_filename, const std::string force_filename, const int n_frames_to_skip, const int n_sites)
+{
+	XDRFILE* position_file = xdrfile_open(position_filename.c_str(), "r");
+	XDRFILE* force_file = xdrfile_open(force_filename.c_str(), "r");
+	std::vector<char> buffer;
+	int junk_integer;
+	real junk_floating_point;
+	
+	// Move past the frames already read and those decoded by the threads before this one.
+	int read_stat = (position_file != NULL) && (force_file != NULL);
+	for (int i = 0; (i < n_frames_to_skip + thread_index) && (read_stat == 1); i++) {
+		read_stat = skip_xtc_frame(force_file, buffer) && skip_xtc_frame(position_file, buffer);
+	}
+	
+	for (int frame = thread_index; ; frame += decoder->n_threads) {
+		// Wait until the slot for this frame has been handed out.
+		std::unique_lock<std::mutex> ring_lock(decoder->ring_mutex);
+		decoder->slot_emptied.wait(ring_lock, [decoder, frame]{ return decoder->stop_requested == 1 || frame < decoder->next_frame + (int)decoder->slots.size(); });
+		if (decoder->stop_requested == 1) break;
+		XTCDecodeSlot &slot = decoder->slots[frame % decoder->slots.size()];
+		ring_lock.unlock();
+		
+		// Decode the frame as read_next_xtc_frame would.
+		if (read_stat == 1) {
+			read_stat = (read_xtc(force_file, n_sites, &slot.current_timestep, &slot.time, slot.simulation_box_limits, slot.f, &junk_floating_point) == exdrOK) &&
+				(read_xtc(position_file, n_sites, &junk_integer, &junk_floating_point, slot.simulation_box_limits, slot.x, &junk_floating_point) == exdrOK);
+		}
+		slot.read_stat = read_stat;
+		
+		ring_lock.lock();
+		slot.filled = 1;
+		ring_lock.unlock();
+		decoder->slot_filled.notify_all();
+		if (read_stat == 0) break;
+		
+		// Skip the frames decoded by the other threads.
+		for (int i = 0; (i < decoder->n_threads - 1) && (read_stat == 1); i++) {
+			read_stat = skip_xtc_frame(force_file, buffer) && skip_xtc_frame(position_file, buffer);
+		}
+	}
+	
+	if (position_file != NULL) xdrfile_close(position_file);
+	if (force_file != NULL) xdrfile_close(force_file);
+	std::lock_guard<std::mutex> ring_lock(decoder->ring_mutex);
+	decoder->thread_finished[thread_index] = 1;
+	decoder->slot_filled.notify_all();
+}
+
+// Replacement for reading the next frame in line while decoding ahead.
+
+int read_next_decoded_xtc_frame(FrameSource* const frame_source)
+{
+	XTCDecoder* const decoder = frame_source->gromacs_data->decoder;
+	int frame = decoder->next_frame;
+	XTCDecodeSlot &slot = decoder->slots[frame % decoder->slots.size()];
+	
+	std::unique_lock<std::mutex> ring_lock(decoder->ring_mutex);
+	decoder->slot_filled.wait(ring_lock, [decoder, &slot, frame]{ return slot.filled == 1 || decoder->thread_finished[frame % decoder->n_threads] == 1; });
+	if (slot.filled == 0) return 0;
+	ring_lock.unlock();
+	
+	FrameConfig* const frame_config = frame_source->frame_config;
+	for (int i = 0; i < frame_config->current_n_sites; i++) {
+		for (int j = 0; j < DIMENSION; j++) {
+			frame_config->x[i][j] = slot.x[i][j];
+			frame_config->f[i][j] = slot.f[i][j];
+		}
+	}
+	frame_source->current_timestep = slot.current_timestep;
+	frame_source->time = slot.time;
+	std::memcpy(frame_source->simulation_box_limits, slot.simulation_box_limits, sizeof(matrix));
+	for (int i = 0; i < DIMENSION; i++) frame_config->simulation_box_half_lengths[i] = frame_source->simulation_box_limits[i][i] * 0.5;
+	frame_source->current_frame_n += 1;
+	int read_stat = slot.read_stat;
+	
+	// Return the slot to its decode thread.
+	ring_lock.lock();
+	slot.filled = 0;
+	decoder->next_frame++;
+	ring_lock.unlock();
+	decoder->slot_emptied.notify_all();
+	
+	return read_stat;
+}
+
+void stop_xtc_decoder(XTCDecoder* const decoder)
+{
+	{
+		std::lock_guard<std::mutex> ring_lock(decoder->ring_mutex);
+		decoder->stop_requested = 1;
+	}
+	decoder->slot_emptied.notify_all();
+	for (unsigned t = 0; t < decoder->threads.size(); t++) decoder->threads[t].join();
+	
+	for (unsigned i = 0; i < decoder->slots.size(); i++) {
+		delete [] decoder->slots[i].x;
+		delete [] decoder->slots[i].f;
+	}
+	delete decoder;
+}
+#endif
+
+//-------------------------------------------------------------
+// Frame prefetching functions
+//-------------------------------------------------------------
+
+// Start a reader thread that fills a ring of num_prefetch_frames buffers 
+// with the next n_frames_to_read frames. The frame source's get_next_frame
+// and cleanup are replaced so that the calculation receives exactly the
+// same frames in the same order as it would reading in line.
+
+void start_frame_prefetch(FrameSource* const frame_source, const int n_frames_to_read)
+{
+	if (frame_source->num_prefetch_frames < 1 || n_frames_to_read < 1) return;
+	if (frame_source->prefetcher != NULL) {
+		printf("Frame prefetching has already been started for this trajectory.\n");
+		exit(EXIT_FAILURE);
+	}
+	
+	int n_sites = frame_source->frame_config->current_n_sites;
+	FramePrefetcher* prefetcher = new FramePrefetcher;
+	// Leave any in-memory trajectory out of the reader's copy: the reader only sees it
+	// through binary_data->map_data, and swapping the store keeps that pointer valid.
+	std::vector<char> frame_store;
+	frame_store.swap(frame_source->frame_store);
+	prefetcher->reader_source = *frame_source;
+	frame_source->frame_store.swap(frame_store);
+	prefetcher->read_next_frame = frame_source->get_next_frame;
+	prefetcher->cleanup = frame_source->cleanup;
+	prefetcher->n_frames_to_read = n_frames_to_read;
+	prefetcher->next_full_slot = 0;
+	prefetcher->next_empty_slot = 0;
+	prefetcher->n_full_slots = 0;
+	prefetcher->reader_finished = 0;
+	prefetcher->stop_requested = 0;
+	prefetcher->current_state_probabilities = NULL;
+	
+	// Allocate the ring of frame buffers.
+	prefetcher->slots.resize(frame_source->num_prefetch_frames);
+	for (unsigned i = 0; i < prefetcher->slots.size(); i++) {
+		prefetcher->slots[i].frame_config = new FrameConfig(n_sites);
+		prefetcher->slots[i].cg_site_types = NULL;
+		prefetcher->slots[i].cg_site_state_probabilities = NULL;
+		if (frame_source->dynamic_types == 1) prefetcher->slots[i].cg_site_types = new int[n_sites];
+		if (frame_source->dynamic_state_sampling == 1) prefetcher->slots[i].cg_site_state_probabilities = new double[n_sites];
+		prefetcher->slots[i].frame_config->cg_site_types = prefetcher->slots[i].cg_site_types;
+	}
+	
+	// Keep the current frame's state probabilities for resampling it.
+	if (frame_source->dynamic_state_sampling == 1) {
+		prefetcher->current_state_probabilities = new double[n_sites];
+		std::memcpy(prefetcher->current_state_probabilities, state_probability_buffer(frame_source), n_sites * sizeof(double));
+	}
+	
+	prefetcher->reader_source.frame_config = prefetcher->slots[0].frame_config;
+	
+	frame_source->prefetcher = prefetcher;
+	frame_source->get_next_frame = read_next_prefetched_frame;
+	frame_source->cleanup = finish_prefetched_reading;
+	printf("Prefetching up to %d frames in a separate reader thread.\n", frame_source->num_prefetch_frames);
+	prefetcher->reader_thread = std::thread(prefetch_frames, prefetcher);
+}
+
+// Body of the reader thread: read frames into empty slots until the requested
+// number of frames has been read, a read fails, or the calculation stops early.
+
+void prefetch_frames(FramePrefetcher* const prefetcher)
+{
+	FrameSource* const reader_source = &prefetcher->reader_source;
+	int n_sites = reader_source->frame_config->current_n_sites;
+	
+	for (int frame = 0; frame < prefetcher->n_frames_to_read; frame++) {
+		// Wait for an empty slot.
+		std::unique_lock<std::mutex> ring_lock(prefetcher->ring_mutex);
+		prefetcher->slot_emptied.wait(ring_lock, [prefetcher]{ return prefetcher->stop_requested == 1 || prefetcher->n_full_slots < (int)prefetcher->slots.size(); });
+		if (prefetcher->stop_requested == 1) break;
+		PrefetchSlot &slot = prefetcher->slots[prefetcher->next_empty_slot];
+		ring_lock.unlock();
+		
+		// Read the frame directly into the slot's buffers.
+		slot.frame_config->current_n_sites = n_sites;
+		reader_source->frame_config = slot.frame_config;
+		int read_stat = prefetcher->read_next_frame(reader_source);
+		slot.read_stat = read_stat;
+		slot.current_timestep = reader_source->current_timestep;
+		slot.current_frame_n = reader_source->current_frame_n;
+		slot.time = reader_source->time;
+		std::memcpy(slot.simulation_box_limits, reader_source->simulation_box_limits, sizeof(matrix));
+		if (reader_source->dynamic_state_sampling == 1) {
+			std::memcpy(slot.cg_site_state_probabilities, state_probability_buffer(reader_source), n_sites * sizeof(double));
+		}
+		
+		// Hand the slot over to the calculation.
+		ring_lock.lock();
+		prefetcher->next_empty_slot = (prefetcher->next_empty_slot + 1) % prefetcher->slots.size();
+		prefetcher->n_full_slots++;
+		ring_lock.unlock();
+		prefetcher->slot_filled.notify_one();
+		
+		if (read_stat == 0) break;
+	}
+	
+	std::lock_guard<std::mutex> ring_lock(prefetcher->ring_mutex);
+	prefetcher->reader_finished = 1;
+	prefetcher->slot_filled.notify_one();
+}
+
+// Replacement for get_next_frame while prefetching: swap the oldest full slot's buffers
+// into the frame source's frame_config and copy the frame-specific data read with it.
+
+int read_next_prefetched_frame(FrameSource* const frame_source)
+{
+	FramePrefetcher* const prefetcher = frame_source->prefetcher;
+	
+	std::unique_lock<std::mutex> ring_lock(prefetcher->ring_mutex);
+	prefetcher->slot_filled.wait(ring_lock, [prefetcher]{ return prefetcher->reader_finished == 1 || prefetcher->n_full_slots > 0; });
+	if (prefetcher->n_full_slots == 0) {
+		// The reader thread has already read every frame it was asked for, so read in line.
+		ring_lock.unlock();
+		int read_stat = prefetcher->read_next_frame(frame_source);
+		if (frame_source->dynamic_state_sampling == 1) {
+			std::memcpy(prefetcher->current_state_probabilities, state_probability_buffer(frame_source), frame_source->frame_config->current_n_sites * sizeof(double));
+		}
+		return read_stat;
+	}
+	PrefetchSlot &slot = prefetcher->slots[prefetcher->next_full_slot];
+	ring_lock.unlock();
+	
+	FrameConfig* const frame_config = frame_source->frame_config;
+	frame_config->current_n_sites = slot.frame_config->current_n_sites;
+	std::swap(frame_config->x, slot.frame_config->x);
+	std::swap(frame_config->f, slot.frame_config->f);
+	for (int i = 0; i < DIMENSION; i++) frame_config->simulation_box_half_lengths[i] = slot.frame_config->simulation_box_half_lengths[i];
+	if (frame_source->dynamic_types == 1) {
+		std::memcpy(frame_config->cg_site_types, slot.cg_site_types, frame_config->current_n_sites * sizeof(int));
+	}
+	if (frame_source->dynamic_state_sampling == 1) {
+		std::swap(prefetcher->current_state_probabilities, slot.cg_site_state_probabilities);
+	}
+	frame_source->current_timestep = slot.current_timestep;
+	frame_source->current_frame_n = slot.current_frame_n;
+	frame_source->time = slot.time;
+	std::memcpy(frame_source->simulation_box_limits, slot.simulation_box_limits, sizeof(matrix));
+	int read_stat = slot.read_stat;
+	
+	// Return the slot to the reader thread.
+	ring_lock.lock();
+	prefetcher->next_full_slot = (prefetcher->next_full_slot + 1) % prefetcher->slots.size();
+	prefetcher->n_full_slots--;
+	ring_lock.unlock();
+	prefetcher->slot_emptied.notify_one();
+	
+	return read_stat;
+}
+
+// Replacement for cleanup while prefetching: stop and join the reader thread,
+// free the ring, then clean up the underlying trajectory as usual.
+
+void finish_prefetched_reading(FrameSource* const frame_source)
+{
+	FramePrefetcher* const prefetcher = frame_source->prefetcher;
+	{
+		std::lock_guard<std::mutex> ring_lock(prefetcher->ring_mutex);
+		prefetcher->stop_requested = 1;
+	}
+	prefetcher->slot_emptied.notify_one();
+	prefetcher->reader_thread.join();
+	
+	for (unsigned i = 0; i < prefetcher->slots.size(); i++) {
+		delete prefetcher->slots[i].frame_config;
+		if (prefetcher->slots[i].cg_site_types != NULL) delete [] prefetcher->slots[i].cg_site_types;
+		if (prefetcher->slots[i].cg_site_state_probabilities != NULL) delete [] prefetcher->slots[i].cg_site_state_probabilities;
+	}
+	if (prefetcher->current_state_probabilities != NULL) delete [] prefetcher->current_state_probabilities;
+	
+	frame_source->get_next_frame = prefetcher->read_next_frame;
+	frame_source->cleanup = prefetcher->cleanup;
+	frame_source->prefetcher = NULL;
+	delete prefetcher;
+	
+	frame_source->cleanup(frame_source);
+}
+
+//-------------------------------------------------------------
+// Worker process functions
+//-------------------------------------------------------------
+
+// Split the frames across num_worker_processes local worker processes.
+// Each worker's output is sent to worker_<index>.log.
+
+int launch_frame_worker_processes(ControlInputs* const control_input, FrameSource* const frame_source, const int block_size, const char* result_filename_format, std::vector<std::string> &result_filenames)
+{
+    int n_blocks = (control_input->n_frames + block_size - 1) / block_size;
+    int n_workers = std::min(control_input->num_worker_processes, n_blocks);
+    printf("Splitting %d frames across %d worker processes.\n", control_input->n_frames, n_workers);
+    result_filenames.clear();
+    for (int w = 0; w < n_workers; w++) {
+        char filename[100];
+        sprintf(filename, result_filename_format, w);
+        result_filenames.push_back(filename);
+    }
+    
+    std::vector<pid_t> worker_pids(n_workers);
+    for (int w = 0; w < n_workers; w++) {
+        int first_frame = (int)((long long)n_blocks * w / n_workers) * block_size;
+        int end_frame = std::min((int)((long long)n_blocks * (w + 1) / n_workers) * block_size, control_input->n_frames);
+        
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid < 0) {
+            printf("Could not start worker process %d.\n", w);
+            exit(EXIT_FAILURE);
+        } else if (pid == 0) {
+            char log_filename[100];
+            sprintf(log_filename, "worker_%d.log", w);
+            if (freopen(log_filename, "w", stdout) == NULL) exit(EXIT_FAILURE);
+            control_input->starting_frame += first_frame;
+            control_input->n_frames = end_frame - first_frame;
+            frame_source->starting_frame += first_frame;
+            frame_source->n_frames = control_input->n_frames;
+            printf("Worker process %d processing frames %d to %d.\n", w, control_input->starting_frame, control_input->starting_frame + control_input->n_frames - 1);
+            return w;
+        }
+        worker_pids[w] = pid;
+        printf("Started worker process %d for frames %d to %d.\n", w, control_input->starting_frame + first_frame, control_input->starting_frame + end_frame - 1);
+    }
+    
+    // Wait for all workers, even after one has failed, so that none is left running.
+    int n_failed = 0;
+    for (int w = 0; w < n_workers; w++) {
+        int status;
+        if ( (waitpid(worker_pids[w], &status, 0) < 0) || !WIFEXITED(status) || (WEXITSTATUS(status) != EXIT_SUCCESS) ) {
+            printf("Worker process %d failed; see worker_%d.log.\n", w, w);
+            n_failed++;
+        }
+    }
+    if (n_failed > 0) {
+        // Do not leave the results of the other workers behind.
+        for (int w = 0; w < n_workers; w++) remove(result_filenames[w].c_str());
+        exit(EXIT_FAILURE);
+    }
+    printf("All worker processes finished.\n");
+    return -1;
+}
+
 //-------------------------------------------------------------
 // Whole-trajectory reading functions
 //-------------------------------------------------------------
 
 // Read information to reweight all frames from an auxiliary file 'frame_weights.in'.
+// Any weights read before are replaced.
 
 void read_frame_weights(FrameSource* const frame_source, const int start_frame, const int n_frames, const std::string &extension)
 {
+	delete [] frame_source->frame_weights;
 	std::string filename = "frame_weights." + extension;
     read_frame_values(filename.c_str(), start_frame, n_frames, frame_source->frame_weights);
 	
@@ -891,16 +2393,20 @@ int add_pair_stencil_element(const std::vector<int>& cell_number,  const std::ve
 int add_3B_stencil_element(const std::vector<int>& cell_number, const std::vector<int> &cell_indices, std::vector<int> &shift_indices, std::vector<int> &stencil, const std::vector<int> &hash_offset, int stencil_counter);
 
 // Initializer for cell lists, using derived class's stencil set up routine.
+// The lists are reused in place when the box changes. If the number of cells in each dimension 
+// stays the same (as for most frames of a constant pressure trajectory), only the cell sizes change
+// and the stencil is kept.
 
 void BaseCellList::init(const double cutoff, const FrameSource* const fr)
 {
-    setUpCellListCells(cutoff, fr->frame_config->simulation_box_half_lengths, fr->frame_config->current_n_sites);
-    setUpCellListStencil();
+    if (setUpCellListCells(cutoff, fr->frame_config->simulation_box_half_lengths, fr->frame_config->current_n_sites)) {
+    	setUpCellListStencil();
+    }
 }
 
-// Set up the lists and the spatial decomposition.
+// Set up the lists and the spatial decomposition, returning true if the number of cells in any dimension changed.
 
-void BaseCellList::setUpCellListCells(const double cutoff, const real*  simulation_box_half_lengths, const int current_n_sites)
+bool BaseCellList::setUpCellListCells(const double cutoff, const real*  simulation_box_half_lengths, const int current_n_sites)
 {
     assert(cutoff > 0);
  	for (int i = 0; i < DIMENSION; i++) {
@@ -910,13 +2416,13 @@ void BaseCellList::setUpCellListCells(const double cutoff, const real*  simulati
     	}
     }
 	
-	cell_number = std::vector<int>(DIMENSION);
-	cell_size = std::vector<double>(DIMENSION);
+	std::array<int, DIMENSION> new_cell_number;
+	cell_size.resize(DIMENSION);
 	int too_small = 0;
 	
 	// Determine the number of cells in the box first by calculateng the number of cells needed to span each dimension.
     for (int i = 0; i < DIMENSION; i++) {
-    	cell_number[i] = (int)(2.0 * simulation_box_half_lengths[i] / cutoff);
+    	new_cell_number[i] = (int)(2.0 * simulation_box_half_lengths[i] / cutoff);
     }
 
     // Check that there are enough cells to make a cell list worthwhile.
@@ -925,8 +2431,8 @@ void BaseCellList::setUpCellListCells(const double cutoff, const real*  simulati
     	// It would be possible to shrink the cell list dimension by the number of dimensions that are too small.
     	
     	// This is a special case where the number of cells is smaller than the stencil in at least one dimension.
-    	if (cell_number[i] < 3) {
-    		std::fill(cell_number.begin(), cell_number.end(), 3);
+    	if (new_cell_number[i] < 3) {
+    		std::fill(new_cell_number.begin(), new_cell_number.end(), 3);
     		std::fill(cell_size.begin(), cell_size.end(), -1.0);
     		too_small = 1;
     		break;
@@ -935,23 +2441,33 @@ void BaseCellList::setUpCellListCells(const double cutoff, const real*  simulati
     // Otherwise, continue with cell list setup.
     if (too_small == 0) {
     	for (int i = 0; i < DIMENSION; i++) {
-	        cell_size[i] = 2.0 * simulation_box_half_lengths[i] / (double)(cell_number[i]);
+	        cell_size[i] = 2.0 * simulation_box_half_lengths[i] / (double)(new_cell_number[i]);
 	    }
 	}
 	
-	// Allocate arrays based on the total number of cells needed to cover the entire simulation box.
+	// Record the cell layout, noting whether it differs from the previous one.
+	bool cells_changed = false;
+	cell_number.resize(DIMENSION);
+	for (int i = 0; i < DIMENSION; i++) {
+		if (cell_number[i] != new_cell_number[i]) cells_changed = true;
+		cell_number[i] = new_cell_number[i];
+	}
+	
+	// Size arrays based on the total number of cells needed to cover the entire simulation box.
+	// Existing storage is reused when it is already large enough.
     size = 1;
     for (int i = 0; i < DIMENSION; i++) {
     	size *= cell_number[i];
     }
     
-    head = std::vector<int>(size);
-    list = std::vector<int>(current_n_sites);
+    head.resize(size);
+    list.resize(current_n_sites);
+    return cells_changed;
 }
 
 // Populate the cell lists.
 
-void BaseCellList::populateList(const int n_particles, std::array<double, DIMENSION>* const &particle_positions)
+void BaseCellList::populateList(const int n_particles, std::array<frame_real, DIMENSION>* const &particle_positions)
 {
     assert(n_particles > 0);
     int icell; // The index for the cell that a particle is in;
@@ -964,7 +2480,7 @@ void BaseCellList::populateList(const int n_particles, std::array<double, DIMENS
     }
     
     // Calculate the inverse of the size of a cell in each dimension.
-	std::vector<double> cell_inv(DIMENSION);
+	std::array<double, DIMENSION> cell_inv;
 	for (int i = 0; i < DIMENSION; i++) {
 		cell_inv[i] = 1.0 / cell_size[i];
 	}
@@ -1025,7 +2541,7 @@ void PairCellList::setUpCellListStencil()
 	// The stencil vector is a flat vector that includes
 	// the neighboring cells that need to be looked at for all cells.
 	stencil_size = neighbor_cells / 2;
-    stencil = std::vector<int>(number_cells * stencil_size);
+    stencil.assign(number_cells * stencil_size, 0);
         
     // Note: The acceptable numbers could be modeled as
     // Run number from 0 or 1 to 2^(dimension) - 1.
@@ -1055,7 +2571,7 @@ void ThreeBCellList::setUpCellListStencil()
 	// The stencil vector is a flat vector that includes
 	// the neighboring cells that need to be looked at for all cells.
 	stencil_size = neighbor_cells;
-    stencil = std::vector<int>(number_cells * stencil_size);
+    stencil.assign(number_cells * stencil_size, 0);
         
     // Note: The acceptable numbers could be modeled as
     // Run number from 0 or 1 to 2^(dimension) - 1.
@@ -1200,3 +2716,107 @@ int add_3B_stencil_element(const std::vector<int> &cell_number, const std::vecto
 	stencil_counter++;
 	return stencil_counter;
 }
+
+//--------------------------------------------------------------------
+// Verlet list routines for pair nonbonded and density interactions
+//--------------------------------------------------------------------
+
+// Local function prototypes for this section.
+void fill_verlet_partners(const int n_particles, const std::vector<int> &first_particles, const std::vector<int> &second_particles, const TopoList* const exclusion_list, std::vector<int> &starts, std::vector<int> &partners);
+
+PairVerletList::PairVerletList(const double cutoff, const double skin) : n_particles(0)
+{
+	list_cutoff2 = (cutoff + skin) * (cutoff + skin);
+	max_displacement2 = 0.25 * skin * skin;
+}
+
+// Check whether a particle may have moved far enough since the last build for an interacting pair to be missing from the list.
+
+bool PairVerletList::needsRebuild(const int current_n_sites, std::array<frame_real, DIMENSION>* const &particle_positions, const real* simulation_box_half_lengths) const
+{
+	if (current_n_sites != n_particles) return true;
+	for (int i = 0; i < DIMENSION; i++) {
+		if (simulation_box_half_lengths[i] != reference_box_half_lengths[i]) return true;
+	}
+	for (int i = 0; i < n_particles; i++) {
+		double displacement2 = 0.0;
+		for (int j = 0; j < DIMENSION; j++) {
+			// Positions are wrapped into the box every frame, so use the minimum image displacement.
+			double dx = particle_positions[i][j] - reference_positions[i][j];
+			if (dx > simulation_box_half_lengths[j]) dx -= 2.0 * simulation_box_half_lengths[j];
+			else if (dx < -simulation_box_half_lengths[j]) dx += 2.0 * simulation_box_half_lengths[j];
+			displacement2 += dx * dx;
+		}
+		if (displacement2 > max_displacement2) return true;
+	}
+	return false;
+}
+
+// Rebuild the list from a populated cell list. A NULL exclusion list leaves the corresponding pair list empty.
+
+void PairVerletList::build(const PairCellList& pair_cell_list, const int current_n_sites, std::array<frame_real, DIMENSION>* const &particle_positions, const real* simulation_box_half_lengths, const TopoList* exclusion_list, const TopoList* density_exclusion_list)
+{
+	n_particles = current_n_sites;
+	reference_positions.assign(particle_positions, particle_positions + n_particles);
+	for (int i = 0; i < DIMENSION; i++) {
+		reference_box_half_lengths[i] = simulation_box_half_lengths[i];
+	}
+	
+	// Collect every pair within the list cutoff, visiting and orienting them as the cell list walk does.
+	std::vector<int> first_particles;
+	std::vector<int> second_particles;
+	int particle_ids[2];
+	double distance2;
+	int stencil_size = pair_cell_list.get_stencil_size();
+	for (int kk = 0; kk < pair_cell_list.size; kk++) {
+		for (int k = pair_cell_list.head[kk]; k >= 0; k = pair_cell_list.list[k]) {
+			particle_ids[0] = k;
+			for (int l = pair_cell_list.list[k]; l >= 0; l = pair_cell_list.list[l]) {
+				particle_ids[1] = l;
+				calc_squared_distance(particle_ids, particle_positions, simulation_box_half_lengths, distance2);
+				if (distance2 < list_cutoff2) {
+					first_particles.push_back(k);
+					second_particles.push_back(l);
+				}
+			}
+			for (int nei = 0; nei < stencil_size; nei++) {
+				int ll = pair_cell_list.stencil[stencil_size * kk + nei];
+				for (int l = pair_cell_list.head[ll]; l >= 0; l = pair_cell_list.list[l]) {
+					particle_ids[1] = l;
+					calc_squared_distance(particle_ids, particle_positions, simulation_box_half_lengths, distance2);
+					if (distance2 < list_cutoff2) {
+						first_particles.push_back(k);
+						second_particles.push_back(l);
+					}
+				}
+			}
+		}
+	}
+	
+	fill_verlet_partners(n_particles, first_particles, second_particles, exclusion_list, pair_starts, pair_partners);
+	fill_verlet_partners(n_particles, first_particles, second_particles, density_exclusion_list, density_starts, density_partners);
+}
+
+// Sort the non-excluded pairs into compressed rows by their first particle, keeping the order found within each row.
+
+void fill_verlet_partners(const int n_particles, const std::vector<int> &first_particles, const std::vector<int> &second_particles, const TopoList* const exclusion_list, std::vector<int> &starts, std::vector<int> &partners)
+{
+	starts.assign(n_particles + 1, 0);
+	partners.clear();
+	if (exclusion_list == NULL) return;
+	
+	std::vector<bool> kept(first_particles.size());
+	for (unsigned p = 0; p < first_particles.size(); p++) {
+		kept[p] = !exclusion_list->is_partner(first_particles[p], second_particles[p]);
+		if (kept[p]) starts[first_particles[p] + 1]++;
+	}
+	for (int i = 0; i < n_particles; i++) {
+		starts[i + 1] += starts[i];
+	}
+	
+	partners.resize(starts[n_particles]);
+	std::vector<int> next(starts.begin(), starts.end() - 1);
+	for (unsigned p = 0; p < first_particles.size(); p++) {
+		if (kept[p]) partners[next[first_particles[p]]++] = second_particles[p];
+	}
+}
@@ -29,11 +29,14 @@
 
 struct ControlInputs;
 struct LammpsData;
+struct BinaryTrajectoryData;
+struct BinaryTrajectoryWriter;
 struct XRDData;
+struct FramePrefetcher;
 
 typedef real matrix[3][3];
 
-enum TrajectoryType {kGromacsTRR = 0, kGromacsXTC = 1, kLAMMPSDump = 2};
+enum TrajectoryType {kGromacsTRR = 0, kGromacsXTC = 1, kLAMMPSDump = 2, kMSCGBinary = 3};
 
 typedef void (*dimension_neighbor_action)(const std::vector<int> &cell_number, std::vector<int> &indices, std::vector<int> &stencil, const std::vector<int> &hash_offset);
 typedef int (*add_stencil_element)(const std::vector<int> &cell_number, const std::vector<int> &cell_indices, std::vector<int> &shift_indices, std::vector<int> &stencil, const std::vector<int> &hash_offset, int stencil_counter);
@@ -45,21 +48,21 @@ typedef int (*add_stencil_element)(const std::vector<int> &cell_number, const st
 struct FrameConfig {
     int current_n_sites;                 // Total number of sites in this frame
     real* simulation_box_half_lengths;   // A list of half the box length in each dimension
-    std::array<double, DIMENSION>* x;    // A list of all CG particle positions for a single frame stored in a flat array, x,y,z components contiguous 
-    std::array<double, DIMENSION>* f;    // A list of all CG particle positions for a single frame stored in a flat array, x,y,z components contiguous    
+    std::array<frame_real, DIMENSION>* x;    // A list of all CG particle positions for a single frame stored in a flat array, x,y,z components contiguous 
+    std::array<frame_real, DIMENSION>* f;    // A list of all CG particle positions for a single frame stored in a flat array, x,y,z components contiguous    
 	int* cg_site_types;				   	 // A list of all CG particle types (used if dynamic_types = 1)
 	
 	inline FrameConfig(const int n_sites) {
 		current_n_sites = n_sites;
-		x = new std::array<double, DIMENSION>[current_n_sites + 1];
-		f = new std::array<double, DIMENSION>[current_n_sites + 1];
+		x = new std::array<frame_real, DIMENSION>[current_n_sites + 1];
+		f = new std::array<frame_real, DIMENSION>[current_n_sites + 1];
 		simulation_box_half_lengths = new real[DIMENSION];
 	};
 	
 	inline FrameConfig(const int n_sites, int* site_types) {
 		current_n_sites = n_sites;
-		x = new std::array<double, DIMENSION>[current_n_sites + 1];
-		f = new std::array<double, DIMENSION>[current_n_sites + 1];
+		x = new std::array<frame_real, DIMENSION>[current_n_sites + 1];
+		f = new std::array<frame_real, DIMENSION>[current_n_sites + 1];
 		simulation_box_half_lengths = new real[DIMENSION];
 		cg_site_types = site_types;		
 	};
@@ -92,11 +95,17 @@ struct FrameSource {
     char trajectory_filename[1000];         // Trajectory file name (positions for .xtc, forces and positions for .trr)
     std::mt19937 mt_rand_gen;    			// A Mersenne Twister random number generator for dynamic state sampling.
 	int position_dimension;					// The number of elements in each particle's position vector.
+	int num_prefetch_frames;				// Number of frames to read ahead of the calculation in a separate thread (0 to read in line)
+	int num_xtc_decode_threads;				// Number of threads decoding XTC frames ahead of their use (1 to decode in line)
+	int frame_index_flag;					// 1 to locate frames through a sidecar frame index file (LAMMPS only); 0 otherwise
 	
     // Type-dependent source data and functions
-    TrajectoryType trajectory_type;         // 0 to use .trr format trajectories; 1 to use .xtc format trajectories; 2 to use LAMMPS trajectories
+    TrajectoryType trajectory_type;         // 0 to use .trr format trajectories; 1 to use .xtc format trajectories; 2 to use LAMMPS trajectories; 3 to use MSCG binary trajectories
 	XRDData* gromacs_data;
 	LammpsData* lammps_data;
+	BinaryTrajectoryData* binary_data;
+	FramePrefetcher* prefetcher;			// Reader thread and frame buffers if num_prefetch_frames > 0; NULL otherwise
+	std::vector<char> frame_store;			// In-memory MSCG binary trajectory read instead of trajectory_filename when it is not empty
 
     // Type-dependent function to read the first frame of a given source
     // Performs initial sanity checks to make sure the frame is consistent 
@@ -137,6 +146,42 @@ struct FrameSource {
 void parse_command_line_arguments(const int num_arg, char** arg, FrameSource* const frame_source);
 // Copy trajectory-reading specifications from ControlInputs to FRAME_DATA.
 void copy_control_inputs_to_frd(struct ControlInputs* const control_input, FrameSource* const frame_source);
+// Begin reading up to n_frames_to_read further frames in a separate thread if num_prefetch_frames > 0.
+// Frames are still handed out in trajectory order through get_next_frame.
+void start_frame_prefetch(FrameSource* const frame_source, const int n_frames_to_read);
+// Make frame frame_number (counting from 1) the current frame by seeking directly to it.
+// This requires a frame index (frame_index_flag 1) and must be done before frame prefetching is started.
+// Returns 1 if the frame was read successfully and 0 otherwise.
+int seek_to_frame(FrameSource* const frame_source, const int frame_number);
+// Number of frames listed in the frame index (or binary trajectory), or -1 if the trajectory has no frame index.
+int get_n_indexed_frames(FrameSource* const frame_source);
+// State probabilities of the current frame (used if dynamic_state_sampling = 1).
+double* get_current_state_probabilities(FrameSource* const frame_source);
+// Split the frames to be processed across num_worker_processes local processes in whole blocks of block_size frames.
+// Worker w writes its results to the file named by result_filename_format with w in place of %d;
+// result_filenames lists these names for every worker.
+// In each worker, the frame range is narrowed to that worker's share and the worker's index is returned;
+// in the original process, -1 is returned once every worker has finished successfully.
+// If any worker fails, the results of all workers are removed and the program exits.
+int launch_frame_worker_processes(struct ControlInputs* const control_input, FrameSource* const frame_source, const int block_size, const char* result_filename_format, std::vector<std::string> &result_filenames);
+
+//-------------------------------------------------------------
+// Binary trajectory writing functions.
+//-------------------------------------------------------------
+
+// Write the current frame and the next n_frames_to_write - 1 frames of frame_source
+// to an MSCG binary trajectory storing positions and forces with value_size bytes (4 or 8).
+void write_binary_trajectory(FrameSource* const frame_source, const char* filename, const int value_size, const int n_frames_to_write);
+// Write a binary trajectory one frame at a time: open it once frame_source has read its first frame,
+// append each frame as it becomes current, then close it to record the number of frames written.
+// If memory_budget is more than 0, the trajectory is kept in frame_source->frame_store instead of filename
+// for as long as it fits in memory_budget bytes; it is moved to filename once it would not.
+BinaryTrajectoryWriter* open_binary_trajectory_writer(FrameSource* const frame_source, const char* filename, const int value_size, const size_t memory_budget = 0);
+void write_binary_trajectory_frame(BinaryTrajectoryWriter* const writer, FrameSource* const frame_source);
+void close_binary_trajectory_writer(BinaryTrajectoryWriter* const writer);
+// Read frames from the MSCG binary trajectory filename instead of the trajectory given on the command line,
+// or from frame_source->frame_store if it holds the trajectory.
+void use_binary_trajectory(FrameSource* const frame_source, const char* filename);
 
 //-------------------------------------------------------------
 // Auxiliary-trajectory reading functions.
@@ -176,8 +221,8 @@ class BaseCellList {
 	// This is repeated until the value is -1.
 
 public:
-    void init(const double cutoff, const FrameSource* const fr);
-    void populateList(const int n_particles, std::array<double, DIMENSION>* const &particle_positions);
+    void init(const double cutoff, const FrameSource* const fr);	// Set up for the current box, reusing existing storage.
+    void populateList(const int n_particles, std::array<frame_real, DIMENSION>* const &particle_positions);
     inline int get_stencil_size() const { return stencil_size; };
     inline double get_cell_size(int i) const {return cell_size[i]; };
     int size;					// The total number of cells to cover the simulation box.
@@ -195,11 +240,15 @@ protected:
     std::vector<double> cell_size;
 	int stencil_size;			// The number of neighboring cells surrounding a given cell that need to be searched through during force computation.
 
-    void setUpCellListCells(const double cutoff, const real* simulation_box_half_lengths, const int current_n_sites);
+    bool setUpCellListCells(const double cutoff, const real* simulation_box_half_lengths, const int current_n_sites);
     virtual void setUpCellListStencil() = 0;
 };
 
+class PairVerletList;
+
 class PairCellList: public BaseCellList {
+public:
+	PairVerletList* verlet_list = NULL;	// If set, pair and density interactions are found from this Verlet list instead of by walking the cells.
 protected:
     virtual void setUpCellListStencil();
 };
@@ -209,4 +258,35 @@ protected:
     virtual void setUpCellListStencil();
 };
 
+//--------------------------------------------------------------------
+// Verlet list routines for pair nonbonded and density interactions.
+//--------------------------------------------------------------------
+
+struct TopoList;
+
+class PairVerletList {
+
+	// The list holds every pair within the interaction cutoff plus a skin distance and is built by walking a pair cell list
+	// set up with that extended cutoff. It stays valid until some particle has moved more than half the skin since the build,
+	// so one list can serve many consecutive frames.
+	// Pairs are stored in compressed rows: the partners of particle k are partners[starts[k]] through partners[starts[k + 1] - 1].
+	// Pair nonbonded and density interactions have different exclusions, so each gets its own list.
+
+public:
+	PairVerletList(const double cutoff, const double skin);
+	bool needsRebuild(const int current_n_sites, std::array<frame_real, DIMENSION>* const &particle_positions, const real* simulation_box_half_lengths) const;
+	void build(const PairCellList& pair_cell_list, const int current_n_sites, std::array<frame_real, DIMENSION>* const &particle_positions, const real* simulation_box_half_lengths, const TopoList* exclusion_list, const TopoList* density_exclusion_list);
+	int n_particles;					// The number of particles when the list was last built.
+	std::vector<int> pair_starts;		// Index of each particle's first partner in pair_partners (n_particles + 1 entries).
+	std::vector<int> pair_partners;		// Partners that are not excluded from pair nonbonded interactions.
+	std::vector<int> density_starts;	// Index of each particle's first partner in density_partners (n_particles + 1 entries).
+	std::vector<int> density_partners;	// Partners that are not excluded from density interactions.
+
+protected:
+	double list_cutoff2;				// Squared cutoff for pairs kept in the list.
+	double max_displacement2;			// Squared displacement (half the skin) that forces a rebuild.
+	std::vector<std::array<frame_real, DIMENSION> > reference_positions;	// Positions when the list was last built.
+	std::array<real, DIMENSION> reference_box_half_lengths;
+};
+
 #endif